@@ -60,10 +60,7 @@ int main(int argc, char *argv[])
     LIBSSH2_CHANNEL *channel = NULL;
     const char *shost;
     unsigned int sport;
-    fd_set fds;
-    struct timeval tv;
-    ssize_t len, wr;
-    char buf[16384];
+    fd_set rfds, wfds;
 
 #ifdef WIN32
     char sockopt;
@@ -258,65 +255,46 @@ int main(int argc, char *argv[])
 
     /* Must use non-blocking IO hereafter due to the current libssh2 API */
     libssh2_session_set_blocking(session, 0);
+#ifdef WIN32
+    {
+        u_long nonblock = 1;
+        ioctlsocket(forwardsock, FIONBIO, &nonblock);
+    }
+#else
+    fcntl(forwardsock, F_SETFL, fcntl(forwardsock, F_GETFL) | O_NONBLOCK);
+#endif
 
-    while(1) {
-        FD_ZERO(&fds);
-        FD_SET(forwardsock, &fds);
-        tv.tv_sec = 0;
-        tv.tv_usec = 100000;
-        rc = select(forwardsock + 1, &fds, NULL, NULL, &tv);
+    /* the library moves the data both ways, we only wait for the sockets */
+    libssh2_channel_relay_fd(channel, forwardsock, 0);
+
+    while((rc = libssh2_channel_relay_pump(channel)) ==
+          LIBSSH2_ERROR_EAGAIN) {
+        int dir = libssh2_channel_relay_directions(channel);
+        int sdir = libssh2_session_block_directions(session);
+
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        /* incoming packets may be window adjusts, so always read them */
+        FD_SET(sock, &rfds);
+        if(sdir & LIBSSH2_SESSION_BLOCK_OUTBOUND)
+            FD_SET(sock, &wfds);
+        if(dir & LIBSSH2_RELAY_WAIT_READ)
+            FD_SET(forwardsock, &rfds);
+        if(dir & LIBSSH2_RELAY_WAIT_WRITE)
+            FD_SET(forwardsock, &wfds);
+
+        rc = select((int)(sock > forwardsock ? sock : forwardsock) + 1,
+                    &rfds, &wfds, NULL, NULL);
         if(-1 == rc) {
             perror("select");
             goto shutdown;
         }
-        if(rc && FD_ISSET(forwardsock, &fds)) {
-            len = recv(forwardsock, buf, sizeof(buf), 0);
-            if(len < 0) {
-                perror("read");
-                goto shutdown;
-            }
-            else if(0 == len) {
-                fprintf(stderr, "The client at %s:%d disconnected!\n", shost,
-                    sport);
-                goto shutdown;
-            }
-            wr = 0;
-            while(wr < len) {
-                i = libssh2_channel_write(channel, buf + wr, len - wr);
-                if(LIBSSH2_ERROR_EAGAIN == i) {
-                    continue;
-                }
-                if(i < 0) {
-                    fprintf(stderr, "libssh2_channel_write: %d\n", i);
-                    goto shutdown;
-                }
-                wr += i;
-            }
-        }
-        while(1) {
-            len = libssh2_channel_read(channel, buf, sizeof(buf));
-            if(LIBSSH2_ERROR_EAGAIN == len)
-                break;
-            else if(len < 0) {
-                fprintf(stderr, "libssh2_channel_read: %d", (int)len);
-                goto shutdown;
-            }
-            wr = 0;
-            while(wr < len) {
-                i = send(forwardsock, buf + wr, len - wr, 0);
-                if(i <= 0) {
-                    perror("write");
-                    goto shutdown;
-                }
-                wr += i;
-            }
-            if(libssh2_channel_eof(channel)) {
-                fprintf(stderr, "The server at %s:%d disconnected!\n",
-                    remote_desthost, remote_destport);
-                goto shutdown;
-            }
-        }
     }
+    if(rc)
+        fprintf(stderr, "libssh2_channel_relay_pump: %d\n", rc);
+    else
+        fprintf(stderr, "The connection from %s:%d to %s:%d is done\n",
+                shost, sport, remote_desthost, remote_destport);
 
 shutdown:
 #ifdef WIN32
@@ -326,6 +326,16 @@ typedef struct _LIBSSH2_USERAUTH_KBDINT_RESPONSE
   void name(LIBSSH2_SESSION *session, void **session_abstract, \
             LIBSSH2_CHANNEL *channel, void **channel_abstract)
 
+/* Channel event callbacks, see libssh2_channel_callback_set() */
+#define LIBSSH2_CHANNEL_DATA_FUNC(name) \
+  size_t name(LIBSSH2_SESSION *session, LIBSSH2_CHANNEL *channel, \
+              int stream_id, const char *data, size_t data_len, \
+              void **channel_abstract)
+
+#define LIBSSH2_CHANNEL_EVENT_FUNC(name) \
+  void name(LIBSSH2_SESSION *session, LIBSSH2_CHANNEL *channel, \
+            void **channel_abstract)
+
 /* I/O callbacks */
 #define LIBSSH2_RECV_FUNC(name)                                         \
     ssize_t name(libssh2_socket_t socket,                               \
@@ -345,6 +355,12 @@ typedef struct _LIBSSH2_USERAUTH_KBDINT_RESPONSE
 #define LIBSSH2_CALLBACK_SEND               5
 #define LIBSSH2_CALLBACK_RECV               6
 
+/* libssh2_channel_callback_set() constants */
+#define LIBSSH2_CHANNEL_CALLBACK_DATA       0
+#define LIBSSH2_CHANNEL_CALLBACK_EOF        1
+#define LIBSSH2_CHANNEL_CALLBACK_CLOSE      2
+#define LIBSSH2_CHANNEL_CALLBACK_WINDOW     3
+
 /* libssh2_session_method_pref() constants */
 #define LIBSSH2_METHOD_KEX          0
 #define LIBSSH2_METHOD_HOSTKEY      1
@@ -361,10 +377,12 @@ typedef struct _LIBSSH2_USERAUTH_KBDINT_RESPONSE
 /* flags */
 #define LIBSSH2_FLAG_SIGPIPE        1
 #define LIBSSH2_FLAG_COMPRESS       2
+#define LIBSSH2_FLAG_RELEASE_BUFFERS 3
 
 typedef struct _LIBSSH2_SESSION                     LIBSSH2_SESSION;
 typedef struct _LIBSSH2_CHANNEL                     LIBSSH2_CHANNEL;
 typedef struct _LIBSSH2_LISTENER                    LIBSSH2_LISTENER;
+typedef struct _LIBSSH2_CHANNEL_POOL                LIBSSH2_CHANNEL_POOL;
 typedef struct _LIBSSH2_KNOWNHOSTS                  LIBSSH2_KNOWNHOSTS;
 typedef struct _LIBSSH2_AGENT                       LIBSSH2_AGENT;
 
@@ -383,6 +401,13 @@ typedef struct _LIBSSH2_POLLFD {
     unsigned long revents; /* Returned Events */
 } LIBSSH2_POLLFD;
 
+/* One buffer of the data to libssh2_channel_writev(), laid out like the
+   POSIX struct iovec so that an array of those can be passed on as is */
+typedef struct _LIBSSH2_IOVEC {
+    void *iov_base;
+    size_t iov_len;
+} LIBSSH2_IOVEC;
+
 /* Poll FD Descriptor Types */
 #define LIBSSH2_POLLFD_SOCKET       1
 #define LIBSSH2_POLLFD_CHANNEL      2
@@ -740,12 +765,54 @@ libssh2_channel_open_ex(LIBSSH2_SESSION *session, const char *channel_type,
                           LIBSSH2_CHANNEL_WINDOW_DEFAULT, \
                           LIBSSH2_CHANNEL_PACKET_DEFAULT, NULL, 0)
 
+LIBSSH2_API LIBSSH2_CHANNEL *
+libssh2_channel_open_start(LIBSSH2_SESSION *session, const char *channel_type,
+                           unsigned int channel_type_len,
+                           unsigned int window_size, unsigned int packet_size,
+                           const char *message, unsigned int message_len);
+
+#define libssh2_channel_open_session_start(session) \
+  libssh2_channel_open_start((session), "session", sizeof("session") - 1, \
+                             LIBSSH2_CHANNEL_WINDOW_DEFAULT, \
+                             LIBSSH2_CHANNEL_PACKET_DEFAULT, NULL, 0)
+
+LIBSSH2_API int libssh2_channel_open_finish(LIBSSH2_CHANNEL *channel);
+
 LIBSSH2_API LIBSSH2_CHANNEL *
 libssh2_channel_direct_tcpip_ex(LIBSSH2_SESSION *session, const char *host,
                                 int port, const char *shost, int sport);
 #define libssh2_channel_direct_tcpip(session, host, port) \
   libssh2_channel_direct_tcpip_ex((session), (host), (port), "127.0.0.1", 22)
 
+LIBSSH2_API LIBSSH2_CHANNEL *
+libssh2_channel_direct_tcpip_start(LIBSSH2_SESSION *session, const char *host,
+                                   int port, const char *shost, int sport);
+
+LIBSSH2_API LIBSSH2_CHANNEL_POOL *
+libssh2_channel_pool_init_ex(LIBSSH2_SESSION *session,
+                             const char *channel_type,
+                             unsigned int channel_type_len,
+                             unsigned int window_size,
+                             unsigned int packet_size,
+                             const char *message, unsigned int message_len,
+                             unsigned int size);
+
+#define libssh2_channel_pool_init(session, size) \
+  libssh2_channel_pool_init_ex((session), "session", sizeof("session") - 1, \
+                               LIBSSH2_CHANNEL_WINDOW_DEFAULT, \
+                               LIBSSH2_CHANNEL_PACKET_DEFAULT, NULL, 0, \
+                               (size))
+
+LIBSSH2_API LIBSSH2_CHANNEL_POOL *
+libssh2_channel_pool_direct_tcpip(LIBSSH2_SESSION *session, const char *host,
+                                  int port, const char *shost, int sport,
+                                  unsigned int size);
+
+LIBSSH2_API LIBSSH2_CHANNEL *
+libssh2_channel_pool_acquire(LIBSSH2_CHANNEL_POOL *pool);
+
+LIBSSH2_API int libssh2_channel_pool_free(LIBSSH2_CHANNEL_POOL *pool);
+
 LIBSSH2_API LIBSSH2_LISTENER *
 libssh2_channel_forward_listen_ex(LIBSSH2_SESSION *session, const char *host,
                                   int port, int *bound_port,
@@ -753,6 +820,14 @@ libssh2_channel_forward_listen_ex(LIBSSH2_SESSION *session, const char *host,
 #define libssh2_channel_forward_listen(session, port) \
  libssh2_channel_forward_listen_ex((session), NULL, (port), NULL, 16)
 
+LIBSSH2_API LIBSSH2_LISTENER *
+libssh2_channel_forward_listen_start(LIBSSH2_SESSION *session,
+                                     const char *host, int port,
+                                     int queue_maxsize);
+LIBSSH2_API int
+libssh2_channel_forward_listen_finish(LIBSSH2_LISTENER *listener,
+                                      int *bound_port);
+
 LIBSSH2_API int libssh2_channel_forward_cancel(LIBSSH2_LISTENER *listener);
 
 LIBSSH2_API LIBSSH2_CHANNEL *
@@ -826,9 +901,19 @@ LIBSSH2_API ssize_t libssh2_channel_read_ex(LIBSSH2_CHANNEL *channel,
 #define libssh2_channel_read_stderr(channel, buf, buflen) \
   libssh2_channel_read_ex((channel), SSH_EXTENDED_DATA_STDERR, (buf), (buflen))
 
+LIBSSH2_API int libssh2_channel_read_peek(LIBSSH2_CHANNEL *channel,
+                                          int stream_id, const char **data,
+                                          size_t *data_len);
+LIBSSH2_API int libssh2_channel_read_consume(LIBSSH2_CHANNEL *channel,
+                                             int stream_id, size_t len);
+
 LIBSSH2_API int libssh2_poll_channel_read(LIBSSH2_CHANNEL *channel,
                                           int extended);
 
+LIBSSH2_API void *libssh2_channel_callback_set(LIBSSH2_CHANNEL *channel,
+                                               int cbtype, void *callback);
+LIBSSH2_API void **libssh2_channel_abstract(LIBSSH2_CHANNEL *channel);
+
 LIBSSH2_API unsigned long
 libssh2_channel_window_read_ex(LIBSSH2_CHANNEL *channel,
                                unsigned long *read_avail,
@@ -858,12 +943,24 @@ LIBSSH2_API ssize_t libssh2_channel_write_ex(LIBSSH2_CHANNEL *channel,
     libssh2_channel_write_ex((channel), SSH_EXTENDED_DATA_STDERR,       \
                              (buf), (buflen))
 
+LIBSSH2_API ssize_t libssh2_channel_writev(LIBSSH2_CHANNEL *channel,
+                                           int stream_id,
+                                           const LIBSSH2_IOVEC *iov,
+                                           int iovcnt);
+
 LIBSSH2_API unsigned long
 libssh2_channel_window_write_ex(LIBSSH2_CHANNEL *channel,
                                 unsigned long *window_size_initial);
 #define libssh2_channel_window_write(channel) \
   libssh2_channel_window_write_ex((channel), NULL)
 
+LIBSSH2_API int libssh2_transport_read(LIBSSH2_SESSION *session,
+                                       LIBSSH2_CHANNEL **channels,
+                                       size_t channels_len);
+LIBSSH2_API int libssh2_transport_write(LIBSSH2_SESSION *session,
+                                        LIBSSH2_CHANNEL **channels,
+                                        size_t channels_len);
+
 LIBSSH2_API void libssh2_session_set_blocking(LIBSSH2_SESSION* session,
                                               int blocking);
 LIBSSH2_API int libssh2_session_get_blocking(LIBSSH2_SESSION* session);
@@ -875,6 +972,82 @@ LIBSSH2_API void libssh2_session_set_timeout(LIBSSH2_SESSION* session,
                                              long timeout);
 LIBSSH2_API long libssh2_session_get_timeout(LIBSSH2_SESSION* session);
 
+LIBSSH2_API void libssh2_session_set_recv_buffer_max(LIBSSH2_SESSION* session,
+                                                     size_t max);
+LIBSSH2_API size_t
+libssh2_session_get_recv_buffer_max(LIBSSH2_SESSION* session);
+
+/* Statistics of the session's packet buffer pool */
+typedef struct _LIBSSH2_POOL_STATS
+{
+    libssh2_uint64_t hits;   /* packet buffers reused from the pool */
+    libssh2_uint64_t misses; /* packet buffers that had to be allocated */
+    size_t cached;           /* unused buffers kept in the pool */
+    size_t cached_bytes;     /* size of those buffers */
+    size_t cached_max;       /* most bytes of buffers the pool keeps */
+} LIBSSH2_POOL_STATS;
+
+LIBSSH2_API void libssh2_session_pool_stats(LIBSSH2_SESSION *session,
+                                            LIBSSH2_POOL_STATS *stats);
+
+/* Receive window modes for libssh2_session_set_window_mode() */
+#define LIBSSH2_WINDOW_FIXED 0 /* keep the size a channel was opened with */
+#define LIBSSH2_WINDOW_AUTO  1 /* follow the measured bandwidth-delay
+                                  product */
+
+LIBSSH2_API int libssh2_session_set_window_mode(LIBSSH2_SESSION *session,
+                                                int mode,
+                                                unsigned long window_min,
+                                                unsigned long window_max);
+
+LIBSSH2_API void
+libssh2_session_set_channel_buffer_max(LIBSSH2_SESSION *session, size_t max);
+LIBSSH2_API size_t
+libssh2_session_get_channel_buffered(LIBSSH2_SESSION *session);
+LIBSSH2_API void libssh2_channel_set_buffer_max(LIBSSH2_CHANNEL *channel,
+                                                size_t max);
+
+/* Statistics of a channel's receive window */
+typedef struct _LIBSSH2_WINDOW_STATS
+{
+    unsigned long window;      /* size the receive window is kept at */
+    unsigned long open;        /* bytes the remote end may send right now */
+    unsigned long queued;      /* bytes received but not read yet */
+    libssh2_uint64_t consumed; /* bytes read from the channel */
+    unsigned long rate;        /* bytes per second read, 0 if not measured */
+    unsigned long rtt;         /* round trip time in microseconds, 0 if not
+                                  measured */
+} LIBSSH2_WINDOW_STATS;
+
+LIBSSH2_API void libssh2_channel_window_stats(LIBSSH2_CHANNEL *channel,
+                                              LIBSSH2_WINDOW_STATS *stats);
+
+/* Priorities for libssh2_channel_set_priority(), data written to channels
+   of a higher priority is sent before that of lower ones */
+#define LIBSSH2_CHANNEL_PRIORITY_BULK        0
+#define LIBSSH2_CHANNEL_PRIORITY_NORMAL      1
+#define LIBSSH2_CHANNEL_PRIORITY_INTERACTIVE 2
+
+LIBSSH2_API int libssh2_channel_set_priority(LIBSSH2_CHANNEL *channel,
+                                             int priority,
+                                             unsigned int weight);
+
+/* Flags for libssh2_channel_relay_fd() */
+#define LIBSSH2_RELAY_NO_EOF      0x0001 /* don't send EOF on the channel at
+                                            the end of the socket's data */
+#define LIBSSH2_RELAY_NO_SHUTDOWN 0x0002 /* don't shut down writing to the
+                                            socket at EOF on the channel */
+
+/* What libssh2_channel_relay_pump() waits for on the relayed socket, see
+   libssh2_channel_relay_directions() */
+#define LIBSSH2_RELAY_WAIT_READ  0x0001
+#define LIBSSH2_RELAY_WAIT_WRITE 0x0002
+
+LIBSSH2_API int libssh2_channel_relay_fd(LIBSSH2_CHANNEL *channel,
+                                         libssh2_socket_t fd, int flags);
+LIBSSH2_API int libssh2_channel_relay_pump(LIBSSH2_CHANNEL *channel);
+LIBSSH2_API int libssh2_channel_relay_directions(LIBSSH2_CHANNEL *channel);
+
 /* libssh2_channel_handle_extended_data is DEPRECATED, do not use! */
 LIBSSH2_API void libssh2_channel_handle_extended_data(LIBSSH2_CHANNEL *channel,
                                                       int ignore_mode);
@@ -0,0 +1,381 @@
+/* Copyright (C) 2022 The libssh2 project and its contributors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+/*
+ * Portable ChaCha20 (the original variant with a 64 bit nonce and a 64 bit
+ * block counter) and Poly1305, following D. J. Bernstein's reference
+ * descriptions. Poly1305 uses 26 bit limbs so that it only needs 32x32->64
+ * bit multiplications.
+ */
+
+#include "libssh2_priv.h"
+#include "chacha.h"
+
+#define U8TO32_LE(p)                                                   \
+    ((uint32_t)(p)[0] | ((uint32_t)(p)[1] << 8) |                      \
+     ((uint32_t)(p)[2] << 16) | ((uint32_t)(p)[3] << 24))
+
+#define U32TO8_LE(p, v)                                                \
+    do {                                                               \
+        (p)[0] = (unsigned char)(v);                                   \
+        (p)[1] = (unsigned char)((v) >> 8);                            \
+        (p)[2] = (unsigned char)((v) >> 16);                           \
+        (p)[3] = (unsigned char)((v) >> 24);                           \
+    } while(0)
+
+#if !LIBSSH2_CHACHA20
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTERROUND(a, b, c, d)                                       \
+    a += b; d ^= a; d = ROTL32(d, 16);                                 \
+    c += d; b ^= c; b = ROTL32(b, 12);                                 \
+    a += b; d ^= a; d = ROTL32(d, 8);                                  \
+    c += d; b ^= c; b = ROTL32(b, 7)
+
+int
+_libssh2_chacha20_init(_libssh2_chacha20_ctx *ctx, const unsigned char *key)
+{
+    int i;
+
+    /* "expand 32-byte k" */
+    ctx->input[0] = 0x61707865;
+    ctx->input[1] = 0x3320646e;
+    ctx->input[2] = 0x79622d32;
+    ctx->input[3] = 0x6b206574;
+    for(i = 0; i < 8; i++)
+        ctx->input[4 + i] = U8TO32_LE(key + 4 * i);
+    ctx->input[12] = ctx->input[13] = 0;
+    ctx->input[14] = ctx->input[15] = 0;
+    ctx->avail = 0;
+    return 0;
+}
+
+int
+_libssh2_chacha20_setiv(_libssh2_chacha20_ctx *ctx,
+                        const unsigned char *nonce, uint32_t counter)
+{
+    ctx->input[12] = counter;
+    ctx->input[13] = 0;
+    ctx->input[14] = U8TO32_LE(nonce);
+    ctx->input[15] = U8TO32_LE(nonce + 4);
+    ctx->avail = 0;
+    return 0;
+}
+
+/* produce the next 64 bytes of key stream and step the block counter */
+static void
+chacha20_block(_libssh2_chacha20_ctx *ctx)
+{
+    uint32_t x[16];
+    int i;
+
+    for(i = 0; i < 16; i++)
+        x[i] = ctx->input[i];
+
+    for(i = 0; i < 10; i++) {
+        QUARTERROUND(x[0], x[4], x[8], x[12]);
+        QUARTERROUND(x[1], x[5], x[9], x[13]);
+        QUARTERROUND(x[2], x[6], x[10], x[14]);
+        QUARTERROUND(x[3], x[7], x[11], x[15]);
+        QUARTERROUND(x[0], x[5], x[10], x[15]);
+        QUARTERROUND(x[1], x[6], x[11], x[12]);
+        QUARTERROUND(x[2], x[7], x[8], x[13]);
+        QUARTERROUND(x[3], x[4], x[9], x[14]);
+    }
+
+    for(i = 0; i < 16; i++) {
+        uint32_t v = x[i] + ctx->input[i];
+        U32TO8_LE(&ctx->stream[4 * i], v);
+    }
+
+    if(!++ctx->input[12])
+        ctx->input[13]++;
+    ctx->avail = sizeof(ctx->stream);
+}
+
+int
+_libssh2_chacha20_crypt(_libssh2_chacha20_ctx *ctx,
+                        const unsigned char *src, unsigned char *dst,
+                        size_t len)
+{
+    while(len) {
+        const unsigned char *ks;
+        size_t n;
+        size_t i;
+
+        if(!ctx->avail)
+            chacha20_block(ctx);
+
+        ks = &ctx->stream[sizeof(ctx->stream) - ctx->avail];
+        n = len < ctx->avail ? len : ctx->avail;
+        for(i = 0; i < n; i++)
+            dst[i] = src[i] ^ ks[i];
+
+        ctx->avail -= n;
+        src += n;
+        dst += n;
+        len -= n;
+    }
+    return 0;
+}
+
+void
+_libssh2_chacha20_dtor(_libssh2_chacha20_ctx *ctx)
+{
+    _libssh2_explicit_zero(ctx, sizeof(*ctx));
+}
+
+#endif /* !LIBSSH2_CHACHA20 */
+
+void
+_libssh2_poly1305_init(_libssh2_poly1305_ctx *ctx, const unsigned char *key)
+{
+    /* r &= 0xffffffc0ffffffc0ffffffc0fffffff */
+    ctx->r[0] = (U8TO32_LE(&key[0])) & 0x3ffffff;
+    ctx->r[1] = (U8TO32_LE(&key[3]) >> 2) & 0x3ffff03;
+    ctx->r[2] = (U8TO32_LE(&key[6]) >> 4) & 0x3ffc0ff;
+    ctx->r[3] = (U8TO32_LE(&key[9]) >> 6) & 0x3f03fff;
+    ctx->r[4] = (U8TO32_LE(&key[12]) >> 8) & 0x00fffff;
+
+    ctx->h[0] = ctx->h[1] = ctx->h[2] = ctx->h[3] = ctx->h[4] = 0;
+
+    ctx->pad[0] = U8TO32_LE(&key[16]);
+    ctx->pad[1] = U8TO32_LE(&key[20]);
+    ctx->pad[2] = U8TO32_LE(&key[24]);
+    ctx->pad[3] = U8TO32_LE(&key[28]);
+
+    ctx->leftover = 0;
+    ctx->final = 0;
+}
+
+/* absorb 'len' bytes, a multiple of 16 */
+static void
+poly1305_blocks(_libssh2_poly1305_ctx *ctx, const unsigned char *m,
+                size_t len)
+{
+    const uint32_t hibit = ctx->final ? 0 : (1UL << 24); /* 2^128 */
+    uint32_t r0 = ctx->r[0], r1 = ctx->r[1], r2 = ctx->r[2];
+    uint32_t r3 = ctx->r[3], r4 = ctx->r[4];
+    uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+    uint32_t h0 = ctx->h[0], h1 = ctx->h[1], h2 = ctx->h[2];
+    uint32_t h3 = ctx->h[3], h4 = ctx->h[4];
+
+    while(len >= 16) {
+        libssh2_uint64_t d0, d1, d2, d3, d4;
+        uint32_t c;
+
+        /* h += m[i] */
+        h0 += (U8TO32_LE(m + 0)) & 0x3ffffff;
+        h1 += (U8TO32_LE(m + 3) >> 2) & 0x3ffffff;
+        h2 += (U8TO32_LE(m + 6) >> 4) & 0x3ffffff;
+        h3 += (U8TO32_LE(m + 9) >> 6) & 0x3ffffff;
+        h4 += (U8TO32_LE(m + 12) >> 8) | hibit;
+
+        /* h *= r */
+        d0 = ((libssh2_uint64_t)h0 * r0) + ((libssh2_uint64_t)h1 * s4) +
+             ((libssh2_uint64_t)h2 * s3) + ((libssh2_uint64_t)h3 * s2) +
+             ((libssh2_uint64_t)h4 * s1);
+        d1 = ((libssh2_uint64_t)h0 * r1) + ((libssh2_uint64_t)h1 * r0) +
+             ((libssh2_uint64_t)h2 * s4) + ((libssh2_uint64_t)h3 * s3) +
+             ((libssh2_uint64_t)h4 * s2);
+        d2 = ((libssh2_uint64_t)h0 * r2) + ((libssh2_uint64_t)h1 * r1) +
+             ((libssh2_uint64_t)h2 * r0) + ((libssh2_uint64_t)h3 * s4) +
+             ((libssh2_uint64_t)h4 * s3);
+        d3 = ((libssh2_uint64_t)h0 * r3) + ((libssh2_uint64_t)h1 * r2) +
+             ((libssh2_uint64_t)h2 * r1) + ((libssh2_uint64_t)h3 * r0) +
+             ((libssh2_uint64_t)h4 * s4);
+        d4 = ((libssh2_uint64_t)h0 * r4) + ((libssh2_uint64_t)h1 * r3) +
+             ((libssh2_uint64_t)h2 * r2) + ((libssh2_uint64_t)h3 * r1) +
+             ((libssh2_uint64_t)h4 * r0);
+
+        /* (partial) h %= p */
+        c = (uint32_t)(d0 >> 26);
+        h0 = (uint32_t)d0 & 0x3ffffff;
+        d1 += c;
+        c = (uint32_t)(d1 >> 26);
+        h1 = (uint32_t)d1 & 0x3ffffff;
+        d2 += c;
+        c = (uint32_t)(d2 >> 26);
+        h2 = (uint32_t)d2 & 0x3ffffff;
+        d3 += c;
+        c = (uint32_t)(d3 >> 26);
+        h3 = (uint32_t)d3 & 0x3ffffff;
+        d4 += c;
+        c = (uint32_t)(d4 >> 26);
+        h4 = (uint32_t)d4 & 0x3ffffff;
+        h0 += c * 5;
+        c = h0 >> 26;
+        h0 &= 0x3ffffff;
+        h1 += c;
+
+        m += 16;
+        len -= 16;
+    }
+
+    ctx->h[0] = h0;
+    ctx->h[1] = h1;
+    ctx->h[2] = h2;
+    ctx->h[3] = h3;
+    ctx->h[4] = h4;
+}
+
+void
+_libssh2_poly1305_update(_libssh2_poly1305_ctx *ctx, const unsigned char *m,
+                         size_t len)
+{
+    /* top up a partial block first */
+    if(ctx->leftover) {
+        size_t want = 16 - ctx->leftover;
+        if(want > len)
+            want = len;
+        memcpy(&ctx->buffer[ctx->leftover], m, want);
+        len -= want;
+        m += want;
+        ctx->leftover += want;
+        if(ctx->leftover < 16)
+            return;
+        poly1305_blocks(ctx, ctx->buffer, 16);
+        ctx->leftover = 0;
+    }
+
+    if(len >= 16) {
+        size_t want = len & ~(size_t)15;
+        poly1305_blocks(ctx, m, want);
+        m += want;
+        len -= want;
+    }
+
+    if(len) {
+        memcpy(&ctx->buffer[ctx->leftover], m, len);
+        ctx->leftover += len;
+    }
+}
+
+void
+_libssh2_poly1305_finish(_libssh2_poly1305_ctx *ctx, unsigned char *tag)
+{
+    uint32_t h0, h1, h2, h3, h4, c;
+    uint32_t g0, g1, g2, g3, g4;
+    uint32_t mask;
+    libssh2_uint64_t f;
+
+    /* process the remaining block, padded with a single 1 bit */
+    if(ctx->leftover) {
+        size_t i = ctx->leftover;
+        ctx->buffer[i++] = 1;
+        for(; i < 16; i++)
+            ctx->buffer[i] = 0;
+        ctx->final = 1;
+        poly1305_blocks(ctx, ctx->buffer, 16);
+    }
+
+    /* fully carry h */
+    h0 = ctx->h[0];
+    h1 = ctx->h[1];
+    h2 = ctx->h[2];
+    h3 = ctx->h[3];
+    h4 = ctx->h[4];
+
+    c = h1 >> 26;
+    h1 &= 0x3ffffff;
+    h2 += c;
+    c = h2 >> 26;
+    h2 &= 0x3ffffff;
+    h3 += c;
+    c = h3 >> 26;
+    h3 &= 0x3ffffff;
+    h4 += c;
+    c = h4 >> 26;
+    h4 &= 0x3ffffff;
+    h0 += c * 5;
+    c = h0 >> 26;
+    h0 &= 0x3ffffff;
+    h1 += c;
+
+    /* compute h + -p */
+    g0 = h0 + 5;
+    c = g0 >> 26;
+    g0 &= 0x3ffffff;
+    g1 = h1 + c;
+    c = g1 >> 26;
+    g1 &= 0x3ffffff;
+    g2 = h2 + c;
+    c = g2 >> 26;
+    g2 &= 0x3ffffff;
+    g3 = h3 + c;
+    c = g3 >> 26;
+    g3 &= 0x3ffffff;
+    g4 = h4 + c - (1UL << 26);
+
+    /* select h if h < p, or h + -p if h >= p, without branching */
+    mask = (g4 >> 31) - 1;
+    g0 &= mask;
+    g1 &= mask;
+    g2 &= mask;
+    g3 &= mask;
+    g4 &= mask;
+    mask = ~mask;
+    h0 = (h0 & mask) | g0;
+    h1 = (h1 & mask) | g1;
+    h2 = (h2 & mask) | g2;
+    h3 = (h3 & mask) | g3;
+    h4 = (h4 & mask) | g4;
+
+    /* h = h % (2^128) */
+    h0 = (h0 | (h1 << 26)) & 0xffffffff;
+    h1 = ((h1 >> 6) | (h2 << 20)) & 0xffffffff;
+    h2 = ((h2 >> 12) | (h3 << 14)) & 0xffffffff;
+    h3 = ((h3 >> 18) | (h4 << 8)) & 0xffffffff;
+
+    /* tag = (h + pad) % (2^128) */
+    f = (libssh2_uint64_t)h0 + ctx->pad[0];
+    h0 = (uint32_t)f;
+    f = (libssh2_uint64_t)h1 + ctx->pad[1] + (f >> 32);
+    h1 = (uint32_t)f;
+    f = (libssh2_uint64_t)h2 + ctx->pad[2] + (f >> 32);
+    h2 = (uint32_t)f;
+    f = (libssh2_uint64_t)h3 + ctx->pad[3] + (f >> 32);
+    h3 = (uint32_t)f;
+
+    U32TO8_LE(tag + 0, h0);
+    U32TO8_LE(tag + 4, h1);
+    U32TO8_LE(tag + 8, h2);
+    U32TO8_LE(tag + 12, h3);
+
+    _libssh2_explicit_zero(ctx, sizeof(*ctx));
+}
@@ -0,0 +1,92 @@
+#ifndef __LIBSSH2_CHACHA_H
+#define __LIBSSH2_CHACHA_H
+/* Copyright (C) 2022 The libssh2 project and its contributors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+/*
+ * ChaCha20 and Poly1305 as used by the chacha20-poly1305@openssh.com cipher.
+ *
+ * ChaCha20 is taken from the crypto backend when it has one
+ * (LIBSSH2_CHACHA20 is 1), otherwise the portable version in chacha.c is
+ * used. Poly1305 is always the portable version: the backends that have it
+ * need a full MAC object set up for every packet, which costs more than the
+ * computation itself for typical packet sizes.
+ */
+
+#include "libssh2_priv.h"
+
+#define CHACHA20_KEY_LEN   32
+#define CHACHA20_NONCE_LEN 8
+#define POLY1305_KEY_LEN   32
+#define POLY1305_TAG_LEN   16
+
+#if !LIBSSH2_CHACHA20
+typedef struct
+{
+    uint32_t input[16];
+    unsigned char stream[64];
+    size_t avail;               /* unused bytes at the end of 'stream' */
+} _libssh2_chacha20_ctx;
+
+int _libssh2_chacha20_init(_libssh2_chacha20_ctx *ctx,
+                           const unsigned char *key);
+int _libssh2_chacha20_setiv(_libssh2_chacha20_ctx *ctx,
+                            const unsigned char *nonce, uint32_t counter);
+int _libssh2_chacha20_crypt(_libssh2_chacha20_ctx *ctx,
+                            const unsigned char *src, unsigned char *dst,
+                            size_t len);
+void _libssh2_chacha20_dtor(_libssh2_chacha20_ctx *ctx);
+#endif /* !LIBSSH2_CHACHA20 */
+
+typedef struct
+{
+    uint32_t r[5];
+    uint32_t h[5];
+    uint32_t pad[4];
+    unsigned char buffer[16];
+    size_t leftover;
+    int final;
+} _libssh2_poly1305_ctx;
+
+void _libssh2_poly1305_init(_libssh2_poly1305_ctx *ctx,
+                            const unsigned char *key);
+void _libssh2_poly1305_update(_libssh2_poly1305_ctx *ctx,
+                              const unsigned char *m, size_t len);
+void _libssh2_poly1305_finish(_libssh2_poly1305_ctx *ctx,
+                              unsigned char *tag);
+
+#endif /* __LIBSSH2_CHACHA_H */
@@ -53,556 +53,1383 @@
 #include "packet.h"
 #include "session.h"
 
+#define CHANNEL_SLOTS_MIN 16
+
 /*
  *  _libssh2_channel_nextid
  *
- * Determine the next channel ID we can use at our end
+ * Give 'channel' the next channel ID we can use at our end. IDs are indexes
+ * in the session's table of channels, and those of freed channels are used
+ * again, which keeps the table as small as the number of channels open at
+ * once.
  */
-uint32_t
-_libssh2_channel_nextid(LIBSSH2_SESSION * session)
+int
+_libssh2_channel_nextid(LIBSSH2_SESSION *session, LIBSSH2_CHANNEL *channel)
 {
-    uint32_t id = session->next_channel;
-    LIBSSH2_CHANNEL *channel;
+    struct channel_slot *slot;
+    uint32_t id;
 
-    channel = _libssh2_list_first(&session->channels);
+    if(!session->channel_slots_free) {
+        /* no free slot, double the table and chain up the new ones */
+        uint32_t num = session->channel_slots_num ?
+            session->channel_slots_num * 2 : CHANNEL_SLOTS_MIN;
+        struct channel_slot *slots;
 
-    while(channel) {
-        if(channel->local.id > id) {
-            id = channel->local.id;
+        if(num < session->channel_slots_num)
+            return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                  "Out of channel IDs");
+        slots = LIBSSH2_REALLOC(session, session->channel_slots,
+                                num * sizeof(*slots));
+        if(!slots)
+            return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                  "Unable to allocate channel ID table");
+
+        for(id = session->channel_slots_num; id < num; id++) {
+            slots[id].channel = NULL;
+            slots[id].state = CHANNEL_SLOT_FREE;
+            slots[id].next_free = id + 2 <= num ? id + 2 : 0;
         }
-        channel = _libssh2_list_next(&channel->node);
+        session->channel_slots_free = session->channel_slots_num + 1;
+        session->channel_slots = slots;
+        session->channel_slots_num = num;
     }
 
-    /* This is a shortcut to avoid waiting for close packets on channels we've
-     * forgotten about, This *could* be a problem if we request and close 4
-     * billion or so channels in too rapid succession for the remote end to
-     * respond, but the worst case scenario is that some data meant for
-     * another channel Gets picked up by the new one.... Pretty unlikely all
-     * told...
-     */
-    session->next_channel = id + 1;
+    id = session->channel_slots_free - 1;
+    slot = &session->channel_slots[id];
+    session->channel_slots_free = slot->next_free;
+    slot->channel = channel;
+    slot->state = CHANNEL_SLOT_USED;
+    channel->local.id = id;
+
     _libssh2_debug(session, LIBSSH2_TRACE_CONN, "Allocated new channel ID#%lu",
                    id);
-    return id;
+    return 0;
+}
+
+/* put a slot of the channel ID table back in the free list */
+static void
+channel_slot_free(LIBSSH2_SESSION *session, uint32_t id)
+{
+    struct channel_slot *slot = &session->channel_slots[id];
+
+    slot->channel = NULL;
+    slot->state = CHANNEL_SLOT_FREE;
+    slot->next_free = session->channel_slots_free;
+    session->channel_slots_free = id + 1;
 }
 
 /*
- * _libssh2_channel_locate
+ * _libssh2_channel_release_id
  *
- * Locate a channel pointer by number
+ * Give up the ID of a channel that is being freed. Until the peer has closed
+ * its end too, it may still send packets for the channel, so then the ID is
+ * only used again once its close arrives.
  */
-LIBSSH2_CHANNEL *
-_libssh2_channel_locate(LIBSSH2_SESSION *session, uint32_t channel_id)
+void
+_libssh2_channel_release_id(LIBSSH2_SESSION *session,
+                            LIBSSH2_CHANNEL *channel)
 {
-    LIBSSH2_CHANNEL *channel;
-    LIBSSH2_LISTENER *l;
+    uint32_t id = channel->local.id;
 
-    for(channel = _libssh2_list_first(&session->channels);
-        channel;
-        channel = _libssh2_list_next(&channel->node)) {
-        if(channel->local.id == channel_id)
-            return channel;
-    }
+    if(id >= session->channel_slots_num ||
+       session->channel_slots[id].channel != channel)
+        return;
 
-    /* We didn't find the channel in the session, let's then check its
-       listeners since each listener may have its own set of pending channels
-    */
-    for(l = _libssh2_list_first(&session->listeners); l;
-        l = _libssh2_list_next(&l->node)) {
-        for(channel = _libssh2_list_first(&l->queue);
-            channel;
-            channel = _libssh2_list_next(&channel->node)) {
-            if(channel->local.id == channel_id)
-                return channel;
-        }
+    if(channel->remote.close)
+        channel_slot_free(session, id);
+    else {
+        session->channel_slots[id].channel = NULL;
+        session->channel_slots[id].state = CHANNEL_SLOT_CLOSING;
     }
+}
 
-    return NULL;
+/*
+ * _libssh2_channel_closed_id
+ *
+ * The peer closed a channel that has been freed already, so its ID can be
+ * used again.
+ */
+void
+_libssh2_channel_closed_id(LIBSSH2_SESSION *session, uint32_t channel_id)
+{
+    if(channel_id < session->channel_slots_num &&
+       session->channel_slots[channel_id].state == CHANNEL_SLOT_CLOSING)
+        channel_slot_free(session, channel_id);
 }
 
 /*
- * _libssh2_channel_open
+ * _libssh2_channel_locate
  *
- * Establish a generic session channel
+ * Locate a channel pointer by number, including the channels waiting in
+ * listener queues
  */
 LIBSSH2_CHANNEL *
-_libssh2_channel_open(LIBSSH2_SESSION * session, const char *channel_type,
-                      uint32_t channel_type_len,
-                      uint32_t window_size,
-                      uint32_t packet_size,
-                      const unsigned char *message,
-                      size_t message_len)
+_libssh2_channel_locate(LIBSSH2_SESSION *session, uint32_t channel_id)
 {
-    static const unsigned char reply_codes[3] = {
-        SSH_MSG_CHANNEL_OPEN_CONFIRMATION,
-        SSH_MSG_CHANNEL_OPEN_FAILURE,
-        0
-    };
-    unsigned char *s;
-    int rc;
+    if(channel_id < session->channel_slots_num)
+        return session->channel_slots[channel_id].channel;
 
-    if(session->open_state == libssh2_NB_state_idle) {
-        session->open_channel = NULL;
-        session->open_packet = NULL;
-        session->open_data = NULL;
-        /* 17 = packet_type(1) + channel_type_len(4) + sender_channel(4) +
-         * window_size(4) + packet_size(4) */
-        session->open_packet_len = channel_type_len + 17;
-        session->open_local_channel = _libssh2_channel_nextid(session);
+    return NULL;
+}
 
-        /* Zero the whole thing out */
-        memset(&session->open_packet_requirev_state, 0,
-               sizeof(session->open_packet_requirev_state));
+/* the read queue of a CHANNEL_DATA or CHANNEL_EXTENDED_DATA packet */
+#define READ_QUEUE(packet) \
+    ((packet)->data[0] == SSH_MSG_CHANNEL_EXTENDED_DATA)
 
-        _libssh2_debug(session, LIBSSH2_TRACE_CONN,
-                       "Opening Channel - win %d pack %d", window_size,
-                       packet_size);
-        session->open_channel =
-            LIBSSH2_CALLOC(session, sizeof(LIBSSH2_CHANNEL));
-        if(!session->open_channel) {
-            _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
-                           "Unable to allocate space for channel data");
-            return NULL;
-        }
-        session->open_channel->channel_type_len = channel_type_len;
-        session->open_channel->channel_type =
-            LIBSSH2_ALLOC(session, channel_type_len);
-        if(!session->open_channel->channel_type) {
-            _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
-                           "Failed allocating memory for channel type name");
-            LIBSSH2_FREE(session, session->open_channel);
-            session->open_channel = NULL;
-            return NULL;
-        }
-        memcpy(session->open_channel->channel_type, channel_type,
-               channel_type_len);
+/*
+ * _libssh2_channel_queue_data
+ *
+ * Add a received data packet to the read queue of its channel
+ */
+void
+_libssh2_channel_queue_data(LIBSSH2_CHANNEL *channel, LIBSSH2_PACKET *packet)
+{
+    int queue = READ_QUEUE(packet);
 
-        /* REMEMBER: local as in locally sourced */
-        session->open_channel->local.id = session->open_local_channel;
-        session->open_channel->remote.window_size = window_size;
-        session->open_channel->remote.window_size_initial = window_size;
-        session->open_channel->remote.packet_size = packet_size;
-        session->open_channel->session = session;
+    packet->seq = channel->read_seq++;
+    channel->read_queued[queue] += packet->data_len - packet->data_head;
+    channel->session->channel_queued += packet->data_len - packet->data_head;
+    _libssh2_list_add(&channel->read_queue[queue], &packet->node);
 
-        _libssh2_list_add(&session->channels,
-                          &session->open_channel->node);
+    _libssh2_channel_ready(channel);
+}
 
-        s = session->open_packet =
-            LIBSSH2_ALLOC(session, session->open_packet_len);
-        if(!session->open_packet) {
-            _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
-                           "Unable to allocate temporary space for packet");
-            goto channel_error;
-        }
-        *(s++) = SSH_MSG_CHANNEL_OPEN;
-        _libssh2_store_str(&s, channel_type, channel_type_len);
-        _libssh2_store_u32(&s, session->open_local_channel);
-        _libssh2_store_u32(&s, window_size);
-        _libssh2_store_u32(&s, packet_size);
+/*
+ * channel_data_first
+ *
+ * Return the packet to read the data of stream 'stream_id' from next, or
+ * NULL if there is none. Stream 0 also reads the extended data when it is
+ * merged, in the order it arrived.
+ */
+static LIBSSH2_PACKET *
+channel_data_first(LIBSSH2_CHANNEL *channel, int stream_id)
+{
+    LIBSSH2_PACKET *data = _libssh2_list_first(&channel->read_queue[0]);
+    LIBSSH2_PACKET *ext = _libssh2_list_first(&channel->read_queue[1]);
+
+    if(stream_id) {
+        while(ext && (stream_id != (int) _libssh2_ntohu32(ext->data + 5)))
+            ext = _libssh2_list_next(&ext->node);
+        return ext;
+    }
+
+    if(ext && (channel->remote.extended_data_ignore_mode ==
+               LIBSSH2_CHANNEL_EXTENDED_DATA_MERGE) &&
+       (!data || ((int32_t)(ext->seq - data->seq) < 0)))
+        return ext;
 
-        /* Do not copy the message */
+    return data;
+}
 
-        session->open_state = libssh2_NB_state_created;
+/*
+ * channel_data_consume
+ *
+ * Mark 'len' bytes of a queued packet read, and free it once all are
+ */
+static void
+channel_data_consume(LIBSSH2_CHANNEL *channel, LIBSSH2_PACKET *packet,
+                     size_t len)
+{
+    packet->data_head += len;
+    channel->read_queued[READ_QUEUE(packet)] -= len;
+    channel->session->channel_queued -= len;
+    channel->window_consumed += len;
+
+    if(packet->data_head == packet->data_len) {
+        _libssh2_list_remove(&packet->node);
+        _libssh2_packet_free(channel->session, packet);
     }
+}
 
-    if(session->open_state == libssh2_NB_state_created) {
-        rc = _libssh2_transport_send(session,
-                                     session->open_packet,
-                                     session->open_packet_len,
-                                     message, message_len);
-        if(rc == LIBSSH2_ERROR_EAGAIN) {
-            _libssh2_error(session, rc,
-                           "Would block sending channel-open request");
-            return NULL;
-        }
-        else if(rc) {
-            _libssh2_error(session, rc,
-                           "Unable to send channel-open request");
-            goto channel_error;
-        }
+/*
+ * _libssh2_channel_queue_clear
+ *
+ * Throw away all data received for a channel but not read
+ */
+void
+_libssh2_channel_queue_clear(LIBSSH2_CHANNEL *channel)
+{
+    LIBSSH2_PACKET *packet;
+    int queue;
 
-        session->open_state = libssh2_NB_state_sent;
+    for(queue = 0; queue < 2; queue++) {
+        while((packet = _libssh2_list_first(&channel->read_queue[queue])))
+            channel_data_consume(channel, packet,
+                                 packet->data_len - packet->data_head);
     }
+}
 
-    if(session->open_state == libssh2_NB_state_sent) {
-        rc = _libssh2_packet_requirev(session, reply_codes,
-                                      &session->open_data,
-                                      &session->open_data_len, 1,
-                                      session->open_packet + 5 +
-                                      channel_type_len, 4,
-                                      &session->open_packet_requirev_state);
-        if(rc == LIBSSH2_ERROR_EAGAIN) {
-            _libssh2_error(session, LIBSSH2_ERROR_EAGAIN, "Would block");
-            return NULL;
-        }
-        else if(rc) {
-            _libssh2_error(session, rc, "Unexpected error");
-            goto channel_error;
-        }
+/*
+ * channel_is_ready
+ *
+ * Tell if reading from or writing to a channel would not block now
+ */
+static int
+channel_is_ready(LIBSSH2_CHANNEL *channel, int which)
+{
+    if(which == CHANNEL_READABLE)
+        /* at the end of the data, reading returns 0 at once, and so does
+           libssh2_channel_open_finish() once the reply to the open is in */
+        return channel->read_queued[0] || channel->read_queued[1] ||
+            channel->remote.eof || channel->remote.close ||
+            (channel->open_state == libssh2_NB_state_end);
+
+    return channel->local.window_size && !channel->local.eof &&
+        !channel->local.close && !channel->remote.close;
+}
 
-        if(session->open_data_len < 1) {
-            _libssh2_error(session, LIBSSH2_ERROR_PROTO,
-                           "Unexpected packet size");
-            goto channel_error;
-        }
+/*
+ * _libssh2_channel_ready
+ *
+ * Add a channel that has become readable or writable to the session's list
+ * of such channels. It is taken off again by channel_ready_collect() once
+ * it isn't any longer, or when it is freed.
+ */
+void
+_libssh2_channel_ready(LIBSSH2_CHANNEL *channel)
+{
+    LIBSSH2_SESSION *session = channel->session;
+    int which;
 
-        if(session->open_data[0] == SSH_MSG_CHANNEL_OPEN_CONFIRMATION) {
+    /* channels waiting in a listener queue or a pool are not the app's
+       yet */
+    if((channel->node.head != &session->channels) || channel->pool)
+        return;
 
-            if(session->open_data_len < 17) {
-                _libssh2_error(session, LIBSSH2_ERROR_PROTO,
-                               "Unexpected packet size");
-                goto channel_error;
-            }
+    for(which = CHANNEL_READABLE; which <= CHANNEL_WRITABLE; which++) {
+        struct channel_ready *ready = &channel->ready[which];
 
-            session->open_channel->remote.id =
-                _libssh2_ntohu32(session->open_data + 5);
-            session->open_channel->local.window_size =
-                _libssh2_ntohu32(session->open_data + 9);
-            session->open_channel->local.window_size_initial =
-                _libssh2_ntohu32(session->open_data + 9);
-            session->open_channel->local.packet_size =
-                _libssh2_ntohu32(session->open_data + 13);
-            _libssh2_debug(session, LIBSSH2_TRACE_CONN,
-                           "Connection Established - ID: %lu/%lu win: %lu/%lu"
-                           " pack: %lu/%lu",
-                           session->open_channel->local.id,
-                           session->open_channel->remote.id,
-                           session->open_channel->local.window_size,
-                           session->open_channel->remote.window_size,
-                           session->open_channel->local.packet_size,
-                           session->open_channel->remote.packet_size);
-            LIBSSH2_FREE(session, session->open_packet);
-            session->open_packet = NULL;
-            LIBSSH2_FREE(session, session->open_data);
-            session->open_data = NULL;
-
-            session->open_state = libssh2_NB_state_idle;
-            return session->open_channel;
-        }
-
-        if(session->open_data[0] == SSH_MSG_CHANNEL_OPEN_FAILURE) {
-            unsigned int reason_code =
-                _libssh2_ntohu32(session->open_data + 5);
-            switch(reason_code) {
-            case SSH_OPEN_ADMINISTRATIVELY_PROHIBITED:
-                _libssh2_error(session, LIBSSH2_ERROR_CHANNEL_FAILURE,
-                               "Channel open failure "
-                               "(administratively prohibited)");
-                break;
-            case SSH_OPEN_CONNECT_FAILED:
-                _libssh2_error(session, LIBSSH2_ERROR_CHANNEL_FAILURE,
-                               "Channel open failure (connect failed)");
-                break;
-            case SSH_OPEN_UNKNOWN_CHANNELTYPE:
-                _libssh2_error(session, LIBSSH2_ERROR_CHANNEL_FAILURE,
-                               "Channel open failure (unknown channel type)");
-                break;
-            case SSH_OPEN_RESOURCE_SHORTAGE:
-                _libssh2_error(session, LIBSSH2_ERROR_CHANNEL_FAILURE,
-                               "Channel open failure (resource shortage)");
-                break;
-            default:
-                _libssh2_error(session, LIBSSH2_ERROR_CHANNEL_FAILURE,
-                               "Channel open failure");
-            }
+        if(!ready->listed && channel_is_ready(channel, which)) {
+            ready->channel = channel;
+            ready->listed = 1;
+            _libssh2_list_add(&session->channels_ready[which], &ready->node);
         }
     }
+}
 
-  channel_error:
+/*
+ * channel_unready
+ *
+ * Take a channel that is being freed off the session's ready lists
+ */
+static void
+channel_unready(LIBSSH2_CHANNEL *channel)
+{
+    int which;
 
-    if(session->open_data) {
-        LIBSSH2_FREE(session, session->open_data);
-        session->open_data = NULL;
-    }
-    if(session->open_packet) {
-        LIBSSH2_FREE(session, session->open_packet);
-        session->open_packet = NULL;
+    for(which = CHANNEL_READABLE; which <= CHANNEL_WRITABLE; which++) {
+        if(channel->ready[which].listed) {
+            _libssh2_list_remove(&channel->ready[which].node);
+            channel->ready[which].listed = 0;
+        }
     }
-    if(session->open_channel) {
-        unsigned char channel_id[4];
-        LIBSSH2_FREE(session, session->open_channel->channel_type);
-
-        _libssh2_list_remove(&session->open_channel->node);
+}
 
-        /* Clear out packets meant for this channel */
-        _libssh2_htonu32(channel_id, session->open_channel->local.id);
-        while((_libssh2_packet_ask(session, SSH_MSG_CHANNEL_DATA,
-                                    &session->open_data,
-                                    &session->open_data_len, 1,
-                                    channel_id, 4) >= 0)
-               ||
-               (_libssh2_packet_ask(session, SSH_MSG_CHANNEL_EXTENDED_DATA,
-                                    &session->open_data,
-                                    &session->open_data_len, 1,
-                                    channel_id, 4) >= 0)) {
-            LIBSSH2_FREE(session, session->open_data);
-            session->open_data = NULL;
+/*
+ * channel_ready_collect
+ *
+ * Store up to 'channels_len' channels from one of the session's ready lists
+ * that still are ready in 'channels', and drop those that aren't. The ones
+ * stored go to the end of the list, so that others come first next time.
+ * Returns the number of channels stored.
+ */
+static size_t
+channel_ready_collect(LIBSSH2_SESSION *session, int which,
+                      LIBSSH2_CHANNEL **channels, size_t channels_len)
+{
+    struct list_head *list = &session->channels_ready[which];
+    struct channel_ready *last = (struct channel_ready *)list->last;
+    struct channel_ready *ready = _libssh2_list_first(list);
+    size_t found = 0;
+
+    while(ready && (found < channels_len)) {
+        struct channel_ready *next = _libssh2_list_next(&ready->node);
+        int done = (ready == last);
+
+        _libssh2_list_remove(&ready->node);
+        if(channel_is_ready(ready->channel, which)) {
+            channels[found++] = ready->channel;
+            _libssh2_list_add(list, &ready->node);
         }
+        else
+            ready->listed = 0;
 
-        LIBSSH2_FREE(session, session->open_channel);
-        session->open_channel = NULL;
+        if(done)
+            break;
+        ready = next;
     }
 
-    session->open_state = libssh2_NB_state_idle;
-    return NULL;
+    return found;
 }
 
 /*
- * libssh2_channel_open_ex
+ * channel_open_send
  *
- * Establish a generic session channel
+ * Queue the CHANNEL_OPEN request of a channel. It is only put in the
+ * outgoing queue, the reply is picked up in _libssh2_channel_open_reply()
+ * whenever it arrives.
  */
-LIBSSH2_API LIBSSH2_CHANNEL *
-libssh2_channel_open_ex(LIBSSH2_SESSION *session, const char *type,
-                        unsigned int type_len,
-                        unsigned int window_size, unsigned int packet_size,
-                        const char *msg, unsigned int msg_len)
+static int
+channel_open_send(LIBSSH2_CHANNEL *channel)
 {
-    LIBSSH2_CHANNEL *ptr;
+    LIBSSH2_SESSION *session = channel->session;
+    int rc;
 
-    if(!session)
-        return NULL;
+    rc = _libssh2_transport_queue(session, channel->open_packet,
+                                  channel->open_packet_len);
+    if(rc == LIBSSH2_ERROR_EAGAIN)
+        return _libssh2_error(session, rc,
+                              "Would block sending channel-open request");
+    else if(rc)
+        return _libssh2_error(session, rc,
+                              "Unable to send channel-open request");
 
-    BLOCK_ADJUST_ERRNO(ptr, session,
-                       _libssh2_channel_open(session, type, type_len,
-                                             window_size, packet_size,
-                                             (unsigned char *)msg,
-                                             msg_len));
-    return ptr;
+    LIBSSH2_FREE(session, channel->open_packet);
+    channel->open_packet = NULL;
+
+    if(session->window_mode == LIBSSH2_WINDOW_AUTO)
+        /* the confirmation times a round trip */
+        channel->window_probe = _libssh2_usecs();
+
+    channel->open_state = libssh2_NB_state_sent;
+    return 0;
 }
 
 /*
- * libssh2_channel_direct_tcpip_ex
+ * channel_open_drop
  *
- * Tunnel TCP/IP connect through the SSH session to direct host/port
+ * Free a channel whose open did not work out, without waiting for anything
+ * more from the peer
+ */
+static void
+channel_open_drop(LIBSSH2_CHANNEL *channel)
+{
+    if(channel->open_state != libssh2_NB_state_sent)
+        /* the peer never got the request or turned it down, so it won't
+           send anything for this channel */
+        channel->remote.close = 1;
+    channel->local.close = 1;
+
+    _libssh2_channel_free(channel);
+}
+
+/*
+ * channel_open_start
+ *
+ * Allocate a channel and queue its CHANNEL_OPEN request, without waiting
+ * for the reply. Replies are matched to their channels by ID, so any number
+ * of opens may be in flight at once.
  */
 static LIBSSH2_CHANNEL *
-channel_direct_tcpip(LIBSSH2_SESSION * session, const char *host,
-                     int port, const char *shost, int sport)
+channel_open_start(LIBSSH2_SESSION *session, const char *channel_type,
+                   uint32_t channel_type_len, uint32_t window_size,
+                   uint32_t packet_size, const unsigned char *message,
+                   size_t message_len)
 {
     LIBSSH2_CHANNEL *channel;
     unsigned char *s;
+    int rc;
 
-    if(session->direct_state == libssh2_NB_state_idle) {
-        session->direct_host_len = strlen(host);
-        session->direct_shost_len = strlen(shost);
-        /* host_len(4) + port(4) + shost_len(4) + sport(4) */
-        session->direct_message_len =
-            session->direct_host_len + session->direct_shost_len + 16;
-
-        _libssh2_debug(session, LIBSSH2_TRACE_CONN,
-                       "Requesting direct-tcpip session from %s:%d to %s:%d",
-                       shost, sport, host, port);
-
-        s = session->direct_message =
-            LIBSSH2_ALLOC(session, session->direct_message_len);
-        if(!session->direct_message) {
-            _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
-                           "Unable to allocate memory for "
-                           "direct-tcpip connection");
-            return NULL;
-        }
-        _libssh2_store_str(&s, host, session->direct_host_len);
-        _libssh2_store_u32(&s, port);
-        _libssh2_store_str(&s, shost, session->direct_shost_len);
-        _libssh2_store_u32(&s, sport);
-    }
-
-    channel =
-        _libssh2_channel_open(session, "direct-tcpip",
-                              sizeof("direct-tcpip") - 1,
-                              LIBSSH2_CHANNEL_WINDOW_DEFAULT,
-                              LIBSSH2_CHANNEL_PACKET_DEFAULT,
-                              session->direct_message,
-                              session->direct_message_len);
-
-    if(!channel &&
-        libssh2_session_last_errno(session) == LIBSSH2_ERROR_EAGAIN) {
-        /* The error code is still set to LIBSSH2_ERROR_EAGAIN, set our state
-           to created to avoid re-creating the package on next invoke */
-        session->direct_state = libssh2_NB_state_created;
+    _libssh2_debug(session, LIBSSH2_TRACE_CONN,
+                   "Opening Channel - win %d pack %d", window_size,
+                   packet_size);
+    channel = LIBSSH2_CALLOC(session, sizeof(LIBSSH2_CHANNEL));
+    if(!channel) {
+        _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                       "Unable to allocate space for channel data");
+        return NULL;
+    }
+    channel->channel_type_len = channel_type_len;
+    channel->channel_type = LIBSSH2_ALLOC(session, channel_type_len);
+    if(!channel->channel_type) {
+        _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                       "Failed allocating memory for channel type name");
+        LIBSSH2_FREE(session, channel);
+        return NULL;
+    }
+    memcpy(channel->channel_type, channel_type, channel_type_len);
+
+    /* 17 = packet_type(1) + channel_type_len(4) + sender_channel(4) +
+     * window_size(4) + packet_size(4) */
+    channel->open_packet_len = channel_type_len + 17 + message_len;
+    channel->open_packet = LIBSSH2_ALLOC(session, channel->open_packet_len);
+    if(!channel->open_packet) {
+        _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                       "Unable to allocate temporary space for packet");
+        LIBSSH2_FREE(session, channel->channel_type);
+        LIBSSH2_FREE(session, channel);
         return NULL;
     }
-    /* by default we set (keep?) idle state... */
-    session->direct_state = libssh2_NB_state_idle;
 
-    LIBSSH2_FREE(session, session->direct_message);
-    session->direct_message = NULL;
+    /* REMEMBER: local as in locally sourced */
+    if(_libssh2_channel_nextid(session, channel)) {
+        LIBSSH2_FREE(session, channel->open_packet);
+        LIBSSH2_FREE(session, channel->channel_type);
+        LIBSSH2_FREE(session, channel);
+        return NULL;
+    }
+    if(session->window_mode == LIBSSH2_WINDOW_AUTO) {
+        if(window_size < session->window_min)
+            window_size = session->window_min;
+        else if(window_size > session->window_max)
+            window_size = session->window_max;
+    }
+    window_size = _libssh2_channel_window_open(session, window_size,
+                                               packet_size);
+    channel->remote.window_size = window_size;
+    channel->remote.window_size_initial = window_size;
+    channel->remote.packet_size = packet_size;
+    channel->session = session;
+
+    _libssh2_list_add(&session->channels, &channel->node);
+    session->channel_windows += window_size;
+
+    s = channel->open_packet;
+    *(s++) = SSH_MSG_CHANNEL_OPEN;
+    _libssh2_store_str(&s, channel_type, channel_type_len);
+    _libssh2_store_u32(&s, channel->local.id);
+    _libssh2_store_u32(&s, window_size);
+    _libssh2_store_u32(&s, packet_size);
+    if(message_len)
+        memcpy(s, message, message_len);
+
+    channel->open_state = libssh2_NB_state_created;
+
+    /* if it can't be queued now, libssh2_channel_open_finish() does it */
+    rc = channel_open_send(channel);
+    if(rc && (rc != LIBSSH2_ERROR_EAGAIN)) {
+        channel_open_drop(channel);
+        return NULL;
+    }
 
     return channel;
 }
 
 /*
- * libssh2_channel_direct_tcpip_ex
+ * channel_open_error
  *
- * Tunnel TCP/IP connect through the SSH session to direct host/port
+ * Set the error of an open that failed
  */
-LIBSSH2_API LIBSSH2_CHANNEL *
-libssh2_channel_direct_tcpip_ex(LIBSSH2_SESSION *session, const char *host,
-                                int port, const char *shost, int sport)
+static int
+channel_open_error(LIBSSH2_CHANNEL *channel)
 {
-    LIBSSH2_CHANNEL *ptr;
-
-    if(!session)
-        return NULL;
+    LIBSSH2_SESSION *session = channel->session;
 
-    BLOCK_ADJUST_ERRNO(ptr, session,
-                       channel_direct_tcpip(session, host, port,
-                                            shost, sport));
-    return ptr;
+    if(channel->open_error != LIBSSH2_ERROR_CHANNEL_FAILURE)
+        return _libssh2_error(session, channel->open_error,
+                              "Unexpected packet size");
+
+    switch(channel->open_reason) {
+    case SSH_OPEN_ADMINISTRATIVELY_PROHIBITED:
+        return _libssh2_error(session, LIBSSH2_ERROR_CHANNEL_FAILURE,
+                              "Channel open failure "
+                              "(administratively prohibited)");
+    case SSH_OPEN_CONNECT_FAILED:
+        return _libssh2_error(session, LIBSSH2_ERROR_CHANNEL_FAILURE,
+                              "Channel open failure (connect failed)");
+    case SSH_OPEN_UNKNOWN_CHANNELTYPE:
+        return _libssh2_error(session, LIBSSH2_ERROR_CHANNEL_FAILURE,
+                              "Channel open failure (unknown channel type)");
+    case SSH_OPEN_RESOURCE_SHORTAGE:
+        return _libssh2_error(session, LIBSSH2_ERROR_CHANNEL_FAILURE,
+                              "Channel open failure (resource shortage)");
+    default:
+        return _libssh2_error(session, LIBSSH2_ERROR_CHANNEL_FAILURE,
+                              "Channel open failure");
+    }
 }
 
 /*
- * channel_forward_listen
+ * channel_open_finish
  *
- * Bind a port on the remote host and listen for connections
+ * Wait for the reply to the CHANNEL_OPEN request of a channel
  */
-static LIBSSH2_LISTENER *
-channel_forward_listen(LIBSSH2_SESSION * session, const char *host,
-                       int port, int *bound_port, int queue_maxsize)
+static int
+channel_open_finish(LIBSSH2_CHANNEL *channel)
 {
-    unsigned char *s;
-    static const unsigned char reply_codes[3] =
-        { SSH_MSG_REQUEST_SUCCESS, SSH_MSG_REQUEST_FAILURE, 0 };
+    LIBSSH2_SESSION *session = channel->session;
     int rc;
 
-    if(!host)
-        host = "0.0.0.0";
+    if(channel->open_state == libssh2_NB_state_created) {
+        rc = channel_open_send(channel);
+        if(rc)
+            return rc;
+    }
 
-    if(session->fwdLstn_state == libssh2_NB_state_idle) {
-        session->fwdLstn_host_len = strlen(host);
-        /* 14 = packet_type(1) + request_len(4) + want_replay(1) + host_len(4)
-           + port(4) */
-        session->fwdLstn_packet_len =
-            session->fwdLstn_host_len + (sizeof("tcpip-forward") - 1) + 14;
+    while(channel->open_state == libssh2_NB_state_sent) {
+        if(session->socket_state == LIBSSH2_SOCKET_DISCONNECTED)
+            return _libssh2_error(session, LIBSSH2_ERROR_SOCKET_DISCONNECT,
+                                  "Disconnected while waiting for "
+                                  "channel-open reply");
 
-        /* Zero the whole thing out */
-        memset(&session->fwdLstn_packet_requirev_state, 0,
-               sizeof(session->fwdLstn_packet_requirev_state));
+        rc = _libssh2_transport_read(session);
+        if(rc == LIBSSH2_ERROR_EAGAIN)
+            return _libssh2_error(session, rc, "Would block");
+        else if(rc < 0)
+            return _libssh2_error(session, rc, "Unexpected error");
+    }
 
-        _libssh2_debug(session, LIBSSH2_TRACE_CONN,
-                       "Requesting tcpip-forward session for %s:%d", host,
-                       port);
+    if(channel->open_state == libssh2_NB_state_end)
+        channel->open_state = libssh2_NB_state_idle;
 
-        s = session->fwdLstn_packet =
-            LIBSSH2_ALLOC(session, session->fwdLstn_packet_len);
-        if(!session->fwdLstn_packet) {
-            _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
-                           "Unable to allocate memory for setenv packet");
-            return NULL;
+    if(channel->open_error)
+        return channel_open_error(channel);
+
+    return 0;
+}
+
+/*
+ * _libssh2_channel_open_reply
+ *
+ * Take the CHANNEL_OPEN_CONFIRMATION or CHANNEL_OPEN_FAILURE in 'data' to
+ * the channel it is for
+ */
+void
+_libssh2_channel_open_reply(LIBSSH2_SESSION *session,
+                            const unsigned char *data, size_t datalen)
+{
+    LIBSSH2_CHANNEL *channel;
+    uint32_t id;
+
+    if(datalen < 5)
+        return;
+
+    id = _libssh2_ntohu32(data + 1);
+    channel = _libssh2_channel_locate(session, id);
+    if(!channel) {
+        if(data[0] == SSH_MSG_CHANNEL_OPEN_FAILURE)
+            /* the channel was freed while its open was in flight, and now
+               the peer won't use its ID */
+            _libssh2_channel_closed_id(session, id);
+        return;
+    }
+    if(channel->open_state != libssh2_NB_state_sent)
+        return;
+
+    if((data[0] == SSH_MSG_CHANNEL_OPEN_CONFIRMATION) && (datalen >= 17)) {
+        channel->remote.id = _libssh2_ntohu32(data + 5);
+        channel->local.window_size = _libssh2_ntohu32(data + 9);
+        channel->local.window_size_initial = _libssh2_ntohu32(data + 9);
+        channel->local.packet_size = _libssh2_ntohu32(data + 13);
+        if(channel->window_probe)
+            _libssh2_channel_rtt_sample(channel);
+        _libssh2_debug(session, LIBSSH2_TRACE_CONN,
+                       "Connection Established - ID: %lu/%lu win: %lu/%lu"
+                       " pack: %lu/%lu",
+                       channel->local.id, channel->remote.id,
+                       channel->local.window_size,
+                       channel->remote.window_size,
+                       channel->local.packet_size,
+                       channel->remote.packet_size);
+    }
+    else {
+        if((data[0] == SSH_MSG_CHANNEL_OPEN_FAILURE) && (datalen >= 9)) {
+            channel->open_error = LIBSSH2_ERROR_CHANNEL_FAILURE;
+            channel->open_reason = _libssh2_ntohu32(data + 5);
         }
+        else
+            channel->open_error = LIBSSH2_ERROR_PROTO;
 
-        *(s++) = SSH_MSG_GLOBAL_REQUEST;
-        _libssh2_store_str(&s, "tcpip-forward", sizeof("tcpip-forward") - 1);
-        *(s++) = 0x01;          /* want_reply */
+        _libssh2_debug(session, LIBSSH2_TRACE_CONN,
+                       "Channel open failure for ID %lu", id);
+
+        /* there is nothing to close at either end */
+        channel->local.close = 1;
+        channel->remote.close = 1;
+    }
+
+    channel->open_state = libssh2_NB_state_end;
+    _libssh2_channel_ready(channel);
+}
+
+/*
+ * channel_open_wait
+ *
+ * Finish the open of session->open_channel for the calls that wait for it,
+ * and get rid of the channel if it fails
+ */
+static LIBSSH2_CHANNEL *
+channel_open_wait(LIBSSH2_SESSION *session)
+{
+    LIBSSH2_CHANNEL *channel = session->open_channel;
+    int rc;
 
-        _libssh2_store_str(&s, host, session->fwdLstn_host_len);
-        _libssh2_store_u32(&s, port);
+    rc = channel_open_finish(channel);
+    if(rc == LIBSSH2_ERROR_EAGAIN)
+        return NULL;
 
-        session->fwdLstn_state = libssh2_NB_state_created;
+    session->open_channel = NULL;
+    if(rc) {
+        channel_open_drop(channel);
+        return NULL;
     }
 
-    if(session->fwdLstn_state == libssh2_NB_state_created) {
-        rc = _libssh2_transport_send(session,
-                                     session->fwdLstn_packet,
-                                     session->fwdLstn_packet_len,
-                                     NULL, 0);
-        if(rc == LIBSSH2_ERROR_EAGAIN) {
-            _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
-                           "Would block sending global-request packet for "
-                           "forward listen request");
-            return NULL;
-        }
-        else if(rc) {
-            _libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND,
-                           "Unable to send global-request packet for forward "
-                           "listen request");
-            LIBSSH2_FREE(session, session->fwdLstn_packet);
-            session->fwdLstn_packet = NULL;
-            session->fwdLstn_state = libssh2_NB_state_idle;
-            return NULL;
+    return channel;
+}
+
+/*
+ * _libssh2_channel_open
+ *
+ * Establish a generic session channel
+ */
+LIBSSH2_CHANNEL *
+_libssh2_channel_open(LIBSSH2_SESSION * session, const char *channel_type,
+                      uint32_t channel_type_len,
+                      uint32_t window_size,
+                      uint32_t packet_size,
+                      const unsigned char *message,
+                      size_t message_len)
+{
+    if(!session->open_channel) {
+        session->open_channel =
+            channel_open_start(session, channel_type, channel_type_len,
+                               window_size, packet_size, message,
+                               message_len);
+        if(!session->open_channel)
+            return NULL;
+    }
+
+    return channel_open_wait(session);
+}
+
+/*
+ * libssh2_channel_open_ex
+ *
+ * Establish a generic session channel
+ */
+LIBSSH2_API LIBSSH2_CHANNEL *
+libssh2_channel_open_ex(LIBSSH2_SESSION *session, const char *type,
+                        unsigned int type_len,
+                        unsigned int window_size, unsigned int packet_size,
+                        const char *msg, unsigned int msg_len)
+{
+    LIBSSH2_CHANNEL *ptr;
+
+    if(!session)
+        return NULL;
+
+    BLOCK_ADJUST_ERRNO(ptr, session,
+                       _libssh2_channel_open(session, type, type_len,
+                                             window_size, packet_size,
+                                             (unsigned char *)msg,
+                                             msg_len));
+    return ptr;
+}
+
+/*
+ * libssh2_channel_open_start
+ *
+ * Send the request to open a channel without waiting for the reply. That is
+ * left to libssh2_channel_open_finish(), so that many opens can be in flight
+ * at once. Never blocks.
+ */
+LIBSSH2_API LIBSSH2_CHANNEL *
+libssh2_channel_open_start(LIBSSH2_SESSION *session, const char *type,
+                           unsigned int type_len,
+                           unsigned int window_size, unsigned int packet_size,
+                           const char *msg, unsigned int msg_len)
+{
+    if(!session)
+        return NULL;
+
+    return channel_open_start(session, type, type_len, window_size,
+                              packet_size, (const unsigned char *)msg,
+                              msg_len);
+}
+
+/*
+ * libssh2_channel_open_finish
+ *
+ * Wait for the reply to the open of a channel from
+ * libssh2_channel_open_start(). Returns 0 once the channel is open.
+ */
+LIBSSH2_API int
+libssh2_channel_open_finish(LIBSSH2_CHANNEL *channel)
+{
+    int rc;
+
+    if(!channel)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    BLOCK_ADJUST(rc, channel->session, channel_open_finish(channel));
+    return rc;
+}
+
+/*
+ * channel_direct_tcpip_message
+ *
+ * Allocate the part of the CHANNEL_OPEN request for a direct-tcpip channel
+ * that follows the channel type
+ */
+static unsigned char *
+channel_direct_tcpip_message(LIBSSH2_SESSION *session, const char *host,
+                             int port, const char *shost, int sport,
+                             size_t *message_len)
+{
+    unsigned char *message, *s;
+    size_t host_len = strlen(host);
+    size_t shost_len = strlen(shost);
+
+    _libssh2_debug(session, LIBSSH2_TRACE_CONN,
+                   "Requesting direct-tcpip session from %s:%d to %s:%d",
+                   shost, sport, host, port);
+
+    /* host_len(4) + port(4) + shost_len(4) + sport(4) */
+    *message_len = host_len + shost_len + 16;
+    s = message = LIBSSH2_ALLOC(session, *message_len);
+    if(!message) {
+        _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                       "Unable to allocate memory for "
+                       "direct-tcpip connection");
+        return NULL;
+    }
+    _libssh2_store_str(&s, host, host_len);
+    _libssh2_store_u32(&s, port);
+    _libssh2_store_str(&s, shost, shost_len);
+    _libssh2_store_u32(&s, sport);
+
+    return message;
+}
+
+/*
+ * channel_direct_tcpip_start
+ *
+ * Start the open of a direct-tcpip channel
+ */
+static LIBSSH2_CHANNEL *
+channel_direct_tcpip_start(LIBSSH2_SESSION *session, const char *host,
+                           int port, const char *shost, int sport)
+{
+    LIBSSH2_CHANNEL *channel;
+    unsigned char *message;
+    size_t message_len;
+
+    message = channel_direct_tcpip_message(session, host, port, shost, sport,
+                                           &message_len);
+    if(!message)
+        return NULL;
+
+    channel = channel_open_start(session, "direct-tcpip",
+                                 sizeof("direct-tcpip") - 1,
+                                 LIBSSH2_CHANNEL_WINDOW_DEFAULT,
+                                 LIBSSH2_CHANNEL_PACKET_DEFAULT,
+                                 message, message_len);
+    LIBSSH2_FREE(session, message);
+
+    return channel;
+}
+
+/*
+ * libssh2_channel_direct_tcpip_ex
+ *
+ * Tunnel TCP/IP connect through the SSH session to direct host/port
+ */
+static LIBSSH2_CHANNEL *
+channel_direct_tcpip(LIBSSH2_SESSION * session, const char *host,
+                     int port, const char *shost, int sport)
+{
+    if(!session->open_channel) {
+        session->open_channel =
+            channel_direct_tcpip_start(session, host, port, shost, sport);
+        if(!session->open_channel)
+            return NULL;
+    }
+
+    return channel_open_wait(session);
+}
+
+/*
+ * libssh2_channel_direct_tcpip_ex
+ *
+ * Tunnel TCP/IP connect through the SSH session to direct host/port
+ */
+LIBSSH2_API LIBSSH2_CHANNEL *
+libssh2_channel_direct_tcpip_ex(LIBSSH2_SESSION *session, const char *host,
+                                int port, const char *shost, int sport)
+{
+    LIBSSH2_CHANNEL *ptr;
+
+    if(!session)
+        return NULL;
+
+    BLOCK_ADJUST_ERRNO(ptr, session,
+                       channel_direct_tcpip(session, host, port,
+                                            shost, sport));
+    return ptr;
+}
+
+/*
+ * libssh2_channel_direct_tcpip_start
+ *
+ * Send the request for a direct-tcpip channel without waiting for the
+ * reply, see libssh2_channel_open_start()
+ */
+LIBSSH2_API LIBSSH2_CHANNEL *
+libssh2_channel_direct_tcpip_start(LIBSSH2_SESSION *session,
+                                   const char *host, int port,
+                                   const char *shost, int sport)
+{
+    if(!session)
+        return NULL;
+
+    return channel_direct_tcpip_start(session, host, port, shost, sport);
+}
+
+/*
+ * channel_pool_fill
+ *
+ * Start opening a channel in every empty slot of a pool, and queue the
+ * requests that couldn't be earlier. Never blocks.
+ */
+static int
+channel_pool_fill(LIBSSH2_CHANNEL_POOL *pool)
+{
+    LIBSSH2_CHANNEL *channel;
+    unsigned int i;
+    int rc;
+
+    for(i = 0; i < pool->size; i++) {
+        channel = pool->channels[i];
+        if(!channel) {
+            channel = channel_open_start(pool->session, pool->channel_type,
+                                         pool->channel_type_len,
+                                         pool->window_size,
+                                         pool->packet_size, pool->message,
+                                         pool->message_len);
+            if(!channel)
+                return libssh2_session_last_errno(pool->session);
+            channel->pool = pool;
+            pool->channels[i] = channel;
+        }
+        else if(channel->open_state == libssh2_NB_state_created) {
+            rc = channel_open_send(channel);
+            if(rc)
+                return rc;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * channel_pool_create
+ *
+ * Allocate a pool and start opening its channels
+ */
+static LIBSSH2_CHANNEL_POOL *
+channel_pool_create(LIBSSH2_SESSION *session, const char *channel_type,
+                    uint32_t channel_type_len, uint32_t window_size,
+                    uint32_t packet_size, const unsigned char *message,
+                    size_t message_len, unsigned int size)
+{
+    LIBSSH2_CHANNEL_POOL *pool;
+
+    if(!size) {
+        _libssh2_error(session, LIBSSH2_ERROR_INVAL,
+                       "A channel pool needs room for a channel");
+        return NULL;
+    }
+
+    pool = LIBSSH2_CALLOC(session, sizeof(LIBSSH2_CHANNEL_POOL));
+    if(!pool) {
+        _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                       "Unable to allocate memory for channel pool");
+        return NULL;
+    }
+    pool->session = session;
+    pool->channel_type_len = channel_type_len;
+    pool->window_size = window_size;
+    pool->packet_size = packet_size;
+    pool->message_len = message_len;
+    pool->size = size;
+
+    pool->channel_type = LIBSSH2_ALLOC(session, channel_type_len);
+    pool->channels = LIBSSH2_CALLOC(session, size * sizeof(LIBSSH2_CHANNEL *));
+    if(message_len)
+        pool->message = LIBSSH2_ALLOC(session, message_len);
+    if(!pool->channel_type || !pool->channels ||
+       (message_len && !pool->message)) {
+        _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                       "Unable to allocate memory for channel pool");
+        if(pool->channel_type)
+            LIBSSH2_FREE(session, pool->channel_type);
+        if(pool->channels)
+            LIBSSH2_FREE(session, pool->channels);
+        if(pool->message)
+            LIBSSH2_FREE(session, pool->message);
+        LIBSSH2_FREE(session, pool);
+        return NULL;
+    }
+    memcpy(pool->channel_type, channel_type, channel_type_len);
+    if(message_len)
+        memcpy(pool->message, message, message_len);
+
+    _libssh2_debug(session, LIBSSH2_TRACE_CONN,
+                   "Opening a pool of %u channels", size);
+    channel_pool_fill(pool);
+
+    return pool;
+}
+
+/*
+ * channel_pool_acquire
+ *
+ * Take an open channel out of a pool and start opening another in its place
+ */
+static LIBSSH2_CHANNEL *
+channel_pool_acquire(LIBSSH2_CHANNEL_POOL *pool)
+{
+    LIBSSH2_SESSION *session = pool->session;
+    LIBSSH2_CHANNEL *channel = NULL;
+    int failed = 0;
+    unsigned int i;
+    int rc;
+
+    /* take in the replies that have arrived */
+    do {
+        rc = _libssh2_transport_read(session);
+    } while(rc > 0);
+    if(rc < 0 && rc != LIBSSH2_ERROR_EAGAIN) {
+        _libssh2_error(session, rc, "Unable to read from socket");
+        return NULL;
+    }
+
+    for(i = 0; i < pool->size && !channel; i++) {
+        LIBSSH2_CHANNEL *pooled = pool->channels[i];
+
+        if(!pooled || (pooled->open_state == libssh2_NB_state_created) ||
+           (pooled->open_state == libssh2_NB_state_sent))
+            continue;
+
+        rc = channel_open_finish(pooled);
+        if(rc || pooled->remote.eof || pooled->remote.close) {
+            /* turned down, or the server has given up on it since */
+            if(_libssh2_channel_free(pooled) != LIBSSH2_ERROR_EAGAIN)
+                pool->channels[i] = NULL;
+            if(rc)
+                failed = rc;
+            continue;
+        }
+
+        pool->channels[i] = NULL;
+        channel = pooled;
+    }
+
+    if(!channel && failed)
+        /* with the error of the open still set. The slot is filled again
+           on the next call rather than now, so that a blocking call returns
+           the error instead of asking a server that turns every open down
+           again and again. */
+        return NULL;
+
+    rc = channel_pool_fill(pool);
+
+    if(channel) {
+        channel->pool = NULL;
+        /* it is the app's now, and so is anything that arrived for it */
+        _libssh2_channel_ready(channel);
+        return channel;
+    }
+
+    if(rc && rc != LIBSSH2_ERROR_EAGAIN) {
+        _libssh2_error(session, rc, "Unable to refill channel pool");
+        return NULL;
+    }
+
+    _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
+                   "Would block waiting for a pooled channel");
+    return NULL;
+}
+
+/*
+ * channel_pool_free
+ *
+ * Free the channels of a pool, and then the pool
+ */
+static int
+channel_pool_free(LIBSSH2_CHANNEL_POOL *pool)
+{
+    LIBSSH2_SESSION *session = pool->session;
+    unsigned int i;
+    int rc = 0;
+
+    for(i = 0; i < pool->size; i++) {
+        if(!pool->channels[i])
+            continue;
+        if(_libssh2_channel_free(pool->channels[i]) == LIBSSH2_ERROR_EAGAIN)
+            rc = LIBSSH2_ERROR_EAGAIN;
+        else
+            pool->channels[i] = NULL;
+    }
+    if(rc)
+        return rc;
+
+    LIBSSH2_FREE(session, pool->channels);
+    LIBSSH2_FREE(session, pool->channel_type);
+    if(pool->message)
+        LIBSSH2_FREE(session, pool->message);
+    LIBSSH2_FREE(session, pool);
+
+    return 0;
+}
+
+/*
+ * libssh2_channel_pool_init_ex
+ *
+ * Create a pool that keeps 'size' channels opened ahead of time. Never
+ * blocks.
+ */
+LIBSSH2_API LIBSSH2_CHANNEL_POOL *
+libssh2_channel_pool_init_ex(LIBSSH2_SESSION *session,
+                             const char *channel_type,
+                             unsigned int channel_type_len,
+                             unsigned int window_size,
+                             unsigned int packet_size,
+                             const char *message, unsigned int message_len,
+                             unsigned int size)
+{
+    if(!session)
+        return NULL;
+
+    return channel_pool_create(session, channel_type, channel_type_len,
+                               window_size, packet_size,
+                               (const unsigned char *)message, message_len,
+                               size);
+}
+
+/*
+ * libssh2_channel_pool_direct_tcpip
+ *
+ * Create a pool of channels tunneled to host/port. Never blocks.
+ */
+LIBSSH2_API LIBSSH2_CHANNEL_POOL *
+libssh2_channel_pool_direct_tcpip(LIBSSH2_SESSION *session, const char *host,
+                                  int port, const char *shost, int sport,
+                                  unsigned int size)
+{
+    LIBSSH2_CHANNEL_POOL *pool;
+    unsigned char *message;
+    size_t message_len;
+
+    if(!session)
+        return NULL;
+
+    message = channel_direct_tcpip_message(session, host, port, shost, sport,
+                                           &message_len);
+    if(!message)
+        return NULL;
+
+    pool = channel_pool_create(session, "direct-tcpip",
+                               sizeof("direct-tcpip") - 1,
+                               LIBSSH2_CHANNEL_WINDOW_DEFAULT,
+                               LIBSSH2_CHANNEL_PACKET_DEFAULT,
+                               message, message_len, size);
+    LIBSSH2_FREE(session, message);
+
+    return pool;
+}
+
+/*
+ * libssh2_channel_pool_acquire
+ *
+ * Take an open channel out of a pool. Once the pool has filled up this
+ * returns at once, the channel taken is replaced in the background.
+ */
+LIBSSH2_API LIBSSH2_CHANNEL *
+libssh2_channel_pool_acquire(LIBSSH2_CHANNEL_POOL *pool)
+{
+    LIBSSH2_CHANNEL *ptr;
+
+    if(!pool)
+        return NULL;
+
+    BLOCK_ADJUST_ERRNO(ptr, pool->session, channel_pool_acquire(pool));
+    return ptr;
+}
+
+/*
+ * libssh2_channel_pool_free
+ *
+ * Close and free the channels left in a pool, and the pool
+ */
+LIBSSH2_API int
+libssh2_channel_pool_free(LIBSSH2_CHANNEL_POOL *pool)
+{
+    int rc;
+
+    if(!pool)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    BLOCK_ADJUST(rc, pool->session, channel_pool_free(pool));
+    return rc;
+}
+
+/*
+ * channel_forward_listen_send
+ *
+ * Queue the tcpip-forward request of a listener. The reply is picked up in
+ * _libssh2_global_request_reply() whenever it arrives.
+ */
+static int
+channel_forward_listen_send(LIBSSH2_LISTENER *listener)
+{
+    LIBSSH2_SESSION *session = listener->session;
+    int rc;
+
+    rc = _libssh2_transport_queue(session, listener->fwd_packet,
+                                  listener->fwd_packet_len);
+    if(rc == LIBSSH2_ERROR_EAGAIN)
+        return _libssh2_error(session, rc,
+                              "Would block sending global-request packet for "
+                              "forward listen request");
+    else if(rc)
+        return _libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND,
+                              "Unable to send global-request packet for "
+                              "forward listen request");
+
+    LIBSSH2_FREE(session, listener->fwd_packet);
+    listener->fwd_packet = NULL;
+
+    _libssh2_list_add(&session->global_requests, &listener->request->node);
+    listener->fwd_state = libssh2_NB_state_sent;
+    return 0;
+}
+
+/*
+ * channel_forward_listen_release
+ *
+ * Let go of the tcpip-forward request of a listener that is being freed.
+ * If the reply is still to come, the request stays in line for it.
+ */
+static void
+channel_forward_listen_release(LIBSSH2_LISTENER *listener)
+{
+    LIBSSH2_SESSION *session = listener->session;
+
+    if(listener->request) {
+        if(listener->fwd_state == libssh2_NB_state_sent)
+            listener->request->listener = NULL;
+        else
+            LIBSSH2_FREE(session, listener->request);
+        listener->request = NULL;
+    }
+    if(listener->fwd_packet) {
+        LIBSSH2_FREE(session, listener->fwd_packet);
+        listener->fwd_packet = NULL;
+    }
+}
+
+/*
+ * channel_forward_listen_drop
+ *
+ * Free a listener whose tcpip-forward request did not work out
+ */
+static void
+channel_forward_listen_drop(LIBSSH2_LISTENER *listener)
+{
+    LIBSSH2_SESSION *session = listener->session;
+
+    channel_forward_listen_release(listener);
+    _libssh2_list_remove(&listener->node);
+    LIBSSH2_FREE(session, listener->host);
+    LIBSSH2_FREE(session, listener);
+}
+
+/*
+ * channel_forward_listen_start
+ *
+ * Allocate a listener and queue its tcpip-forward request, without waiting
+ * for the reply. Replies to global requests come in the order the requests
+ * were sent, so any number of them may be in flight at once.
+ */
+static LIBSSH2_LISTENER *
+channel_forward_listen_start(LIBSSH2_SESSION *session, const char *host,
+                             int port, int queue_maxsize)
+{
+    LIBSSH2_LISTENER *listener;
+    unsigned char *s;
+    size_t host_len;
+    int rc;
+
+    if(!host)
+        host = "0.0.0.0";
+    host_len = strlen(host);
+
+    _libssh2_debug(session, LIBSSH2_TRACE_CONN,
+                   "Requesting tcpip-forward session for %s:%d", host,
+                   port);
+
+    listener = LIBSSH2_CALLOC(session, sizeof(LIBSSH2_LISTENER));
+    if(!listener) {
+        _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                       "Unable to allocate memory for listener queue");
+        return NULL;
+    }
+    listener->session = session;
+    listener->port = port;
+    listener->queue_maxsize = queue_maxsize;
+
+    listener->host = LIBSSH2_ALLOC(session, host_len + 1);
+    listener->request = LIBSSH2_CALLOC(session, sizeof(*listener->request));
+    /* 14 = packet_type(1) + request_len(4) + want_replay(1) + host_len(4)
+       + port(4) */
+    listener->fwd_packet_len = host_len + (sizeof("tcpip-forward") - 1) + 14;
+    listener->fwd_packet = LIBSSH2_ALLOC(session, listener->fwd_packet_len);
+    if(!listener->host || !listener->request || !listener->fwd_packet) {
+        _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                       "Unable to allocate memory for listener queue");
+        if(listener->host)
+            LIBSSH2_FREE(session, listener->host);
+        if(listener->request)
+            LIBSSH2_FREE(session, listener->request);
+        if(listener->fwd_packet)
+            LIBSSH2_FREE(session, listener->fwd_packet);
+        LIBSSH2_FREE(session, listener);
+        return NULL;
+    }
+    memcpy(listener->host, host, host_len);
+    listener->host[host_len] = 0;
+    listener->request->listener = listener;
+
+    s = listener->fwd_packet;
+    *(s++) = SSH_MSG_GLOBAL_REQUEST;
+    _libssh2_store_str(&s, "tcpip-forward", sizeof("tcpip-forward") - 1);
+    *(s++) = 0x01;          /* want_reply */
+
+    _libssh2_store_str(&s, host, host_len);
+    _libssh2_store_u32(&s, port);
+
+    listener->fwd_state = libssh2_NB_state_created;
+
+    /* append this to the parent's list of listeners */
+    _libssh2_list_add(&session->listeners, &listener->node);
+
+    /* if it can't be queued now, libssh2_channel_forward_listen_finish()
+       does it */
+    rc = channel_forward_listen_send(listener);
+    if(rc && (rc != LIBSSH2_ERROR_EAGAIN)) {
+        channel_forward_listen_drop(listener);
+        return NULL;
+    }
+
+    return listener;
+}
+
+/*
+ * channel_forward_listen_finish
+ *
+ * Wait for the reply to the tcpip-forward request of a listener
+ */
+static int
+channel_forward_listen_finish(LIBSSH2_LISTENER *listener, int *bound_port)
+{
+    LIBSSH2_SESSION *session = listener->session;
+    int rc;
+
+    if(listener->fwd_state == libssh2_NB_state_created) {
+        rc = channel_forward_listen_send(listener);
+        if(rc)
+            return rc;
+    }
+
+    while(listener->fwd_state == libssh2_NB_state_sent) {
+        if(session->socket_state == LIBSSH2_SOCKET_DISCONNECTED)
+            return _libssh2_error(session, LIBSSH2_ERROR_SOCKET_DISCONNECT,
+                                  "Disconnected while waiting for "
+                                  "forward listen reply");
+
+        rc = _libssh2_transport_read(session);
+        if(rc == LIBSSH2_ERROR_EAGAIN)
+            return _libssh2_error(session, rc, "Would block");
+        else if(rc < 0)
+            return _libssh2_error(session, rc, "Unexpected error");
+    }
+
+    if(listener->fwd_state == libssh2_NB_state_end)
+        listener->fwd_state = libssh2_NB_state_idle;
+
+    if(listener->fwd_failed)
+        return _libssh2_error(session, LIBSSH2_ERROR_REQUEST_DENIED,
+                              "Unable to complete request for "
+                              "forward-listen");
+
+    if(bound_port)
+        *bound_port = listener->port;
+
+    return 0;
+}
+
+/*
+ * _libssh2_global_request_reply
+ *
+ * Take the REQUEST_SUCCESS or REQUEST_FAILURE in 'data' to the oldest global
+ * request still waiting for its reply
+ */
+void
+_libssh2_global_request_reply(LIBSSH2_SESSION *session,
+                              const unsigned char *data, size_t datalen)
+{
+    struct global_request *request =
+        _libssh2_list_first(&session->global_requests);
+    LIBSSH2_LISTENER *listener;
+
+    if(!request)
+        /* a reply to nothing we asked, ignore it */
+        return;
+
+    _libssh2_list_remove(&request->node);
+    listener = request->listener;
+    LIBSSH2_FREE(session, request);
+    if(!listener)
+        return;
+
+    listener->request = NULL;
+    if(data[0] == SSH_MSG_REQUEST_SUCCESS) {
+        if((datalen >= 5) && !listener->port) {
+            listener->port = _libssh2_ntohu32(data + 1);
+            _libssh2_debug(session, LIBSSH2_TRACE_CONN,
+                           "Dynamic tcpip-forward port allocated: %d",
+                           listener->port);
         }
-        LIBSSH2_FREE(session, session->fwdLstn_packet);
-        session->fwdLstn_packet = NULL;
-
-        session->fwdLstn_state = libssh2_NB_state_sent;
     }
+    else
+        listener->fwd_failed = 1;
 
-    if(session->fwdLstn_state == libssh2_NB_state_sent) {
-        unsigned char *data;
-        size_t data_len;
-        rc = _libssh2_packet_requirev(session, reply_codes, &data, &data_len,
-                                      0, NULL, 0,
-                                      &session->fwdLstn_packet_requirev_state);
-        if(rc == LIBSSH2_ERROR_EAGAIN) {
-            _libssh2_error(session, LIBSSH2_ERROR_EAGAIN, "Would block");
-            return NULL;
-        }
-        else if(rc || (data_len < 1)) {
-            _libssh2_error(session, LIBSSH2_ERROR_PROTO, "Unknown");
-            session->fwdLstn_state = libssh2_NB_state_idle;
-            return NULL;
-        }
+    listener->fwd_state = libssh2_NB_state_end;
+}
 
-        if(data[0] == SSH_MSG_REQUEST_SUCCESS) {
-            LIBSSH2_LISTENER *listener;
-
-            listener = LIBSSH2_CALLOC(session, sizeof(LIBSSH2_LISTENER));
-            if(!listener)
-                _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
-                               "Unable to allocate memory for listener queue");
-            else {
-                listener->host =
-                    LIBSSH2_ALLOC(session, session->fwdLstn_host_len + 1);
-                if(!listener->host) {
-                    _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
-                                   "Unable to allocate memory "
-                                   "for listener queue");
-                    LIBSSH2_FREE(session, listener);
-                    listener = NULL;
-                }
-                else {
-                    listener->session = session;
-                    memcpy(listener->host, host, session->fwdLstn_host_len);
-                    listener->host[session->fwdLstn_host_len] = 0;
-                    if(data_len >= 5 && !port) {
-                        listener->port = _libssh2_ntohu32(data + 1);
-                        _libssh2_debug(session, LIBSSH2_TRACE_CONN,
-                                       "Dynamic tcpip-forward port "
-                                       "allocated: %d",
-                                       listener->port);
-                    }
-                    else
-                        listener->port = port;
-
-                    listener->queue_size = 0;
-                    listener->queue_maxsize = queue_maxsize;
-
-                    /* append this to the parent's list of listeners */
-                    _libssh2_list_add(&session->listeners, &listener->node);
-
-                    if(bound_port) {
-                        *bound_port = listener->port;
-                    }
-                }
-            }
+/*
+ * channel_forward_listen
+ *
+ * Bind a port on the remote host and listen for connections
+ */
+static LIBSSH2_LISTENER *
+channel_forward_listen(LIBSSH2_SESSION * session, const char *host,
+                       int port, int *bound_port, int queue_maxsize)
+{
+    LIBSSH2_LISTENER *listener;
+    int rc;
 
-            LIBSSH2_FREE(session, data);
-            session->fwdLstn_state = libssh2_NB_state_idle;
-            return listener;
-        }
-        else if(data[0] == SSH_MSG_REQUEST_FAILURE) {
-            LIBSSH2_FREE(session, data);
-            _libssh2_error(session, LIBSSH2_ERROR_REQUEST_DENIED,
-                           "Unable to complete request for forward-listen");
-            session->fwdLstn_state = libssh2_NB_state_idle;
+    if(!session->fwdLstn_listener) {
+        session->fwdLstn_listener =
+            channel_forward_listen_start(session, host, port,
+                                         queue_maxsize);
+        if(!session->fwdLstn_listener)
             return NULL;
-        }
     }
+    listener = session->fwdLstn_listener;
 
-    session->fwdLstn_state = libssh2_NB_state_idle;
+    rc = channel_forward_listen_finish(listener, bound_port);
+    if(rc == LIBSSH2_ERROR_EAGAIN)
+        return NULL;
 
-    return NULL;
+    session->fwdLstn_listener = NULL;
+    if(rc) {
+        channel_forward_listen_drop(listener);
+        return NULL;
+    }
+
+    return listener;
 }
 
 /*
@@ -625,6 +1452,44 @@ libssh2_channel_forward_listen_ex(LIBSSH2_SESSION *session, const char *host,
     return ptr;
 }
 
+/*
+ * libssh2_channel_forward_listen_start
+ *
+ * Send the request to bind a port on the remote host without waiting for
+ * the reply. That is left to libssh2_channel_forward_listen_finish(). Never
+ * blocks.
+ */
+LIBSSH2_API LIBSSH2_LISTENER *
+libssh2_channel_forward_listen_start(LIBSSH2_SESSION *session,
+                                     const char *host, int port,
+                                     int queue_maxsize)
+{
+    if(!session)
+        return NULL;
+
+    return channel_forward_listen_start(session, host, port, queue_maxsize);
+}
+
+/*
+ * libssh2_channel_forward_listen_finish
+ *
+ * Wait for the reply to a request from
+ * libssh2_channel_forward_listen_start(). Returns 0 once the port is bound.
+ */
+LIBSSH2_API int
+libssh2_channel_forward_listen_finish(LIBSSH2_LISTENER *listener,
+                                      int *bound_port)
+{
+    int rc;
+
+    if(!listener)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    BLOCK_ADJUST(rc, listener->session,
+                 channel_forward_listen_finish(listener, bound_port));
+    return rc;
+}
+
 /*
  * _libssh2_channel_forward_cancel
  *
@@ -646,6 +1511,23 @@ int _libssh2_channel_forward_cancel(LIBSSH2_LISTENER *listener)
     int rc;
     int retcode = 0;
 
+    if(listener->chanFwdCncl_state == libssh2_NB_state_idle) {
+        if((listener->fwd_state == libssh2_NB_state_sent) &&
+           (session->socket_state == LIBSSH2_SOCKET_CONNECTED)) {
+            /* wait for the reply to know if there is anything to cancel */
+            rc = channel_forward_listen_finish(listener, NULL);
+            if(rc == LIBSSH2_ERROR_EAGAIN)
+                return rc;
+        }
+        if((listener->fwd_state == libssh2_NB_state_created) ||
+           (listener->fwd_state == libssh2_NB_state_sent) ||
+           listener->fwd_failed) {
+            /* the port never got bound, there is no cancel to send */
+            channel_forward_listen_release(listener);
+            listener->chanFwdCncl_state = libssh2_NB_state_sent;
+        }
+    }
+
     if(listener->chanFwdCncl_state == libssh2_NB_state_idle) {
         _libssh2_debug(session, LIBSSH2_TRACE_CONN,
                        "Cancelling tcpip-forward session for %s:%d",
@@ -761,6 +1643,9 @@ channel_forward_accept(LIBSSH2_LISTENER *listener)
         /* add channel to session's channel list */
         _libssh2_list_add(&channel->session->channels, &channel->node);
 
+        /* it may have received data or window already */
+        _libssh2_channel_ready(channel);
+
         return channel;
     }
 
@@ -1584,51 +2469,26 @@ int
 _libssh2_channel_flush(LIBSSH2_CHANNEL *channel, int streamid)
 {
     if(channel->flush_state == libssh2_NB_state_idle) {
-        LIBSSH2_PACKET *packet =
-            _libssh2_list_first(&channel->session->packets);
+        int queue;
         channel->flush_refund_bytes = 0;
         channel->flush_flush_bytes = 0;
 
-        while(packet) {
-            unsigned char packet_type;
-            LIBSSH2_PACKET *next = _libssh2_list_next(&packet->node);
+        for(queue = 0; queue < 2; queue++) {
+            LIBSSH2_PACKET *packet;
 
-            if(packet->data_len < 1) {
-                packet = next;
-                _libssh2_debug(channel->session, LIBSSH2_TRACE_ERROR,
-                               "Unexpected packet length");
+            /* the standard stream is only in the first queue, the extended
+               ones only in the second */
+            if(queue ? !streamid :
+               (streamid && (streamid != LIBSSH2_CHANNEL_FLUSH_ALL)))
                 continue;
-            }
-
-            packet_type = packet->data[0];
 
-            if(((packet_type == SSH_MSG_CHANNEL_DATA)
-                || (packet_type == SSH_MSG_CHANNEL_EXTENDED_DATA))
-               && ((packet->data_len >= 5)
-                   && (_libssh2_ntohu32(packet->data + 1)
-                       == channel->local.id))) {
-                /* It's our channel at least */
-                int packet_stream_id;
+            packet = _libssh2_list_first(&channel->read_queue[queue]);
+            while(packet) {
+                LIBSSH2_PACKET *next = _libssh2_list_next(&packet->node);
+                int packet_stream_id =
+                    queue ? (int) _libssh2_ntohu32(packet->data + 5) : 0;
 
-                if(packet_type == SSH_MSG_CHANNEL_DATA) {
-                    packet_stream_id = 0;
-                }
-                else if(packet->data_len >= 9) {
-                    packet_stream_id = _libssh2_ntohu32(packet->data + 5);
-                }
-                else {
-                    channel->flush_state = libssh2_NB_state_idle;
-                    return _libssh2_error(channel->session,
-                                          LIBSSH2_ERROR_PROTO,
-                                          "Unexpected packet length");
-                }
-
-                if((streamid == LIBSSH2_CHANNEL_FLUSH_ALL)
-                    || ((packet_type == SSH_MSG_CHANNEL_EXTENDED_DATA)
-                        && ((streamid == LIBSSH2_CHANNEL_FLUSH_EXTENDED_DATA)
-                            || (streamid == packet_stream_id)))
-                    || ((packet_type == SSH_MSG_CHANNEL_DATA)
-                        && (streamid == 0))) {
+                if((streamid < 0) || (streamid == packet_stream_id)) {
                     size_t bytes_to_flush = packet->data_len -
                         packet->data_head;
 
@@ -1642,14 +2502,11 @@ _libssh2_channel_flush(LIBSSH2_CHANNEL *channel, int streamid)
                     channel->flush_refund_bytes += packet->data_len - 13;
                     channel->flush_flush_bytes += bytes_to_flush;
 
-                    LIBSSH2_FREE(channel->session, packet->data);
-
-                    /* remove this packet from the parent's list */
-                    _libssh2_list_remove(&packet->node);
-                    LIBSSH2_FREE(channel->session, packet);
+                    /* remove this packet from the channel's queue */
+                    channel_data_consume(channel, packet, bytes_to_flush);
                 }
+                packet = next;
             }
-            packet = next;
         }
 
         channel->flush_state = libssh2_NB_state_created;
@@ -1657,6 +2514,7 @@ _libssh2_channel_flush(LIBSSH2_CHANNEL *channel, int streamid)
 
     channel->read_avail -= channel->flush_flush_bytes;
     channel->remote.window_size -= channel->flush_flush_bytes;
+    channel->session->channel_windows -= channel->flush_flush_bytes;
 
     if(channel->flush_refund_bytes) {
         int rc =
@@ -1836,7 +2694,14 @@ _libssh2_channel_receive_window_adjust(LIBSSH2_CHANNEL * channel,
                               "packet, deferring");
     }
     else {
+        if(channel->session->window_mode == LIBSSH2_WINDOW_AUTO &&
+           channel->remote.window_size <= channel->read_avail &&
+           !channel->window_probe)
+            /* the remote end had no window left, so the data this lets it
+               send times a round trip */
+            channel->window_probe = _libssh2_usecs();
         channel->remote.window_size += adjustment;
+        channel->session->channel_windows += adjustment;
     }
 
     channel->adjust_state = libssh2_NB_state_idle;
@@ -1969,6 +2834,176 @@ libssh2_channel_handle_extended_data(LIBSSH2_CHANNEL *channel,
 
 
 
+/*
+ * _libssh2_channel_rtt_sample
+ *
+ * The answer to the packet in flight that times a round trip arrived for the
+ * channel. Fold the time it took into the session's smoothed round trip
+ * time.
+ */
+void
+_libssh2_channel_rtt_sample(LIBSSH2_CHANNEL *channel)
+{
+    LIBSSH2_SESSION *session = channel->session;
+    libssh2_uint64_t now = _libssh2_usecs();
+    libssh2_uint64_t rtt;
+
+    if(!channel->window_probe || now < channel->window_probe) {
+        channel->window_probe = 0;
+        return;
+    }
+    rtt = now - channel->window_probe;
+    channel->window_probe = 0;
+
+    if(!session->window_rtt)
+        session->window_rtt = rtt ? (uint32_t)rtt : 1;
+    else {
+        /* a remote end that had nothing to send right away makes a sample
+           too long, so let a single one raise the estimate only so much */
+        if(rtt > (libssh2_uint64_t)session->window_rtt * 2)
+            rtt = (libssh2_uint64_t)session->window_rtt * 2;
+        session->window_rtt = (uint32_t)
+            ((session->window_rtt * (libssh2_uint64_t)7 + rtt) / 8);
+        if(!session->window_rtt)
+            session->window_rtt = 1;
+    }
+    _libssh2_debug(session, LIBSSH2_TRACE_CONN,
+                   "Round trip time now %lu us",
+                   (unsigned long)session->window_rtt);
+}
+
+/*
+ * channel_window_tune
+ *
+ * In the automatic window mode, resize the receive window every two round
+ * trips to twice the data the application read per round trip, within the
+ * session's bounds. A window that holds back the remote end is filled in
+ * each round trip, so it doubles until the link or the application is the
+ * limit. A window that isn't filled shrinks, by an eighth at most each time
+ * so that a short lull doesn't throw it away.
+ */
+static void
+channel_window_tune(LIBSSH2_CHANNEL *channel)
+{
+    LIBSSH2_SESSION *session = channel->session;
+    libssh2_uint64_t now = _libssh2_usecs();
+    libssh2_uint64_t rtt = session->window_rtt ? session->window_rtt :
+        WINDOW_AUTO_RTT;
+    libssh2_uint64_t elapsed;
+    libssh2_uint64_t consumed;
+    libssh2_uint64_t window;
+    uint32_t current = channel->remote.window_size_initial;
+
+    if(!channel->window_mark_time || now < channel->window_mark_time) {
+        channel->window_mark_time = now;
+        channel->window_mark_consumed = channel->window_consumed;
+        return;
+    }
+    elapsed = now - channel->window_mark_time;
+    if(elapsed < rtt * 2)
+        return;
+
+    consumed = channel->window_consumed - channel->window_mark_consumed;
+    channel->window_mark_time = now;
+    channel->window_mark_consumed = channel->window_consumed;
+    channel->window_rate = (uint32_t)(consumed * 1000000 / elapsed);
+
+    /* twice the bandwidth-delay product the application kept up with */
+    window = consumed * rtt / elapsed * 2;
+    if(window < current - current / 8)
+        window = current - current / 8;
+    if(window < session->window_min)
+        window = session->window_min;
+    else if(window > session->window_max)
+        window = session->window_max;
+
+    if(window != current) {
+        _libssh2_debug(session, LIBSSH2_TRACE_CONN,
+                       "Receive window of channel %lu/%lu from %lu to %lu",
+                       channel->local.id, channel->remote.id,
+                       (unsigned long)current, (unsigned long)window);
+        /* a smaller window is not taken back from the remote end, less of
+           it is given back as data is read instead */
+        channel->remote.window_size_initial = (uint32_t)window;
+    }
+}
+
+/*
+ * channel_window_target
+ *
+ * The size to keep the receive window at: the one it was opened with or
+ * tuned to plus 'extra' room for a read, held down by the channel's buffer
+ * budget and by what the windows of the other channels leave of the
+ * session's. There is always room for a packet, so that the channel being
+ * read moves on.
+ */
+static uint32_t
+channel_window_target(LIBSSH2_CHANNEL *channel, size_t extra)
+{
+    LIBSSH2_SESSION *session = channel->session;
+    size_t target = channel->remote.window_size_initial + extra;
+    size_t budget = target;
+
+    if(channel->buffer_max && budget > channel->buffer_max)
+        budget = channel->buffer_max;
+
+    if(session->channel_buffer_max) {
+        size_t others = session->channel_windows -
+            channel->remote.window_size;
+        size_t left = session->channel_buffer_max > others ?
+            session->channel_buffer_max - others : 0;
+
+        if(budget > left)
+            budget = left;
+    }
+
+    if(budget < channel->remote.packet_size)
+        budget = channel->remote.packet_size;
+    if(budget < LIBSSH2_CHANNEL_MINADJUST)
+        budget = LIBSSH2_CHANNEL_MINADJUST;
+
+    return (uint32_t)(budget < target ? budget : target);
+}
+
+/*
+ * session_over_budget
+ *
+ * Tell if the channel data buffered for the session has reached its budget,
+ * so that no more should be read off the socket than needed
+ */
+static int
+session_over_budget(LIBSSH2_SESSION *session)
+{
+    return session->channel_buffer_max &&
+        session->channel_queued >= session->channel_buffer_max;
+}
+
+/*
+ * _libssh2_channel_window_open
+ *
+ * The receive window to offer a new channel that asks for 'window_size':
+ * no more than what the windows of the other channels leave of the
+ * session's buffer budget, but room for a packet
+ */
+uint32_t
+_libssh2_channel_window_open(LIBSSH2_SESSION *session, uint32_t window_size,
+                             uint32_t packet_size)
+{
+    size_t left;
+
+    if(!session->channel_buffer_max)
+        return window_size;
+
+    left = session->channel_buffer_max > session->channel_windows ?
+        session->channel_buffer_max - session->channel_windows : 0;
+    if(left < packet_size)
+        left = packet_size;
+    if(left < LIBSSH2_CHANNEL_MINADJUST)
+        left = LIBSSH2_CHANNEL_MINADJUST;
+
+    return window_size < left ? window_size : (uint32_t)left;
+}
+
 /*
  * _libssh2_channel_read
  *
@@ -1988,9 +3023,7 @@ ssize_t _libssh2_channel_read(LIBSSH2_CHANNEL *channel, int stream_id,
     int rc;
     size_t bytes_read = 0;
     size_t bytes_want;
-    int unlink_packet;
-    LIBSSH2_PACKET *read_packet;
-    LIBSSH2_PACKET *read_next;
+    uint32_t target;
 
     _libssh2_debug(session, LIBSSH2_TRACE_CONN,
                    "channel_read() wants %d bytes from channel %lu/%lu "
@@ -1998,13 +3031,17 @@ ssize_t _libssh2_channel_read(LIBSSH2_CHANNEL *channel, int stream_id,
                    (int) buflen, channel->local.id, channel->remote.id,
                    stream_id);
 
+    if(session->window_mode == LIBSSH2_WINDOW_AUTO &&
+       channel->read_state != libssh2_NB_state_jump1)
+        channel_window_tune(channel);
+
     /* expand the receiving window first if it has become too narrow */
+    target = channel_window_target(channel, buflen);
     if((channel->read_state == libssh2_NB_state_jump1) ||
-       (channel->remote.window_size <
-        channel->remote.window_size_initial / 4 * 3 + buflen) ) {
+       (channel->remote.window_size < target / 4 * 3)) {
 
-        uint32_t adjustment = channel->remote.window_size_initial + buflen -
-            channel->remote.window_size;
+        uint32_t adjustment = channel->remote.window_size < target ?
+            target - channel->remote.window_size : 0;
         if(adjustment < LIBSSH2_CHANNEL_MINADJUST)
             adjustment = LIBSSH2_CHANNEL_MINADJUST;
 
@@ -2020,16 +3057,17 @@ ssize_t _libssh2_channel_read(LIBSSH2_CHANNEL *channel, int stream_id,
     }
 
     /* Process all pending incoming packets. Tests prove that this way
-       produces faster transfers. */
+       produces faster transfers. Over the buffer budget, only until there
+       is something to read. */
     do {
         rc = _libssh2_transport_read(session);
-    } while(rc > 0);
+    } while(rc > 0 && !(session_over_budget(session) &&
+                        channel_data_first(channel, stream_id)));
 
     if((rc < 0) && (rc != LIBSSH2_ERROR_EAGAIN))
         return _libssh2_error(session, rc, "transport read");
 
-    read_packet = _libssh2_list_first(&session->packets);
-    while(read_packet && (bytes_read < buflen)) {
+    while(bytes_read < buflen) {
         /* previously this loop condition also checked for
            !channel->remote.close but we cannot let it do this:
 
@@ -2037,84 +3075,30 @@ ssize_t _libssh2_channel_read(LIBSSH2_CHANNEL *channel, int stream_id,
            if a close has been received. Acknowledging the close too early
            makes us flush buffers prematurely and loose data.
         */
+        LIBSSH2_PACKET *readpkt = channel_data_first(channel, stream_id);
 
-        LIBSSH2_PACKET *readpkt = read_packet;
-
-        /* In case packet gets destroyed during this iteration */
-        read_next = _libssh2_list_next(&readpkt->node);
-
-        if(readpkt->data_len < 5) {
-            read_packet = read_next;
-
-            if(readpkt->data_len != 1 ||
-                readpkt->data[0] != SSH_MSG_REQUEST_FAILURE) {
-                _libssh2_debug(channel->session, LIBSSH2_TRACE_ERROR,
-                               "Unexpected packet length");
-            }
-
-            continue;
-        }
-
-        channel->read_local_id =
-            _libssh2_ntohu32(readpkt->data + 1);
-
-        /*
-         * Either we asked for a specific extended data stream
-         * (and data was available),
-         * or the standard stream (and data was available),
-         * or the standard stream with extended_data_merge
-         * enabled and data was available
-         */
-        if((stream_id
-             && (readpkt->data[0] == SSH_MSG_CHANNEL_EXTENDED_DATA)
-             && (channel->local.id == channel->read_local_id)
-             && (readpkt->data_len >= 9)
-             && (stream_id == (int) _libssh2_ntohu32(readpkt->data + 5)))
-            || (!stream_id && (readpkt->data[0] == SSH_MSG_CHANNEL_DATA)
-                && (channel->local.id == channel->read_local_id))
-            || (!stream_id
-                && (readpkt->data[0] == SSH_MSG_CHANNEL_EXTENDED_DATA)
-                && (channel->local.id == channel->read_local_id)
-                && (channel->remote.extended_data_ignore_mode ==
-                    LIBSSH2_CHANNEL_EXTENDED_DATA_MERGE))) {
-
-            /* figure out much more data we want to read */
-            bytes_want = buflen - bytes_read;
-            unlink_packet = FALSE;
-
-            if(bytes_want >= (readpkt->data_len - readpkt->data_head)) {
-                /* we want more than this node keeps, so adjust the number and
-                   delete this node after the copy */
-                bytes_want = readpkt->data_len - readpkt->data_head;
-                unlink_packet = TRUE;
-            }
+        if(!readpkt)
+            break;
 
-            _libssh2_debug(session, LIBSSH2_TRACE_CONN,
-                           "channel_read() got %d of data from %lu/%lu/%d%s",
-                           bytes_want, channel->local.id,
-                           channel->remote.id, stream_id,
-                           unlink_packet?" [ul]":"");
-
-            /* copy data from this struct to the target buffer */
-            memcpy(&buf[bytes_read],
-                   &readpkt->data[readpkt->data_head], bytes_want);
-
-            /* advance pointer and counter */
-            readpkt->data_head += bytes_want;
-            bytes_read += bytes_want;
-
-            /* if drained, remove from list */
-            if(unlink_packet) {
-                /* detach readpkt from session->packets list */
-                _libssh2_list_remove(&readpkt->node);
-
-                LIBSSH2_FREE(session, readpkt->data);
-                LIBSSH2_FREE(session, readpkt);
-            }
-        }
+        /* figure out much more data we want to read */
+        bytes_want = buflen - bytes_read;
+        if(bytes_want > (readpkt->data_len - readpkt->data_head))
+            bytes_want = readpkt->data_len - readpkt->data_head;
 
-        /* check the next struct in the chain */
-        read_packet = read_next;
+        _libssh2_debug(session, LIBSSH2_TRACE_CONN,
+                       "channel_read() got %d of data from %lu/%lu/%d%s",
+                       bytes_want, channel->local.id,
+                       channel->remote.id, stream_id,
+                       (bytes_want == readpkt->data_len - readpkt->data_head)?
+                       " [ul]":"");
+
+        /* copy data from this struct to the target buffer */
+        memcpy(&buf[bytes_read],
+               &readpkt->data[readpkt->data_head], bytes_want);
+        bytes_read += bytes_want;
+
+        /* advance the packet, which is freed once drained */
+        channel_data_consume(channel, readpkt, bytes_want);
     }
 
     if(!bytes_read) {
@@ -2133,6 +3117,7 @@ ssize_t _libssh2_channel_read(LIBSSH2_CHANNEL *channel, int stream_id,
 
     channel->read_avail -= bytes_read;
     channel->remote.window_size -= bytes_read;
+    session->channel_windows -= bytes_read;
 
     return bytes_read;
 }
@@ -2175,97 +3160,191 @@ libssh2_channel_read_ex(LIBSSH2_CHANNEL *channel, int stream_id, char *buf,
 }
 
 /*
- * _libssh2_channel_packet_data_len
+ * channel_window_refund
  *
- * Return the size of the data block of the current packet, or 0 if there
- * isn't a packet.
+ * Give back the receive window that consumed data has freed, once it is a
+ * quarter of the whole.
  */
-size_t
-_libssh2_channel_packet_data_len(LIBSSH2_CHANNEL * channel, int stream_id)
+static int
+channel_window_refund(LIBSSH2_CHANNEL *channel)
+{
+    uint32_t target;
+    int rc;
+
+    if(channel->session->window_mode == LIBSSH2_WINDOW_AUTO &&
+       channel->read_state != libssh2_NB_state_jump1)
+        channel_window_tune(channel);
+
+    target = channel_window_target(channel, 0);
+    if((channel->read_state == libssh2_NB_state_jump1) ||
+       (channel->remote.window_size < target / 4 * 3)) {
+
+        uint32_t adjustment = channel->remote.window_size < target ?
+            target - channel->remote.window_size : 0;
+        if(adjustment < LIBSSH2_CHANNEL_MINADJUST)
+            adjustment = LIBSSH2_CHANNEL_MINADJUST;
+
+        channel->read_state = libssh2_NB_state_jump1;
+        rc = _libssh2_channel_receive_window_adjust(channel, adjustment,
+                                                    0, NULL);
+        if(rc)
+            return rc;
+
+        channel->read_state = libssh2_NB_state_idle;
+    }
+    return 0;
+}
+
+/*
+ * channel_read_peek
+ *
+ * Point to the data of stream 'stream_id' that is next to read, where it
+ * was received. Like _libssh2_channel_read() it processes the incoming
+ * packets first, and returns LIBSSH2_ERROR_EAGAIN if there is no data yet.
+ * At EOF, it returns 0 with a length of 0.
+ */
+static int
+channel_read_peek(LIBSSH2_CHANNEL *channel, int stream_id,
+                  const char **data, size_t *data_len)
 {
     LIBSSH2_SESSION *session = channel->session;
-    LIBSSH2_PACKET *read_packet;
-    LIBSSH2_PACKET *next_packet;
-    uint32_t read_local_id;
+    LIBSSH2_PACKET *packet;
+    int rc;
 
-    read_packet = _libssh2_list_first(&session->packets);
-    if(read_packet == NULL)
+    rc = channel_window_refund(channel);
+    if(rc)
+        return rc;
+
+    do {
+        rc = _libssh2_transport_read(session);
+    } while(rc > 0 && !(session_over_budget(session) &&
+                        channel_data_first(channel, stream_id)));
+
+    if((rc < 0) && (rc != LIBSSH2_ERROR_EAGAIN))
+        return _libssh2_error(session, rc, "transport read");
+
+    packet = channel_data_first(channel, stream_id);
+    if(packet) {
+        *data = (const char *)&packet->data[packet->data_head];
+        *data_len = packet->data_len - packet->data_head;
         return 0;
+    }
 
-    while(read_packet) {
+    *data = NULL;
+    *data_len = 0;
+    if(channel->remote.eof || channel->remote.close ||
+       (rc != LIBSSH2_ERROR_EAGAIN))
+        return 0;
 
-        next_packet = _libssh2_list_next(&read_packet->node);
+    return _libssh2_error(session, rc, "would block");
+}
 
-        if(read_packet->data_len < 5) {
-            read_packet = next_packet;
-            _libssh2_debug(channel->session, LIBSSH2_TRACE_ERROR,
-                           "Unexpected packet length");
-            continue;
-        }
+/*
+ * libssh2_channel_read_peek
+ *
+ * Point to the next data to read from a stream of the channel, without
+ * copying it. It stays in place until consumed with
+ * libssh2_channel_read_consume() or read otherwise.
+ */
+LIBSSH2_API int
+libssh2_channel_read_peek(LIBSSH2_CHANNEL *channel, int stream_id,
+                          const char **data, size_t *data_len)
+{
+    int rc;
 
-        read_local_id = _libssh2_ntohu32(read_packet->data + 1);
+    if(!channel || !data || !data_len)
+        return LIBSSH2_ERROR_BAD_USE;
 
-        /*
-         * Either we asked for a specific extended data stream
-         * (and data was available),
-         * or the standard stream (and data was available),
-         * or the standard stream with extended_data_merge
-         * enabled and data was available
-         */
-        if((stream_id
-             && (read_packet->data[0] == SSH_MSG_CHANNEL_EXTENDED_DATA)
-             && (channel->local.id == read_local_id)
-             && (read_packet->data_len >= 9)
-             && (stream_id == (int) _libssh2_ntohu32(read_packet->data + 5)))
-            ||
-            (!stream_id
-             && (read_packet->data[0] == SSH_MSG_CHANNEL_DATA)
-             && (channel->local.id == read_local_id))
-            ||
-            (!stream_id
-             && (read_packet->data[0] == SSH_MSG_CHANNEL_EXTENDED_DATA)
-             && (channel->local.id == read_local_id)
-             && (channel->remote.extended_data_ignore_mode
-                 == LIBSSH2_CHANNEL_EXTENDED_DATA_MERGE))) {
-            return (read_packet->data_len - read_packet->data_head);
-        }
-
-        read_packet = next_packet;
-    }
+    BLOCK_ADJUST(rc, channel->session,
+                 channel_read_peek(channel, stream_id, data, data_len));
+    return rc;
+}
+
+/*
+ * channel_read_consumed
+ *
+ * Mark 'len' bytes at the start of a packet that was peeked at read, and
+ * take them off the receive window.
+ */
+static void
+channel_read_consumed(LIBSSH2_CHANNEL *channel, LIBSSH2_PACKET *packet,
+                      size_t len)
+{
+    channel_data_consume(channel, packet, len);
+    channel->read_avail -= len;
+    channel->remote.window_size -= len;
+    channel->session->channel_windows -= len;
+}
+
+/*
+ * libssh2_channel_read_consume
+ *
+ * Mark the first 'len' bytes that libssh2_channel_read_peek() pointed to as
+ * read. The receive window they take up is given back by following reads.
+ */
+LIBSSH2_API int
+libssh2_channel_read_consume(LIBSSH2_CHANNEL *channel, int stream_id,
+                             size_t len)
+{
+    LIBSSH2_PACKET *packet;
+
+    if(!channel)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    if(!len)
+        return 0;
+
+    packet = channel_data_first(channel, stream_id);
+    if(!packet || (len > packet->data_len - packet->data_head))
+        return _libssh2_error(channel->session, LIBSSH2_ERROR_BAD_USE,
+                              "Consuming more data than was peeked at");
 
+    channel_read_consumed(channel, packet, len);
     return 0;
 }
 
 /*
- * _libssh2_channel_write
+ * _libssh2_channel_packet_data_len
  *
- * Send data to a channel. Note that if this returns EAGAIN, the caller must
- * call this function again with the SAME input arguments.
+ * Return the size of the data block of the current packet, or 0 if there
+ * isn't a packet.
+ */
+size_t
+_libssh2_channel_packet_data_len(LIBSSH2_CHANNEL * channel, int stream_id)
+{
+    LIBSSH2_PACKET *read_packet = channel_data_first(channel, stream_id);
+
+    if(!read_packet)
+        return 0;
+
+    return read_packet->data_len - read_packet->data_head;
+}
+
+/*
+ * _libssh2_channel_writev
+ *
+ * Send the data of 'iovcnt' iovecs to a channel, gathered straight into the
+ * outgoing packets. Note that if this returns EAGAIN, the caller must call
+ * this function again with the SAME input arguments.
  *
  * Returns: number of bytes sent, or if it returns a negative number, that is
  * the error code!
  */
-ssize_t
-_libssh2_channel_write(LIBSSH2_CHANNEL *channel, int stream_id,
-                       const unsigned char *buf, size_t buflen)
+ssize_t
+_libssh2_channel_writev(LIBSSH2_CHANNEL *channel, int stream_id,
+                        const LIBSSH2_IOVEC *iov, int iovcnt)
 {
     int rc = 0;
     LIBSSH2_SESSION *session = channel->session;
     ssize_t wrote = 0; /* counter for this specific this call */
 
-    /* In theory we could split larger buffers into several smaller packets
-     * but it turns out to be really hard and nasty to do while still offering
-     * the API/prototype.
-     *
-     * Instead we only deal with the first 32K in this call and for the parent
-     * function to call it again with the remainder! 32K is a conservative
-     * limit based on the text in RFC4253 section 6.1.
-     */
-    if(buflen > 32700)
-        buflen = 32700;
-
     if(channel->write_state == libssh2_NB_state_idle) {
         unsigned char *s = channel->write_packet;
+        size_t buflen = 0;
+        int i;
+
+        for(i = 0; i < iovcnt; i++)
+            buflen += iov[i].iov_len;
 
         _libssh2_debug(channel->session, LIBSSH2_TRACE_CONN,
                        "Writing %d bytes on channel %lu/%lu, stream #%d",
@@ -2283,10 +3362,10 @@ _libssh2_channel_write(LIBSSH2_CHANNEL *channel, int stream_id,
                                   "data might be ignored");
 
         /* drain the incoming flow first, mostly to make sure we get all
-         * pending window adjust packets */
+         * pending window adjust packets, but not beyond the buffer budget */
         do
             rc = _libssh2_transport_read(session);
-        while(rc > 0);
+        while(rc > 0 && !session_over_budget(session));
 
         if((rc < 0) && (rc != LIBSSH2_ERROR_EAGAIN)) {
             return _libssh2_error(channel->session, rc,
@@ -2323,17 +3402,9 @@ _libssh2_channel_write(LIBSSH2_CHANNEL *channel, int stream_id,
                            channel->remote.id, stream_id);
             channel->write_bufwrite = channel->local.window_size;
         }
-        if(channel->write_bufwrite > channel->local.packet_size) {
-            _libssh2_debug(session, LIBSSH2_TRACE_CONN,
-                           "Splitting write block due to %lu byte "
-                           "packet_size on %lu/%lu/%d",
-                           channel->local.packet_size, channel->local.id,
-                           channel->remote.id, stream_id);
-            channel->write_bufwrite = channel->local.packet_size;
-        }
-        /* store the size here only, the buffer is passed in as-is to
-           _libssh2_transport_send() */
-        _libssh2_store_u32(&s, channel->write_bufwrite);
+        /* room for the size, which _libssh2_transport_send_splitv() sets
+           for each packet it sends the buffer in */
+        _libssh2_store_u32(&s, 0);
         channel->write_packet_len = s - channel->write_packet;
 
         _libssh2_debug(session, LIBSSH2_TRACE_CONN,
@@ -2345,32 +3416,39 @@ _libssh2_channel_write(LIBSSH2_CHANNEL *channel, int stream_id,
     }
 
     if(channel->write_state == libssh2_NB_state_created) {
-        rc = _libssh2_transport_send(session, channel->write_packet,
-                                     channel->write_packet_len,
-                                     buf, channel->write_bufwrite);
-        if(rc == LIBSSH2_ERROR_EAGAIN) {
-            return _libssh2_error(session, rc,
+        ssize_t queued;
+        size_t chunk;
+
+        /* Don't exceed the remote end's packet size limit, nor 32K which is
+           a conservative limit based on the text in RFC4253 section 6.1 */
+        chunk = channel->local.packet_size;
+        if(chunk > 32700 || !chunk)
+            chunk = 32700;
+
+        queued = _libssh2_transport_send_splitv(session, channel,
+                                                channel->write_packet,
+                                                channel->write_packet_len,
+                                                iov, iovcnt,
+                                                channel->write_bufwrite,
+                                                chunk);
+        if(queued == LIBSSH2_ERROR_EAGAIN) {
+            return _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
                                   "Unable to send channel data");
         }
-        else if(rc) {
+        else if(queued < 0) {
             channel->write_state = libssh2_NB_state_idle;
-            return _libssh2_error(session, rc,
+            return _libssh2_error(session, (int)queued,
                                   "Unable to send channel data");
         }
         /* Shrink local window size */
-        channel->local.window_size -= channel->write_bufwrite;
+        channel->local.window_size -= queued;
 
-        wrote += channel->write_bufwrite;
+        wrote += queued;
 
-        /* Since _libssh2_transport_write() succeeded, we must return
-           now to allow the caller to provide the next chunk of data.
-
-           We cannot move on to send the next piece of data that may
-           already have been provided in this same function call, as we
-           risk getting EAGAIN for that and we can't return information
-           both about sent data as well as EAGAIN. So, by returning short
-           now, the caller will call this function again with new data to
-           send */
+        /* Return now with what has been queued to allow the caller to
+           provide the next chunk of data. What is left of this buffer, if
+           the queue could not be sent off in time to take all of it, comes
+           back with the next call. */
 
         channel->write_state = libssh2_NB_state_idle;
 
@@ -2380,6 +3458,23 @@ _libssh2_channel_write(LIBSSH2_CHANNEL *channel, int stream_id,
     return LIBSSH2_ERROR_INVAL; /* reaching this point is really bad */
 }
 
+/*
+ * _libssh2_channel_write
+ *
+ * Send data to a channel. Note that if this returns EAGAIN, the caller must
+ * call this function again with the SAME input arguments.
+ */
+ssize_t
+_libssh2_channel_write(LIBSSH2_CHANNEL *channel, int stream_id,
+                       const unsigned char *buf, size_t buflen)
+{
+    LIBSSH2_IOVEC iov;
+
+    iov.iov_base = (void *)buf;
+    iov.iov_len = buflen;
+    return _libssh2_channel_writev(channel, stream_id, &iov, 1);
+}
+
 /*
  * libssh2_channel_write_ex
  *
@@ -2400,6 +3495,26 @@ libssh2_channel_write_ex(LIBSSH2_CHANNEL *channel, int stream_id,
     return rc;
 }
 
+/*
+ * libssh2_channel_writev
+ *
+ * Send the data of a number of iovecs to a channel, in as few packets as
+ * if it was in a single buffer
+ */
+LIBSSH2_API ssize_t
+libssh2_channel_writev(LIBSSH2_CHANNEL *channel, int stream_id,
+                       const LIBSSH2_IOVEC *iov, int iovcnt)
+{
+    ssize_t rc;
+
+    if(!channel || iovcnt < 0 || (iovcnt && !iov))
+        return LIBSSH2_ERROR_BAD_USE;
+
+    BLOCK_ADJUST(rc, channel->session,
+                 _libssh2_channel_writev(channel, stream_id, iov, iovcnt));
+    return rc;
+}
+
 /*
  * channel_send_eof
  *
@@ -2456,35 +3571,12 @@ libssh2_channel_send_eof(LIBSSH2_CHANNEL *channel)
 LIBSSH2_API int
 libssh2_channel_eof(LIBSSH2_CHANNEL * channel)
 {
-    LIBSSH2_SESSION *session;
-    LIBSSH2_PACKET *packet;
-    LIBSSH2_PACKET *next_packet;
-
     if(!channel)
         return LIBSSH2_ERROR_BAD_USE;
 
-    session = channel->session;
-    packet = _libssh2_list_first(&session->packets);
-
-    while(packet) {
-
-        next_packet = _libssh2_list_next(&packet->node);
-
-        if(packet->data_len < 1) {
-            packet = next_packet;
-            _libssh2_debug(channel->session, LIBSSH2_TRACE_ERROR,
-                           "Unexpected packet length");
-            continue;
-        }
-
-        if(((packet->data[0] == SSH_MSG_CHANNEL_DATA)
-            || (packet->data[0] == SSH_MSG_CHANNEL_EXTENDED_DATA))
-            && ((packet->data_len >= 5)
-            && (channel->local.id == _libssh2_ntohu32(packet->data + 1)))) {
-            /* There's data waiting to be read yet, mask the EOF status */
-            return 0;
-        }
-        packet = next_packet;
+    if(channel->read_queued[0] || channel->read_queued[1]) {
+        /* There's data waiting to be read yet, mask the EOF status */
+        return 0;
     }
 
     return channel->remote.eof;
@@ -2568,10 +3660,15 @@ int _libssh2_channel_close(LIBSSH2_CHANNEL * channel)
         return 0;
     }
 
+    /* let the EOF and the close go out together */
+    if(channel->close_state != libssh2_NB_state_sent)
+        _libssh2_transport_cork(session);
+
     if(!channel->local.eof) {
         rc = channel_send_eof(channel);
         if(rc) {
             if(rc == LIBSSH2_ERROR_EAGAIN) {
+                _libssh2_transport_uncork(session);
                 return rc;
             }
             _libssh2_error(session, rc,
@@ -2595,6 +3692,8 @@ int _libssh2_channel_close(LIBSSH2_CHANNEL * channel)
     if(channel->close_state == libssh2_NB_state_created) {
         rc = _libssh2_transport_send(session, channel->close_packet, 5,
                                      NULL, 0);
+        /* the reading below sends off whatever this can't */
+        _libssh2_transport_uncork(session);
         if(rc == LIBSSH2_ERROR_EAGAIN) {
             _libssh2_error(session, rc,
                            "Would block sending close-channel");
@@ -2717,6 +3816,23 @@ libssh2_channel_wait_closed(LIBSSH2_CHANNEL *channel)
     return rc;
 }
 
+/*
+ * channel_relay_release
+ *
+ * Give back the buffer of data read from a relayed socket.
+ */
+static void
+channel_relay_release(LIBSSH2_CHANNEL *channel)
+{
+    if(channel->relay_buf) {
+        _libssh2_packet_buf_free(channel->session, channel->relay_buf,
+                                 channel->relay_buf_class);
+        channel->relay_buf = NULL;
+    }
+    channel->relay_len = 0;
+    channel->relay_sent = 0;
+}
+
 /*
  * _libssh2_channel_free
  *
@@ -2728,9 +3844,6 @@ libssh2_channel_wait_closed(LIBSSH2_CHANNEL *channel)
 int _libssh2_channel_free(LIBSSH2_CHANNEL *channel)
 {
     LIBSSH2_SESSION *session = channel->session;
-    unsigned char channel_id[4];
-    unsigned char *data;
-    size_t data_len;
     int rc;
 
     assert(session);
@@ -2743,6 +3856,21 @@ int _libssh2_channel_free(LIBSSH2_CHANNEL *channel)
         channel->free_state = libssh2_NB_state_created;
     }
 
+    if((channel->open_state == libssh2_NB_state_sent) &&
+       !channel->local.close &&
+       (session->socket_state == LIBSSH2_SOCKET_CONNECTED)) {
+        /* wait for the reply to the open, to know if there is a channel at
+           the other end to close */
+        rc = channel_open_finish(channel);
+        if(rc == LIBSSH2_ERROR_EAGAIN)
+            return rc;
+    }
+    if(channel->open_state == libssh2_NB_state_created) {
+        /* the peer never heard of the channel */
+        channel->local.close = 1;
+        channel->remote.close = 1;
+    }
+
     /* Allow channel freeing even when the socket has lost its connection */
     if(!channel->local.close
         && (session->socket_state == LIBSSH2_SOCKET_CONNECTED)) {
@@ -2768,14 +3896,10 @@ int _libssh2_channel_free(LIBSSH2_CHANNEL *channel)
      */
 
     /* Clear out packets meant for this channel */
-    _libssh2_htonu32(channel_id, channel->local.id);
-    while((_libssh2_packet_ask(session, SSH_MSG_CHANNEL_DATA, &data,
-                                &data_len, 1, channel_id, 4) >= 0)
-           ||
-           (_libssh2_packet_ask(session, SSH_MSG_CHANNEL_EXTENDED_DATA, &data,
-                                &data_len, 1, channel_id, 4) >= 0)) {
-        LIBSSH2_FREE(session, data);
-    }
+    _libssh2_channel_queue_clear(channel);
+    channel_unready(channel);
+    _libssh2_transport_drop_writes(channel);
+    channel_relay_release(channel);
 
     /* free "channel_type" */
     if(channel->channel_type) {
@@ -2784,6 +3908,8 @@ int _libssh2_channel_free(LIBSSH2_CHANNEL *channel)
 
     /* Unlink from channel list */
     _libssh2_list_remove(&channel->node);
+    _libssh2_channel_release_id(session, channel);
+    session->channel_windows -= channel->remote.window_size;
 
     /*
      * Make sure all memory used in the state variables are free
@@ -2797,6 +3923,9 @@ int _libssh2_channel_free(LIBSSH2_CHANNEL *channel)
     if(channel->process_packet) {
         LIBSSH2_FREE(session, channel->process_packet);
     }
+    if(channel->open_packet) {
+        LIBSSH2_FREE(session, channel->open_packet);
+    }
 
     LIBSSH2_FREE(session, channel);
 
@@ -2844,36 +3973,7 @@ libssh2_channel_window_read_ex(LIBSSH2_CHANNEL *channel,
     }
 
     if(read_avail) {
-        size_t bytes_queued = 0;
-        LIBSSH2_PACKET *next_packet;
-        LIBSSH2_PACKET *packet =
-            _libssh2_list_first(&channel->session->packets);
-
-        while(packet) {
-            unsigned char packet_type;
-               next_packet = _libssh2_list_next(&packet->node);
-
-            if(packet->data_len < 1) {
-                packet = next_packet;
-                _libssh2_debug(channel->session, LIBSSH2_TRACE_ERROR,
-                               "Unexpected packet length");
-                continue;
-            }
-
-            packet_type = packet->data[0];
-
-            if(((packet_type == SSH_MSG_CHANNEL_DATA)
-                || (packet_type == SSH_MSG_CHANNEL_EXTENDED_DATA))
-               && ((packet->data_len >= 5)
-                   && (_libssh2_ntohu32(packet->data + 1) ==
-                       channel->local.id))) {
-                bytes_queued += packet->data_len - packet->data_head;
-            }
-
-            packet = next_packet;
-        }
-
-        *read_avail = bytes_queued;
+        *read_avail = channel->read_queued[0] + channel->read_queued[1];
     }
 
     return channel->remote.window_size;
@@ -2902,3 +4002,392 @@ libssh2_channel_window_write_ex(LIBSSH2_CHANNEL *channel,
 
     return channel->local.window_size;
 }
+
+/*
+ * libssh2_channel_set_buffer_max
+ *
+ * Set how many bytes of received data may be buffered for a channel, 0 for
+ * no limit besides its window
+ */
+LIBSSH2_API void
+libssh2_channel_set_buffer_max(LIBSSH2_CHANNEL *channel, size_t max)
+{
+    if(channel)
+        channel->buffer_max = max;
+}
+
+/*
+ * libssh2_channel_window_stats
+ *
+ * Get the statistics of a channel's receive window
+ */
+LIBSSH2_API void
+libssh2_channel_window_stats(LIBSSH2_CHANNEL *channel,
+                             LIBSSH2_WINDOW_STATS *stats)
+{
+    if(!channel || !stats)
+        return;
+
+    stats->window = channel->remote.window_size_initial;
+    stats->open = channel->remote.window_size > channel->read_avail ?
+        channel->remote.window_size - channel->read_avail : 0;
+    stats->queued = channel->read_avail;
+    stats->consumed = channel->window_consumed;
+    stats->rate = channel->window_rate;
+    stats->rtt = channel->session->window_rtt;
+}
+
+/*
+ * libssh2_channel_set_priority
+ *
+ * Set the priority and weight that data written to a channel is sent with
+ * when the session has more to send than the socket takes
+ */
+LIBSSH2_API int
+libssh2_channel_set_priority(LIBSSH2_CHANNEL *channel, int priority,
+                             unsigned int weight)
+{
+    LIBSSH2_SESSION *session;
+
+    if(!channel)
+        return LIBSSH2_ERROR_BAD_USE;
+    session = channel->session;
+
+    if(priority < LIBSSH2_CHANNEL_PRIORITY_BULK ||
+       priority > LIBSSH2_CHANNEL_PRIORITY_INTERACTIVE ||
+       !weight || weight > SCHED_WEIGHT_MAX)
+        return _libssh2_error(session, LIBSSH2_ERROR_INVAL,
+                              "Invalid channel priority or weight");
+
+    channel->priority = priority;
+    channel->weight = weight;
+    session->sched = 1;
+
+    if(channel->sched.listed) {
+        /* what it has waiting moves along */
+        _libssh2_list_remove(&channel->sched.node);
+        _libssh2_list_add(&session->channels_sched[priority],
+                          &channel->sched.node);
+    }
+    return 0;
+}
+
+/*
+ * channel_relay_out
+ *
+ * Write the data received on a relayed channel to its socket straight from
+ * the packets it arrived in, as much as the socket takes, and shut down
+ * writing to the socket once all data up to EOF is written. Only consumed
+ * data is given back to the receive window.
+ */
+static int
+channel_relay_out(LIBSSH2_CHANNEL *channel)
+{
+    LIBSSH2_SESSION *session = channel->session;
+    LIBSSH2_PACKET *packet;
+    const char *data;
+    size_t len;
+    ssize_t sent;
+    int rc;
+
+    if(channel->relay_state & RELAY_SHUTDOWN)
+        return 0;
+
+    rc = channel_read_peek(channel, 0, &data, &len);
+    if(rc == LIBSSH2_ERROR_EAGAIN)
+        return 0;
+    if(rc)
+        return rc;
+
+    while((packet = channel_data_first(channel, 0))) {
+        len = packet->data_len - packet->data_head;
+        sent = _libssh2_send(channel->relay_fd,
+                             &packet->data[packet->data_head], len,
+                             LIBSSH2_SOCKET_SEND_FLAGS(session),
+                             &session->abstract);
+        if(sent == -EAGAIN) {
+            channel->relay_directions |= LIBSSH2_RELAY_WAIT_WRITE;
+            break;
+        }
+        if(sent < 0)
+            return _libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND,
+                                  "Unable to write relayed data");
+
+        channel_read_consumed(channel, packet, (size_t)sent);
+    }
+
+    if(!packet && (channel->remote.eof || channel->remote.close)) {
+        if(!(channel->relay_flags & LIBSSH2_RELAY_NO_SHUTDOWN))
+#ifdef WIN32
+            shutdown(channel->relay_fd, SD_SEND);
+#else
+            shutdown(channel->relay_fd, SHUT_WR);
+#endif
+        channel->relay_state |= RELAY_SHUTDOWN;
+        return 0;
+    }
+
+    rc = channel_window_refund(channel);
+    return rc == LIBSSH2_ERROR_EAGAIN ? 0 : rc;
+}
+
+/*
+ * channel_relay_in
+ *
+ * Read from a relayed socket and write what it gives to the channel, no
+ * more than the remote end's window takes, and send EOF once the socket
+ * has no more data.
+ */
+static int
+channel_relay_in(LIBSSH2_CHANNEL *channel)
+{
+    LIBSSH2_SESSION *session = channel->session;
+    ssize_t rc;
+
+    while(!channel->remote.close) {
+        if(channel->relay_sent == channel->relay_len) {
+            size_t want = RELAY_BUFSIZE;
+
+            /* without window, the socket waits for a window adjust */
+            if((channel->relay_state & RELAY_FD_EOF) ||
+               !channel->local.window_size)
+                break;
+            if(want > channel->local.window_size)
+                want = channel->local.window_size;
+
+            if(!channel->relay_buf) {
+                channel->relay_buf =
+                    _libssh2_packet_buf_alloc(session, RELAY_BUFSIZE,
+                                              &channel->relay_buf_class);
+                if(!channel->relay_buf)
+                    return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                          "Unable to allocate memory for "
+                                          "relayed data");
+            }
+
+            rc = _libssh2_recv(channel->relay_fd, channel->relay_buf, want,
+                               LIBSSH2_SOCKET_RECV_FLAGS(session),
+                               &session->abstract);
+            if(rc == -EAGAIN) {
+                channel->relay_directions |= LIBSSH2_RELAY_WAIT_READ;
+                break;
+            }
+            if(rc < 0)
+                return _libssh2_error(session, LIBSSH2_ERROR_SOCKET_RECV,
+                                      "Unable to read data to relay");
+            if(!rc) {
+                channel->relay_state |= RELAY_FD_EOF;
+                break;
+            }
+            channel->relay_len = rc;
+            channel->relay_sent = 0;
+        }
+
+        /* called again with the same data if this gets EAGAIN */
+        rc = _libssh2_channel_write(channel, 0,
+                                    &channel->relay_buf[channel->relay_sent],
+                                    channel->relay_len - channel->relay_sent);
+        if(rc == LIBSSH2_ERROR_EAGAIN || !rc)
+            break;
+        if(rc < 0)
+            return (int)rc;
+        channel->relay_sent += rc;
+    }
+
+    if(channel->relay_sent == channel->relay_len)
+        channel_relay_release(channel);
+
+    if((channel->relay_state & RELAY_FD_EOF) && !channel->relay_len &&
+       !(channel->relay_flags & LIBSSH2_RELAY_NO_EOF) &&
+       !channel->local.eof && !channel->remote.close) {
+        rc = channel_send_eof(channel);
+        if(rc && rc != LIBSSH2_ERROR_EAGAIN)
+            return (int)rc;
+    }
+    return 0;
+}
+
+/*
+ * libssh2_channel_relay_fd
+ *
+ * Relay data between a channel and a socket, moved along by
+ * libssh2_channel_relay_pump(). LIBSSH2_INVALID_SOCKET ends the relay.
+ */
+LIBSSH2_API int
+libssh2_channel_relay_fd(LIBSSH2_CHANNEL *channel, libssh2_socket_t fd,
+                         int flags)
+{
+    if(!channel)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    channel_relay_release(channel);
+    channel->relay_fd = fd;
+    channel->relay_flags = flags;
+    channel->relay_state = fd == LIBSSH2_INVALID_SOCKET ? 0 : RELAY_ACTIVE;
+    channel->relay_directions = 0;
+    return 0;
+}
+
+/*
+ * libssh2_channel_relay_pump
+ *
+ * Move what data a relay can in both directions without waiting. Returns 0
+ * once both directions are done, LIBSSH2_ERROR_EAGAIN until then.
+ */
+LIBSSH2_API int
+libssh2_channel_relay_pump(LIBSSH2_CHANNEL *channel)
+{
+    int rc;
+
+    if(!channel || !(channel->relay_state & RELAY_ACTIVE))
+        return LIBSSH2_ERROR_BAD_USE;
+
+    channel->relay_directions = 0;
+
+    rc = channel_relay_out(channel);
+    if(rc)
+        return rc;
+    rc = channel_relay_in(channel);
+    if(rc)
+        return rc;
+
+    if((channel->relay_state & RELAY_SHUTDOWN) &&
+       (channel->remote.close ||
+        ((channel->relay_state & RELAY_FD_EOF) && !channel->relay_len &&
+         (channel->local.eof ||
+          (channel->relay_flags & LIBSSH2_RELAY_NO_EOF)))))
+        return 0;
+
+    return LIBSSH2_ERROR_EAGAIN;
+}
+
+/*
+ * libssh2_channel_relay_directions
+ *
+ * Tell what the last libssh2_channel_relay_pump() waits for on the socket,
+ * a mask of LIBSSH2_RELAY_WAIT_READ and LIBSSH2_RELAY_WAIT_WRITE.
+ */
+LIBSSH2_API int
+libssh2_channel_relay_directions(LIBSSH2_CHANNEL *channel)
+{
+    if(!channel)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    return channel->relay_directions;
+}
+
+/*
+ * libssh2_channel_callback_set
+ *
+ * Set (or reset) a callback function for events on a channel
+ * Returns the prior address
+ *
+ * ALERT: this function relies on that we can typecast function pointers
+ * to void pointers, which isn't allowed in ISO C!
+ */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+LIBSSH2_API void *
+libssh2_channel_callback_set(LIBSSH2_CHANNEL *channel, int cbtype,
+                             void *callback)
+{
+    void *oldcb;
+
+    if(!channel)
+        return NULL;
+
+    switch(cbtype) {
+    case LIBSSH2_CHANNEL_CALLBACK_DATA:
+        oldcb = channel->data_cb;
+        channel->data_cb = callback;
+        return oldcb;
+
+    case LIBSSH2_CHANNEL_CALLBACK_EOF:
+        oldcb = channel->eof_cb;
+        channel->eof_cb = callback;
+        return oldcb;
+
+    case LIBSSH2_CHANNEL_CALLBACK_CLOSE:
+        oldcb = channel->remote_close_cb;
+        channel->remote_close_cb = callback;
+        return oldcb;
+
+    case LIBSSH2_CHANNEL_CALLBACK_WINDOW:
+        oldcb = channel->window_cb;
+        channel->window_cb = callback;
+        return oldcb;
+    }
+
+    return NULL;
+}
+#pragma GCC diagnostic pop
+
+/*
+ * libssh2_channel_abstract
+ *
+ * Retrieve a pointer to the abstract property passed to the channel's
+ * callbacks
+ */
+LIBSSH2_API void **
+libssh2_channel_abstract(LIBSSH2_CHANNEL *channel)
+{
+    if(!channel)
+        return NULL;
+
+    return &channel->callback_abstract;
+}
+
+/*
+ * libssh2_transport_read
+ *
+ * Process the packets that have arrived on the session's socket, without
+ * waiting for more, and store up to 'channels_len' channels that can be read
+ * from without blocking in 'channels'. Returns the number stored, or a
+ * negative error code.
+ */
+LIBSSH2_API int
+libssh2_transport_read(LIBSSH2_SESSION *session, LIBSSH2_CHANNEL **channels,
+                       size_t channels_len)
+{
+    int rc;
+
+    if(!session || (!channels && channels_len))
+        return LIBSSH2_ERROR_BAD_USE;
+
+    do {
+        rc = _libssh2_transport_read(session);
+    } while(rc > 0 && !session_over_budget(session));
+
+    if((rc < 0) && (rc != LIBSSH2_ERROR_EAGAIN))
+        return _libssh2_error(session, rc, "transport read");
+
+    return (int)channel_ready_collect(session, CHANNEL_READABLE, channels,
+                                      channels_len);
+}
+
+/*
+ * libssh2_transport_write
+ *
+ * Send off the packets queued for the session's socket, without waiting for
+ * it, and store up to 'channels_len' channels that the remote end's window
+ * lets us write to in 'channels'. Returns the number stored, or a negative
+ * error code. LIBSSH2_ERROR_EAGAIN means queued packets are still waiting
+ * for the socket.
+ */
+LIBSSH2_API int
+libssh2_transport_write(LIBSSH2_SESSION *session, LIBSSH2_CHANNEL **channels,
+                        size_t channels_len)
+{
+    int rc;
+
+    if(!session || (!channels && channels_len))
+        return LIBSSH2_ERROR_BAD_USE;
+
+    rc = _libssh2_transport_flush(session);
+    if(rc)
+        return _libssh2_error(session, rc,
+                              "Unable to send queued packets");
+
+    return (int)channel_ready_collect(session, CHANNEL_WRITABLE, channels,
+                                      channels_len);
+}
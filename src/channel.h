@@ -82,6 +82,32 @@ ssize_t
 _libssh2_channel_write(LIBSSH2_CHANNEL *channel, int stream_id,
                        const unsigned char *buf, size_t buflen);
 
+/*
+ * _libssh2_channel_window_open
+ *
+ * The receive window to offer a new channel within the session's budget
+ */
+uint32_t
+_libssh2_channel_window_open(LIBSSH2_SESSION *session, uint32_t window_size,
+                             uint32_t packet_size);
+
+/*
+ * _libssh2_channel_rtt_sample
+ *
+ * The answer to a packet that times a round trip arrived for the channel
+ */
+void
+_libssh2_channel_rtt_sample(LIBSSH2_CHANNEL *channel);
+
+/*
+ * _libssh2_channel_writev
+ *
+ * Send the data of a number of iovecs to a channel
+ */
+ssize_t
+_libssh2_channel_writev(LIBSSH2_CHANNEL *channel, int stream_id,
+                        const LIBSSH2_IOVEC *iov, int iovcnt);
+
 /*
  * _libssh2_channel_open
  *
@@ -117,16 +143,45 @@ _libssh2_channel_process_startup(LIBSSH2_CHANNEL *channel,
 ssize_t _libssh2_channel_read(LIBSSH2_CHANNEL *channel, int stream_id,
                               char *buf, size_t buflen);
 
-uint32_t _libssh2_channel_nextid(LIBSSH2_SESSION * session);
+int _libssh2_channel_nextid(LIBSSH2_SESSION *session,
+                            LIBSSH2_CHANNEL *channel);
+void _libssh2_channel_release_id(LIBSSH2_SESSION *session,
+                                 LIBSSH2_CHANNEL *channel);
+void _libssh2_channel_closed_id(LIBSSH2_SESSION *session,
+                                uint32_t channel_id);
 
 LIBSSH2_CHANNEL *_libssh2_channel_locate(LIBSSH2_SESSION * session,
                                          uint32_t channel_id);
 
+void _libssh2_channel_queue_data(LIBSSH2_CHANNEL *channel,
+                                 LIBSSH2_PACKET *packet);
+void _libssh2_channel_queue_clear(LIBSSH2_CHANNEL *channel);
+void _libssh2_channel_ready(LIBSSH2_CHANNEL *channel);
+
 size_t _libssh2_channel_packet_data_len(LIBSSH2_CHANNEL * channel,
                                         int stream_id);
 
 int _libssh2_channel_close(LIBSSH2_CHANNEL * channel);
 
+/*
+ * _libssh2_channel_open_reply
+ *
+ * Take a CHANNEL_OPEN_CONFIRMATION or CHANNEL_OPEN_FAILURE to the channel it
+ * is for
+ */
+void _libssh2_channel_open_reply(LIBSSH2_SESSION *session,
+                                 const unsigned char *data, size_t datalen);
+
+/*
+ * _libssh2_global_request_reply
+ *
+ * Take a REQUEST_SUCCESS or REQUEST_FAILURE to the oldest global request
+ * waiting for its reply
+ */
+void _libssh2_global_request_reply(LIBSSH2_SESSION *session,
+                                   const unsigned char *data,
+                                   size_t datalen);
+
 /*
  * _libssh2_channel_forward_cancel
  *
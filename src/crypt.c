@@ -37,6 +37,8 @@
  */
 
 #include "libssh2_priv.h"
+#include "chacha.h"
+#include "mac.h"
 
 #ifdef LIBSSH2_CRYPT_NONE
 
@@ -60,7 +62,12 @@ static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_none = {
     0,                /* flags */
     NULL,
     crypt_none_crypt,
-    NULL
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    _libssh2_cipher_none
 };
 #endif /* LIBSSH2_CRYPT_NONE */
 
@@ -105,6 +112,16 @@ crypt_encrypt(LIBSSH2_SESSION * session, unsigned char *block,
                                  blocksize);
 }
 
+static int
+crypt_encrypt_bulk(LIBSSH2_SESSION * session, const unsigned char *src,
+                   unsigned char *dst, size_t len, void **abstract)
+{
+    struct crypt_ctx *cctx = *(struct crypt_ctx **) abstract;
+    (void) session;
+    return _libssh2_cipher_crypt_bulk(&cctx->h, cctx->algo, cctx->encrypt,
+                                      src, dst, len);
+}
+
 static int
 crypt_dtor(LIBSSH2_SESSION * session, void **abstract)
 {
@@ -127,7 +144,11 @@ static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_aes128_ctr = {
     0,                          /* flags */
     &crypt_init,
     &crypt_encrypt,
+    &crypt_encrypt_bulk,
     &crypt_dtor,
+    NULL,
+    NULL,
+    NULL,
     _libssh2_cipher_aes128ctr
 };
 
@@ -140,7 +161,11 @@ static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_aes192_ctr = {
     0,                          /* flags */
     &crypt_init,
     &crypt_encrypt,
+    &crypt_encrypt_bulk,
     &crypt_dtor,
+    NULL,
+    NULL,
+    NULL,
     _libssh2_cipher_aes192ctr
 };
 
@@ -153,7 +178,11 @@ static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_aes256_ctr = {
     0,                          /* flags */
     &crypt_init,
     &crypt_encrypt,
+    &crypt_encrypt_bulk,
     &crypt_dtor,
+    NULL,
+    NULL,
+    NULL,
     _libssh2_cipher_aes256ctr
 };
 #endif
@@ -168,7 +197,11 @@ static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_aes128_cbc = {
     0,                          /* flags */
     &crypt_init,
     &crypt_encrypt,
+    &crypt_encrypt_bulk,
     &crypt_dtor,
+    NULL,
+    NULL,
+    NULL,
     _libssh2_cipher_aes128
 };
 
@@ -181,7 +214,11 @@ static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_aes192_cbc = {
     0,                          /* flags */
     &crypt_init,
     &crypt_encrypt,
+    &crypt_encrypt_bulk,
     &crypt_dtor,
+    NULL,
+    NULL,
+    NULL,
     _libssh2_cipher_aes192
 };
 
@@ -194,7 +231,11 @@ static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_aes256_cbc = {
     0,                          /* flags */
     &crypt_init,
     &crypt_encrypt,
+    &crypt_encrypt_bulk,
     &crypt_dtor,
+    NULL,
+    NULL,
+    NULL,
     _libssh2_cipher_aes256
 };
 
@@ -209,7 +250,11 @@ static const LIBSSH2_CRYPT_METHOD
     0,                          /* flags */
     &crypt_init,
     &crypt_encrypt,
+    &crypt_encrypt_bulk,
     &crypt_dtor,
+    NULL,
+    NULL,
+    NULL,
     _libssh2_cipher_aes256
 };
 #endif /* LIBSSH2_AES */
@@ -224,7 +269,11 @@ static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_blowfish_cbc = {
     0,                          /* flags */
     &crypt_init,
     &crypt_encrypt,
+    &crypt_encrypt_bulk,
     &crypt_dtor,
+    NULL,
+    NULL,
+    NULL,
     _libssh2_cipher_blowfish
 };
 #endif /* LIBSSH2_BLOWFISH */
@@ -239,7 +288,11 @@ static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_arcfour = {
     0,                          /* flags */
     &crypt_init,
     &crypt_encrypt,
+    &crypt_encrypt_bulk,
     &crypt_dtor,
+    NULL,
+    NULL,
+    NULL,
     _libssh2_cipher_arcfour
 };
 
@@ -275,7 +328,11 @@ static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_arcfour128 = {
     0,                          /* flags */
     &crypt_init_arcfour128,
     &crypt_encrypt,
+    &crypt_encrypt_bulk,
     &crypt_dtor,
+    NULL,
+    NULL,
+    NULL,
     _libssh2_cipher_arcfour
 };
 #endif /* LIBSSH2_RC4 */
@@ -290,7 +347,11 @@ static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_cast128_cbc = {
     0,                          /* flags */
     &crypt_init,
     &crypt_encrypt,
+    &crypt_encrypt_bulk,
     &crypt_dtor,
+    NULL,
+    NULL,
+    NULL,
     _libssh2_cipher_cast5
 };
 #endif /* LIBSSH2_CAST */
@@ -305,12 +366,379 @@ static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_3des_cbc = {
     0,                          /* flags */
     &crypt_init,
     &crypt_encrypt,
+    &crypt_encrypt_bulk,
     &crypt_dtor,
+    NULL,
+    NULL,
+    NULL,
     _libssh2_cipher_3des
 };
 #endif
 
+/* chacha20-poly1305@openssh.com
+ *
+ * The 64 byte key holds two ChaCha20 keys. The first one encrypts the
+ * packet and its first block of key stream is the one-time Poly1305 key,
+ * the second one only encrypts the packet_length field. Both use the
+ * sequence number as nonce. The tag covers the encrypted packet_length and
+ * the encrypted packet and is checked in aead_end().
+ */
+struct chachapoly_ctx
+{
+    int encrypt;
+    _libssh2_chacha20_ctx main_ctx;
+    _libssh2_chacha20_ctx header_ctx;
+    _libssh2_poly1305_ctx poly;
+};
+
+static int
+chachapoly_init(LIBSSH2_SESSION * session,
+                const LIBSSH2_CRYPT_METHOD * method,
+                unsigned char *iv, int *free_iv,
+                unsigned char *secret, int *free_secret,
+                int encrypt, void **abstract)
+{
+    static const unsigned char zero_nonce[CHACHA20_NONCE_LEN] = { 0 };
+    struct chachapoly_ctx *ctx = LIBSSH2_CALLOC(session,
+                                                sizeof(struct chachapoly_ctx));
+    (void) method;
+    (void) iv;
+
+    if(!ctx)
+        return LIBSSH2_ERROR_ALLOC;
+
+    if(_libssh2_chacha20_init(&ctx->main_ctx, secret)) {
+        LIBSSH2_FREE(session, ctx);
+        return -1;
+    }
+    if(_libssh2_chacha20_init(&ctx->header_ctx, secret + CHACHA20_KEY_LEN)) {
+        _libssh2_chacha20_dtor(&ctx->main_ctx);
+        LIBSSH2_FREE(session, ctx);
+        return -1;
+    }
+
+    /* crypt() on its own, as used for OpenSSH private keys, is the packet
+       body of sequence number zero */
+    if(_libssh2_chacha20_setiv(&ctx->main_ctx, zero_nonce, 1)) {
+        _libssh2_chacha20_dtor(&ctx->main_ctx);
+        _libssh2_chacha20_dtor(&ctx->header_ctx);
+        LIBSSH2_FREE(session, ctx);
+        return -1;
+    }
+
+    ctx->encrypt = encrypt;
+    *abstract = ctx;
+    *free_iv = 1;
+    *free_secret = 1;
+    return 0;
+}
+
+static int
+chachapoly_crypt(LIBSSH2_SESSION * session, unsigned char *block,
+                 size_t blocksize, void **abstract)
+{
+    struct chachapoly_ctx *ctx = *(struct chachapoly_ctx **) abstract;
+    (void) session;
+    return _libssh2_chacha20_crypt(&ctx->main_ctx, block, block, blocksize);
+}
+
+static int
+chachapoly_crypt_bulk(LIBSSH2_SESSION * session, const unsigned char *src,
+                      unsigned char *dst, size_t len, void **abstract)
+{
+    struct chachapoly_ctx *ctx = *(struct chachapoly_ctx **) abstract;
+    (void) session;
+
+    /* the tag is computed over the cipher text */
+    if(!ctx->encrypt)
+        _libssh2_poly1305_update(&ctx->poly, src, len);
+    if(_libssh2_chacha20_crypt(&ctx->main_ctx, src, dst, len))
+        return -1;
+    if(ctx->encrypt)
+        _libssh2_poly1305_update(&ctx->poly, dst, len);
+    return 0;
+}
+
+static int
+chachapoly_aead_begin(LIBSSH2_SESSION * session, uint32_t seqno,
+                      const unsigned char *src, unsigned char *dst,
+                      void **abstract)
+{
+    static const unsigned char zeros[POLY1305_KEY_LEN] = { 0 };
+    struct chachapoly_ctx *ctx = *(struct chachapoly_ctx **) abstract;
+    unsigned char nonce[CHACHA20_NONCE_LEN];
+    unsigned char poly_key[POLY1305_KEY_LEN];
+    int rc;
+    (void) session;
+
+    /* the nonce is the 64 bit big endian sequence number */
+    memset(nonce, 0, 4);
+    _libssh2_htonu32(&nonce[4], seqno);
+
+    /* block 0 of the main key stream is the Poly1305 key, the packet is
+       encrypted from block 1 on */
+    rc = _libssh2_chacha20_setiv(&ctx->main_ctx, nonce, 0);
+    if(!rc)
+        rc = _libssh2_chacha20_crypt(&ctx->main_ctx, zeros, poly_key,
+                                     sizeof(poly_key));
+    if(!rc)
+        rc = _libssh2_chacha20_setiv(&ctx->main_ctx, nonce, 1);
+    if(!rc)
+        rc = _libssh2_chacha20_setiv(&ctx->header_ctx, nonce, 0);
+    if(rc) {
+        _libssh2_explicit_zero(poly_key, sizeof(poly_key));
+        return -1;
+    }
+
+    _libssh2_poly1305_init(&ctx->poly, poly_key);
+    _libssh2_explicit_zero(poly_key, sizeof(poly_key));
+
+    if(!ctx->encrypt)
+        _libssh2_poly1305_update(&ctx->poly, src, 4);
+    if(_libssh2_chacha20_crypt(&ctx->header_ctx, src, dst, 4))
+        return -1;
+    if(ctx->encrypt)
+        _libssh2_poly1305_update(&ctx->poly, dst, 4);
+    return 0;
+}
+
+static int
+chachapoly_aead_end(LIBSSH2_SESSION * session, unsigned char *tag,
+                    void **abstract)
+{
+    struct chachapoly_ctx *ctx = *(struct chachapoly_ctx **) abstract;
+    unsigned char expected[POLY1305_TAG_LEN];
+    unsigned char diff = 0;
+    int i;
+    (void) session;
+
+    _libssh2_poly1305_finish(&ctx->poly, expected);
+
+    if(ctx->encrypt) {
+        memcpy(tag, expected, POLY1305_TAG_LEN);
+        return 0;
+    }
+
+    /* compare in constant time */
+    for(i = 0; i < POLY1305_TAG_LEN; i++)
+        diff |= (unsigned char)(tag[i] ^ expected[i]);
+    _libssh2_explicit_zero(expected, sizeof(expected));
+
+    return diff ? -1 : 0;
+}
+
+static int
+chachapoly_dtor(LIBSSH2_SESSION * session, void **abstract)
+{
+    struct chachapoly_ctx **ctx = (struct chachapoly_ctx **) abstract;
+    if(ctx && *ctx) {
+        _libssh2_chacha20_dtor(&(*ctx)->main_ctx);
+        _libssh2_chacha20_dtor(&(*ctx)->header_ctx);
+        _libssh2_explicit_zero(*ctx, sizeof(struct chachapoly_ctx));
+        LIBSSH2_FREE(session, *ctx);
+        *abstract = NULL;
+    }
+    return 0;
+}
+
+/* Stand-in for the MAC, it is never offered or negotiated */
+static const LIBSSH2_MAC_METHOD crypt_mac_integrated_poly1305 = {
+    "INTEGRATED-POLY1305",      /* display only */
+    16,
+    0,
+    NULL,
+    NULL,
+    NULL,
+    0                           /* etm */
+};
+
+static const LIBSSH2_CRYPT_METHOD
+    libssh2_crypt_method_chacha20_poly1305_openssh_com = {
+    "chacha20-poly1305@openssh.com",
+    "",
+    8,                          /* blocksize */
+    0,                          /* initial value length */
+    64,                         /* secret length -- two 256 bit keys */
+    LIBSSH2_CRYPT_FLAG_INTEGRATED_MAC | LIBSSH2_CRYPT_FLAG_PKTLEN_AAD,
+    &chachapoly_init,
+    &chachapoly_crypt,
+    &chachapoly_crypt_bulk,
+    &chachapoly_dtor,
+    &chachapoly_aead_begin,
+    &chachapoly_aead_end,
+    &crypt_mac_integrated_poly1305,
+    _libssh2_cipher_none
+};
+
+#if LIBSSH2_AES_GCM
+/* aes128-gcm@openssh.com and aes256-gcm@openssh.com
+ *
+ * RFC 5647 with the changes OpenSSH made to it: the packet_length field is
+ * sent in the clear and authenticated as additional data, the MAC name-list
+ * is ignored and the 16 byte tag follows the packet where the MAC would be.
+ * The 12 byte IV is a fixed 4 byte field followed by a 64 bit invocation
+ * counter that goes up by one for every packet.
+ */
+#define AES_GCM_IV_LEN 12
+
+struct aes_gcm_ctx
+{
+    int encrypt;
+    unsigned char iv[AES_GCM_IV_LEN];
+    _libssh2_aes_gcm_ctx h;
+};
+
+static int
+aes_gcm_init(LIBSSH2_SESSION * session,
+             const LIBSSH2_CRYPT_METHOD * method,
+             unsigned char *iv, int *free_iv,
+             unsigned char *secret, int *free_secret,
+             int encrypt, void **abstract)
+{
+    struct aes_gcm_ctx *ctx = LIBSSH2_CALLOC(session,
+                                             sizeof(struct aes_gcm_ctx));
+    if(!ctx)
+        return LIBSSH2_ERROR_ALLOC;
+
+    if(_libssh2_aes_gcm_init(&ctx->h, secret, method->secret_len,
+                             encrypt)) {
+        LIBSSH2_FREE(session, ctx);
+        return -1;
+    }
+
+    /* crypt() on its own, as used for OpenSSH private keys, is a message
+       without additional data under the initial IV */
+    memcpy(ctx->iv, iv, AES_GCM_IV_LEN);
+    if(_libssh2_aes_gcm_setiv(&ctx->h, encrypt, ctx->iv, NULL, 0)) {
+        _libssh2_aes_gcm_dtor(&ctx->h);
+        LIBSSH2_FREE(session, ctx);
+        return -1;
+    }
+
+    ctx->encrypt = encrypt;
+    *abstract = ctx;
+    *free_iv = 1;
+    *free_secret = 1;
+    return 0;
+}
+
+static int
+aes_gcm_crypt(LIBSSH2_SESSION * session, unsigned char *block,
+              size_t blocksize, void **abstract)
+{
+    struct aes_gcm_ctx *ctx = *(struct aes_gcm_ctx **) abstract;
+    (void) session;
+    return _libssh2_aes_gcm_crypt(&ctx->h, ctx->encrypt, block, block,
+                                  blocksize);
+}
+
+static int
+aes_gcm_crypt_bulk(LIBSSH2_SESSION * session, const unsigned char *src,
+                   unsigned char *dst, size_t len, void **abstract)
+{
+    struct aes_gcm_ctx *ctx = *(struct aes_gcm_ctx **) abstract;
+    (void) session;
+    return _libssh2_aes_gcm_crypt(&ctx->h, ctx->encrypt, src, dst, len);
+}
+
+static int
+aes_gcm_aead_begin(LIBSSH2_SESSION * session, uint32_t seqno,
+                   const unsigned char *src, unsigned char *dst,
+                   void **abstract)
+{
+    struct aes_gcm_ctx *ctx = *(struct aes_gcm_ctx **) abstract;
+    int i;
+    (void) session;
+    (void) seqno;
+
+    /* the packet_length field is only authenticated */
+    if(_libssh2_aes_gcm_setiv(&ctx->h, ctx->encrypt, ctx->iv, src, 4))
+        return -1;
+    if(dst != src)
+        memcpy(dst, src, 4);
+
+    /* increment the big endian invocation counter for the next packet */
+    for(i = AES_GCM_IV_LEN - 1; i >= 4; i--) {
+        if(++ctx->iv[i])
+            break;
+    }
+    return 0;
+}
+
+static int
+aes_gcm_aead_end(LIBSSH2_SESSION * session, unsigned char *tag,
+                 void **abstract)
+{
+    struct aes_gcm_ctx *ctx = *(struct aes_gcm_ctx **) abstract;
+    (void) session;
+    return _libssh2_aes_gcm_finish(&ctx->h, ctx->encrypt, tag);
+}
+
+static int
+aes_gcm_dtor(LIBSSH2_SESSION * session, void **abstract)
+{
+    struct aes_gcm_ctx **ctx = (struct aes_gcm_ctx **) abstract;
+    if(ctx && *ctx) {
+        _libssh2_aes_gcm_dtor(&(*ctx)->h);
+        _libssh2_explicit_zero(*ctx, sizeof(struct aes_gcm_ctx));
+        LIBSSH2_FREE(session, *ctx);
+        *abstract = NULL;
+    }
+    return 0;
+}
+
+/* Stand-in for the MAC, it is never offered or negotiated */
+static const LIBSSH2_MAC_METHOD crypt_mac_integrated_aes_gcm = {
+    "INTEGRATED-AES-GCM",       /* display only */
+    16,
+    0,
+    NULL,
+    NULL,
+    NULL,
+    0                           /* etm */
+};
+
+static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_aes128_gcm = {
+    "aes128-gcm@openssh.com",
+    "",
+    16,                         /* blocksize */
+    AES_GCM_IV_LEN,             /* initial value length */
+    16,                         /* secret length -- 16*8 == 128bit */
+    LIBSSH2_CRYPT_FLAG_INTEGRATED_MAC | LIBSSH2_CRYPT_FLAG_PKTLEN_AAD,
+    &aes_gcm_init,
+    &aes_gcm_crypt,
+    &aes_gcm_crypt_bulk,
+    &aes_gcm_dtor,
+    &aes_gcm_aead_begin,
+    &aes_gcm_aead_end,
+    &crypt_mac_integrated_aes_gcm,
+    _libssh2_cipher_none
+};
+
+static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_aes256_gcm = {
+    "aes256-gcm@openssh.com",
+    "",
+    16,                         /* blocksize */
+    AES_GCM_IV_LEN,             /* initial value length */
+    32,                         /* secret length -- 32*8 == 256bit */
+    LIBSSH2_CRYPT_FLAG_INTEGRATED_MAC | LIBSSH2_CRYPT_FLAG_PKTLEN_AAD,
+    &aes_gcm_init,
+    &aes_gcm_crypt,
+    &aes_gcm_crypt_bulk,
+    &aes_gcm_dtor,
+    &aes_gcm_aead_begin,
+    &aes_gcm_aead_end,
+    &crypt_mac_integrated_aes_gcm,
+    _libssh2_cipher_none
+};
+#endif /* LIBSSH2_AES_GCM */
+
 static const LIBSSH2_CRYPT_METHOD *_libssh2_crypt_methods[] = {
+    &libssh2_crypt_method_chacha20_poly1305_openssh_com,
+#if LIBSSH2_AES_GCM
+    &libssh2_crypt_method_aes128_gcm,
+    &libssh2_crypt_method_aes256_gcm,
+#endif /* LIBSSH2_AES_GCM */
 #if LIBSSH2_AES_CTR
   &libssh2_crypt_method_aes128_ctr,
   &libssh2_crypt_method_aes192_ctr,
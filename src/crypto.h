@@ -241,6 +241,11 @@ int _libssh2_cipher_crypt(_libssh2_cipher_ctx * ctx,
                           _libssh2_cipher_type(algo),
                           int encrypt, unsigned char *block, size_t blocksize);
 
+int _libssh2_cipher_crypt_bulk(_libssh2_cipher_ctx * ctx,
+                               _libssh2_cipher_type(algo),
+                               int encrypt, const unsigned char *src,
+                               unsigned char *dst, size_t len);
+
 int _libssh2_pub_priv_keyfile(LIBSSH2_SESSION *session,
                               unsigned char **method,
                               size_t *method_len,
@@ -37,7 +37,7 @@
  */
 
 #include "libssh2_priv.h"
-#include "transport.h" /* _libssh2_transport_write */
+#include "transport.h" /* _libssh2_transport_queue */
 
 /* Keep-alive stuff. */
 
@@ -73,12 +73,29 @@ libssh2_keepalive_send (LIBSSH2_SESSION *session,
         unsigned char keepalive_data[]
             = "\x50\x00\x00\x00\x15keepalive@libssh2.orgW";
         size_t len = sizeof(keepalive_data) - 1;
+        struct global_request *request = NULL;
         int rc;
 
         keepalive_data[len - 1] =
             (unsigned char)session->keepalive_want_reply;
 
-        rc = _libssh2_transport_send(session, keepalive_data, len, NULL, 0);
+        if(session->keepalive_want_reply) {
+            /* the reply holds its place in line with the replies to other
+               global requests, and is thrown away when it comes */
+            request = LIBSSH2_CALLOC(session, sizeof(*request));
+            if(!request)
+                return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                      "Unable to allocate memory for "
+                                      "keepalive");
+        }
+
+        rc = _libssh2_transport_queue(session, keepalive_data, len);
+        if(request) {
+            if(!rc)
+                _libssh2_list_add(&session->global_requests, &request->node);
+            else
+                LIBSSH2_FREE(session, request);
+        }
         /* Silently ignore PACKET_EAGAIN here: if the write buffer is
            already full, sending another keepalive is not useful. */
         if(rc && rc != LIBSSH2_ERROR_EAGAIN) {
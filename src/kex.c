@@ -3588,6 +3588,13 @@ static int kex_agree_mac(LIBSSH2_SESSION * session,
     unsigned char *s;
     (void) session;
 
+    /* an AEAD cipher authenticates the packets by itself, so like OpenSSH
+       we ignore the MAC name-list when one has been agreed on */
+    if(endpoint->crypt->flags & LIBSSH2_CRYPT_FLAG_INTEGRATED_MAC) {
+        endpoint->mac = endpoint->crypt->integrated_mac;
+        return 0;
+    }
+
     if(endpoint->mac_prefs) {
         s = (unsigned char *) endpoint->mac_prefs;
 
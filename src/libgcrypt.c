@@ -597,6 +597,144 @@ _libssh2_cipher_crypt(_libssh2_cipher_ctx * ctx,
     return ret;
 }
 
+int
+_libssh2_cipher_crypt_bulk(_libssh2_cipher_ctx * ctx,
+                           _libssh2_cipher_type(algo),
+                           int encrypt, const unsigned char *src,
+                           unsigned char *dst, size_t len)
+{
+    int ret;
+    size_t srclen = len;
+    (void) algo;
+
+    /* libgcrypt operates in-place when given a NULL input buffer */
+    if(src == dst) {
+        src = NULL;
+        srclen = 0;
+    }
+
+    if(encrypt) {
+        ret = gcry_cipher_encrypt(*ctx, dst, len, src, srclen);
+    }
+    else {
+        ret = gcry_cipher_decrypt(*ctx, dst, len, src, srclen);
+    }
+    return ret;
+}
+
+#if LIBSSH2_CHACHA20
+int
+_libssh2_chacha20_init(_libssh2_chacha20_ctx *ctx, const unsigned char *key)
+{
+    if(gcry_cipher_open(ctx, GCRY_CIPHER_CHACHA20, GCRY_CIPHER_MODE_STREAM,
+                        0))
+        return -1;
+
+    if(gcry_cipher_setkey(*ctx, key, 32)) {
+        gcry_cipher_close(*ctx);
+        return -1;
+    }
+    return 0;
+}
+
+int
+_libssh2_chacha20_setiv(_libssh2_chacha20_ctx *ctx,
+                        const unsigned char *nonce, uint32_t counter)
+{
+    /* a 16 byte IV sets the last four words of the ChaCha state: the
+       little endian 64 bit block counter followed by the 64 bit nonce */
+    unsigned char iv[16];
+
+    iv[0] = (unsigned char)counter;
+    iv[1] = (unsigned char)(counter >> 8);
+    iv[2] = (unsigned char)(counter >> 16);
+    iv[3] = (unsigned char)(counter >> 24);
+    memset(&iv[4], 0, 4);
+    memcpy(&iv[8], nonce, 8);
+
+    return gcry_cipher_setiv(*ctx, iv, sizeof(iv)) ? -1 : 0;
+}
+
+int
+_libssh2_chacha20_crypt(_libssh2_chacha20_ctx *ctx,
+                        const unsigned char *src, unsigned char *dst,
+                        size_t len)
+{
+    if(src == dst)
+        return gcry_cipher_encrypt(*ctx, dst, len, NULL, 0) ? -1 : 0;
+    return gcry_cipher_encrypt(*ctx, dst, len, src, len) ? -1 : 0;
+}
+#endif /* LIBSSH2_CHACHA20 */
+
+#if LIBSSH2_AES_GCM
+int
+_libssh2_aes_gcm_init(_libssh2_aes_gcm_ctx *ctx, const unsigned char *key,
+                      size_t keylen, int encrypt)
+{
+    int algo;
+    (void) encrypt;
+
+    switch(keylen) {
+    case 16:
+        algo = GCRY_CIPHER_AES128;
+        break;
+    case 32:
+        algo = GCRY_CIPHER_AES256;
+        break;
+    default:
+        return -1;
+    }
+
+    if(gcry_cipher_open(ctx, algo, GCRY_CIPHER_MODE_GCM, 0))
+        return -1;
+
+    if(gcry_cipher_setkey(*ctx, key, keylen)) {
+        gcry_cipher_close(*ctx);
+        return -1;
+    }
+    return 0;
+}
+
+int
+_libssh2_aes_gcm_setiv(_libssh2_aes_gcm_ctx *ctx, int encrypt,
+                       const unsigned char *iv,
+                       const unsigned char *aad, size_t aadlen)
+{
+    (void) encrypt;
+
+    if(gcry_cipher_setiv(*ctx, iv, 12))
+        return -1;
+    if(aadlen && gcry_cipher_authenticate(*ctx, aad, aadlen))
+        return -1;
+    return 0;
+}
+
+int
+_libssh2_aes_gcm_crypt(_libssh2_aes_gcm_ctx *ctx, int encrypt,
+                       const unsigned char *src, unsigned char *dst,
+                       size_t len)
+{
+    gcry_error_t err;
+
+    if(src == dst)
+        src = NULL;
+    if(encrypt)
+        err = gcry_cipher_encrypt(*ctx, dst, len, src, src ? len : 0);
+    else
+        err = gcry_cipher_decrypt(*ctx, dst, len, src, src ? len : 0);
+    return err ? -1 : 0;
+}
+
+int
+_libssh2_aes_gcm_finish(_libssh2_aes_gcm_ctx *ctx, int encrypt,
+                        unsigned char *tag)
+{
+    if(encrypt)
+        return gcry_cipher_gettag(*ctx, tag, 16) ? -1 : 0;
+    return gcry_cipher_checktag(*ctx, tag, 16) ? -1 : 0;
+}
+#endif /* LIBSSH2_AES_GCM */
+
 int
 _libssh2_pub_priv_keyfilememory(LIBSSH2_SESSION *session,
                                 unsigned char **method,
@@ -46,6 +46,7 @@
 #define LIBSSH2_HMAC_RIPEMD 1
 #define LIBSSH2_HMAC_SHA256 1
 #define LIBSSH2_HMAC_SHA512 1
+#define LIBSSH2_HMAC_RESET 1
 
 #define LIBSSH2_AES 1
 #define LIBSSH2_AES_CTR 1
@@ -53,6 +54,16 @@
 #define LIBSSH2_RC4 1
 #define LIBSSH2_CAST 1
 #define LIBSSH2_3DES 1
+#if GCRYPT_VERSION_NUMBER >= 0x010800
+#define LIBSSH2_CHACHA20 1
+#else
+#define LIBSSH2_CHACHA20 0
+#endif
+#if GCRYPT_VERSION_NUMBER >= 0x010600
+#define LIBSSH2_AES_GCM 1
+#else
+#define LIBSSH2_AES_GCM 0
+#endif
 
 #define LIBSSH2_RSA 1
 #define LIBSSH2_RSA_SHA2 0
@@ -153,6 +164,7 @@
 #define libssh2_hmac_final(ctx, data) \
   memcpy(data, gcry_md_read(ctx, 0), \
       gcry_md_get_algo_dlen(gcry_md_get_algo(ctx)))
+#define libssh2_hmac_reset(ctx) gcry_md_reset(*(ctx))
 #define libssh2_hmac_cleanup(ctx) gcry_md_close (*ctx);
 
 #define libssh2_crypto_init() gcry_control (GCRYCTL_DISABLE_SECMEM)
@@ -190,6 +202,8 @@
   _libssh2_gcry_ciphermode(GCRY_CIPHER_AES192, GCRY_CIPHER_MODE_CBC)
 #define _libssh2_cipher_aes128 \
   _libssh2_gcry_ciphermode(GCRY_CIPHER_AES128, GCRY_CIPHER_MODE_CBC)
+#define _libssh2_cipher_aes128ecb \
+  _libssh2_gcry_ciphermode(GCRY_CIPHER_AES128, GCRY_CIPHER_MODE_ECB)
 #define _libssh2_cipher_blowfish \
   _libssh2_gcry_ciphermode(GCRY_CIPHER_BLOWFISH, GCRY_CIPHER_MODE_CBC)
 #define _libssh2_cipher_arcfour \
@@ -198,10 +212,39 @@
   _libssh2_gcry_ciphermode(GCRY_CIPHER_CAST5, GCRY_CIPHER_MODE_CBC)
 #define _libssh2_cipher_3des \
   _libssh2_gcry_ciphermode(GCRY_CIPHER_3DES, GCRY_CIPHER_MODE_CBC)
+#define _libssh2_cipher_none 0
 
 
 #define _libssh2_cipher_dtor(ctx) gcry_cipher_close(*(ctx))
 
+#if LIBSSH2_CHACHA20
+#define _libssh2_chacha20_ctx gcry_cipher_hd_t
+#define _libssh2_chacha20_dtor(ctx) gcry_cipher_close(*(ctx))
+int _libssh2_chacha20_init(_libssh2_chacha20_ctx *ctx,
+                           const unsigned char *key);
+int _libssh2_chacha20_setiv(_libssh2_chacha20_ctx *ctx,
+                            const unsigned char *nonce, uint32_t counter);
+int _libssh2_chacha20_crypt(_libssh2_chacha20_ctx *ctx,
+                            const unsigned char *src, unsigned char *dst,
+                            size_t len);
+#endif
+
+#if LIBSSH2_AES_GCM
+#define _libssh2_aes_gcm_ctx gcry_cipher_hd_t
+#define _libssh2_aes_gcm_dtor(ctx) gcry_cipher_close(*(ctx))
+int _libssh2_aes_gcm_init(_libssh2_aes_gcm_ctx *ctx,
+                          const unsigned char *key, size_t keylen,
+                          int encrypt);
+int _libssh2_aes_gcm_setiv(_libssh2_aes_gcm_ctx *ctx, int encrypt,
+                           const unsigned char *iv,
+                           const unsigned char *aad, size_t aadlen);
+int _libssh2_aes_gcm_crypt(_libssh2_aes_gcm_ctx *ctx, int encrypt,
+                           const unsigned char *src, unsigned char *dst,
+                           size_t len);
+int _libssh2_aes_gcm_finish(_libssh2_aes_gcm_ctx *ctx, int encrypt,
+                            unsigned char *tag);
+#endif
+
 #define _libssh2_bn struct gcry_mpi
 #define _libssh2_bn_ctx int
 #define _libssh2_bn_ctx_new() 0
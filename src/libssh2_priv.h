@@ -200,6 +200,12 @@ static inline int writev(int sock, struct iovec *iov, int nvecs)
     channel->close_cb((session), &(session)->abstract, \
                       (channel), &(channel)->abstract)
 
+#define LIBSSH2_CHANNEL_DATA(session, channel, stream_id, data, data_len) \
+    channel->data_cb((session), (channel), (stream_id), (data), (data_len), \
+                     &(channel)->callback_abstract)
+#define LIBSSH2_CHANNEL_EVENT(session, channel, cb) \
+    channel->cb((session), (channel), &(channel)->callback_abstract)
+
 #define LIBSSH2_SEND_FD(session, fd, buffer, length, flags) \
     (session->send)(fd, buffer, length, flags, &session->abstract)
 #define LIBSSH2_RECV_FD(session, fd, buffer, length, flags) \
@@ -235,6 +241,7 @@ typedef enum
     libssh2_NB_state_jump3,
     libssh2_NB_state_jump4,
     libssh2_NB_state_jump5,
+    libssh2_NB_state_jump6,
     libssh2_NB_state_end
 } libssh2_nonblocking_states;
 
@@ -352,8 +359,26 @@ struct _LIBSSH2_PACKET
     /* Where to start reading data from,
      * used for channel data that's been partially consumed */
     size_t data_head;
+
+    /* Size class of the pool buffer that holds both the data and this
+       struct, right after the data. -1 if they are allocated apart. */
+    int pool_class;
+
+    /* Arrival order of channel data, to merge extended data in order */
+    uint32_t seq;
+};
+
+/* an entry in one of the session's lists of channels that may be readable
+   or writable, see libssh2_transport_read() */
+struct channel_ready {
+    struct list_node node;      /* must be first */
+    LIBSSH2_CHANNEL *channel;
+    int listed;                 /* set while in the list */
 };
 
+#define CHANNEL_READABLE 0
+#define CHANNEL_WRITABLE 1
+
 typedef struct _libssh2_channel_data
 {
     /* Identifier */
@@ -385,11 +410,81 @@ struct _LIBSSH2_CHANNEL
     /* Data immediately available for reading */
     uint32_t read_avail;
 
+    /* Received CHANNEL_DATA (0) and CHANNEL_EXTENDED_DATA (1) packets in
+       arrival order, the payload bytes left in each queue and the sequence
+       number for the next packet */
+    struct list_head read_queue[2];
+    size_t read_queued[2];
+    uint32_t read_seq;
+
+    /* Most bytes of received data to buffer for the channel, 0 for no
+       limit besides the window */
+    size_t buffer_max;
+
+    /* Entries in the session's lists of readable and writable channels */
+    struct channel_ready ready[2];
+
+    /* Outgoing data packets that wait for their turn to be sent, their
+       bytes, the priority and weight set for the channel (0 if never set)
+       and how many bytes it may still send in the current round. The entry
+       is in the session's list for the priority while packets wait. */
+    struct list_head write_queue;
+    size_t write_queued;
+    int priority;
+    unsigned int weight;
+    size_t deficit;
+    struct channel_ready sched;
+
+    /* The CHANNEL_OPEN request of the channel: libssh2_NB_state_created
+       while the packet waits to be queued, libssh2_NB_state_sent until the
+       reply arrives and libssh2_NB_state_end until
+       libssh2_channel_open_finish() takes it. 'open_error' is set if the
+       open failed, with the reason code the peer gave */
+    libssh2_nonblocking_states open_state;
+    unsigned char *open_packet;
+    size_t open_packet_len;
+    int open_error;
+    uint32_t open_reason;
+
+    /* The pool the channel waits in until it is taken, see
+       libssh2_channel_pool_acquire() */
+    LIBSSH2_CHANNEL_POOL *pool;
+
+    /* Relay set up with libssh2_channel_relay_fd(): the socket, the flags
+       and RELAY_* state bits, data read from the socket but not written
+       to the channel yet in a pool buffer and what the last pump waits for
+       on the socket */
+    libssh2_socket_t relay_fd;
+    int relay_flags;
+    int relay_state;
+    unsigned char *relay_buf;
+    int relay_buf_class;
+    size_t relay_len;
+    size_t relay_sent;
+    int relay_directions;
+
+    /* Automatic receive window: the bytes read from the channel so far, the
+       time and count that the current measurement started at, the read
+       rate it last found and when a packet was sent whose answer times a
+       round trip (0 when none is) */
+    libssh2_uint64_t window_consumed;
+    libssh2_uint64_t window_mark_consumed;
+    libssh2_uint64_t window_mark_time;
+    uint32_t window_rate;
+    libssh2_uint64_t window_probe;
+
     LIBSSH2_SESSION *session;
 
     void *abstract;
       LIBSSH2_CHANNEL_CLOSE_FUNC((*close_cb));
 
+    /* Callbacks set with libssh2_channel_callback_set() */
+    LIBSSH2_CHANNEL_DATA_FUNC((*data_cb));
+    LIBSSH2_CHANNEL_EVENT_FUNC((*eof_cb));
+    LIBSSH2_CHANNEL_EVENT_FUNC((*remote_close_cb));
+    LIBSSH2_CHANNEL_EVENT_FUNC((*window_cb));
+    void *callback_abstract;
+
     /* State variables used in libssh2_channel_setenv_ex() */
     libssh2_nonblocking_states setenv_state;
     unsigned char *setenv_packet;
@@ -432,8 +527,6 @@ struct _LIBSSH2_CHANNEL
     /* State variables used in libssh2_channel_read_ex() */
     libssh2_nonblocking_states read_state;
 
-    uint32_t read_local_id;
-
     /* State variables used in libssh2_channel_write_ex() */
     libssh2_nonblocking_states write_state;
     unsigned char write_packet[13];
@@ -465,6 +558,14 @@ struct _LIBSSH2_CHANNEL
     packet_requirev_state_t req_auth_agent_requirev_state;
 };
 
+/* A global request sent with want reply set. The replies come in the
+   order of the requests, see _libssh2_global_request_reply(). */
+struct global_request {
+    struct list_node node;      /* must be first */
+    LIBSSH2_LISTENER *listener; /* the tcpip-forward request is for, NULL
+                                   if nothing waits for the reply */
+};
+
 struct _LIBSSH2_LISTENER
 {
     struct list_node node; /* linked list header */
@@ -484,6 +585,35 @@ struct _LIBSSH2_LISTENER
     libssh2_nonblocking_states chanFwdCncl_state;
     unsigned char *chanFwdCncl_data;
     size_t chanFwdCncl_data_len;
+
+    /* The tcpip-forward request: libssh2_NB_state_created while the packet
+       waits to be queued, libssh2_NB_state_sent until the reply arrives
+       and libssh2_NB_state_end until libssh2_channel_forward_listen_finish()
+       takes it, with 'fwd_failed' set if it was turned down. 'request' is
+       its entry in the session's list of requests awaiting replies. */
+    libssh2_nonblocking_states fwd_state;
+    unsigned char *fwd_packet;
+    size_t fwd_packet_len;
+    int fwd_failed;
+    struct global_request *request;
+};
+
+struct _LIBSSH2_CHANNEL_POOL
+{
+    LIBSSH2_SESSION *session;
+
+    /* what the channels are opened with */
+    char *channel_type;
+    uint32_t channel_type_len;
+    uint32_t window_size;
+    uint32_t packet_size;
+    unsigned char *message;
+    size_t message_len;
+
+    /* 'size' slots, each NULL or holding a channel that is being opened or
+       is open and waiting to be taken */
+    LIBSSH2_CHANNEL **channels;
+    unsigned int size;
 };
 
 typedef struct _libssh2_endpoint_data
@@ -510,18 +640,48 @@ typedef struct _libssh2_endpoint_data
     char *lang_prefs;
 } libssh2_endpoint_data;
 
-#define PACKETBUFSIZE (1024*16)
+#define PACKETBUFSIZE (1024*16) /* initial size of the receive buffer */
+#define PACKETBUFMAX (1024*256) /* default limit for the receive buffer */
+#define OUTBUFSIZE (MAX_SSH_PACKET_LEN + 8192) /* initial size of the
+                                                 outgoing queue, a packet
+                                                 of the largest size and a
+                                                 few small ones */
+#define OUTBUFMAX (MAX_SSH_PACKET_LEN*4) /* limit for the outgoing queue */
+#define PACKETPOOL_CLASSES 4 /* number of packet buffer sizes pooled */
+#define PACKETPOOLMAX (1024*256) /* most bytes of unused buffers to keep */
+#define WINDOW_AUTO_MIN (64*1024) /* default bounds of automatic windows */
+#define WINDOW_AUTO_MAX (64*1024*1024)
+#define WINDOW_AUTO_RTT 100000 /* microseconds assumed until measured */
+#define SCHED_LOWAT MAX_SSH_PACKET_LEN /* unsent bytes kept in the outgoing
+                                          queue while channel data waits */
+#define SCHED_QUEUE_MAX (32768*4) /* most bytes waiting per channel */
+#define SCHED_QUANTUM 32768 /* bytes per round and unit of weight, at least
+                               the largest channel data packet */
+#define SCHED_WEIGHT_MAX 1000
+#define RELAY_BUFSIZE 16384 /* most bytes read from a relayed socket at a
+                               time, a packet pool size class */
+#define RELAY_ACTIVE   1 /* relay_state: relaying */
+#define RELAY_FD_EOF   2 /* the socket has no more data */
+#define RELAY_SHUTDOWN 4 /* all data up to the channel's EOF is written */
+#define MAX_BLOCKSIZE 32    /* MUST fit biggest crypto block size we use/get */
 
 struct transportpacket
 {
     /* ------------- for incoming data --------------- */
-    unsigned char buf[PACKETBUFSIZE];
-    unsigned char init[5];  /* first 5 bytes of the incoming data stream,
-                               still encrypted */
-    size_t writeidx;        /* at what array index we do the next write into
-                               the buffer */
+    unsigned char *buf;     /* ring buffer for the incoming data, with room
+                               for MAX_BLOCKSIZE + 4 more bytes after its end
+                               to make a wrapped block contiguous */
+    size_t buf_size;        /* size of the ring */
+    int buf_grow;           /* the last receive filled all the space it was
+                               given, use a larger ring next time */
+    unsigned char init[MAX_BLOCKSIZE + 4]; /* first 5 bytes of the
+                               decrypted packet, or with an encrypt-then-MAC
+                               MAC the packet_length field and the first
+                               block exactly as received */
     size_t readidx;         /* at what array index we do the next read from
                                the buffer */
+    size_t buffered;        /* number of bytes in the buffer from readidx on,
+                               wrapping around at buf_size */
     uint32_t packet_length; /* the most recent packet_length as read from the
                                network data */
     uint8_t padding_length; /* the most recent padding_length as read from the
@@ -534,17 +694,34 @@ struct transportpacket
                                mac_length. */
     unsigned char *payload; /* this is a pointer to a LIBSSH2_ALLOC()
                                area to which we write decrypted data */
+    int payload_class;      /* packet pool size class of payload, or -1 */
     unsigned char *wptr;    /* write pointer into the payload to where we
                                are currently writing decrypted data */
 
     /* ------------- for outgoing data --------------- */
-    unsigned char outbuf[MAX_SSH_PACKET_LEN]; /* area for the outgoing data */
+    unsigned char *outbuf;  /* queue of encrypted packets to send, allocated
+                               with OUTBUFSIZE bytes on first use */
+    size_t osize;           /* size of outbuf, grown up to OUTBUFMAX while
+                               packets queue up faster than they are sent */
+    size_t oqueued;         /* number of bytes in outbuf */
+    size_t osent;           /* number of bytes of outbuf already sent */
+    int ocorked;            /* hold the queued packets back so that more can
+                               join them in one send */
+    const unsigned char *odata; /* original pointer to the data of the packet
+                               the caller got EAGAIN for */
+    size_t olen;            /* original size of that data */
+    size_t oend;            /* where in outbuf that packet ends, channel
+                               data queued after it need not go first */
+};
 
-    int ototal_num;         /* size of outbuf in number of bytes */
-    const unsigned char *odata; /* original pointer to the data */
-    size_t olen;            /* original size of the data we stored in
-                               outbuf */
-    size_t osent;           /* number of bytes already sent */
+/* unused packet buffers kept for reuse, see _libssh2_packet_buf_alloc() */
+struct packetpool
+{
+    struct list_head cached[PACKETPOOL_CLASSES];
+    size_t cached_num;
+    size_t cached_bytes;
+    libssh2_uint64_t hits;
+    libssh2_uint64_t misses;
 };
 
 struct _LIBSSH2_PUBLICKEY
@@ -577,9 +754,21 @@ struct _LIBSSH2_PUBLICKEY
 
 #define LIBSSH2_SCP_RESPONSE_BUFLEN     256
 
+/* an entry in the session's table of channel ids */
+struct channel_slot {
+    LIBSSH2_CHANNEL *channel;   /* the channel with this id, or NULL */
+    uint32_t next_free;         /* next free slot + 1, if this one is free */
+    int state;                  /* CHANNEL_SLOT_* */
+};
+
+#define CHANNEL_SLOT_FREE    0
+#define CHANNEL_SLOT_USED    1
+#define CHANNEL_SLOT_CLOSING 2  /* freed, waiting for the peer's close */
+
 struct flags {
     int sigpipe;  /* LIBSSH2_FLAG_SIGPIPE */
     int compress; /* LIBSSH2_FLAG_COMPRESS */
+    int release_buffers; /* LIBSSH2_FLAG_RELEASE_BUFFERS */
 };
 
 struct _LIBSSH2_SESSION
@@ -621,6 +810,32 @@ struct _LIBSSH2_SESSION
     /* Timeout used when blocking API behavior is active */
     long api_timeout;
 
+    /* Largest size the receive buffer may grow to */
+    size_t recv_buf_max;
+
+    /* Receive window mode set with libssh2_session_set_window_mode(), the
+       bounds of automatic windows and the smoothed round trip time in
+       microseconds, 0 until measured */
+    int window_mode;
+    uint32_t window_min;
+    uint32_t window_max;
+    uint32_t window_rtt;
+
+    /* Received channel data buffered for all channels, the receive windows
+       of all channels (which that data is part of) and the most there may
+       be before reading and window adjusts hold back (0 for no limit) */
+    size_t channel_queued;
+    size_t channel_windows;
+    size_t channel_buffer_max;
+
+    /* Channels with data packets waiting in their write queues, one list
+       per priority, the bytes waiting in all of them and whether
+       libssh2_channel_set_priority() turned the scheduling on, see
+       _libssh2_transport_send_splitv() */
+    struct list_head channels_sched[LIBSSH2_CHANNEL_PRIORITY_INTERACTIVE + 1];
+    size_t sched_queued;
+    int sched;
+
     /* Server's public key */
     const LIBSSH2_HOSTKEY_METHOD *hostkey;
     void *server_hostkey_abstract;
@@ -659,7 +874,15 @@ struct _LIBSSH2_SESSION
     /* Active connection channels */
     struct list_head channels;
 
-    uint32_t next_channel;
+    /* Channels by their local id, which is the index, see
+       _libssh2_channel_nextid() */
+    struct channel_slot *channel_slots;
+    uint32_t channel_slots_num;
+    uint32_t channel_slots_free; /* first free slot + 1, or 0 for none */
+
+    /* Channels that may have become readable and writable, see
+       _libssh2_channel_ready() */
+    struct list_head channels_ready[2];
 
     struct list_head listeners; /* list of LIBSSH2_LISTENER structs */
 
@@ -677,6 +900,7 @@ struct _LIBSSH2_SESSION
 
     /* struct members for packet-level reading */
     struct transportpacket packet;
+    struct packetpool packetpool;
 #ifdef LIBSSH2DEBUG
     int showmask;               /* what debug/trace messages to display */
     libssh2_trace_handler_func tracehandler; /* callback to display trace
@@ -770,29 +994,17 @@ struct _LIBSSH2_SESSION
     LIBSSH2_USERAUTH_KBDINT_RESPONSE *userauth_kybd_responses;
     packet_requirev_state_t userauth_kybd_packet_requirev_state;
 
-    /* State variables used in libssh2_channel_open_ex() */
-    libssh2_nonblocking_states open_state;
-    packet_requirev_state_t open_packet_requirev_state;
+    /* The channel that libssh2_channel_open_ex() and
+       libssh2_channel_direct_tcpip_ex() are opening, the state of the open
+       is in the channel */
     LIBSSH2_CHANNEL *open_channel;
-    unsigned char *open_packet;
-    size_t open_packet_len;
-    unsigned char *open_data;
-    size_t open_data_len;
-    uint32_t open_local_channel;
-
-    /* State variables used in libssh2_channel_direct_tcpip_ex() */
-    libssh2_nonblocking_states direct_state;
-    unsigned char *direct_message;
-    size_t direct_host_len;
-    size_t direct_shost_len;
-    size_t direct_message_len;
-
-    /* State variables used in libssh2_channel_forward_listen_ex() */
-    libssh2_nonblocking_states fwdLstn_state;
-    unsigned char *fwdLstn_packet;
-    uint32_t fwdLstn_host_len;
-    uint32_t fwdLstn_packet_len;
-    packet_requirev_state_t fwdLstn_packet_requirev_state;
+
+    /* The listener that libssh2_channel_forward_listen_ex() is requesting,
+       the state of the request is in the listener */
+    LIBSSH2_LISTENER *fwdLstn_listener;
+
+    /* Global requests waiting for their replies, in the order sent */
+    struct list_head global_requests;
 
     /* State variables used in libssh2_publickey_init() */
     libssh2_nonblocking_states pkeyInit_state;
@@ -808,6 +1020,7 @@ struct _LIBSSH2_SESSION
     libssh2_nonblocking_states packAdd_state;
     LIBSSH2_CHANNEL *packAdd_channelp; /* keeper of the channel during EAGAIN
                                           states */
+    uint32_t packAdd_consumed; /* channel data the app took in a callback */
     packet_queue_listener_state_t packAdd_Qlstn_state;
     packet_x11_open_state_t packAdd_x11open_state;
 
@@ -942,11 +1155,42 @@ struct _LIBSSH2_CRYPT_METHOD
                  int encrypt, void **abstract);
     int (*crypt) (LIBSSH2_SESSION * session, unsigned char *block,
                   size_t blocksize, void **abstract);
+    /* Encrypt or decrypt 'len' bytes (a multiple of blocksize) from 'src'
+       into 'dst' in a single call. 'dst' may be the same as 'src' for
+       in-place operation. May be NULL, in which case crypt() is used one
+       block at a time. */
+    int (*crypt_bulk) (LIBSSH2_SESSION * session, const unsigned char *src,
+                       unsigned char *dst, size_t len, void **abstract);
     int (*dtor) (LIBSSH2_SESSION * session, void **abstract);
 
+    /* Authenticated encryption, for methods that set
+       LIBSSH2_CRYPT_FLAG_INTEGRATED_MAC. A packet is processed by calling
+       aead_begin() on its 4 byte packet_length field, crypt_bulk() on the
+       rest of it and finally aead_end() on the tag that follows it. */
+
+    /* Start a packet with sequence number 'seqno' and encrypt or decrypt
+       the packet_length field from 'src' to 'dst' */
+    int (*aead_begin) (LIBSSH2_SESSION * session, uint32_t seqno,
+                       const unsigned char *src, unsigned char *dst,
+                       void **abstract);
+    /* Write the tag when encrypting, or compare it when decrypting in which
+       case a mismatch returns non-zero */
+    int (*aead_end) (LIBSSH2_SESSION * session, unsigned char *tag,
+                     void **abstract);
+    /* Used in place of the negotiated MAC, it only accounts for the tag
+       that follows each packet */
+    const struct _LIBSSH2_MAC_METHOD *integrated_mac;
+
       _libssh2_cipher_type(algo);
 };
 
+/* The cipher authenticates the packets itself and the negotiated MAC is not
+   used, see aead_begin() and aead_end() */
+#define LIBSSH2_CRYPT_FLAG_INTEGRATED_MAC 0x0001
+/* The packet_length field is not part of the cipher's block stream, so it
+   is left out when the packet is padded to a multiple of the block size */
+#define LIBSSH2_CRYPT_FLAG_PKTLEN_AAD     0x0002
+
 struct _LIBSSH2_COMP_METHOD
 {
     const char *name;
@@ -37,6 +37,7 @@
 
 #include "libssh2_priv.h"
 #include "mac.h"
+#include "umac.h"
 
 #ifdef LIBSSH2_MAC_NONE
 /* mac_none_MAC
@@ -60,116 +61,189 @@ static LIBSSH2_MAC_METHOD mac_method_none = {
     0,
     NULL,
     mac_none_MAC,
-    NULL
+    NULL,
+    0                           /* etm */
 };
 #endif /* LIBSSH2_MAC_NONE */
 
-/* mac_method_common_init
- * Initialize simple mac methods
+/* mac_method_hmac_ctx
+ * The HMAC state of one direction. The key is processed once, when the keys
+ * are exchanged, and the context is restarted with it for every packet.
+ */
+typedef void (*mac_hmac_setkey_func)(libssh2_hmac_ctx *ctx,
+                                     unsigned char *key, int key_len);
+
+struct mac_hmac_ctx
+{
+    libssh2_hmac_ctx ctx;
+#if !LIBSSH2_HMAC_RESET
+    /* the backend can't restart a context, set up a new one each time */
+    mac_hmac_setkey_func setkey;
+    unsigned char *key;
+    int key_len;
+#endif
+};
+
+/* mac_method_hmac_init
+ * Set up the HMAC context of one direction
  */
 static int
-mac_method_common_init(LIBSSH2_SESSION * session, unsigned char *key,
-                       int *free_key, void **abstract)
+mac_method_hmac_init(LIBSSH2_SESSION * session, unsigned char *key,
+                     int key_len, int *free_key, void **abstract,
+                     mac_hmac_setkey_func setkey)
 {
-    *abstract = key;
+    struct mac_hmac_ctx *c = LIBSSH2_ALLOC(session,
+                                           sizeof(struct mac_hmac_ctx));
+    if(!c) {
+        *free_key = 1;
+        return LIBSSH2_ERROR_ALLOC;
+    }
+
+#if LIBSSH2_HMAC_RESET
+    setkey(&c->ctx, key, key_len);
+    *free_key = 1;
+#else
+    c->setkey = setkey;
+    c->key = key;
+    c->key_len = key_len;
     *free_key = 0;
-    (void) session;
+#endif
 
+    *abstract = c;
     return 0;
 }
 
 
 
-/* mac_method_common_dtor
- * Cleanup simple mac methods
+/* mac_method_hmac_hash
+ * Calculate the HMAC of a packet, the algorithm is the one the context has
+ * been set up for
  */
 static int
-mac_method_common_dtor(LIBSSH2_SESSION * session, void **abstract)
+mac_method_hmac_hash(LIBSSH2_SESSION * session,
+                     unsigned char *buf, uint32_t seqno,
+                     const unsigned char *packet,
+                     uint32_t packet_len,
+                     const unsigned char *addtl,
+                     uint32_t addtl_len, void **abstract)
 {
-    if(*abstract) {
-        LIBSSH2_FREE(session, *abstract);
+    struct mac_hmac_ctx *c = *abstract;
+    unsigned char seqno_buf[4];
+    (void) session;
+
+    if(!c)
+        return -1;
+
+    _libssh2_htonu32(seqno_buf, seqno);
+
+#if LIBSSH2_HMAC_RESET
+    libssh2_hmac_reset(&c->ctx);
+#else
+    c->setkey(&c->ctx, c->key, c->key_len);
+#endif
+    libssh2_hmac_update(c->ctx, seqno_buf, 4);
+    libssh2_hmac_update(c->ctx, packet, packet_len);
+    if(addtl && addtl_len) {
+        libssh2_hmac_update(c->ctx, addtl, addtl_len);
     }
-    *abstract = NULL;
+    libssh2_hmac_final(c->ctx, buf);
+#if !LIBSSH2_HMAC_RESET
+    libssh2_hmac_cleanup(&c->ctx);
+#endif
 
     return 0;
 }
 
 
 
-#if LIBSSH2_HMAC_SHA512
-/* mac_method_hmac_sha512_hash
- * Calculate hash using full sha512 value
+/* mac_method_hmac_dtor
+ * Cleanup the HMAC context of one direction
  */
 static int
-mac_method_hmac_sha2_512_hash(LIBSSH2_SESSION * session,
-                          unsigned char *buf, uint32_t seqno,
-                          const unsigned char *packet,
-                          uint32_t packet_len,
-                          const unsigned char *addtl,
-                          uint32_t addtl_len, void **abstract)
+mac_method_hmac_dtor(LIBSSH2_SESSION * session, void **abstract)
 {
-    libssh2_hmac_ctx ctx;
-    unsigned char seqno_buf[4];
-    (void) session;
-
-    _libssh2_htonu32(seqno_buf, seqno);
-
-    libssh2_hmac_ctx_init(ctx);
-    libssh2_hmac_sha512_init(&ctx, *abstract, 64);
-    libssh2_hmac_update(ctx, seqno_buf, 4);
-    libssh2_hmac_update(ctx, packet, packet_len);
-    if(addtl && addtl_len) {
-        libssh2_hmac_update(ctx, addtl, addtl_len);
+    struct mac_hmac_ctx *c = *abstract;
+
+    if(c) {
+#if LIBSSH2_HMAC_RESET
+        libssh2_hmac_cleanup(&c->ctx);
+#else
+        _libssh2_explicit_zero(c->key, c->key_len);
+        LIBSSH2_FREE(session, c->key);
+#endif
+        _libssh2_explicit_zero(c, sizeof(struct mac_hmac_ctx));
+        LIBSSH2_FREE(session, c);
     }
-    libssh2_hmac_final(ctx, buf);
-    libssh2_hmac_cleanup(&ctx);
+    *abstract = NULL;
 
     return 0;
 }
 
 
 
+#if LIBSSH2_HMAC_SHA512
+static void
+mac_hmac_sha2_512_setkey(libssh2_hmac_ctx *ctx, unsigned char *key,
+                         int key_len)
+{
+    libssh2_hmac_ctx_init(*ctx);
+    libssh2_hmac_sha512_init(ctx, key, key_len);
+}
+
+/* mac_method_hmac_sha2_512_init
+ * HMAC using the full sha512 value
+ */
+static int
+mac_method_hmac_sha2_512_init(LIBSSH2_SESSION * session, unsigned char *key,
+                              int *free_key, void **abstract)
+{
+    return mac_method_hmac_init(session, key, 64, free_key, abstract,
+                                mac_hmac_sha2_512_setkey);
+}
+
+
+
 static const LIBSSH2_MAC_METHOD mac_method_hmac_sha2_512 = {
     "hmac-sha2-512",
     64,
     64,
-    mac_method_common_init,
-    mac_method_hmac_sha2_512_hash,
-    mac_method_common_dtor,
+    mac_method_hmac_sha2_512_init,
+    mac_method_hmac_hash,
+    mac_method_hmac_dtor,
+    0                           /* etm */
+};
+
+static const LIBSSH2_MAC_METHOD mac_method_hmac_sha2_512_etm = {
+    "hmac-sha2-512-etm@openssh.com",
+    64,
+    64,
+    mac_method_hmac_sha2_512_init,
+    mac_method_hmac_hash,
+    mac_method_hmac_dtor,
+    1                           /* etm */
 };
 #endif
 
 
 
 #if LIBSSH2_HMAC_SHA256
-/* mac_method_hmac_sha256_hash
- * Calculate hash using full sha256 value
+static void
+mac_hmac_sha2_256_setkey(libssh2_hmac_ctx *ctx, unsigned char *key,
+                         int key_len)
+{
+    libssh2_hmac_ctx_init(*ctx);
+    libssh2_hmac_sha256_init(ctx, key, key_len);
+}
+
+/* mac_method_hmac_sha2_256_init
+ * HMAC using the full sha256 value
  */
 static int
-mac_method_hmac_sha2_256_hash(LIBSSH2_SESSION * session,
-                          unsigned char *buf, uint32_t seqno,
-                          const unsigned char *packet,
-                          uint32_t packet_len,
-                          const unsigned char *addtl,
-                          uint32_t addtl_len, void **abstract)
+mac_method_hmac_sha2_256_init(LIBSSH2_SESSION * session, unsigned char *key,
+                              int *free_key, void **abstract)
 {
-    libssh2_hmac_ctx ctx;
-    unsigned char seqno_buf[4];
-    (void) session;
-
-    _libssh2_htonu32(seqno_buf, seqno);
-
-    libssh2_hmac_ctx_init(ctx);
-    libssh2_hmac_sha256_init(&ctx, *abstract, 32);
-    libssh2_hmac_update(ctx, seqno_buf, 4);
-    libssh2_hmac_update(ctx, packet, packet_len);
-    if(addtl && addtl_len) {
-        libssh2_hmac_update(ctx, addtl, addtl_len);
-    }
-    libssh2_hmac_final(ctx, buf);
-    libssh2_hmac_cleanup(&ctx);
-
-    return 0;
+    return mac_method_hmac_init(session, key, 32, free_key, abstract,
+                                mac_hmac_sha2_256_setkey);
 }
 
 
@@ -178,43 +252,43 @@ static const LIBSSH2_MAC_METHOD mac_method_hmac_sha2_256 = {
     "hmac-sha2-256",
     32,
     32,
-    mac_method_common_init,
-    mac_method_hmac_sha2_256_hash,
-    mac_method_common_dtor,
+    mac_method_hmac_sha2_256_init,
+    mac_method_hmac_hash,
+    mac_method_hmac_dtor,
+    0                           /* etm */
+};
+
+static const LIBSSH2_MAC_METHOD mac_method_hmac_sha2_256_etm = {
+    "hmac-sha2-256-etm@openssh.com",
+    32,
+    32,
+    mac_method_hmac_sha2_256_init,
+    mac_method_hmac_hash,
+    mac_method_hmac_dtor,
+    1                           /* etm */
 };
 #endif
 
 
 
 
-/* mac_method_hmac_sha1_hash
- * Calculate hash using full sha1 value
+static void
+mac_hmac_sha1_setkey(libssh2_hmac_ctx *ctx, unsigned char *key,
+                     int key_len)
+{
+    libssh2_hmac_ctx_init(*ctx);
+    libssh2_hmac_sha1_init(ctx, key, key_len);
+}
+
+/* mac_method_hmac_sha1_init
+ * HMAC using the sha1 value, in full or its first 96 bits
  */
 static int
-mac_method_hmac_sha1_hash(LIBSSH2_SESSION * session,
-                          unsigned char *buf, uint32_t seqno,
-                          const unsigned char *packet,
-                          uint32_t packet_len,
-                          const unsigned char *addtl,
-                          uint32_t addtl_len, void **abstract)
+mac_method_hmac_sha1_init(LIBSSH2_SESSION * session, unsigned char *key,
+                          int *free_key, void **abstract)
 {
-    libssh2_hmac_ctx ctx;
-    unsigned char seqno_buf[4];
-    (void) session;
-
-    _libssh2_htonu32(seqno_buf, seqno);
-
-    libssh2_hmac_ctx_init(ctx);
-    libssh2_hmac_sha1_init(&ctx, *abstract, 20);
-    libssh2_hmac_update(ctx, seqno_buf, 4);
-    libssh2_hmac_update(ctx, packet, packet_len);
-    if(addtl && addtl_len) {
-        libssh2_hmac_update(ctx, addtl, addtl_len);
-    }
-    libssh2_hmac_final(ctx, buf);
-    libssh2_hmac_cleanup(&ctx);
-
-    return 0;
+    return mac_method_hmac_init(session, key, 20, free_key, abstract,
+                                mac_hmac_sha1_setkey);
 }
 
 
@@ -223,9 +297,20 @@ static const LIBSSH2_MAC_METHOD mac_method_hmac_sha1 = {
     "hmac-sha1",
     20,
     20,
-    mac_method_common_init,
-    mac_method_hmac_sha1_hash,
-    mac_method_common_dtor,
+    mac_method_hmac_sha1_init,
+    mac_method_hmac_hash,
+    mac_method_hmac_dtor,
+    0                           /* etm */
+};
+
+static const LIBSSH2_MAC_METHOD mac_method_hmac_sha1_etm = {
+    "hmac-sha1-etm@openssh.com",
+    20,
+    20,
+    mac_method_hmac_sha1_init,
+    mac_method_hmac_hash,
+    mac_method_hmac_dtor,
+    1                           /* etm */
 };
 
 /* mac_method_hmac_sha1_96_hash
@@ -241,8 +326,8 @@ mac_method_hmac_sha1_96_hash(LIBSSH2_SESSION * session,
 {
     unsigned char temp[SHA_DIGEST_LENGTH];
 
-    mac_method_hmac_sha1_hash(session, temp, seqno, packet, packet_len,
-                              addtl, addtl_len, abstract);
+    mac_method_hmac_hash(session, temp, seqno, packet, packet_len,
+                         addtl, addtl_len, abstract);
     memcpy(buf, (char *) temp, 96 / 8);
 
     return 0;
@@ -254,40 +339,30 @@ static const LIBSSH2_MAC_METHOD mac_method_hmac_sha1_96 = {
     "hmac-sha1-96",
     12,
     20,
-    mac_method_common_init,
+    mac_method_hmac_sha1_init,
     mac_method_hmac_sha1_96_hash,
-    mac_method_common_dtor,
+    mac_method_hmac_dtor,
+    0                           /* etm */
 };
 
 #if LIBSSH2_MD5
-/* mac_method_hmac_md5_hash
- * Calculate hash using full md5 value
+static void
+mac_hmac_md5_setkey(libssh2_hmac_ctx *ctx, unsigned char *key,
+                    int key_len)
+{
+    libssh2_hmac_ctx_init(*ctx);
+    libssh2_hmac_md5_init(ctx, key, key_len);
+}
+
+/* mac_method_hmac_md5_init
+ * HMAC using the md5 value, in full or its first 96 bits
  */
 static int
-mac_method_hmac_md5_hash(LIBSSH2_SESSION * session, unsigned char *buf,
-                         uint32_t seqno,
-                         const unsigned char *packet,
-                         uint32_t packet_len,
-                         const unsigned char *addtl,
-                         uint32_t addtl_len, void **abstract)
+mac_method_hmac_md5_init(LIBSSH2_SESSION * session, unsigned char *key,
+                         int *free_key, void **abstract)
 {
-    libssh2_hmac_ctx ctx;
-    unsigned char seqno_buf[4];
-    (void) session;
-
-    _libssh2_htonu32(seqno_buf, seqno);
-
-    libssh2_hmac_ctx_init(ctx);
-    libssh2_hmac_md5_init(&ctx, *abstract, 16);
-    libssh2_hmac_update(ctx, seqno_buf, 4);
-    libssh2_hmac_update(ctx, packet, packet_len);
-    if(addtl && addtl_len) {
-        libssh2_hmac_update(ctx, addtl, addtl_len);
-    }
-    libssh2_hmac_final(ctx, buf);
-    libssh2_hmac_cleanup(&ctx);
-
-    return 0;
+    return mac_method_hmac_init(session, key, 16, free_key, abstract,
+                                mac_hmac_md5_setkey);
 }
 
 
@@ -296,9 +371,10 @@ static const LIBSSH2_MAC_METHOD mac_method_hmac_md5 = {
     "hmac-md5",
     16,
     16,
-    mac_method_common_init,
-    mac_method_hmac_md5_hash,
-    mac_method_common_dtor,
+    mac_method_hmac_md5_init,
+    mac_method_hmac_hash,
+    mac_method_hmac_dtor,
+    0                           /* etm */
 };
 
 /* mac_method_hmac_md5_96_hash
@@ -313,8 +389,8 @@ mac_method_hmac_md5_96_hash(LIBSSH2_SESSION * session,
                             uint32_t addtl_len, void **abstract)
 {
     unsigned char temp[MD5_DIGEST_LENGTH];
-    mac_method_hmac_md5_hash(session, temp, seqno, packet, packet_len,
-                             addtl, addtl_len, abstract);
+    mac_method_hmac_hash(session, temp, seqno, packet, packet_len,
+                         addtl, addtl_len, abstract);
     memcpy(buf, (char *) temp, 96 / 8);
     return 0;
 }
@@ -325,42 +401,31 @@ static const LIBSSH2_MAC_METHOD mac_method_hmac_md5_96 = {
     "hmac-md5-96",
     12,
     16,
-    mac_method_common_init,
+    mac_method_hmac_md5_init,
     mac_method_hmac_md5_96_hash,
-    mac_method_common_dtor,
+    mac_method_hmac_dtor,
+    0                           /* etm */
 };
 #endif /* LIBSSH2_MD5 */
 
 #if LIBSSH2_HMAC_RIPEMD
-/* mac_method_hmac_ripemd160_hash
- * Calculate hash using ripemd160 value
+static void
+mac_hmac_ripemd160_setkey(libssh2_hmac_ctx *ctx, unsigned char *key,
+                          int key_len)
+{
+    libssh2_hmac_ctx_init(*ctx);
+    libssh2_hmac_ripemd160_init(ctx, key, key_len);
+}
+
+/* mac_method_hmac_ripemd160_init
+ * HMAC using the ripemd160 value
  */
 static int
-mac_method_hmac_ripemd160_hash(LIBSSH2_SESSION * session,
-                               unsigned char *buf, uint32_t seqno,
-                               const unsigned char *packet,
-                               uint32_t packet_len,
-                               const unsigned char *addtl,
-                               uint32_t addtl_len,
-                               void **abstract)
+mac_method_hmac_ripemd160_init(LIBSSH2_SESSION * session, unsigned char *key,
+                               int *free_key, void **abstract)
 {
-    libssh2_hmac_ctx ctx;
-    unsigned char seqno_buf[4];
-    (void) session;
-
-    _libssh2_htonu32(seqno_buf, seqno);
-
-    libssh2_hmac_ctx_init(ctx);
-    libssh2_hmac_ripemd160_init(&ctx, *abstract, 20);
-    libssh2_hmac_update(ctx, seqno_buf, 4);
-    libssh2_hmac_update(ctx, packet, packet_len);
-    if(addtl && addtl_len) {
-        libssh2_hmac_update(ctx, addtl, addtl_len);
-    }
-    libssh2_hmac_final(ctx, buf);
-    libssh2_hmac_cleanup(&ctx);
-
-    return 0;
+    return mac_method_hmac_init(session, key, 20, free_key, abstract,
+                                mac_hmac_ripemd160_setkey);
 }
 
 
@@ -369,22 +434,173 @@ static const LIBSSH2_MAC_METHOD mac_method_hmac_ripemd160 = {
     "hmac-ripemd160",
     20,
     20,
-    mac_method_common_init,
-    mac_method_hmac_ripemd160_hash,
-    mac_method_common_dtor,
+    mac_method_hmac_ripemd160_init,
+    mac_method_hmac_hash,
+    mac_method_hmac_dtor,
+    0                           /* etm */
 };
 
 static const LIBSSH2_MAC_METHOD mac_method_hmac_ripemd160_openssh_com = {
     "hmac-ripemd160@openssh.com",
     20,
     20,
-    mac_method_common_init,
-    mac_method_hmac_ripemd160_hash,
-    mac_method_common_dtor,
+    mac_method_hmac_ripemd160_init,
+    mac_method_hmac_hash,
+    mac_method_hmac_dtor,
+    0                           /* etm */
 };
 #endif /* LIBSSH2_HMAC_RIPEMD */
 
+#if LIBSSH2_AES
+/* mac_method_umac_init
+ * Derive the UMAC keys of one direction
+ */
+static int
+mac_method_umac_init(LIBSSH2_SESSION * session, unsigned char *key,
+                     int *free_key, void **abstract, size_t taglen)
+{
+    _libssh2_umac_ctx *ctx = LIBSSH2_ALLOC(session,
+                                           sizeof(_libssh2_umac_ctx));
+
+    *free_key = 1;
+    if(!ctx)
+        return LIBSSH2_ERROR_ALLOC;
+
+    if(_libssh2_umac_init(ctx, key, taglen)) {
+        LIBSSH2_FREE(session, ctx);
+        return -1;
+    }
+
+    *abstract = ctx;
+    return 0;
+}
+
+
+
+static int
+mac_method_umac_64_init(LIBSSH2_SESSION * session, unsigned char *key,
+                        int *free_key, void **abstract)
+{
+    return mac_method_umac_init(session, key, free_key, abstract, 8);
+}
+
+
+
+static int
+mac_method_umac_128_init(LIBSSH2_SESSION * session, unsigned char *key,
+                         int *free_key, void **abstract)
+{
+    return mac_method_umac_init(session, key, free_key, abstract, 16);
+}
+
+
+
+/* mac_method_umac_hash
+ * Calculate the UMAC of a packet, the sequence number is the nonce
+ */
+static int
+mac_method_umac_hash(LIBSSH2_SESSION * session,
+                     unsigned char *buf, uint32_t seqno,
+                     const unsigned char *packet,
+                     uint32_t packet_len,
+                     const unsigned char *addtl,
+                     uint32_t addtl_len, void **abstract)
+{
+    _libssh2_umac_ctx *ctx = *abstract;
+    unsigned char nonce[UMAC_NONCE_LEN];
+    (void) session;
+
+    if(!ctx)
+        return -1;
+
+    memset(nonce, 0, 4);
+    _libssh2_htonu32(&nonce[4], seqno);
+
+    _libssh2_umac_update(ctx, packet, packet_len);
+    if(addtl && addtl_len) {
+        _libssh2_umac_update(ctx, addtl, addtl_len);
+    }
+    return _libssh2_umac_final(ctx, buf, nonce);
+}
+
+
+
+/* mac_method_umac_dtor
+ * Cleanup the UMAC context of one direction
+ */
+static int
+mac_method_umac_dtor(LIBSSH2_SESSION * session, void **abstract)
+{
+    _libssh2_umac_ctx *ctx = *abstract;
+
+    if(ctx) {
+        _libssh2_umac_dtor(ctx);
+        LIBSSH2_FREE(session, ctx);
+    }
+    *abstract = NULL;
+
+    return 0;
+}
+
+
+
+static const LIBSSH2_MAC_METHOD mac_method_umac_64 = {
+    "umac-64@openssh.com",
+    8,
+    UMAC_KEY_LEN,
+    mac_method_umac_64_init,
+    mac_method_umac_hash,
+    mac_method_umac_dtor,
+    0                           /* etm */
+};
+
+static const LIBSSH2_MAC_METHOD mac_method_umac_64_etm = {
+    "umac-64-etm@openssh.com",
+    8,
+    UMAC_KEY_LEN,
+    mac_method_umac_64_init,
+    mac_method_umac_hash,
+    mac_method_umac_dtor,
+    1                           /* etm */
+};
+
+static const LIBSSH2_MAC_METHOD mac_method_umac_128 = {
+    "umac-128@openssh.com",
+    16,
+    UMAC_KEY_LEN,
+    mac_method_umac_128_init,
+    mac_method_umac_hash,
+    mac_method_umac_dtor,
+    0                           /* etm */
+};
+
+static const LIBSSH2_MAC_METHOD mac_method_umac_128_etm = {
+    "umac-128-etm@openssh.com",
+    16,
+    UMAC_KEY_LEN,
+    mac_method_umac_128_init,
+    mac_method_umac_hash,
+    mac_method_umac_dtor,
+    1                           /* etm */
+};
+#endif /* LIBSSH2_AES */
+
 static const LIBSSH2_MAC_METHOD *mac_methods[] = {
+#if LIBSSH2_AES
+    &mac_method_umac_64_etm,
+    &mac_method_umac_128_etm,
+#endif
+#if LIBSSH2_HMAC_SHA256
+    &mac_method_hmac_sha2_256_etm,
+#endif
+#if LIBSSH2_HMAC_SHA512
+    &mac_method_hmac_sha2_512_etm,
+#endif
+    &mac_method_hmac_sha1_etm,
+#if LIBSSH2_AES
+    &mac_method_umac_64,
+    &mac_method_umac_128,
+#endif
 #if LIBSSH2_HMAC_SHA256
     &mac_method_hmac_sha2_256,
 #endif
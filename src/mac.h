@@ -57,6 +57,10 @@ struct _LIBSSH2_MAC_METHOD
                  uint32_t packet_len, const unsigned char *addtl,
                  uint32_t addtl_len, void **abstract);
     int (*dtor) (LIBSSH2_SESSION * session, void **abstract);
+
+    /* Encrypt-then-MAC: the MAC is calculated over the encrypted packet and
+       the packet_length field is sent in the clear */
+    int etm;
 };
 
 typedef struct _LIBSSH2_MAC_METHOD LIBSSH2_MAC_METHOD;
@@ -127,6 +127,13 @@ _libssh2_mbedtls_cipher_init(_libssh2_cipher_ctx *ctx,
     if(!ret)
         ret = mbedtls_cipher_set_iv(ctx, iv, cipher_info->iv_size);
 
+#if defined(MBEDTLS_CIPHER_MODE_WITH_PADDING)
+    /* SSH pads its packets itself, so any padding added or stripped here
+       would corrupt the stream */
+    if(!ret && mbedtls_cipher_get_cipher_mode(ctx) == MBEDTLS_MODE_CBC)
+        ret = mbedtls_cipher_set_padding_mode(ctx, MBEDTLS_PADDING_NONE);
+#endif
+
     return ret == 0 ? 0 : -1;
 }
 
@@ -169,12 +176,110 @@ _libssh2_mbedtls_cipher_crypt(_libssh2_cipher_ctx *ctx,
     return ret == 0 ? 0 : -1;
 }
 
+int
+_libssh2_mbedtls_cipher_crypt_bulk(_libssh2_cipher_ctx *ctx,
+                                   _libssh2_cipher_type(algo),
+                                   int encrypt,
+                                   const unsigned char *src,
+                                   unsigned char *dst,
+                                   size_t len)
+{
+    int ret;
+    size_t olen = 0;
+    size_t finish_olen = 0;
+
+    (void) encrypt;
+    (void) algo;
+
+    /* 'len' is a whole number of blocks and padding is disabled, so the
+       output goes straight to 'dst' without a bounce buffer */
+    ret = mbedtls_cipher_reset(ctx);
+
+    if(!ret)
+        ret = mbedtls_cipher_update(ctx, src, len, dst, &olen);
+
+    if(!ret)
+        ret = mbedtls_cipher_finish(ctx, dst + olen, &finish_olen);
+
+    if(!ret && (olen + finish_olen) != len)
+        ret = -1;
+
+    return ret == 0 ? 0 : -1;
+}
+
 void
 _libssh2_mbedtls_cipher_dtor(_libssh2_cipher_ctx *ctx)
 {
     mbedtls_cipher_free(ctx);
 }
 
+#if LIBSSH2_CHACHA20
+int
+_libssh2_mbedtls_chacha20_init(_libssh2_chacha20_ctx *ctx,
+                               const unsigned char *key)
+{
+    mbedtls_chacha20_init(ctx);
+    if(mbedtls_chacha20_setkey(ctx, key)) {
+        mbedtls_chacha20_free(ctx);
+        return -1;
+    }
+    return 0;
+}
+
+int
+_libssh2_mbedtls_chacha20_setiv(_libssh2_chacha20_ctx *ctx,
+                                const unsigned char *nonce,
+                                uint32_t counter)
+{
+    /* mbedTLS implements the RFC 8439 layout with a 32 bit counter and a
+       96 bit nonce. The SSH variant's 64 bit nonce maps onto its last eight
+       bytes, the first four holding the (always zero) high counter word. */
+    unsigned char iv[12];
+
+    memset(iv, 0, 4);
+    memcpy(&iv[4], nonce, 8);
+
+    return mbedtls_chacha20_starts(ctx, iv, counter) ? -1 : 0;
+}
+#endif /* LIBSSH2_CHACHA20 */
+
+#if LIBSSH2_AES_GCM
+int
+_libssh2_mbedtls_aes_gcm_init(_libssh2_aes_gcm_ctx *ctx,
+                              const unsigned char *key, size_t keylen)
+{
+    mbedtls_gcm_init(ctx);
+    if(mbedtls_gcm_setkey(ctx, MBEDTLS_CIPHER_ID_AES, key,
+                          (unsigned int)(keylen * 8))) {
+        mbedtls_gcm_free(ctx);
+        return -1;
+    }
+    return 0;
+}
+
+int
+_libssh2_mbedtls_aes_gcm_finish(_libssh2_aes_gcm_ctx *ctx, int encrypt,
+                                unsigned char *tag)
+{
+    unsigned char expected[16];
+    unsigned char diff = 0;
+    int i;
+
+    if(encrypt)
+        return mbedtls_gcm_finish(ctx, tag, 16) ? -1 : 0;
+
+    /* the streaming API has no tag check of its own, compare in constant
+       time */
+    if(mbedtls_gcm_finish(ctx, expected, sizeof(expected)))
+        return -1;
+    for(i = 0; i < 16; i++)
+        diff |= (unsigned char)(tag[i] ^ expected[i]);
+    _libssh2_explicit_zero(expected, sizeof(expected));
+
+    return diff ? -1 : 0;
+}
+#endif /* LIBSSH2_AES_GCM */
+
 
 int
 _libssh2_mbedtls_hash_init(mbedtls_md_context_t *ctx,
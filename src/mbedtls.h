@@ -45,6 +45,12 @@
 #include <mbedtls/rsa.h>
 #include <mbedtls/bignum.h>
 #include <mbedtls/cipher.h>
+#ifdef MBEDTLS_CHACHA20_C
+# include <mbedtls/chacha20.h>
+#endif
+#ifdef MBEDTLS_GCM_C
+# include <mbedtls/gcm.h>
+#endif
 #ifdef MBEDTLS_ECDH_C
 # include <mbedtls/ecdh.h>
 #endif
@@ -62,6 +68,7 @@
 #define LIBSSH2_HMAC_RIPEMD     1
 #define LIBSSH2_HMAC_SHA256     1
 #define LIBSSH2_HMAC_SHA512     1
+#define LIBSSH2_HMAC_RESET      1
 
 #define LIBSSH2_AES             1
 #define LIBSSH2_AES_CTR         1
@@ -69,6 +76,16 @@
 #define LIBSSH2_RC4             1
 #define LIBSSH2_CAST            0
 #define LIBSSH2_3DES            1
+#ifdef MBEDTLS_CHACHA20_C
+# define LIBSSH2_CHACHA20       1
+#else
+# define LIBSSH2_CHACHA20       0
+#endif
+#ifdef MBEDTLS_GCM_C
+# define LIBSSH2_AES_GCM        1
+#else
+# define LIBSSH2_AES_GCM        0
+#endif
 
 #define LIBSSH2_RSA             1
 #define LIBSSH2_RSA_SHA2        1
@@ -119,6 +136,8 @@
   mbedtls_md_hmac_update(&ctx, (unsigned char *) data, datalen)
 #define libssh2_hmac_final(ctx, hash) \
   mbedtls_md_hmac_finish(&ctx, hash)
+#define libssh2_hmac_reset(pctx) \
+  mbedtls_md_hmac_reset(pctx)
 
 #define libssh2_hmac_sha1_init(pctx, key, keylen) \
   _libssh2_mbedtls_hash_init(pctx, MBEDTLS_MD_SHA1, key, keylen)
@@ -359,10 +378,12 @@ typedef enum {
 #define _libssh2_cipher_aes256    MBEDTLS_CIPHER_AES_256_CBC
 #define _libssh2_cipher_aes192    MBEDTLS_CIPHER_AES_192_CBC
 #define _libssh2_cipher_aes128    MBEDTLS_CIPHER_AES_128_CBC
+#define _libssh2_cipher_aes128ecb MBEDTLS_CIPHER_AES_128_ECB
 #define _libssh2_cipher_blowfish  MBEDTLS_CIPHER_BLOWFISH_CBC
 #define _libssh2_cipher_arcfour   MBEDTLS_CIPHER_ARC4_128
 #define _libssh2_cipher_cast5     MBEDTLS_CIPHER_NULL
 #define _libssh2_cipher_3des      MBEDTLS_CIPHER_DES_EDE3_CBC
+#define _libssh2_cipher_none      MBEDTLS_CIPHER_NONE
 
 
 /*******************************************************************/
@@ -374,9 +395,40 @@ typedef enum {
   _libssh2_mbedtls_cipher_init(ctx, type, iv, secret, encrypt)
 #define _libssh2_cipher_crypt(ctx, type, encrypt, block, blocklen) \
   _libssh2_mbedtls_cipher_crypt(ctx, type, encrypt, block, blocklen)
+#define _libssh2_cipher_crypt_bulk(ctx, type, encrypt, src, dst, len) \
+  _libssh2_mbedtls_cipher_crypt_bulk(ctx, type, encrypt, src, dst, len)
 #define _libssh2_cipher_dtor(ctx) \
   _libssh2_mbedtls_cipher_dtor(ctx)
 
+#if LIBSSH2_CHACHA20
+#define _libssh2_chacha20_ctx mbedtls_chacha20_context
+
+#define _libssh2_chacha20_init(ctx, key) \
+  _libssh2_mbedtls_chacha20_init(ctx, key)
+#define _libssh2_chacha20_setiv(ctx, nonce, counter) \
+  _libssh2_mbedtls_chacha20_setiv(ctx, nonce, counter)
+#define _libssh2_chacha20_crypt(ctx, src, dst, len) \
+  (mbedtls_chacha20_update(ctx, len, src, dst) ? -1 : 0)
+#define _libssh2_chacha20_dtor(ctx) \
+  mbedtls_chacha20_free(ctx)
+#endif
+
+#if LIBSSH2_AES_GCM
+#define _libssh2_aes_gcm_ctx mbedtls_gcm_context
+
+#define _libssh2_aes_gcm_init(ctx, key, keylen, encrypt) \
+  _libssh2_mbedtls_aes_gcm_init(ctx, key, keylen)
+#define _libssh2_aes_gcm_setiv(ctx, encrypt, iv, aad, aadlen) \
+  (mbedtls_gcm_starts(ctx, (encrypt) ? MBEDTLS_GCM_ENCRYPT : \
+                      MBEDTLS_GCM_DECRYPT, iv, 12, aad, aadlen) ? -1 : 0)
+#define _libssh2_aes_gcm_crypt(ctx, encrypt, src, dst, len) \
+  (mbedtls_gcm_update(ctx, len, src, dst) ? -1 : 0)
+#define _libssh2_aes_gcm_finish(ctx, encrypt, tag) \
+  _libssh2_mbedtls_aes_gcm_finish(ctx, encrypt, tag)
+#define _libssh2_aes_gcm_dtor(ctx) \
+  mbedtls_gcm_free(ctx)
+#endif
+
 
 /*******************************************************************/
 /*
@@ -447,9 +499,35 @@ _libssh2_mbedtls_cipher_crypt(_libssh2_cipher_ctx *ctx,
                              int encrypt,
                              unsigned char *block,
                              size_t blocklen);
+int
+_libssh2_mbedtls_cipher_crypt_bulk(_libssh2_cipher_ctx *ctx,
+                                  _libssh2_cipher_type(type),
+                                  int encrypt,
+                                  const unsigned char *src,
+                                  unsigned char *dst,
+                                  size_t len);
 void
 _libssh2_mbedtls_cipher_dtor(_libssh2_cipher_ctx *ctx);
 
+#if LIBSSH2_CHACHA20
+int
+_libssh2_mbedtls_chacha20_init(_libssh2_chacha20_ctx *ctx,
+                               const unsigned char *key);
+int
+_libssh2_mbedtls_chacha20_setiv(_libssh2_chacha20_ctx *ctx,
+                                const unsigned char *nonce,
+                                uint32_t counter);
+#endif
+
+#if LIBSSH2_AES_GCM
+int
+_libssh2_mbedtls_aes_gcm_init(_libssh2_aes_gcm_ctx *ctx,
+                              const unsigned char *key, size_t keylen);
+int
+_libssh2_mbedtls_aes_gcm_finish(_libssh2_aes_gcm_ctx *ctx, int encrypt,
+                                unsigned char *tag);
+#endif
+
 int
 _libssh2_mbedtls_hash_init(mbedtls_md_context_t *ctx,
                           mbedtls_md_type_t mdtype,
@@ -647,6 +647,20 @@ int __cdecl _libssh2_gettimeofday(struct timeval *tp, void *tzp)
 
 #endif
 
+/* Current time in microseconds, for timing round trips. Returns 0 when
+   there is no clock to read. */
+libssh2_uint64_t _libssh2_usecs(void)
+{
+#ifdef HAVE_LIBSSH2_GETTIMEOFDAY
+    struct timeval now;
+
+    _libssh2_gettimeofday(&now, NULL);
+    return (libssh2_uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+#else
+    return 0;
+#endif
+}
+
 void *_libssh2_calloc(LIBSSH2_SESSION* session, size_t size)
 {
     void *p = LIBSSH2_ALLOC(session, size);
@@ -440,12 +440,18 @@ _libssh2_cipher_init(_libssh2_cipher_ctx * h,
                      _libssh2_cipher_type(algo),
                      unsigned char *iv, unsigned char *secret, int encrypt)
 {
+    /* SSH does its own padding, so the EVP padding must be disabled or
+       decryption would hold back the last block of every update */
 #ifdef HAVE_OPAQUE_STRUCTS
     *h = EVP_CIPHER_CTX_new();
-    return !EVP_CipherInit(*h, algo(), secret, iv, encrypt);
+    if(!EVP_CipherInit(*h, algo(), secret, iv, encrypt))
+        return 1;
+    return !EVP_CIPHER_CTX_set_padding(*h, 0);
 #else
     EVP_CIPHER_CTX_init(h);
-    return !EVP_CipherInit(h, algo(), secret, iv, encrypt);
+    if(!EVP_CipherInit(h, algo(), secret, iv, encrypt))
+        return 1;
+    return !EVP_CIPHER_CTX_set_padding(h, 0);
 #endif
 }
 
@@ -472,6 +478,160 @@ _libssh2_cipher_crypt(_libssh2_cipher_ctx * ctx,
     return ret == 1 ? 0 : 1;
 }
 
+int
+_libssh2_cipher_crypt_bulk(_libssh2_cipher_ctx * ctx,
+                           _libssh2_cipher_type(algo),
+                           int encrypt, const unsigned char *src,
+                           unsigned char *dst, size_t len)
+{
+    int ret;
+    int outlen;
+    (void) algo;
+    (void) encrypt;
+
+    /* EVP_CipherUpdate() handles src == dst, and since padding is disabled
+       in _libssh2_cipher_init() and 'len' is a whole number of blocks, all
+       of the output is produced by this single call */
+#ifdef HAVE_OPAQUE_STRUCTS
+    ret = EVP_CipherUpdate(*ctx, dst, &outlen, src, (int)len);
+#else
+    ret = EVP_CipherUpdate(ctx, dst, &outlen, src, (int)len);
+#endif
+
+    return (ret == 1 && (size_t)outlen == len) ? 0 : 1;
+}
+
+#if LIBSSH2_CHACHA20
+int
+_libssh2_chacha20_init(_libssh2_chacha20_ctx *ctx, const unsigned char *key)
+{
+    *ctx = EVP_CIPHER_CTX_new();
+    if(!*ctx)
+        return -1;
+
+    if(EVP_CipherInit(*ctx, EVP_chacha20(), key, NULL, 1) != 1) {
+        EVP_CIPHER_CTX_free(*ctx);
+        *ctx = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int
+_libssh2_chacha20_setiv(_libssh2_chacha20_ctx *ctx,
+                        const unsigned char *nonce, uint32_t counter)
+{
+    /* OpenSSL's 16 byte IV is the last four words of the ChaCha state: the
+       little endian block counter followed by the nonce. The SSH variant
+       has a 64 bit counter and a 64 bit nonce, so the counter's high word
+       is always zero. */
+    unsigned char iv[16];
+
+    iv[0] = (unsigned char)counter;
+    iv[1] = (unsigned char)(counter >> 8);
+    iv[2] = (unsigned char)(counter >> 16);
+    iv[3] = (unsigned char)(counter >> 24);
+    memset(&iv[4], 0, 4);
+    memcpy(&iv[8], nonce, 8);
+
+    return EVP_CipherInit_ex(*ctx, NULL, NULL, NULL, iv, -1) == 1 ? 0 : -1;
+}
+
+int
+_libssh2_chacha20_crypt(_libssh2_chacha20_ctx *ctx,
+                        const unsigned char *src, unsigned char *dst,
+                        size_t len)
+{
+    int outlen;
+
+    if(EVP_CipherUpdate(*ctx, dst, &outlen, src, (int)len) != 1)
+        return -1;
+    return (size_t)outlen == len ? 0 : -1;
+}
+#endif /* LIBSSH2_CHACHA20 */
+
+#if LIBSSH2_AES_GCM
+int
+_libssh2_aes_gcm_init(_libssh2_aes_gcm_ctx *ctx, const unsigned char *key,
+                      size_t keylen, int encrypt)
+{
+    const EVP_CIPHER *cipher;
+
+    switch(keylen) {
+    case 16:
+        cipher = EVP_aes_128_gcm();
+        break;
+    case 32:
+        cipher = EVP_aes_256_gcm();
+        break;
+    default:
+        return -1;
+    }
+
+    *ctx = EVP_CIPHER_CTX_new();
+    if(!*ctx)
+        return -1;
+
+    /* the default IV length of GCM is the 12 bytes SSH uses */
+    if(EVP_CipherInit(*ctx, cipher, key, NULL, encrypt) != 1) {
+        EVP_CIPHER_CTX_free(*ctx);
+        *ctx = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int
+_libssh2_aes_gcm_setiv(_libssh2_aes_gcm_ctx *ctx, int encrypt,
+                       const unsigned char *iv,
+                       const unsigned char *aad, size_t aadlen)
+{
+    int outlen;
+    (void) encrypt;
+
+    /* a new IV resets the GHASH state, the key schedule is kept */
+    if(EVP_CipherInit_ex(*ctx, NULL, NULL, NULL, iv, -1) != 1)
+        return -1;
+    if(aadlen &&
+       EVP_CipherUpdate(*ctx, NULL, &outlen, aad, (int)aadlen) != 1)
+        return -1;
+    return 0;
+}
+
+int
+_libssh2_aes_gcm_crypt(_libssh2_aes_gcm_ctx *ctx, int encrypt,
+                       const unsigned char *src, unsigned char *dst,
+                       size_t len)
+{
+    int outlen;
+    (void) encrypt;
+
+    if(EVP_CipherUpdate(*ctx, dst, &outlen, src, (int)len) != 1)
+        return -1;
+    return (size_t)outlen == len ? 0 : -1;
+}
+
+int
+_libssh2_aes_gcm_finish(_libssh2_aes_gcm_ctx *ctx, int encrypt,
+                        unsigned char *tag)
+{
+    unsigned char buf[16];
+    int outlen;
+
+    if(encrypt) {
+        if(EVP_CipherFinal_ex(*ctx, buf, &outlen) != 1)
+            return -1;
+        return EVP_CIPHER_CTX_ctrl(*ctx, EVP_CTRL_GCM_GET_TAG, 16,
+                                   tag) == 1 ? 0 : -1;
+    }
+
+    /* OpenSSL compares the tag, in constant time, when finalizing */
+    if(EVP_CIPHER_CTX_ctrl(*ctx, EVP_CTRL_GCM_SET_TAG, 16, tag) != 1)
+        return -1;
+    return EVP_CipherFinal_ex(*ctx, buf, &outlen) == 1 ? 0 : -1;
+}
+#endif /* LIBSSH2_AES_GCM */
+
 #if LIBSSH2_AES_CTR && !defined(HAVE_EVP_AES_128_CTR)
 
 #include <openssl/aes.h>
@@ -547,16 +707,20 @@ aes_ctr_init(EVP_CIPHER_CTX *ctx, const unsigned char *key,
     return 1;
 }
 
+/* number of counter blocks encrypted per EVP call in the fallback shim */
+#define AES_CTR_BATCH 32
+
 static int
 aes_ctr_do_cipher(EVP_CIPHER_CTX *ctx, unsigned char *out,
                   const unsigned char *in,
                   size_t inl) /* encrypt/decrypt data */
 {
     aes_ctr_ctx *c = EVP_CIPHER_CTX_get_app_data(ctx);
-    unsigned char b1[AES_BLOCK_SIZE];
+    unsigned char ctrs[AES_BLOCK_SIZE * AES_CTR_BATCH];
+    unsigned char b1[AES_BLOCK_SIZE * AES_CTR_BATCH];
     int outlen = 0;
 
-    if(inl != 16) /* libssh2 only ever encrypt one block */
+    if(inl % AES_BLOCK_SIZE) /* libssh2 only ever encrypts whole blocks */
         return 0;
 
     if(c == NULL) {
@@ -568,15 +732,36 @@ aes_ctr_do_cipher(EVP_CIPHER_CTX *ctx, unsigned char *out,
   blocks of length L), the encryptor first encrypts <X> with <cipher>
   to obtain a block B1.  The block B1 is then XORed with P1 to generate
   the ciphertext block C1.  The counter X is then incremented
+
+  The counter blocks for a whole batch are laid out first and encrypted
+  with a single ECB call, which lets the AES implementation pipeline them.
 */
 
-    if(EVP_EncryptUpdate(c->aes_ctx, b1, &outlen,
-                         c->ctr, AES_BLOCK_SIZE) != 1) {
-        return 0;
-    }
+    while(inl) {
+        size_t blocks = inl / AES_BLOCK_SIZE;
+        size_t len;
+        size_t i;
+
+        if(blocks > AES_CTR_BATCH)
+            blocks = AES_CTR_BATCH;
+        len = blocks * AES_BLOCK_SIZE;
 
-    _libssh2_xor_data(out, in, b1, AES_BLOCK_SIZE);
-    _libssh2_aes_ctr_increment(c->ctr, AES_BLOCK_SIZE);
+        for(i = 0; i < blocks; i++) {
+            memcpy(&ctrs[i * AES_BLOCK_SIZE], c->ctr, AES_BLOCK_SIZE);
+            _libssh2_aes_ctr_increment(c->ctr, AES_BLOCK_SIZE);
+        }
+
+        if(EVP_EncryptUpdate(c->aes_ctx, b1, &outlen,
+                             ctrs, (int)len) != 1) {
+            return 0;
+        }
+
+        _libssh2_xor_data(out, in, b1, len);
+
+        in += len;
+        out += len;
+        inl -= len;
+    }
 
     return 1;
 }
@@ -94,6 +94,21 @@
 #include <openssl/pem.h>
 #include <openssl/rand.h>
 
+/* All OpenSSL and LibreSSL versions since 1.0.1 ship the native, pipelined
+   AES-CTR implementation. Builds that don't run the configure time check
+   (NMakefile, Watcom, VMS...) would otherwise fall back to the much slower
+   block-at-a-time shim in openssl.c. */
+#if !defined(HAVE_EVP_AES_128_CTR) && !defined(LIBSSH2_WOLFSSL) && \
+    !defined(OPENSSL_NO_AES) && OPENSSL_VERSION_NUMBER >= 0x10001000L
+#define HAVE_EVP_AES_128_CTR
+#endif
+
+/* test_aes_ctr_shim builds openssl.c with the shim anyway, to check it
+   against the native implementation */
+#if defined(LIBSSH2_TEST_AES_CTR_SHIM) && !defined(LIBSSH2_WOLFSSL)
+#undef HAVE_EVP_AES_128_CTR
+#endif
+
 #if (OPENSSL_VERSION_NUMBER >= 0x10100000L && \
     !defined(LIBRESSL_VERSION_NUMBER)) || defined(LIBSSH2_WOLFSSL) || \
     LIBRESSL_VERSION_NUMBER >= 0x3050000fL
@@ -144,6 +159,7 @@
 
 #define LIBSSH2_HMAC_SHA256 1
 #define LIBSSH2_HMAC_SHA512 1
+#define LIBSSH2_HMAC_RESET 1
 
 #if (OPENSSL_VERSION_NUMBER >= 0x00907000L && !defined(OPENSSL_NO_AES)) || \
     (defined(LIBSSH2_WOLFSSL) && defined(WOLFSSL_AES_COUNTER))
@@ -178,6 +194,21 @@
 # define LIBSSH2_3DES 1
 #endif
 
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && \
+    !defined(LIBRESSL_VERSION_NUMBER) && !defined(LIBSSH2_WOLFSSL) && \
+    !defined(OPENSSL_NO_CHACHA)
+# define LIBSSH2_CHACHA20 1
+#else
+# define LIBSSH2_CHACHA20 0
+#endif
+
+#if OPENSSL_VERSION_NUMBER >= 0x10001000L && !defined(OPENSSL_NO_AES) && \
+    !defined(LIBSSH2_WOLFSSL)
+# define LIBSSH2_AES_GCM 1
+#else
+# define LIBSSH2_AES_GCM 0
+#endif
+
 #define EC_MAX_POINT_LEN ((528 * 2 / 8) + 1)
 
 #define _libssh2_random(buf, len) (RAND_bytes((buf), (len)) == 1 ? 0 : -1)
@@ -316,6 +347,7 @@ int _libssh2_md5_init(libssh2_md5_ctx *ctx);
 #define libssh2_hmac_update(ctx, data, datalen) \
   HMAC_Update(ctx, data, datalen)
 #define libssh2_hmac_final(ctx, data) HMAC_Final(ctx, data, NULL)
+#define libssh2_hmac_reset(ctx) HMAC_Init_ex(*(ctx), NULL, 0, NULL, NULL)
 #define libssh2_hmac_cleanup(ctx) HMAC_CTX_free(*(ctx))
 #else
 #define libssh2_hmac_ctx HMAC_CTX
@@ -335,6 +367,7 @@ int _libssh2_md5_init(libssh2_md5_ctx *ctx);
 #define libssh2_hmac_update(ctx, data, datalen) \
   HMAC_Update(&(ctx), data, datalen)
 #define libssh2_hmac_final(ctx, data) HMAC_Final(&(ctx), data, NULL)
+#define libssh2_hmac_reset(ctx) HMAC_Init_ex(ctx, NULL, 0, NULL, NULL)
 #define libssh2_hmac_cleanup(ctx) HMAC_cleanup(ctx)
 #endif
 
@@ -382,6 +415,7 @@ libssh2_curve_type;
 #define _libssh2_cipher_aes256 EVP_aes_256_cbc
 #define _libssh2_cipher_aes192 EVP_aes_192_cbc
 #define _libssh2_cipher_aes128 EVP_aes_128_cbc
+#define _libssh2_cipher_aes128ecb EVP_aes_128_ecb
 #ifdef HAVE_EVP_AES_128_CTR
 #define _libssh2_cipher_aes128ctr EVP_aes_128_ctr
 #define _libssh2_cipher_aes192ctr EVP_aes_192_ctr
@@ -395,6 +429,7 @@ libssh2_curve_type;
 #define _libssh2_cipher_arcfour EVP_rc4
 #define _libssh2_cipher_cast5 EVP_cast5_cbc
 #define _libssh2_cipher_3des EVP_des_ede3_cbc
+#define _libssh2_cipher_none NULL
 
 #ifdef HAVE_OPAQUE_STRUCTS
 #define _libssh2_cipher_dtor(ctx) EVP_CIPHER_CTX_free(*(ctx))
@@ -402,6 +437,16 @@ libssh2_curve_type;
 #define _libssh2_cipher_dtor(ctx) EVP_CIPHER_CTX_cleanup(ctx)
 #endif
 
+#if LIBSSH2_CHACHA20
+#define _libssh2_chacha20_ctx EVP_CIPHER_CTX *
+#define _libssh2_chacha20_dtor(ctx) EVP_CIPHER_CTX_free(*(ctx))
+#endif
+
+#if LIBSSH2_AES_GCM
+#define _libssh2_aes_gcm_ctx EVP_CIPHER_CTX *
+#define _libssh2_aes_gcm_dtor(ctx) EVP_CIPHER_CTX_free(*(ctx))
+#endif
+
 #define _libssh2_bn BIGNUM
 #define _libssh2_bn_ctx BN_CTX
 #define _libssh2_bn_ctx_new() BN_CTX_new()
@@ -436,4 +481,28 @@ const EVP_CIPHER *_libssh2_EVP_aes_128_ctr(void);
 const EVP_CIPHER *_libssh2_EVP_aes_192_ctr(void);
 const EVP_CIPHER *_libssh2_EVP_aes_256_ctr(void);
 
+#if LIBSSH2_CHACHA20
+int _libssh2_chacha20_init(_libssh2_chacha20_ctx *ctx,
+                           const unsigned char *key);
+int _libssh2_chacha20_setiv(_libssh2_chacha20_ctx *ctx,
+                            const unsigned char *nonce, uint32_t counter);
+int _libssh2_chacha20_crypt(_libssh2_chacha20_ctx *ctx,
+                            const unsigned char *src, unsigned char *dst,
+                            size_t len);
+#endif
+
+#if LIBSSH2_AES_GCM
+int _libssh2_aes_gcm_init(_libssh2_aes_gcm_ctx *ctx,
+                          const unsigned char *key, size_t keylen,
+                          int encrypt);
+int _libssh2_aes_gcm_setiv(_libssh2_aes_gcm_ctx *ctx, int encrypt,
+                           const unsigned char *iv,
+                           const unsigned char *aad, size_t aadlen);
+int _libssh2_aes_gcm_crypt(_libssh2_aes_gcm_ctx *ctx, int encrypt,
+                           const unsigned char *src, unsigned char *dst,
+                           size_t len);
+int _libssh2_aes_gcm_finish(_libssh2_aes_gcm_ctx *ctx, int encrypt,
+                            unsigned char *tag);
+#endif
+
 #endif /* __LIBSSH2_OPENSSL_H */
@@ -1122,6 +1122,20 @@ _libssh2_cipher_crypt(_libssh2_cipher_ctx *ctx,
     return errcode.Bytes_Available? -1: 0;
 }
 
+int
+_libssh2_cipher_crypt_bulk(_libssh2_cipher_ctx *ctx,
+                           _libssh2_cipher_type(algo),
+                           int encrypt, const unsigned char *src,
+                           unsigned char *dst, size_t len)
+{
+    /* Qc3 chains through the algorithm context, so the whole span is
+       processed in one request. */
+    if(dst != src)
+        memmove(dst, src, len);
+
+    return _libssh2_cipher_crypt(ctx, algo, encrypt, dst, len);
+}
+
 
 /*******************************************************************
  *
@@ -166,6 +166,7 @@
 #define LIBSSH2_HMAC_RIPEMD     0
 #define LIBSSH2_HMAC_SHA256     1
 #define LIBSSH2_HMAC_SHA512     1
+#define LIBSSH2_HMAC_RESET      0
 
 #define LIBSSH2_AES             1
 #define LIBSSH2_AES_CTR         1
@@ -173,6 +174,8 @@
 #define LIBSSH2_RC4             1
 #define LIBSSH2_CAST            0
 #define LIBSSH2_3DES            1
+#define LIBSSH2_CHACHA20        0
+#define LIBSSH2_AES_GCM         0
 
 #define LIBSSH2_RSA             1
 #define LIBSSH2_RSA_SHA2        0
@@ -318,6 +321,8 @@ typedef struct {        /* Diffie-Hellman context. */
                                 Qc3_CBC, 24}
 #define _libssh2_cipher_aes256 {Qc3_Alg_Block_Cipher, Qc3_AES, 32,          \
                                 Qc3_CBC, 32}
+#define _libssh2_cipher_aes128ecb {Qc3_Alg_Block_Cipher, Qc3_AES, 16,       \
+                                   Qc3_ECB, 16}
 #define _libssh2_cipher_aes128ctr {Qc3_Alg_Block_Cipher, Qc3_AES, 16,       \
                                    Qc3_CTR, 16}
 #define _libssh2_cipher_aes192ctr {Qc3_Alg_Block_Cipher, Qc3_AES, 24,       \
@@ -327,6 +332,7 @@ typedef struct {        /* Diffie-Hellman context. */
 #define _libssh2_cipher_3des {Qc3_Alg_Block_Cipher, Qc3_TDES, 0,            \
                               Qc3_CBC, 24}
 #define _libssh2_cipher_arcfour {Qc3_Alg_Stream_Cipher, Qc3_RC4, 0, 0, 16}
+#define _libssh2_cipher_none {NULL, 0, 0, 0, 0}
 
 #define _libssh2_cipher_dtor(ctx) _libssh2_os400qc3_crypto_dtor(ctx)
 
@@ -193,13 +193,22 @@ packet_queue_listener(LIBSSH2_SESSION * session, unsigned char *data,
 
                     channel->remote.id = listen_state->sender_channel;
                     channel->remote.window_size_initial =
-                        LIBSSH2_CHANNEL_WINDOW_DEFAULT;
+                        _libssh2_channel_window_open(session,
+                                               LIBSSH2_CHANNEL_WINDOW_DEFAULT,
+                                               LIBSSH2_CHANNEL_PACKET_DEFAULT);
                     channel->remote.window_size =
-                        LIBSSH2_CHANNEL_WINDOW_DEFAULT;
+                        channel->remote.window_size_initial;
                     channel->remote.packet_size =
                         LIBSSH2_CHANNEL_PACKET_DEFAULT;
 
-                    channel->local.id = _libssh2_channel_nextid(session);
+                    if(_libssh2_channel_nextid(session, channel)) {
+                        LIBSSH2_FREE(session, channel->channel_type);
+                        LIBSSH2_FREE(session, channel);
+                        listen_state->channel = NULL;
+                        failure_code = SSH_OPEN_RESOURCE_SHORTAGE;
+                        listen_state->state = libssh2_NB_state_sent;
+                        break;
+                    }
                     channel->local.window_size_initial =
                         listen_state->initial_window_size;
                     channel->local.window_size =
@@ -243,6 +252,8 @@ packet_queue_listener(LIBSSH2_SESSION * session, unsigned char *data,
                         _libssh2_list_add(&listn->queue,
                                           &listen_state->channel->node);
                         listn->queue_size++;
+                        session->channel_windows +=
+                            listen_state->channel->remote.window_size;
                     }
 
                     listen_state->state = libssh2_NB_state_idle;
@@ -381,11 +392,18 @@ packet_x11_open(LIBSSH2_SESSION * session, unsigned char *data,
 
             channel->remote.id = x11open_state->sender_channel;
             channel->remote.window_size_initial =
-                LIBSSH2_CHANNEL_WINDOW_DEFAULT;
-            channel->remote.window_size = LIBSSH2_CHANNEL_WINDOW_DEFAULT;
+                _libssh2_channel_window_open(session,
+                                             LIBSSH2_CHANNEL_WINDOW_DEFAULT,
+                                             LIBSSH2_CHANNEL_PACKET_DEFAULT);
+            channel->remote.window_size = channel->remote.window_size_initial;
             channel->remote.packet_size = LIBSSH2_CHANNEL_PACKET_DEFAULT;
 
-            channel->local.id = _libssh2_channel_nextid(session);
+            if(_libssh2_channel_nextid(session, channel)) {
+                LIBSSH2_FREE(session, channel->channel_type);
+                LIBSSH2_FREE(session, channel);
+                failure_code = SSH_OPEN_RESOURCE_SHORTAGE;
+                goto x11_exit;
+            }
             channel->local.window_size_initial =
                 x11open_state->initial_window_size;
             channel->local.window_size = x11open_state->initial_window_size;
@@ -424,6 +442,8 @@ packet_x11_open(LIBSSH2_SESSION * session, unsigned char *data,
 
             /* Link the channel into the session */
             _libssh2_list_add(&session->channels, &channel->node);
+            session->channel_windows += channel->remote.window_size;
+            _libssh2_channel_ready(channel);
 
             /*
              * Pass control to the callback, they may turn right around and
@@ -460,6 +480,175 @@ packet_x11_open(LIBSSH2_SESSION * session, unsigned char *data,
     return 0;
 }
 
+/*
+ * Packet buffer pool
+ *
+ * The buffers that incoming packets are decrypted into come in a few size
+ * classes. Each has room for a LIBSSH2_PACKET right after the packet data,
+ * so that one allocation holds both once the packet is queued. The data
+ * pointer is what was allocated, so the data can still be handed over to
+ * code that frees it with LIBSSH2_FREE(), which then frees the struct as
+ * well. Freed buffers are kept per size class for reuse, up to
+ * PACKETPOOLMAX bytes in total.
+ */
+
+/* the largest class fits a channel data packet with 32 kB of data, the
+   usual packet size, with the largest padding and MAC */
+static const size_t pool_sizes[PACKETPOOL_CLASSES] = {
+    512, 4096, 16384, 32768 + 512
+};
+
+/* the LIBSSH2_PACKET that comes with a pool buffer */
+#define POOL_NODE(buf, pool_class) \
+    ((LIBSSH2_PACKET *)((buf) + pool_sizes[pool_class]))
+
+/*
+ * _libssh2_packet_pool_class
+ *
+ * Returns the size class a buffer of 'size' bytes gets from the pool, or -1
+ * for a size that is too large for it.
+ */
+int _libssh2_packet_pool_class(size_t size)
+{
+    int i;
+
+    for(i = 0; i < PACKETPOOL_CLASSES; i++)
+        if(size <= pool_sizes[i])
+            return i;
+    return -1;
+}
+
+/*
+ * _libssh2_packet_buf_alloc
+ *
+ * Get a buffer of at least 'size' bytes for packet data, from the pool when
+ * there is one of a fitting size class. Sets 'pool_class' to the size class,
+ * or -1 for a buffer that is too large for the pool.
+ */
+unsigned char *_libssh2_packet_buf_alloc(LIBSSH2_SESSION *session,
+                                         size_t size, int *pool_class)
+{
+    struct packetpool *pool = &session->packetpool;
+    LIBSSH2_PACKET *node;
+    unsigned char *buf;
+    int i = _libssh2_packet_pool_class(size);
+
+    *pool_class = i;
+    if(i < 0)
+        return LIBSSH2_ALLOC(session, size);
+
+    node = _libssh2_list_first(&pool->cached[i]);
+    if(node) {
+        _libssh2_list_remove(&node->node);
+        pool->cached_num--;
+        pool->cached_bytes -= pool_sizes[i];
+        pool->hits++;
+        return node->data;
+    }
+
+    pool->misses++;
+    buf = LIBSSH2_ALLOC(session, pool_sizes[i] + sizeof(LIBSSH2_PACKET));
+    if(buf) {
+        node = POOL_NODE(buf, i);
+        node->data = buf;
+        node->pool_class = i;
+    }
+    return buf;
+}
+
+/*
+ * _libssh2_packet_buf_free
+ *
+ * Give back a buffer from _libssh2_packet_buf_alloc().
+ */
+void _libssh2_packet_buf_free(LIBSSH2_SESSION *session, unsigned char *buf,
+                              int pool_class)
+{
+    struct packetpool *pool = &session->packetpool;
+    LIBSSH2_PACKET *node;
+
+    if(pool_class < 0 ||
+       pool->cached_bytes + pool_sizes[pool_class] > PACKETPOOLMAX) {
+        LIBSSH2_FREE(session, buf);
+        return;
+    }
+
+    node = POOL_NODE(buf, pool_class);
+    node->data = buf;
+    node->pool_class = pool_class;
+    _libssh2_list_add(&pool->cached[pool_class], &node->node);
+    pool->cached_num++;
+    pool->cached_bytes += pool_sizes[pool_class];
+}
+
+/*
+ * _libssh2_packet_node
+ *
+ * Get the LIBSSH2_PACKET to queue 'data' from _libssh2_packet_buf_alloc()
+ * with. Returns NULL if it has to be allocated and that fails.
+ */
+LIBSSH2_PACKET *
+_libssh2_packet_node(LIBSSH2_SESSION *session, unsigned char *data,
+                     int pool_class)
+{
+    LIBSSH2_PACKET *packet;
+
+    if(pool_class >= 0)
+        packet = POOL_NODE(data, pool_class);
+    else {
+        packet = LIBSSH2_ALLOC(session, sizeof(LIBSSH2_PACKET));
+        if(!packet)
+            return NULL;
+    }
+    packet->pool_class = pool_class;
+    return packet;
+}
+
+/*
+ * _libssh2_packet_free
+ *
+ * Free a packet that is no longer in the brigade, along with its data.
+ */
+void _libssh2_packet_free(LIBSSH2_SESSION *session, LIBSSH2_PACKET *packet)
+{
+    if(packet->pool_class >= 0)
+        _libssh2_packet_buf_free(session, packet->data, packet->pool_class);
+    else {
+        LIBSSH2_FREE(session, packet->data);
+        LIBSSH2_FREE(session, packet);
+    }
+}
+
+/*
+ * _libssh2_packet_free_node
+ *
+ * Free a packet that is no longer in the brigade, after its data has been
+ * handed over to someone who frees it with LIBSSH2_FREE().
+ */
+void _libssh2_packet_free_node(LIBSSH2_SESSION *session,
+                               LIBSSH2_PACKET *packet)
+{
+    /* a pool buffer holds the struct, it goes with the data */
+    if(packet->pool_class < 0)
+        LIBSSH2_FREE(session, packet);
+}
+
+void _libssh2_packet_pool_free(LIBSSH2_SESSION *session)
+{
+    struct packetpool *pool = &session->packetpool;
+    LIBSSH2_PACKET *node;
+    int i;
+
+    for(i = 0; i < PACKETPOOL_CLASSES; i++) {
+        while((node = _libssh2_list_first(&pool->cached[i]))) {
+            _libssh2_list_remove(&node->node);
+            LIBSSH2_FREE(session, node->data);
+        }
+    }
+    pool->cached_num = 0;
+    pool->cached_bytes = 0;
+}
+
 /*
  * _libssh2_packet_add
  *
@@ -468,13 +657,14 @@ packet_x11_open(LIBSSH2_SESSION * session, unsigned char *data,
  *
  * The input pointer 'data' is pointing to allocated data that this function
  * is asked to deal with so on failure OR success, it must be freed fine.
+ * 'pool_class' is its packet pool size class, see _libssh2_packet_buf_alloc.
  * The only exception is when the return code is LIBSSH2_ERROR_EAGAIN.
  *
  * This function will always be called with 'datalen' greater than zero.
  */
 int
 _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
-                    size_t datalen, int macstate)
+                    size_t datalen, int macstate, int pool_class)
 {
     int rc = 0;
     unsigned char *message = NULL;
@@ -497,7 +687,7 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
             /* Bad MAC input, but no callback set or non-zero return from the
                callback */
 
-            LIBSSH2_FREE(session, data);
+            _libssh2_packet_buf_free(session, data, pool_class);
             return _libssh2_error(session, LIBSSH2_ERROR_INVALID_MAC,
                                   "Invalid MAC received");
         }
@@ -513,6 +703,8 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
         goto libssh2_packet_add_jump_point4;
     case libssh2_NB_state_jump5:
         goto libssh2_packet_add_jump_point5;
+    case libssh2_NB_state_jump6:
+        goto libssh2_packet_add_jump_point6;
     default: /* nothing to do */
         break;
     }
@@ -552,7 +744,7 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
                                message, language);
             }
 
-            LIBSSH2_FREE(session, data);
+            _libssh2_packet_buf_free(session, data, pool_class);
             session->socket_state = LIBSSH2_SOCKET_DISCONNECTED;
             session->packAdd_state = libssh2_NB_state_idle;
             return _libssh2_error(session, LIBSSH2_ERROR_SOCKET_DISCONNECT,
@@ -571,7 +763,7 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
             else if(session->ssh_msg_ignore) {
                 LIBSSH2_IGNORE(session, "", 0);
             }
-            LIBSSH2_FREE(session, data);
+            _libssh2_packet_buf_free(session, data, pool_class);
             session->packAdd_state = libssh2_NB_state_idle;
             return 0;
 
@@ -611,7 +803,7 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
              */
             _libssh2_debug(session, LIBSSH2_TRACE_TRANS,
                            "Debug Packet: %s", message);
-            LIBSSH2_FREE(session, data);
+            _libssh2_packet_buf_free(session, data, pool_class);
             session->packAdd_state = libssh2_NB_state_idle;
             return 0;
 
@@ -680,7 +872,7 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
                 }
             }
 
-            LIBSSH2_FREE(session, data);
+            _libssh2_packet_buf_free(session, data, pool_class);
             session->packAdd_state = libssh2_NB_state_idle;
             return rc;
 
@@ -715,7 +907,7 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
                         return rc;
                 }
             }
-            LIBSSH2_FREE(session, data);
+            _libssh2_packet_buf_free(session, data, pool_class);
             session->packAdd_state = libssh2_NB_state_idle;
             return 0;
 
@@ -750,7 +942,7 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
             if(!channelp) {
                 _libssh2_error(session, LIBSSH2_ERROR_CHANNEL_UNKNOWN,
                                "Packet received for unknown channel");
-                LIBSSH2_FREE(session, data);
+                _libssh2_packet_buf_free(session, data, pool_class);
                 session->packAdd_state = libssh2_NB_state_idle;
                 return 0;
             }
@@ -772,7 +964,7 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
                  LIBSSH2_CHANNEL_EXTENDED_DATA_IGNORE) &&
                 (msg == SSH_MSG_CHANNEL_EXTENDED_DATA)) {
                 /* Pretend we didn't receive this */
-                LIBSSH2_FREE(session, data);
+                _libssh2_packet_buf_free(session, data, pool_class);
 
                 _libssh2_debug(session, LIBSSH2_TRACE_CONN,
                                "Ignoring extended data and refunding %d bytes",
@@ -783,6 +975,7 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
                         channelp->read_avail + data_head;
 
                 channelp->remote.window_size -= datalen - data_head;
+                session->channel_windows -= datalen - data_head;
                 _libssh2_debug(session, LIBSSH2_TRACE_CONN,
                                "shrinking window size by %lu bytes to %lu, "
                                "read_avail %lu",
@@ -830,10 +1023,13 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
                                LIBSSH2_ERROR_CHANNEL_WINDOW_EXCEEDED,
                                "The current receive window is full,"
                                " data ignored");
-                LIBSSH2_FREE(session, data);
+                _libssh2_packet_buf_free(session, data, pool_class);
                 session->packAdd_state = libssh2_NB_state_idle;
                 return 0;
             }
+            if(channelp->window_probe)
+                _libssh2_channel_rtt_sample(channelp);
+
             /* Reset EOF status */
             channelp->remote.eof = 0;
 
@@ -858,6 +1054,43 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
                            (long)channelp->read_avail,
                            (long)channelp->remote.window_size);
 
+            if(channelp->data_cb) {
+                /* Offer the data to the app first, only what it leaves is
+                   queued for reading */
+                size_t consumed =
+                    LIBSSH2_CHANNEL_DATA(session, channelp,
+                                         (msg == SSH_MSG_CHANNEL_DATA) ? 0 :
+                                         (int) _libssh2_ntohu32(data + 5),
+                                         (const char *) data + data_head,
+                                         datalen - data_head);
+                if(consumed > datalen - data_head)
+                    consumed = datalen - data_head;
+
+                channelp->read_avail -= consumed;
+                channelp->remote.window_size -= consumed;
+                session->channel_windows -= consumed;
+                data_head += consumed;
+
+                if(data_head == datalen) {
+                    /* All of it was taken, so nothing reads it to open the
+                       window again: do that here */
+                    _libssh2_packet_buf_free(session, data, pool_class);
+                    session->packAdd_channelp = channelp;
+                    session->packAdd_consumed = (uint32_t)consumed;
+
+                  libssh2_packet_add_jump_point6:
+                    session->packAdd_state = libssh2_NB_state_jump6;
+                    rc = _libssh2_channel_receive_window_adjust(
+                        session->packAdd_channelp, session->packAdd_consumed,
+                        0, NULL);
+                    if(rc == LIBSSH2_ERROR_EAGAIN)
+                        return rc;
+
+                    session->packAdd_state = libssh2_NB_state_idle;
+                    return 0;
+                }
+            }
+
             break;
 
             /*
@@ -880,8 +1113,11 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
                                channelp->local.id,
                                channelp->remote.id);
                 channelp->remote.eof = 1;
+                _libssh2_channel_ready(channelp);
+                if(channelp->eof_cb)
+                    LIBSSH2_CHANNEL_EVENT(session, channelp, eof_cb);
             }
-            LIBSSH2_FREE(session, data);
+            _libssh2_packet_buf_free(session, data, pool_class);
             session->packAdd_state = libssh2_NB_state_idle;
             return 0;
 
@@ -981,7 +1217,7 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
                         return rc;
                 }
             }
-            LIBSSH2_FREE(session, data);
+            _libssh2_packet_buf_free(session, data, pool_class);
             session->packAdd_state = libssh2_NB_state_idle;
             return rc;
 
@@ -996,8 +1232,12 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
                     _libssh2_channel_locate(session,
                                             _libssh2_ntohu32(data + 1));
             if(!channelp) {
-                /* We may have freed already, just quietly ignore this... */
-                LIBSSH2_FREE(session, data);
+                /* We may have freed already, just quietly ignore this...
+                   but now the channel ID is free to use again */
+                if(datalen >= 5)
+                    _libssh2_channel_closed_id(session,
+                                               _libssh2_ntohu32(data + 1));
+                _libssh2_packet_buf_free(session, data, pool_class);
                 session->packAdd_state = libssh2_NB_state_idle;
                 return 0;
             }
@@ -1008,8 +1248,11 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
 
             channelp->remote.close = 1;
             channelp->remote.eof = 1;
+            _libssh2_channel_ready(channelp);
+            if(channelp->remote_close_cb)
+                LIBSSH2_CHANNEL_EVENT(session, channelp, remote_close_cb);
 
-            LIBSSH2_FREE(session, data);
+            _libssh2_packet_buf_free(session, data, pool_class);
             session->packAdd_state = libssh2_NB_state_idle;
             return 0;
 
@@ -1056,7 +1299,7 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
             if(rc == LIBSSH2_ERROR_EAGAIN)
                 return rc;
 
-            LIBSSH2_FREE(session, data);
+            _libssh2_packet_buf_free(session, data, pool_class);
             session->packAdd_state = libssh2_NB_state_idle;
             return rc;
 
@@ -1075,6 +1318,9 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
                                             _libssh2_ntohu32(data + 1));
                 if(channelp) {
                     channelp->local.window_size += bytestoadd;
+                    _libssh2_channel_ready(channelp);
+                    if(channelp->window_cb)
+                        LIBSSH2_CHANNEL_EVENT(session, channelp, window_cb);
 
                     _libssh2_debug(session, LIBSSH2_TRACE_CONN,
                                    "Window adjust for channel %lu/%lu, "
@@ -1085,7 +1331,38 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
                                    channelp->local.window_size);
                 }
             }
-            LIBSSH2_FREE(session, data);
+            _libssh2_packet_buf_free(session, data, pool_class);
+            session->packAdd_state = libssh2_NB_state_idle;
+            return 0;
+
+            /*
+              byte      SSH_MSG_CHANNEL_OPEN_CONFIRMATION
+              uint32    recipient channel
+              uint32    sender channel
+              uint32    initial window size
+              uint32    maximum packet size
+
+              byte      SSH_MSG_CHANNEL_OPEN_FAILURE
+              uint32    recipient channel
+              uint32    reason code
+              string    description in ISO-10646 UTF-8 encoding [RFC3629]
+              string    language tag [RFC3066]
+            */
+        case SSH_MSG_CHANNEL_OPEN_CONFIRMATION:
+        case SSH_MSG_CHANNEL_OPEN_FAILURE:
+            _libssh2_channel_open_reply(session, data, datalen);
+            _libssh2_packet_buf_free(session, data, pool_class);
+            session->packAdd_state = libssh2_NB_state_idle;
+            return 0;
+
+            /*
+              byte      SSH_MSG_REQUEST_SUCCESS or SSH_MSG_REQUEST_FAILURE
+              ....      response specific data
+            */
+        case SSH_MSG_REQUEST_SUCCESS:
+        case SSH_MSG_REQUEST_FAILURE:
+            _libssh2_global_request_reply(session, data, datalen);
+            _libssh2_packet_buf_free(session, data, pool_class);
             session->packAdd_state = libssh2_NB_state_idle;
             return 0;
         default:
@@ -1096,12 +1373,12 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
     }
 
     if(session->packAdd_state == libssh2_NB_state_sent) {
-        LIBSSH2_PACKET *packetp =
-            LIBSSH2_ALLOC(session, sizeof(LIBSSH2_PACKET));
+        LIBSSH2_PACKET *packetp = _libssh2_packet_node(session, data,
+                                                       pool_class);
         if(!packetp) {
             _libssh2_debug(session, LIBSSH2_ERROR_ALLOC,
                            "memory for packet");
-            LIBSSH2_FREE(session, data);
+            _libssh2_packet_buf_free(session, data, pool_class);
             session->packAdd_state = libssh2_NB_state_idle;
             return LIBSSH2_ERROR_ALLOC;
         }
@@ -1109,7 +1386,11 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
         packetp->data_len = datalen;
         packetp->data_head = data_head;
 
-        _libssh2_list_add(&session->packets, &packetp->node);
+        if((msg == SSH_MSG_CHANNEL_DATA) ||
+           (msg == SSH_MSG_CHANNEL_EXTENDED_DATA))
+            _libssh2_channel_queue_data(channelp, packetp);
+        else
+            _libssh2_list_add(&session->packets, &packetp->node);
 
         session->packAdd_state = libssh2_NB_state_sent1;
     }
@@ -1183,7 +1464,7 @@ _libssh2_packet_ask(LIBSSH2_SESSION * session, unsigned char packet_type,
             /* unlink struct from session->packets */
             _libssh2_list_remove(&packet->node);
 
-            LIBSSH2_FREE(session, packet);
+            _libssh2_packet_free_node(session, packet);
 
             return 0;
         }
@@ -1405,3 +1686,4 @@ _libssh2_packet_requirev(LIBSSH2_SESSION *session,
     return LIBSSH2_ERROR_SOCKET_DISCONNECT;
 }
 
+
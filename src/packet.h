@@ -71,6 +71,18 @@ int _libssh2_packet_burn(LIBSSH2_SESSION * session,
 int _libssh2_packet_write(LIBSSH2_SESSION * session, unsigned char *data,
                           unsigned long data_len);
 int _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
-                        size_t datalen, int macstate);
+                        size_t datalen, int macstate, int pool_class);
+
+int _libssh2_packet_pool_class(size_t size);
+unsigned char *_libssh2_packet_buf_alloc(LIBSSH2_SESSION *session,
+                                         size_t size, int *pool_class);
+void _libssh2_packet_buf_free(LIBSSH2_SESSION *session, unsigned char *buf,
+                              int pool_class);
+LIBSSH2_PACKET *_libssh2_packet_node(LIBSSH2_SESSION *session,
+                                     unsigned char *data, int pool_class);
+void _libssh2_packet_free(LIBSSH2_SESSION *session, LIBSSH2_PACKET *packet);
+void _libssh2_packet_free_node(LIBSSH2_SESSION *session,
+                               LIBSSH2_PACKET *packet);
+void _libssh2_packet_pool_free(LIBSSH2_SESSION *session);
 
 #endif /* __LIBSSH2_PACKET_H */
@@ -57,6 +57,7 @@
 #include "channel.h"
 #include "mac.h"
 #include "misc.h"
+#include "packet.h"
 
 /* libssh2_default_alloc
  */
@@ -500,6 +501,7 @@ libssh2_session_init_ex(LIBSSH2_ALLOC_FUNC((*my_alloc)),
         session->abstract = abstract;
         session->api_timeout = 0; /* timeout-free API by default */
         session->api_block_mode = 1; /* blocking API by default */
+        session->recv_buf_max = PACKETBUFMAX;
         _libssh2_debug(session, LIBSSH2_TRACE_TRANS,
                        "New session resource allocated");
         _libssh2_init_if_needed();
@@ -859,6 +861,7 @@ session_free(LIBSSH2_SESSION *session)
     LIBSSH2_PACKET *pkg;
     LIBSSH2_CHANNEL *ch;
     LIBSSH2_LISTENER *l;
+    struct global_request *request;
     int packets_left = 0;
 
     if(session->free_state == libssh2_NB_state_idle) {
@@ -890,6 +893,11 @@ session_free(LIBSSH2_SESSION *session)
         session->free_state = libssh2_NB_state_sent1;
     }
 
+    if(session->channel_slots) {
+        LIBSSH2_FREE(session, session->channel_slots);
+        session->channel_slots = NULL;
+    }
+
     if(session->state & LIBSSH2_STATE_NEWKEYS) {
         /* hostkey */
         if(session->hostkey && session->hostkey->dtor) {
@@ -1036,17 +1044,9 @@ session_free(LIBSSH2_SESSION *session)
     if(session->userauth_kybd_auth_instruction) {
         LIBSSH2_FREE(session, session->userauth_kybd_auth_instruction);
     }
-    if(session->open_packet) {
-        LIBSSH2_FREE(session, session->open_packet);
-    }
-    if(session->open_data) {
-        LIBSSH2_FREE(session, session->open_data);
-    }
-    if(session->direct_message) {
-        LIBSSH2_FREE(session, session->direct_message);
-    }
-    if(session->fwdLstn_packet) {
-        LIBSSH2_FREE(session, session->fwdLstn_packet);
+    while((request = _libssh2_list_first(&session->global_requests))) {
+        _libssh2_list_remove(&request->node);
+        LIBSSH2_FREE(session, request);
     }
     if(session->pkeyInit_data) {
         LIBSSH2_FREE(session, session->pkeyInit_data);
@@ -1063,7 +1063,14 @@ session_free(LIBSSH2_SESSION *session)
 
     /* Free payload buffer */
     if(session->packet.total_num) {
-        LIBSSH2_FREE(session, session->packet.payload);
+        _libssh2_packet_buf_free(session, session->packet.payload,
+                                 session->packet.payload_class);
+    }
+    if(session->packet.buf) {
+        LIBSSH2_FREE(session, session->packet.buf);
+    }
+    if(session->packet.outbuf) {
+        LIBSSH2_FREE(session, session->packet.outbuf);
     }
 
     /* Cleanup all remaining packets */
@@ -1075,11 +1082,11 @@ session_free(LIBSSH2_SESSION *session)
         _libssh2_list_remove(&pkg->node);
 
         /* free */
-        LIBSSH2_FREE(session, pkg->data);
-        LIBSSH2_FREE(session, pkg);
+        _libssh2_packet_free(session, pkg);
     }
     _libssh2_debug(session, LIBSSH2_TRACE_TRANS,
          "Extra packets left %d", packets_left);
+    _libssh2_packet_pool_free(session);
 
     if(session->socket_prev_blockstate) {
         /* if the socket was previously blocking, put it back so */
@@ -1361,6 +1368,9 @@ libssh2_session_flag(LIBSSH2_SESSION * session, int flag, int value)
     case LIBSSH2_FLAG_COMPRESS:
         session->flag.compress = value;
         break;
+    case LIBSSH2_FLAG_RELEASE_BUFFERS:
+        session->flag.release_buffers = value;
+        break;
     default:
         /* unknown flag */
         return LIBSSH2_ERROR_INVAL;
@@ -1429,6 +1439,102 @@ libssh2_session_get_timeout(LIBSSH2_SESSION * session)
     return session->api_timeout;
 }
 
+/* libssh2_session_set_recv_buffer_max
+ *
+ * Set how large the buffer for incoming data may grow, in bytes
+ */
+LIBSSH2_API void
+libssh2_session_set_recv_buffer_max(LIBSSH2_SESSION * session, size_t max)
+{
+    if(max < PACKETBUFSIZE)
+        max = PACKETBUFSIZE;
+    session->recv_buf_max = max;
+}
+
+/* libssh2_session_get_recv_buffer_max
+ *
+ * Returns how large the buffer for incoming data may grow, in bytes
+ */
+LIBSSH2_API size_t
+libssh2_session_get_recv_buffer_max(LIBSSH2_SESSION * session)
+{
+    return session->recv_buf_max;
+}
+
+/* libssh2_session_pool_stats
+ *
+ * Get the statistics of the packet buffer pool
+ */
+LIBSSH2_API void
+libssh2_session_pool_stats(LIBSSH2_SESSION *session,
+                           LIBSSH2_POOL_STATS *stats)
+{
+    stats->hits = session->packetpool.hits;
+    stats->misses = session->packetpool.misses;
+    stats->cached = session->packetpool.cached_num;
+    stats->cached_bytes = session->packetpool.cached_bytes;
+    stats->cached_max = PACKETPOOLMAX;
+}
+
+/* libssh2_session_set_window_mode
+ *
+ * Choose between fixed receive windows and ones sized after the measured
+ * bandwidth-delay product, within the given bounds
+ */
+LIBSSH2_API int
+libssh2_session_set_window_mode(LIBSSH2_SESSION *session, int mode,
+                                unsigned long window_min,
+                                unsigned long window_max)
+{
+    if(mode == LIBSSH2_WINDOW_FIXED) {
+        session->window_mode = mode;
+        return 0;
+    }
+    if(mode != LIBSSH2_WINDOW_AUTO)
+        return _libssh2_error(session, LIBSSH2_ERROR_INVAL,
+                              "Unknown window mode");
+#ifndef HAVE_LIBSSH2_GETTIMEOFDAY
+    return _libssh2_error(session, LIBSSH2_ERROR_METHOD_NOT_SUPPORTED,
+                          "No clock to time round trips with");
+#else
+    if(!window_min)
+        window_min = WINDOW_AUTO_MIN;
+    if(!window_max)
+        window_max = WINDOW_AUTO_MAX;
+    if(window_min < LIBSSH2_CHANNEL_MINADJUST || window_min > window_max ||
+       (uint32_t)window_max != window_max)
+        return _libssh2_error(session, LIBSSH2_ERROR_INVAL,
+                              "Bad window bounds");
+
+    session->window_mode = mode;
+    session->window_min = (uint32_t)window_min;
+    session->window_max = (uint32_t)window_max;
+    return 0;
+#endif
+}
+
+/* libssh2_session_set_channel_buffer_max
+ *
+ * Set how many bytes of received channel data may be buffered for all the
+ * session's channels together, 0 for no limit
+ */
+LIBSSH2_API void
+libssh2_session_set_channel_buffer_max(LIBSSH2_SESSION *session, size_t max)
+{
+    session->channel_buffer_max = max;
+}
+
+/* libssh2_session_get_channel_buffered
+ *
+ * Returns how many bytes of received channel data are buffered for all the
+ * session's channels together
+ */
+LIBSSH2_API size_t
+libssh2_session_get_channel_buffered(LIBSSH2_SESSION *session)
+{
+    return session->channel_queued;
+}
+
 /*
  * libssh2_poll_channel_read
  *
@@ -1438,35 +1544,12 @@ libssh2_session_get_timeout(LIBSSH2_SESSION * session)
 LIBSSH2_API int
 libssh2_poll_channel_read(LIBSSH2_CHANNEL *channel, int extended)
 {
-    LIBSSH2_SESSION *session;
-    LIBSSH2_PACKET *packet;
-
     if(!channel)
         return LIBSSH2_ERROR_BAD_USE;
 
-    session = channel->session;
-    packet = _libssh2_list_first(&session->packets);
-
-    while(packet) {
-        if(packet->data_len < 5) {
-            return _libssh2_error(session, LIBSSH2_ERROR_BUFFER_TOO_SMALL,
-                                  "Packet too small");
-        }
-
-        if(channel->local.id == _libssh2_ntohu32(packet->data + 1)) {
-            if(extended == 1 &&
-                (packet->data[0] == SSH_MSG_CHANNEL_EXTENDED_DATA
-                 || packet->data[0] == SSH_MSG_CHANNEL_DATA)) {
-                return 1;
-            }
-            else if(extended == 0 &&
-                    packet->data[0] == SSH_MSG_CHANNEL_DATA) {
-                return 1;
-            }
-            /* else - no data of any type is ready to be read */
-        }
-        packet = _libssh2_list_next(&packet->node);
-    }
+    if(channel->read_queued[0] ||
+       (extended == 1 && channel->read_queued[1]))
+        return 1;
 
     return 0;
 }
@@ -42,8 +42,10 @@
 #include "libssh2_priv.h"
 #include "libssh2_sftp.h"
 #include "channel.h"
+#include "packet.h"
 #include "session.h"
 #include "sftp.h"
+#include "transport.h"
 
 /* Note: Version 6 was documented at the time of writing
  * However it was marked as "DO NOT IMPLEMENT" due to pending changes
@@ -192,6 +194,38 @@ add_zombie_request(LIBSSH2_SFTP *sftp, uint32_t request_id)
     }
 }
 
+/* where the LIBSSH2_SFTP_PACKET goes after 'len' bytes of packet data */
+#define SFTP_PACKET_NODE_OFS(len) (((len) + 7) & ~(size_t)7)
+#define SFTP_PACKET_ALLOC_SIZE(len) \
+    (SFTP_PACKET_NODE_OFS(len) + sizeof(LIBSSH2_SFTP_PACKET))
+
+/*
+ * sftp_packet_alloc() gets a buffer for an incoming packet of 'len' bytes
+ * from the session's packet pool, with room for its LIBSSH2_SFTP_PACKET
+ * after the data. The buffer can be freed with LIBSSH2_FREE() like any
+ * other, or returned to the pool with sftp_packet_free().
+ */
+static unsigned char *
+sftp_packet_alloc(LIBSSH2_SESSION *session, size_t len)
+{
+    int pool_class;
+
+    return _libssh2_packet_buf_alloc(session, SFTP_PACKET_ALLOC_SIZE(len),
+                                     &pool_class);
+}
+
+/*
+ * sftp_packet_free() gives back the data of a packet of 'len' bytes to the
+ * pool it was taken from.
+ */
+static void
+sftp_packet_free(LIBSSH2_SESSION *session, unsigned char *data, size_t len)
+{
+    _libssh2_packet_buf_free(session, data,
+                             _libssh2_packet_pool_class(
+                                 SFTP_PACKET_ALLOC_SIZE(len)));
+}
+
 /*
  * sftp_packet_add
  *
@@ -266,18 +300,13 @@ sftp_packet_add(LIBSSH2_SFTP *sftp, unsigned char *data,
         /* If we get here, the file ended before the response arrived. We
            are no longer interested in the request so we discard it */
 
-        LIBSSH2_FREE(session, data);
+        sftp_packet_free(session, data, data_len);
 
         remove_zombie_request(sftp, request_id);
         return LIBSSH2_ERROR_NONE;
     }
 
-    packet = LIBSSH2_ALLOC(session, sizeof(LIBSSH2_SFTP_PACKET));
-    if(!packet) {
-        return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
-                              "Unable to allocate datablock for SFTP packet");
-    }
-
+    packet = (LIBSSH2_SFTP_PACKET *)&data[SFTP_PACKET_NODE_OFS(data_len)];
     packet->data = data;
     packet->data_len = data_len;
     packet->request_id = request_id;
@@ -362,7 +391,7 @@ sftp_packet_read(LIBSSH2_SFTP *sftp)
             _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
                            "Data begin - Packet Length: %lu",
                            sftp->partial_len);
-            packet = LIBSSH2_ALLOC(session, sftp->partial_len);
+            packet = sftp_packet_alloc(session, sftp->partial_len);
             if(!packet)
                 return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
                                       "Unable to allocate SFTP packet");
@@ -432,6 +461,43 @@ sftp_packet_read(LIBSSH2_SFTP *sftp)
     }
     /* WON'T REACH */
 }
+/*
+ * sftp_chunk_alloc() gets a pipeline chunk with room for a request packet of
+ * 'packet_len' bytes, one the handle is done with if there is one large
+ * enough.
+ */
+static struct sftp_pipeline_chunk *
+sftp_chunk_alloc(LIBSSH2_SFTP_HANDLE *handle, size_t packet_len)
+{
+    LIBSSH2_SESSION *session = handle->sftp->channel->session;
+    struct sftp_pipeline_chunk *chunk;
+
+    for(chunk = _libssh2_list_first(&handle->spare_chunks); chunk;
+        chunk = _libssh2_list_next(&chunk->node)) {
+        if(chunk->size >= packet_len) {
+            _libssh2_list_remove(&chunk->node);
+            return chunk;
+        }
+    }
+
+    chunk = LIBSSH2_ALLOC(session, packet_len +
+                          sizeof(struct sftp_pipeline_chunk));
+    if(chunk)
+        chunk->size = packet_len;
+    return chunk;
+}
+
+/*
+ * sftp_chunk_free() keeps a chunk that is done with for the handle's next
+ * requests. They are freed along with the handle.
+ */
+static void
+sftp_chunk_free(LIBSSH2_SFTP_HANDLE *handle,
+                struct sftp_pipeline_chunk *chunk)
+{
+    _libssh2_list_add(&handle->spare_chunks, &chunk->node);
+}
+
 /*
  * sftp_packetlist_flush
  *
@@ -460,18 +526,34 @@ static void sftp_packetlist_flush(LIBSSH2_SFTP_HANDLE *handle)
 
         if(!rc)
             /* we found a packet, free it */
-            LIBSSH2_FREE(session, data);
+            sftp_packet_free(session, data, data_len);
         else if(chunk->sent)
             /* there was no incoming packet for this request, mark this
                request as a zombie if it ever sent the request */
             add_zombie_request(sftp, chunk->request_id);
 
         _libssh2_list_remove(&chunk->node);
-        LIBSSH2_FREE(session, chunk);
+        sftp_chunk_free(handle, chunk);
         chunk = next;
     }
 }
 
+/*
+ * sftp_chunks_free
+ *
+ * Free the chunks kept for reuse by a handle.
+ */
+static void sftp_chunks_free(LIBSSH2_SFTP_HANDLE *handle)
+{
+    LIBSSH2_SESSION *session = handle->sftp->channel->session;
+    struct sftp_pipeline_chunk *chunk;
+
+    while((chunk = _libssh2_list_first(&handle->spare_chunks))) {
+        _libssh2_list_remove(&chunk->node);
+        LIBSSH2_FREE(session, chunk);
+    }
+}
+
 
 /*
  * sftp_packet_ask()
@@ -483,7 +565,6 @@ sftp_packet_ask(LIBSSH2_SFTP *sftp, unsigned char packet_type,
                 uint32_t request_id, unsigned char **data,
                 size_t *data_len)
 {
-    LIBSSH2_SESSION *session = sftp->channel->session;
     LIBSSH2_SFTP_PACKET *packet = _libssh2_list_first(&sftp->packets);
 
     if(!packet)
@@ -500,9 +581,8 @@ sftp_packet_ask(LIBSSH2_SFTP *sftp, unsigned char packet_type,
             *data = packet->data;
             *data_len = packet->data_len;
 
-            /* unlink and free this struct */
+            /* unlink this struct, which goes along with the data */
             _libssh2_list_remove(&packet->node);
-            LIBSSH2_FREE(session, packet);
 
             return 0;
         }
@@ -1397,7 +1477,7 @@ static ssize_t sftp_read(LIBSSH2_SFTP_HANDLE * handle, char *buffer,
             filep->offset += copy;
 
             if(!filep->data_left) {
-                LIBSSH2_FREE(session, filep->data);
+                sftp_packet_free(session, filep->data, filep->data_len);
                 filep->data = NULL;
             }
 
@@ -1477,8 +1557,7 @@ static ssize_t sftp_read(LIBSSH2_SFTP_HANDLE * handle, char *buffer,
             if(size > MAX_SFTP_READ_SIZE)
                 size = MAX_SFTP_READ_SIZE;
 
-            chunk = LIBSSH2_ALLOC(session, packet_len +
-                                  sizeof(struct sftp_pipeline_chunk));
+            chunk = sftp_chunk_alloc(handle, packet_len);
             if(!chunk)
                 return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
                                       "malloc fail for FXP_WRITE");
@@ -1517,6 +1596,9 @@ static ssize_t sftp_read(LIBSSH2_SFTP_HANDLE * handle, char *buffer,
            many as possible - remember that we don't block */
         chunk = _libssh2_list_first(&handle->packet_list);
 
+        /* let the requests go out together rather than one by one */
+        _libssh2_transport_cork(session);
+
         while(chunk) {
             if(chunk->lefttosend) {
 
@@ -1524,6 +1606,7 @@ static ssize_t sftp_read(LIBSSH2_SFTP_HANDLE * handle, char *buffer,
                                             &chunk->packet[chunk->sent],
                                             chunk->lefttosend);
                 if(rc < 0) {
+                    _libssh2_transport_uncork(session);
                     sftp->read_state = libssh2_NB_state_sent;
                     return rc;
                 }
@@ -1548,6 +1631,9 @@ static ssize_t sftp_read(LIBSSH2_SFTP_HANDLE * handle, char *buffer,
             /* move on to the next chunk with data to send */
             chunk = _libssh2_list_next(&chunk->node);
         }
+
+        /* what doesn't go out now goes before the responses are read */
+        _libssh2_transport_uncork(session);
         /* FALL-THROUGH */
 
     case libssh2_NB_state_sent2:
@@ -1610,14 +1696,14 @@ static ssize_t sftp_read(LIBSSH2_SFTP_HANDLE * handle, char *buffer,
                 /* remove the chunk we just processed */
 
                 _libssh2_list_remove(&chunk->node);
-                LIBSSH2_FREE(session, chunk);
+                sftp_chunk_free(handle, chunk);
 
                 /* we must remove all outstanding READ requests, as either we
                    got an error or we're at end of file */
                 sftp_packetlist_flush(handle);
 
                 rc32 = _libssh2_ntohu32(data + 5);
-                LIBSSH2_FREE(session, data);
+                sftp_packet_free(session, data, data_len);
 
                 if(rc32 == LIBSSH2_FX_EOF) {
                     filep->eof = TRUE;
@@ -1685,13 +1771,13 @@ static ssize_t sftp_read(LIBSSH2_SFTP_HANDLE * handle, char *buffer,
 
                 if(filep->data_len == 0)
                     /* free the allocated data if not stored to keep */
-                    LIBSSH2_FREE(session, data);
+                    sftp_packet_free(session, data, data_len);
 
                 /* remove the chunk we just processed keeping track of the
                  * next one in case we need it */
                 next = _libssh2_list_next(&chunk->node);
                 _libssh2_list_remove(&chunk->node);
-                LIBSSH2_FREE(session, chunk);
+                sftp_chunk_free(handle, chunk);
 
                 /* check if we have space left in the buffer
                  * and either continue to the next chunk or stop
@@ -2063,8 +2149,7 @@ static ssize_t sftp_write(LIBSSH2_SFTP_HANDLE *handle, const char *buffer,
                handle_len(4) + offset(8) + count(4) */
             packet_len = handle->handle_len + size + 25;
 
-            chunk = LIBSSH2_ALLOC(session, packet_len +
-                                  sizeof(struct sftp_pipeline_chunk));
+            chunk = sftp_chunk_alloc(handle, packet_len);
             if(!chunk)
                 return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
                                       "malloc fail for FXP_WRITE");
@@ -2097,14 +2182,19 @@ static ssize_t sftp_write(LIBSSH2_SFTP_HANDLE *handle, const char *buffer,
            many as possible - remember that we don't block */
         chunk = _libssh2_list_first(&handle->packet_list);
 
+        /* let the requests go out together rather than one by one */
+        _libssh2_transport_cork(session);
+
         while(chunk) {
             if(chunk->lefttosend) {
                 rc = _libssh2_channel_write(channel, 0,
                                             &chunk->packet[chunk->sent],
                                             chunk->lefttosend);
-                if(rc < 0)
+                if(rc < 0) {
+                    _libssh2_transport_uncork(session);
                     /* remain in idle state */
                     return rc;
+                }
 
                 /* remember where to continue sending the next time */
                 chunk->lefttosend -= rc;
@@ -2119,6 +2209,9 @@ static ssize_t sftp_write(LIBSSH2_SFTP_HANDLE *handle, const char *buffer,
             chunk = _libssh2_list_next(&chunk->node);
         }
 
+        /* what doesn't go out now goes before the responses are read */
+        _libssh2_transport_uncork(session);
+
         /* fall-through */
     case libssh2_NB_state_sent:
 
@@ -2156,7 +2249,7 @@ static ssize_t sftp_write(LIBSSH2_SFTP_HANDLE *handle, const char *buffer,
             }
 
             retcode = _libssh2_ntohu32(data + 5);
-            LIBSSH2_FREE(session, data);
+            sftp_packet_free(session, data, data_len);
 
             sftp->last_errno = retcode;
             if(retcode == LIBSSH2_FX_OK) {
@@ -2169,7 +2262,7 @@ static ssize_t sftp_write(LIBSSH2_SFTP_HANDLE *handle, const char *buffer,
                 next = _libssh2_list_next(&chunk->node);
 
                 _libssh2_list_remove(&chunk->node); /* remove from list */
-                LIBSSH2_FREE(session, chunk); /* free memory */
+                sftp_chunk_free(handle, chunk); /* keep for reuse */
 
                 chunk = next;
             }
@@ -2481,7 +2574,8 @@ libssh2_sftp_seek64(LIBSSH2_SFTP_HANDLE *handle, libssh2_uint64_t offset)
 
     /* free the left received buffered data */
     if(handle->u.file.data_left) {
-        LIBSSH2_FREE(handle->sftp->channel->session, handle->u.file.data);
+        sftp_packet_free(handle->sftp->channel->session, handle->u.file.data,
+                         handle->u.file.data_len);
         handle->u.file.data_left = handle->u.file.data_len = 0;
         handle->u.file.data = NULL;
     }
@@ -2543,8 +2637,7 @@ static void sftp_packet_flush(LIBSSH2_SFTP *sftp)
         /* check next struct in the list */
         next =  _libssh2_list_next(&packet->node);
         _libssh2_list_remove(&packet->node);
-        LIBSSH2_FREE(session, packet->data);
-        LIBSSH2_FREE(session, packet);
+        sftp_packet_free(session, packet->data, packet->data_len);
 
         packet = next;
     }
@@ -2669,10 +2762,12 @@ sftp_close_handle(LIBSSH2_SFTP_HANDLE *handle)
     }
     else if(handle->handle_type == LIBSSH2_SFTP_HANDLE_FILE) {
         if(handle->u.file.data)
-            LIBSSH2_FREE(session, handle->u.file.data);
+            sftp_packet_free(session, handle->u.file.data,
+                             handle->u.file.data_len);
     }
 
     sftp_packetlist_flush(handle);
+    sftp_chunks_free(handle);
     sftp->read_state = libssh2_NB_state_idle;
 
     handle->close_state = libssh2_NB_state_idle;
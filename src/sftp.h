@@ -59,6 +59,7 @@ struct sftp_pipeline_chunk {
     size_t sent;
     ssize_t lefttosend; /* if 0, the entire packet has been sent off */
     uint32_t request_id;
+    size_t size; /* room for data in 'packet' */
     unsigned char packet[1]; /* data */
 };
 
@@ -71,6 +72,8 @@ struct sftp_zombie_requests {
 #define MIN(x,y) ((x)<(y)?(x):(y))
 #endif
 
+/* The struct is stored right after the data of the packet it is for, in
+   the same allocation, see sftp_packet_alloc() */
 struct _LIBSSH2_SFTP_PACKET
 {
     struct list_node node;   /* linked list header */
@@ -134,6 +137,9 @@ struct _LIBSSH2_SFTP_HANDLE
     /* list of outstanding packets sent to server */
     struct list_head packet_list;
 
+    /* chunks done with, kept to be used for the next requests */
+    struct list_head spare_chunks;
+
 };
 
 struct _LIBSSH2_SFTP
@@ -51,8 +51,8 @@
 #include "transport.h"
 #include "mac.h"
 
-#define MAX_BLOCKSIZE 32    /* MUST fit biggest crypto block size we use/get */
 #define MAX_MACSIZE 64      /* MUST fit biggest MAC length we support */
+#define SPLIT_PARTS 16      /* iovec pieces gathered into one packet */
 
 #ifdef LIBSSH2DEBUG
 #define UNPRINTABLE_CHAR '.'
@@ -133,22 +133,34 @@ decrypt(LIBSSH2_SESSION * session, unsigned char *source,
 {
     struct transportpacket *p = &session->packet;
     int blocksize = session->remote.crypt->blocksize;
+    int rc;
 
     /* if we get called with a len that isn't an even number of blocksizes
        we risk losing those extra bytes */
     assert((len % blocksize) == 0);
 
+    if(session->remote.crypt->crypt_bulk) {
+        /* decrypt the whole span straight into the destination */
+        rc = session->remote.crypt->crypt_bulk(session, source, dest, len,
+                                            &session->remote.crypt_abstract);
+        if(rc) {
+            _libssh2_packet_buf_free(session, p->payload, p->payload_class);
+            return LIBSSH2_ERROR_DECRYPT;
+        }
+        return LIBSSH2_ERROR_NONE;
+    }
+
     while(len >= blocksize) {
         if(session->remote.crypt->crypt(session, source, blocksize,
                                          &session->remote.crypt_abstract)) {
-            LIBSSH2_FREE(session, p->payload);
+            _libssh2_packet_buf_free(session, p->payload, p->payload_class);
             return LIBSSH2_ERROR_DECRYPT;
         }
 
-        /* if the crypt() function would write to a given address it
-           wouldn't have to memcpy() and we could avoid this memcpy()
-           too */
-        memcpy(dest, source, blocksize);
+        /* the method has no crypt_bulk() so it can only decrypt in place,
+           copy the result over to the destination */
+        if(dest != source)
+            memcpy(dest, source, blocksize);
 
         len -= blocksize;       /* less bytes left */
         dest += blocksize;      /* advance write pointer */
@@ -173,7 +185,64 @@ fullpacket(LIBSSH2_SESSION * session, int encrypted /* 1 or 0 */ )
         session->fullpacket_macstate = LIBSSH2_MAC_CONFIRMED;
         session->fullpacket_payload_len = p->packet_length - 1;
 
-        if(encrypted) {
+        if(encrypted && (session->remote.crypt->flags &
+                         LIBSSH2_CRYPT_FLAG_INTEGRATED_MAC)) {
+            /* The cipher has authenticated the packet while decrypting it,
+               check its tag which sits where the MAC would be */
+            if(session->remote.crypt->aead_end(session,
+                                       p->payload +
+                                       session->fullpacket_payload_len,
+                                       &session->remote.crypt_abstract)) {
+                session->fullpacket_macstate = LIBSSH2_MAC_INVALID;
+            }
+        }
+        else if(encrypted && session->remote.mac->etm) {
+            int blocksize = session->remote.crypt->blocksize;
+            unsigned char block[MAX_BLOCKSIZE];
+
+            /* Encrypt-then-MAC: the MAC covers the packet as it was
+               received, so it is checked before anything is decrypted. The
+               first block is kept in p->init and the rest of the packet
+               follows it in the payload buffer. */
+            session->remote.mac->hash(session, macbuf,
+                                      session->remote.seqno,
+                                      p->init, blocksize + 4,
+                                      p->payload + blocksize - 1,
+                                      p->packet_length - blocksize,
+                                      &session->remote.mac_abstract);
+
+            if(memcmp(macbuf, p->payload + session->fullpacket_payload_len,
+                      session->remote.mac->mac_len)) {
+                session->fullpacket_macstate = LIBSSH2_MAC_INVALID;
+
+                /* unless the application gets to decide about it, don't
+                   spend any time on decrypting a packet that is dropped */
+                if(!session->macerror) {
+                    _libssh2_packet_buf_free(session, p->payload,
+                                             p->payload_class);
+                    return _libssh2_error(session, LIBSSH2_ERROR_INVALID_MAC,
+                                          "Invalid MAC received");
+                }
+            }
+
+            rc = decrypt(session, &p->init[4], block, blocksize);
+            if(rc)
+                return rc;
+            p->padding_length = block[0];
+            if(p->padding_length > p->packet_length - 1) {
+                _libssh2_packet_buf_free(session, p->payload,
+                                         p->payload_class);
+                return LIBSSH2_ERROR_DECRYPT;
+            }
+            memcpy(p->payload, &block[1], blocksize - 1);
+
+            rc = decrypt(session, p->payload + blocksize - 1,
+                         p->payload + blocksize - 1,
+                         p->packet_length - blocksize);
+            if(rc)
+                return rc;
+        }
+        else if(encrypted) {
 
             /* Calculate MAC hash */
             session->remote.mac->hash(session, macbuf,  /* store hash here */
@@ -221,11 +290,12 @@ fullpacket(LIBSSH2_SESSION * session, int encrypted /* 1 or 0 */ )
                                               p->payload,
                                               session->fullpacket_payload_len,
                                               &session->remote.comp_abstract);
-            LIBSSH2_FREE(session, p->payload);
+            _libssh2_packet_buf_free(session, p->payload, p->payload_class);
             if(rc)
                 return rc;
 
             p->payload = data;
+            p->payload_class = -1;
             session->fullpacket_payload_len = data_len;
         }
 
@@ -240,7 +310,8 @@ fullpacket(LIBSSH2_SESSION * session, int encrypted /* 1 or 0 */ )
     if(session->fullpacket_state == libssh2_NB_state_created) {
         rc = _libssh2_packet_add(session, p->payload,
                                  session->fullpacket_payload_len,
-                                 session->fullpacket_macstate);
+                                 session->fullpacket_macstate,
+                                 p->payload_class);
         if(rc == LIBSSH2_ERROR_EAGAIN)
             return rc;
         if(rc) {
@@ -255,12 +326,352 @@ fullpacket(LIBSSH2_SESSION * session, int encrypted /* 1 or 0 */ )
 }
 
 
+/* room after the end of the receive ring, see struct transportpacket */
+#define RECVBUF_SLACK (MAX_BLOCKSIZE + 4)
+
+/*
+ * recvbuf_resize() moves the buffered incoming data over to a new receive
+ * ring of 'size' bytes.
+ */
+static int
+recvbuf_resize(LIBSSH2_SESSION *session, size_t size)
+{
+    struct transportpacket *p = &session->packet;
+    unsigned char *buf = LIBSSH2_ALLOC(session, size + RECVBUF_SLACK);
+
+    if(!buf)
+        return LIBSSH2_ERROR_ALLOC;
+
+    if(p->buffered) {
+        size_t first = p->buf_size - p->readidx;
+        if(first > p->buffered)
+            first = p->buffered;
+        memcpy(buf, &p->buf[p->readidx], first);
+        memcpy(&buf[first], p->buf, p->buffered - first);
+    }
+    if(p->buf)
+        LIBSSH2_FREE(session, p->buf);
+
+    p->buf = buf;
+    p->buf_size = size;
+    p->readidx = 0;
+    return LIBSSH2_ERROR_NONE;
+}
+
+/*
+ * recvbuf_contiguous() returns how many of the buffered bytes follow the
+ * read index without wrapping around the end of the ring.
+ */
+static size_t
+recvbuf_contiguous(struct transportpacket *p)
+{
+    size_t tail = p->buf_size - p->readidx;
+
+    return p->buffered < tail ? p->buffered : tail;
+}
+
+/*
+ * recvbuf_unwrap() makes 'len' buffered bytes, at most RECVBUF_SLACK more
+ * than recvbuf_contiguous() says, readable in one piece at the read index
+ * by copying the start of the ring to after its end.
+ */
+static void
+recvbuf_unwrap(struct transportpacket *p, size_t len)
+{
+    size_t tail = p->buf_size - p->readidx;
+
+    if(len > tail) {
+        assert(len - tail <= RECVBUF_SLACK);
+        memcpy(&p->buf[p->buf_size], p->buf, len - tail);
+    }
+}
+
+/*
+ * recvbuf_consume() drops 'len' bytes from the start of the buffered data.
+ */
+static void
+recvbuf_consume(struct transportpacket *p, size_t len)
+{
+    p->readidx += len;
+    if(p->readidx >= p->buf_size)
+        p->readidx -= p->buf_size;
+    p->buffered -= len;
+
+    /* an empty ring starts over at the beginning */
+    if(!p->buffered)
+        p->readidx = 0;
+}
+
+/*
+ * recvbuf_release() gives back the receive ring and the unused packet
+ * buffers when there is nothing left to read, if LIBSSH2_FLAG_RELEASE_BUFFERS
+ * asks for it. The next read sets the ring up again.
+ */
+static void
+recvbuf_release(LIBSSH2_SESSION *session)
+{
+    struct transportpacket *p = &session->packet;
+
+    if(!session->flag.release_buffers || p->buffered || p->total_num)
+        return;
+
+    if(p->buf) {
+        LIBSSH2_FREE(session, p->buf);
+        p->buf = NULL;
+        p->buf_size = 0;
+        p->readidx = 0;
+    }
+    _libssh2_packet_pool_free(session);
+}
+
+/*
+ * batchable() tells if the transport may go on reading packets after one of
+ * 'packet_type', before returning to the caller. That is fine for channel
+ * data, which nobody waits for by its type, as long as the keys don't
+ * change and the channel data buffered is within the session's budget.
+ */
+static int
+batchable(LIBSSH2_SESSION *session, int packet_type)
+{
+    if(session->state & LIBSSH2_STATE_EXCHANGING_KEYS)
+        return 0;
+
+    if(session->channel_buffer_max &&
+       session->channel_queued >= session->channel_buffer_max)
+        return 0;
+
+    return packet_type == SSH_MSG_CHANNEL_DATA ||
+        packet_type == SSH_MSG_CHANNEL_EXTENDED_DATA ||
+        packet_type == SSH_MSG_CHANNEL_WINDOW_ADJUST;
+}
+
+static int sched_dispatch(LIBSSH2_SESSION *session);
+
+/*
+ * outbuf_room() makes room for another packet of the largest size at the
+ * end of the outgoing queue without sending anything, allocating the queue
+ * or growing it. LIBSSH2_ERROR_EAGAIN if it is as large as it gets.
+ */
+static int
+outbuf_room(LIBSSH2_SESSION *session)
+{
+    struct transportpacket *p = &session->packet;
+    unsigned char *outbuf;
+    size_t size;
+
+    if(!p->outbuf) {
+        p->outbuf = LIBSSH2_ALLOC(session, OUTBUFSIZE);
+        if(!p->outbuf)
+            return LIBSSH2_ERROR_ALLOC;
+        p->osize = OUTBUFSIZE;
+    }
+    if(p->osize - p->oqueued >= MAX_SSH_PACKET_LEN)
+        return LIBSSH2_ERROR_NONE;
+
+    if(p->osize >= OUTBUFMAX)
+        return LIBSSH2_ERROR_EAGAIN;
+
+    size = p->osize * 2;
+    if(size > OUTBUFMAX)
+        size = OUTBUFMAX;
+    outbuf = LIBSSH2_REALLOC(session, p->outbuf, size);
+    if(!outbuf)
+        return LIBSSH2_ERROR_ALLOC;
+    p->outbuf = outbuf;
+    p->osize = size;
+
+    return p->osize - p->oqueued >= MAX_SSH_PACKET_LEN ?
+        LIBSSH2_ERROR_NONE : LIBSSH2_ERROR_EAGAIN;
+}
+
+/*
+ * outbuf_release() gives back the outgoing queue once it is empty. Idle
+ * sessions hold no memory for it, and a queue grown for a burst doesn't stay
+ * grown.
+ */
+static void
+outbuf_release(LIBSSH2_SESSION *session)
+{
+    struct transportpacket *p = &session->packet;
+
+    if(!p->outbuf || p->oqueued)
+        return;
+
+    LIBSSH2_FREE(session, p->outbuf);
+    p->outbuf = NULL;
+    p->osize = 0;
+}
+
+/*
+ * send_queued() sends off the queued outgoing packets, as much of them as
+ * the socket takes. Channel data waiting in the channels' write queues
+ * joins the queue as it empties, see sched_dispatch().
+ */
+static int
+send_queued(LIBSSH2_SESSION *session)
+{
+    struct transportpacket *p = &session->packet;
+    size_t length;
+    ssize_t rc;
+
+    while(1) {
+        if(session->sched_queued) {
+            rc = sched_dispatch(session);
+            if(rc)
+                return (int)rc;
+        }
+
+        length = p->oqueued - p->osent;
+        if(!length)
+            return LIBSSH2_ERROR_NONE;
+
+        rc = LIBSSH2_SEND(session, &p->outbuf[p->osent], length,
+                          LIBSSH2_SOCKET_SEND_FLAGS(session));
+        if(rc < 0)
+            _libssh2_debug(session, LIBSSH2_TRACE_SOCKET,
+                           "Error sending %d bytes: %d", (int)length, -rc);
+        else {
+            _libssh2_debug(session, LIBSSH2_TRACE_SOCKET,
+                           "Sent %d/%d bytes at %p+%d", rc, (int)length,
+                           p->outbuf, (int)p->osent);
+            debugdump(session, "libssh2_transport_write send()",
+                      &p->outbuf[p->osent], rc);
+        }
+
+        if(rc < 0) {
+            /* nothing was sent */
+            if(rc != -EAGAIN)
+                /* send failure! */
+                return LIBSSH2_ERROR_SOCKET_SEND;
+
+            session->socket_block_directions |=
+                LIBSSH2_SESSION_BLOCK_OUTBOUND;
+            return LIBSSH2_ERROR_EAGAIN;
+        }
+
+        p->osent += rc;         /* we sent away this much data */
+        if(p->osent < p->oqueued) {
+            session->socket_block_directions |=
+                LIBSSH2_SESSION_BLOCK_OUTBOUND;
+            return LIBSSH2_ERROR_EAGAIN;
+        }
+
+        /* the queue is empty, start over at its beginning */
+        p->osent = 0;
+        p->oqueued = 0;
+        p->oend = 0;
+
+        if(!session->sched_queued)
+            break;
+    }
+
+    /* nothing waits to join the queue either, so the buffer is not needed
+       until the next packet */
+    if(!p->ocorked)
+        outbuf_release(session);
+    return LIBSSH2_ERROR_NONE;
+}
+
+static int
+send_existing(LIBSSH2_SESSION *session, const unsigned char *data,
+              size_t data_len, ssize_t *ret)
+{
+    struct transportpacket *p = &session->packet;
+    int rc;
+
+    if(!p->olen) {
+        *ret = 0;
+        return LIBSSH2_ERROR_NONE;
+    }
+
+    /* send as much as possible of the existing packet */
+    if((data != p->odata) || (data_len != p->olen)) {
+        /* When we are about to complete the sending of a packet, it is vital
+           that the caller doesn't try to send a new/different packet since
+           we don't add this one up until the previous one has been sent. To
+           make the caller really notice his/hers flaw, we return error for
+           this case */
+        return LIBSSH2_ERROR_BAD_USE;
+    }
+
+    *ret = 1;                   /* set to make our parent return */
+
+    /* the packet is queued already, along with any held back before it */
+    rc = send_queued(session);
+    if(rc == LIBSSH2_ERROR_EAGAIN && p->osent >= p->oend)
+        rc = LIBSSH2_ERROR_NONE; /* what is left came from write queues */
+    if(!rc) {
+        /* the remainder of the package was sent */
+        p->odata = NULL;
+        p->olen = 0;
+        /* we leave *ret set so that the parent returns as we MUST return back
+           a send success now, so that we don't risk sending EAGAIN later
+           which then would confuse the parent function */
+    }
+
+    return rc;
+}
+
+/*
+ * outbuf_reserve() makes room for another packet of the largest size at the
+ * end of the outgoing queue. That means sending off the queue first, and
+ * growing it if the socket doesn't take all of it.
+ */
+static int
+outbuf_reserve(LIBSSH2_SESSION *session)
+{
+    struct transportpacket *p = &session->packet;
+
+    int rc;
+
+    /* sending the queue off may release the buffer, so do that first */
+    if(p->outbuf && p->osize - p->oqueued < MAX_SSH_PACKET_LEN) {
+        rc = send_queued(session);
+        if(rc && (rc != LIBSSH2_ERROR_EAGAIN))
+            return rc;
+    }
+
+    return outbuf_room(session);
+}
+
+/*
+ * holding_back() tells if queued packets should wait for more to join them.
+ * Never during a key exchange, as that waits for replies to what it sends.
+ */
+static int
+holding_back(LIBSSH2_SESSION *session)
+{
+    return session->packet.ocorked &&
+        !(session->state & LIBSSH2_STATE_EXCHANGING_KEYS);
+}
+
+void _libssh2_transport_cork(LIBSSH2_SESSION *session)
+{
+    session->packet.ocorked = 1;
+}
+
+int _libssh2_transport_uncork(LIBSSH2_SESSION *session)
+{
+    session->packet.ocorked = 0;
+
+    return send_queued(session);
+}
+
+int _libssh2_transport_flush(LIBSSH2_SESSION *session)
+{
+    if(holding_back(session))
+        return LIBSSH2_ERROR_NONE;
+
+    return send_queued(session);
+}
+
 /*
  * _libssh2_transport_read
  *
- * Collect a packet into the input queue.
+ * Collect a packet into the input queue. Channel data packets that follow
+ * in the receive buffer are collected in the same call.
  *
- * Returns packet type added to input queue (0 if nothing added), or a
+ * Returns packet type last added to input queue (0 if nothing added), or a
  * negative error number.
  */
 
@@ -278,13 +689,25 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
     int remainpack;
     int numbytes;
     int numdecrypt;
-    unsigned char block[MAX_BLOCKSIZE];
+    unsigned char block[MAX_BLOCKSIZE + 4];
     int blocksize;
+    int firstblock;
     int encrypted = 1;
+    int etm;
+    int batched = 0;    /* type of the last packet added by this call */
+    size_t contiguous;
 
     /* default clear the bit */
     session->socket_block_directions &= ~LIBSSH2_SESSION_BLOCK_INBOUND;
 
+    /* queued packets go out before anything is read, since what is read may
+       well be waited for as a reply to them */
+    if(!holding_back(session)) {
+        rc = send_queued(session);
+        if(rc && rc != LIBSSH2_ERROR_EAGAIN)
+            return rc;
+    }
+
     /*
      * All channels, systems, subsystems, etc eventually make it down here
      * when looking for more incoming data. If a key exchange is going on
@@ -335,40 +758,70 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
                                    make the checks below work fine still */
         }
 
-        /* read/use a whole big chunk into a temporary area stored in
-           the LIBSSH2_SESSION struct. We will decrypt data from that
-           buffer into the packet buffer so this temp one doesn't have
-           to be able to keep a whole SSH packet, just be large enough
-           so that we can read big chunks from the network layer. */
+        /* with an encrypt-then-MAC MAC nothing is decrypted here, the
+           packet is collected as is and dealt with in fullpacket() */
+        etm = encrypted && session->remote.mac->etm;
+
+        /* A cipher that deals with the packet_length field by itself keeps
+           the rest of the packet block aligned, so a packet starts with
+           those 4 bytes plus a whole block. So does encrypt-then-MAC,
+           which leaves that field unencrypted. */
+        if(encrypted && ((session->remote.crypt->flags &
+                          LIBSSH2_CRYPT_FLAG_PKTLEN_AAD) || etm))
+            firstblock = blocksize + 4;
+        else
+            firstblock = blocksize;
+
+        /* read/use a whole big chunk into a ring buffer stored in the
+           LIBSSH2_SESSION struct. We will decrypt data from that buffer
+           into the packet buffer so the ring doesn't have to be able to
+           keep a whole SSH packet, just be large enough so that we can
+           read big chunks from the network layer. */
 
         /* how much data there is remaining in the buffer to deal with
            before we should read more from the network */
-        remainbuf = p->writeidx - p->readidx;
-
-        /* if remainbuf turns negative we have a bad internal error */
-        assert(remainbuf >= 0);
+        remainbuf = (int)p->buffered;
 
-        if(remainbuf < blocksize) {
+        if(remainbuf < (p->total_num ? blocksize : firstblock)) {
             /* If we have less than a blocksize left, it is too
                little data to deal with, read more */
             ssize_t nread;
-
-            /* move any remainder to the start of the buffer so
-               that we can do a full refill */
-            if(remainbuf) {
-                memmove(p->buf, &p->buf[p->readidx], remainbuf);
-                p->readidx = 0;
-                p->writeidx = remainbuf;
+            size_t writeidx;
+            size_t space;
+
+            /* unless this call has added packets already, which is enough
+               to return to the caller without waiting for the network */
+            if(batched)
+                return batched;
+
+            /* with next to nothing buffered, this is the time to set up
+               the ring or change its size */
+            if(!p->buf || p->buf_size > session->recv_buf_max ||
+               (p->buf_grow && p->buf_size < session->recv_buf_max)) {
+                size_t size = p->buf ? p->buf_size * 2 : PACKETBUFSIZE;
+                if(size > session->recv_buf_max)
+                    size = session->recv_buf_max;
+
+                /* a ring that can't be resized is still good to use */
+                rc = recvbuf_resize(session, size);
+                if(rc && !p->buf)
+                    return rc;
+                p->buf_grow = 0;
             }
-            else {
-                /* nothing to move, just zero the indexes */
-                p->readidx = p->writeidx = 0;
+
+            /* read into the free space that follows the buffered data, up
+               to the end of the ring or up to where the data starts */
+            writeidx = p->readidx + remainbuf;
+            if(writeidx >= p->buf_size) {
+                writeidx -= p->buf_size;
+                space = p->readidx - writeidx;
             }
+            else
+                space = p->buf_size - writeidx;
 
-            /* now read a big chunk from the network into the temp buffer */
+            /* now read a big chunk from the network into the ring */
             nread =
-                LIBSSH2_RECV(session, &p->buf[remainbuf],
-                              PACKETBUFSIZE - remainbuf,
+                LIBSSH2_RECV(session, &p->buf[writeidx], space,
                               LIBSSH2_SOCKET_RECV_FLAGS(session));
             if(nread <= 0) {
                 /* check if this is due to EAGAIN and return the special
@@ -376,24 +829,29 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
                 if((nread < 0) && (nread == -EAGAIN)) {
                     session->socket_block_directions |=
                         LIBSSH2_SESSION_BLOCK_INBOUND;
+                    recvbuf_release(session);
                     return LIBSSH2_ERROR_EAGAIN;
                 }
                 _libssh2_debug(session, LIBSSH2_TRACE_SOCKET,
                                "Error recving %d bytes (got %d)",
-                               PACKETBUFSIZE - remainbuf, -nread);
+                               (int)space, -nread);
                 return LIBSSH2_ERROR_SOCKET_RECV;
             }
             _libssh2_debug(session, LIBSSH2_TRACE_SOCKET,
                            "Recved %d/%d bytes to %p+%d", nread,
-                           PACKETBUFSIZE - remainbuf, p->buf, remainbuf);
+                           (int)space, p->buf, (int)writeidx);
 
             debugdump(session, "libssh2_transport_read() raw",
-                      &p->buf[remainbuf], nread);
-            /* advance write pointer */
-            p->writeidx += nread;
+                      &p->buf[writeidx], nread);
+            p->buffered += nread;
+
+            /* the network had at least as much as a good part of the ring
+               could take, so it can do with a larger one */
+            if((size_t)nread == space && space > p->buf_size / 2)
+                p->buf_grow = 1;
 
             /* update remainbuf counter */
-            remainbuf = p->writeidx - p->readidx;
+            remainbuf = (int)p->buffered;
         }
 
         /* how much data to deal with from the buffer */
@@ -406,7 +864,7 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
                size of this payload, we need to decrypt the first
                blocksize data. */
 
-            if(numbytes < blocksize) {
+            if(numbytes < firstblock) {
                 /* we can't act on anything less than blocksize, but this
                    check is only done for the initial block since once we have
                    got the start of a block we can in fact deal with fractions
@@ -416,7 +874,35 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
                 return LIBSSH2_ERROR_EAGAIN;
             }
 
-            if(encrypted) {
+            /* the first block may wrap around the end of the ring */
+            recvbuf_unwrap(p, firstblock);
+
+            if(encrypted && (session->remote.crypt->flags &
+                             LIBSSH2_CRYPT_FLAG_INTEGRATED_MAC)) {
+                const LIBSSH2_CRYPT_METHOD *crypt = session->remote.crypt;
+
+                /* start the packet with the packet_length field, which the
+                   cipher deals with separately, then go on with the rest
+                   of the block */
+                rc = crypt->aead_begin(session, session->remote.seqno,
+                                       &p->buf[p->readidx], block,
+                                       &session->remote.crypt_abstract);
+                if(!rc)
+                    rc = crypt->crypt_bulk(session, &p->buf[p->readidx + 4],
+                                           &block[4], firstblock - 4,
+                                           &session->remote.crypt_abstract);
+                if(rc)
+                    return LIBSSH2_ERROR_DECRYPT;
+
+                memcpy(p->init, block, 5);
+            }
+            else if(etm) {
+                /* only the packet_length field is readable for now, keep
+                   the rest of the block for checking the MAC */
+                memcpy(p->init, &p->buf[p->readidx], firstblock);
+                memcpy(block, p->init, 4);
+            }
+            else if(encrypted) {
                 rc = decrypt(session, &p->buf[p->readidx], block, blocksize);
                 if(rc != LIBSSH2_ERROR_NONE) {
                     return rc;
@@ -432,7 +918,7 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
             }
 
             /* advance the read pointer */
-            p->readidx += blocksize;
+            recvbuf_consume(p, firstblock);
 
             /* we now have the initial blocksize bytes decrypted,
              * and we can extract packet and padding length from it
@@ -445,9 +931,22 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
                 return LIBSSH2_ERROR_OUT_OF_BOUNDARY;
             }
 
-            p->padding_length = block[4];
-            if(p->padding_length > p->packet_length - 1) {
+            /* when the packet_length field is outside of the encrypted
+               part, nothing has made sure yet that the rest of the packet
+               is whole blocks */
+            if(firstblock > blocksize && (p->packet_length % blocksize))
                 return LIBSSH2_ERROR_DECRYPT;
+
+            if(etm) {
+                /* padding_length is still encrypted, fullpacket() checks
+                   it */
+                p->padding_length = 0;
+            }
+            else {
+                p->padding_length = block[4];
+                if(p->padding_length > p->packet_length - 1) {
+                    return LIBSSH2_ERROR_DECRYPT;
+                }
             }
 
 
@@ -471,7 +970,8 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
 
             /* Get a packet handle put data into. We get one to
                hold all data, including padding and MAC. */
-            p->payload = LIBSSH2_ALLOC(session, total_num);
+            p->payload = _libssh2_packet_buf_alloc(session, total_num,
+                                                   &p->payload_class);
             if(!p->payload) {
                 return LIBSSH2_ERROR_ALLOC;
             }
@@ -479,17 +979,21 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
             /* init write pointer to start of payload buffer */
             p->wptr = p->payload;
 
-            if(blocksize > 5) {
+            if(firstblock > 5) {
                 /* copy the data from index 5 to the end of
                    the blocksize from the temporary buffer to
                    the start of the decrypted buffer */
-                if(blocksize - 5 <= (int) total_num) {
-                    memcpy(p->wptr, &block[5], blocksize - 5);
-                    p->wptr += blocksize - 5;       /* advance write pointer */
+                if(firstblock - 5 <= (int) total_num) {
+                    /* with encrypt-then-MAC this is filled in once the
+                       first block has been decrypted */
+                    if(!etm)
+                        memcpy(p->wptr, &block[5], firstblock - 5);
+                    p->wptr += firstblock - 5;      /* advance write pointer */
                 }
                 else {
                     if(p->payload)
-                        LIBSSH2_FREE(session, p->payload);
+                        _libssh2_packet_buf_free(session, p->payload,
+                                                 p->payload_class);
                     return LIBSSH2_ERROR_OUT_OF_BOUNDARY;
                 }
             }
@@ -499,7 +1003,18 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
             p->data_num = p->wptr - p->payload;
 
             /* we already dealt with a blocksize worth of data */
-            numbytes -= blocksize;
+            numbytes -= firstblock;
+        }
+
+        /* this round stops at the end of the ring, unless not even a
+           block is left before it: that block is made contiguous */
+        contiguous = recvbuf_contiguous(p);
+        if((int)contiguous < numbytes) {
+            if((int)contiguous < blocksize) {
+                contiguous = numbytes < blocksize ? numbytes : blocksize;
+                recvbuf_unwrap(p, contiguous);
+            }
+            numbytes = (int)contiguous;
         }
 
         /* how much there is left to add to the current payload
@@ -512,7 +1027,7 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
             numbytes = remainpack;
         }
 
-        if(encrypted) {
+        if(encrypted && !etm) {
             /* At the end of the incoming stream, there is a MAC,
                and we don't want to decrypt that since we need it
                "raw". We MUST however decrypt the padding data
@@ -540,7 +1055,8 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
             }
         }
         else {
-            /* unencrypted data should not be decrypted at all */
+            /* unencrypted data should not be decrypted at all, nor should
+               encrypt-then-MAC data before its MAC has been checked */
             numdecrypt = 0;
         }
 
@@ -554,7 +1070,7 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
             }
 
             /* advance the read pointer */
-            p->readidx += numdecrypt;
+            recvbuf_consume(p, numdecrypt);
             /* advance write pointer */
             p->wptr += numdecrypt;
             /* increase data_num */
@@ -573,12 +1089,13 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
             }
             else {
                 if(p->payload)
-                    LIBSSH2_FREE(session, p->payload);
+                    _libssh2_packet_buf_free(session, p->payload,
+                                             p->payload_class);
                 return LIBSSH2_ERROR_OUT_OF_BOUNDARY;
             }
 
             /* advance the read pointer */
-            p->readidx += numbytes;
+            recvbuf_consume(p, numbytes);
             /* advance write pointer */
             p->wptr += numbytes;
             /* increase data_num */
@@ -614,6 +1131,12 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
 
             p->total_num = 0;   /* no packet buffer available */
 
+            /* go on with the next packet if it has arrived already */
+            if(batchable(session, rc) && p->buffered) {
+                batched = rc;
+                continue;
+            }
+
             return rc;
         }
     } while(1);                /* loop */
@@ -621,147 +1144,38 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
     return LIBSSH2_ERROR_SOCKET_RECV; /* we never reach this point */
 }
 
+/*
+ * queue_packet() encrypts a packet with the payload from 'data' and the
+ * iovecs onto the end of the outgoing queue, which has room for it.
+ */
 static int
-send_existing(LIBSSH2_SESSION *session, const unsigned char *data,
-              size_t data_len, ssize_t *ret)
+queue_packet(LIBSSH2_SESSION *session,
+             const unsigned char *data, size_t data_len,
+             const LIBSSH2_IOVEC *iov, int iovcnt)
 {
-    ssize_t rc;
-    ssize_t length;
+    int blocksize =
+        (session->state & LIBSSH2_STATE_NEWKEYS) ?
+        session->local.crypt->blocksize : 8;
+    int padding_length;
+    size_t packet_length;
+    size_t aad_len;
+    int total_length;
+#ifdef RANDOM_PADDING
+    int rand_max;
+    int seed = data[0];         /* FIXME: make this random */
+#endif
     struct transportpacket *p = &session->packet;
+    int encrypted;
+    int compressed;
+    int rc;
+    unsigned char *buf = &p->outbuf[p->oqueued];
+    size_t iov_len = 0;
+    int i;
 
-    if(!p->olen) {
-        *ret = 0;
-        return LIBSSH2_ERROR_NONE;
-    }
-
-    /* send as much as possible of the existing packet */
-    if((data != p->odata) || (data_len != p->olen)) {
-        /* When we are about to complete the sending of a packet, it is vital
-           that the caller doesn't try to send a new/different packet since
-           we don't add this one up until the previous one has been sent. To
-           make the caller really notice his/hers flaw, we return error for
-           this case */
-        return LIBSSH2_ERROR_BAD_USE;
-    }
-
-    *ret = 1;                   /* set to make our parent return */
+    for(i = 0; i < iovcnt; i++)
+        iov_len += iov[i].iov_len;
 
-    /* number of bytes left to send */
-    length = p->ototal_num - p->osent;
-
-    rc = LIBSSH2_SEND(session, &p->outbuf[p->osent], length,
-                       LIBSSH2_SOCKET_SEND_FLAGS(session));
-    if(rc < 0)
-        _libssh2_debug(session, LIBSSH2_TRACE_SOCKET,
-                       "Error sending %d bytes: %d", length, -rc);
-    else {
-        _libssh2_debug(session, LIBSSH2_TRACE_SOCKET,
-                       "Sent %d/%d bytes at %p+%d", rc, length, p->outbuf,
-                       p->osent);
-        debugdump(session, "libssh2_transport_write send()",
-                  &p->outbuf[p->osent], rc);
-    }
-
-    if(rc == length) {
-        /* the remainder of the package was sent */
-        p->ototal_num = 0;
-        p->olen = 0;
-        /* we leave *ret set so that the parent returns as we MUST return back
-           a send success now, so that we don't risk sending EAGAIN later
-           which then would confuse the parent function */
-        return LIBSSH2_ERROR_NONE;
-
-    }
-    else if(rc < 0) {
-        /* nothing was sent */
-        if(rc != -EAGAIN)
-            /* send failure! */
-            return LIBSSH2_ERROR_SOCKET_SEND;
-
-        session->socket_block_directions |= LIBSSH2_SESSION_BLOCK_OUTBOUND;
-        return LIBSSH2_ERROR_EAGAIN;
-    }
-
-    p->osent += rc;         /* we sent away this much data */
-
-    return rc < length ? LIBSSH2_ERROR_EAGAIN : LIBSSH2_ERROR_NONE;
-}
-
-/*
- * libssh2_transport_send
- *
- * Send a packet, encrypting it and adding a MAC code if necessary
- * Returns 0 on success, non-zero on failure.
- *
- * The data is provided as _two_ data areas that are combined by this
- * function.  The 'data' part is sent immediately before 'data2'. 'data2' may
- * be set to NULL to only use a single part.
- *
- * Returns LIBSSH2_ERROR_EAGAIN if it would block or if the whole packet was
- * not sent yet. If it does so, the caller should call this function again as
- * soon as it is likely that more data can be sent, and this function MUST
- * then be called with the same argument set (same data pointer and same
- * data_len) until ERROR_NONE or failure is returned.
- *
- * This function DOES NOT call _libssh2_error() on any errors.
- */
-int _libssh2_transport_send(LIBSSH2_SESSION *session,
-                            const unsigned char *data, size_t data_len,
-                            const unsigned char *data2, size_t data2_len)
-{
-    int blocksize =
-        (session->state & LIBSSH2_STATE_NEWKEYS) ?
-        session->local.crypt->blocksize : 8;
-    int padding_length;
-    size_t packet_length;
-    int total_length;
-#ifdef RANDOM_PADDING
-    int rand_max;
-    int seed = data[0];         /* FIXME: make this random */
-#endif
-    struct transportpacket *p = &session->packet;
-    int encrypted;
-    int compressed;
-    ssize_t ret;
-    int rc;
-    const unsigned char *orgdata = data;
-    size_t orgdata_len = data_len;
-
-    /*
-     * If the last read operation was interrupted in the middle of a key
-     * exchange, we must complete that key exchange before continuing to write
-     * further data.
-     *
-     * See the similar block in _libssh2_transport_read for more details.
-     */
-    if(session->state & LIBSSH2_STATE_EXCHANGING_KEYS &&
-        !(session->state & LIBSSH2_STATE_KEX_ACTIVE)) {
-        /* Don't write any new packets if we're still in the middle of a key
-         * exchange. */
-        _libssh2_debug(session, LIBSSH2_TRACE_TRANS, "Redirecting into the"
-                       " key re-exchange from _libssh2_transport_send");
-        rc = _libssh2_kex_exchange(session, 1, &session->startup_key_state);
-        if(rc)
-            return rc;
-    }
-
-    debugdump(session, "libssh2_transport_write plain", data, data_len);
-    if(data2)
-        debugdump(session, "libssh2_transport_write plain2", data2, data2_len);
-
-    /* FIRST, check if we have a pending write to complete. send_existing
-       only sanity-check data and data_len and not data2 and data2_len!! */
-    rc = send_existing(session, data, data_len, &ret);
-    if(rc)
-        return rc;
-
-    session->socket_block_directions &= ~LIBSSH2_SESSION_BLOCK_OUTBOUND;
-
-    if(ret)
-        /* set by send_existing if data was sent */
-        return rc;
-
-    encrypted = (session->state & LIBSSH2_STATE_NEWKEYS) ? 1 : 0;
+    encrypted = (session->state & LIBSSH2_STATE_NEWKEYS) ? 1 : 0;
 
     compressed =
         session->local.comp != NULL &&
@@ -778,41 +1192,47 @@ int _libssh2_transport_send(LIBSSH2_SESSION *session,
 
         /* compress directly to the target buffer */
         rc = session->local.comp->comp(session,
-                                       &p->outbuf[5], &dest_len,
+                                       &buf[5], &dest_len,
                                        data, data_len,
                                        &session->local.comp_abstract);
         if(rc)
             return rc;     /* compression failure */
 
-        if(data2 && data2_len) {
-            /* compress directly to the target buffer right after where the
-               previous call put data */
-            dest2_len -= dest_len;
+        /* and each of the iovecs right after where the previous call put
+           its data */
+        dest2_len -= dest_len;
+        for(i = 0; i < iovcnt; i++) {
+            size_t part_len = dest2_len;
 
+            if(!iov[i].iov_len)
+                continue;
             rc = session->local.comp->comp(session,
-                                           &p->outbuf[5 + dest_len],
-                                           &dest2_len,
-                                           data2, data2_len,
+                                           &buf[5 + dest_len],
+                                           &part_len,
+                                           iov[i].iov_base, iov[i].iov_len,
                                            &session->local.comp_abstract);
+            if(rc)
+                return rc;     /* compression failure */
+            dest_len += part_len;
+            dest2_len -= part_len;
         }
-        else
-            dest2_len = 0;
-        if(rc)
-            return rc;     /* compression failure */
 
-        data_len = dest_len + dest2_len; /* use the combined length */
+        data_len = dest_len; /* use the combined length */
     }
     else {
-        if((data_len + data2_len) >= (MAX_SSH_PACKET_LEN-0x100))
+        if((data_len + iov_len) >= (MAX_SSH_PACKET_LEN-0x100))
             /* too large packet, return error for this until we make this
                function split it up and send multiple SSH packets */
             return LIBSSH2_ERROR_INVAL;
 
-        /* copy the payload data */
-        memcpy(&p->outbuf[5], data, data_len);
-        if(data2 && data2_len)
-            memcpy(&p->outbuf[5 + data_len], data2, data2_len);
-        data_len += data2_len; /* use the combined length */
+        /* copy the payload data, gathering it from the iovecs straight
+           into the packet */
+        memcpy(&buf[5], data, data_len);
+        for(i = 0; i < iovcnt; i++) {
+            if(iov[i].iov_len)
+                memcpy(&buf[5 + data_len], iov[i].iov_base, iov[i].iov_len);
+            data_len += iov[i].iov_len; /* use the combined length */
+        }
     }
 
 
@@ -828,9 +1248,16 @@ int _libssh2_transport_send(LIBSSH2_SESSION *session,
 
     /* at this point we have it all except the padding */
 
+    /* a cipher that deals with the packet_length field on its own wants
+       only the part after it to be a multiple of the block size, and so
+       does encrypt-then-MAC which sends that field in the clear */
+    aad_len = (encrypted && ((session->local.crypt->flags &
+                              LIBSSH2_CRYPT_FLAG_PKTLEN_AAD) ||
+                             session->local.mac->etm)) ? 4 : 0;
+
     /* first figure out our minimum padding amount to make it an even
        block size */
-    padding_length = blocksize - (packet_length % blocksize);
+    padding_length = blocksize - ((packet_length - aad_len) % blocksize);
 
     /* if the padding becomes too small we add another blocksize worth
        of it (taken from the original libssh2 where it didn't have any
@@ -857,68 +1284,579 @@ int _libssh2_transport_send(LIBSSH2_SESSION *session,
 
     /* store packet_length, which is the size of the whole packet except
        the MAC and the packet_length field itself */
-    _libssh2_htonu32(p->outbuf, packet_length - 4);
+    _libssh2_htonu32(buf, packet_length - 4);
     /* store padding_length */
-    p->outbuf[4] = (unsigned char)padding_length;
+    buf[4] = (unsigned char)padding_length;
 
     /* fill the padding area with random junk */
-    if(_libssh2_random(p->outbuf + 5 + data_len, padding_length)) {
+    if(_libssh2_random(buf + 5 + data_len, padding_length)) {
         return _libssh2_error(session, LIBSSH2_ERROR_RANDGEN,
                               "Unable to get random bytes for packet padding");
     }
 
-    if(encrypted) {
+    if(encrypted && (session->local.crypt->flags &
+                     LIBSSH2_CRYPT_FLAG_INTEGRATED_MAC)) {
+        const LIBSSH2_CRYPT_METHOD *crypt = session->local.crypt;
+
+        /* Encrypt and authenticate the packet in place in one pass. The tag
+           goes at index packet_length, where the MAC would otherwise be. */
+        rc = crypt->aead_begin(session, session->local.seqno, buf,
+                               buf, &session->local.crypt_abstract);
+        if(!rc)
+            rc = crypt->crypt_bulk(session, buf + 4, buf + 4,
+                                   packet_length - 4,
+                                   &session->local.crypt_abstract);
+        if(!rc)
+            rc = crypt->aead_end(session, buf + packet_length,
+                                 &session->local.crypt_abstract);
+        if(rc)
+            return LIBSSH2_ERROR_ENCRYPT;     /* encryption failure */
+    }
+    else if(encrypted) {
+        int etm = session->local.mac->etm;
         size_t i;
 
         /* Calculate MAC hash. Put the output at index packet_length,
            since that size includes the whole packet. The MAC is
            calculated on the entire unencrypted packet, including all
-           fields except the MAC field itself. */
-        session->local.mac->hash(session, p->outbuf + packet_length,
-                                 session->local.seqno, p->outbuf,
-                                 packet_length, NULL, 0,
-                                 &session->local.mac_abstract);
-
-        /* Encrypt the whole packet data, one block size at a time.
+           fields except the MAC field itself. With encrypt-then-MAC it is
+           done after the encryption instead. */
+        if(!etm)
+            session->local.mac->hash(session, buf + packet_length,
+                                     session->local.seqno, buf,
+                                     packet_length, NULL, 0,
+                                     &session->local.mac_abstract);
+
+        /* Encrypt the whole packet data in place, except for the
+           packet_length field with encrypt-then-MAC (aad_len is 4 then).
            The MAC field is not encrypted. */
-        for(i = 0; i < packet_length; i += session->local.crypt->blocksize) {
-            unsigned char *ptr = &p->outbuf[i];
-            if(session->local.crypt->crypt(session, ptr,
-                                            session->local.crypt->blocksize,
-                                            &session->local.crypt_abstract))
+        if(session->local.crypt->crypt_bulk) {
+            rc = session->local.crypt->crypt_bulk(session,
+                                            buf + aad_len,
+                                            buf + aad_len,
+                                            packet_length - aad_len,
+                                            &session->local.crypt_abstract);
+            if(rc)
                 return LIBSSH2_ERROR_ENCRYPT;     /* encryption failure */
         }
+        else {
+            /* one block size at a time */
+            for(i = aad_len; i < packet_length;
+                i += session->local.crypt->blocksize) {
+                unsigned char *ptr = &buf[i];
+                if(session->local.crypt->crypt(session, ptr,
+                                               session->local.crypt->blocksize,
+                                               &session->local.crypt_abstract))
+                    return LIBSSH2_ERROR_ENCRYPT; /* encryption failure */
+            }
+        }
+
+        if(etm)
+            session->local.mac->hash(session, buf + packet_length,
+                                     session->local.seqno, buf,
+                                     packet_length, NULL, 0,
+                                     &session->local.mac_abstract);
     }
 
     session->local.seqno++;
+    p->oqueued += total_length;
 
-    ret = LIBSSH2_SEND(session, p->outbuf, total_length,
-                        LIBSSH2_SOCKET_SEND_FLAGS(session));
-    if(ret < 0)
-        _libssh2_debug(session, LIBSSH2_TRACE_SOCKET,
-                       "Error sending %d bytes: %d", total_length, -ret);
-    else {
-        _libssh2_debug(session, LIBSSH2_TRACE_SOCKET, "Sent %d/%d bytes at %p",
-                       ret, total_length, p->outbuf);
-        debugdump(session, "libssh2_transport_write send()", p->outbuf, ret);
-    }
-
-    if(ret != total_length) {
-        if(ret >= 0 || ret == -EAGAIN) {
-            /* the whole packet could not be sent, save the rest */
-            session->socket_block_directions |= LIBSSH2_SESSION_BLOCK_OUTBOUND;
-            p->odata = orgdata;
-            p->olen = orgdata_len;
-            p->osent = ret <= 0 ? 0 : ret;
-            p->ototal_num = total_length;
-            return LIBSSH2_ERROR_EAGAIN;
+    return LIBSSH2_ERROR_NONE;
+}
+
+/*
+ * Channel data is sent in the order it is written as long as the outgoing
+ * queue keeps up. Once libssh2_channel_set_priority() has been used on the
+ * session and the queue holds SCHED_LOWAT unsent bytes, the data packets
+ * wait unencrypted in their channel's write queue instead, and
+ * sched_dispatch() encrypts them onto the outgoing queue as it empties.
+ * Channels of a higher priority go first, those of the same priority share
+ * by deficit round robin: each in turn sends packets while they fit in its
+ * deficit, which grows by its weight times SCHED_QUANTUM when they don't.
+ * What is in the outgoing queue or the socket buffer already is not passed,
+ * so an interactive channel waits for at most that much bulk data.
+ */
+static int
+sched_busy(LIBSSH2_SESSION *session)
+{
+    struct transportpacket *p = &session->packet;
+
+    return session->sched &&
+        (session->sched_queued || p->oqueued - p->osent >= SCHED_LOWAT ||
+         (session->state & LIBSSH2_STATE_EXCHANGING_KEYS));
+}
+
+/* the list a channel waits in, by priority */
+static struct list_head *
+sched_list(LIBSSH2_SESSION *session, LIBSSH2_CHANNEL *channel)
+{
+    return &session->channels_sched[channel->weight ? channel->priority :
+                                    LIBSSH2_CHANNEL_PRIORITY_NORMAL];
+}
+
+/*
+ * sched_queue() puts a data packet at the end of a channel's write queue.
+ */
+static int
+sched_queue(LIBSSH2_SESSION *session, LIBSSH2_CHANNEL *channel,
+            const unsigned char *header, size_t header_len,
+            const LIBSSH2_IOVEC *iov, int iovcnt, size_t data_len)
+{
+    size_t len = header_len + data_len;
+    LIBSSH2_PACKET *packet;
+    unsigned char *buf;
+    int pool_class;
+    int i;
+
+    buf = _libssh2_packet_buf_alloc(session, len, &pool_class);
+    if(!buf)
+        return LIBSSH2_ERROR_ALLOC;
+    packet = _libssh2_packet_node(session, buf, pool_class);
+    if(!packet) {
+        _libssh2_packet_buf_free(session, buf, pool_class);
+        return LIBSSH2_ERROR_ALLOC;
+    }
+
+    memcpy(buf, header, header_len);
+    len = header_len;
+    for(i = 0; i < iovcnt; i++) {
+        if(iov[i].iov_len)
+            memcpy(&buf[len], iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+    packet->data = buf;
+    packet->data_len = len;
+    packet->data_head = 0;
+
+    _libssh2_list_add(&channel->write_queue, &packet->node);
+    channel->write_queued += len;
+    session->sched_queued += len;
+
+    if(!channel->sched.listed) {
+        channel->sched.channel = channel;
+        channel->sched.listed = 1;
+        channel->deficit = 0;
+        _libssh2_list_add(sched_list(session, channel), &channel->sched.node);
+    }
+    return LIBSSH2_ERROR_NONE;
+}
+
+/*
+ * sched_send() moves the first packet of a channel's write queue onto the
+ * outgoing queue, which has room for it.
+ */
+static int
+sched_send(LIBSSH2_SESSION *session, LIBSSH2_CHANNEL *channel)
+{
+    LIBSSH2_PACKET *packet = _libssh2_list_first(&channel->write_queue);
+    int rc;
+
+    _libssh2_list_remove(&packet->node);
+    channel->write_queued -= packet->data_len;
+    session->sched_queued -= packet->data_len;
+    channel->deficit = packet->data_len < channel->deficit ?
+        channel->deficit - packet->data_len : 0;
+    if(!channel->write_queued) {
+        _libssh2_list_remove(&channel->sched.node);
+        channel->sched.listed = 0;
+    }
+
+    rc = queue_packet(session, packet->data, packet->data_len, NULL, 0);
+    _libssh2_packet_free(session, packet);
+    return rc;
+}
+
+/*
+ * sched_next() picks the channel to send the next packet of.
+ */
+static LIBSSH2_CHANNEL *
+sched_next(LIBSSH2_SESSION *session)
+{
+    int priority;
+
+    for(priority = LIBSSH2_CHANNEL_PRIORITY_INTERACTIVE; priority >= 0;
+        priority--) {
+        struct list_head *list = &session->channels_sched[priority];
+        struct channel_ready *entry;
+
+        while((entry = _libssh2_list_first(list))) {
+            LIBSSH2_CHANNEL *channel = entry->channel;
+            LIBSSH2_PACKET *packet =
+                _libssh2_list_first(&channel->write_queue);
+
+            if(packet->data_len <= channel->deficit)
+                return channel;
+
+            /* its turn is over, the next one comes at the back of the
+               list with a new quantum */
+            channel->deficit += (size_t)SCHED_QUANTUM *
+                (channel->weight ? channel->weight : 1);
+            _libssh2_list_remove(&entry->node);
+            _libssh2_list_add(list, &entry->node);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * sched_dispatch() moves packets from the channels' write queues onto the
+ * outgoing queue until it holds SCHED_LOWAT unsent bytes. Nothing moves
+ * during a key exchange.
+ */
+static int
+sched_dispatch(LIBSSH2_SESSION *session)
+{
+    struct transportpacket *p = &session->packet;
+    int rc;
+
+    while(session->sched_queued &&
+          !(session->state & LIBSSH2_STATE_EXCHANGING_KEYS) &&
+          p->oqueued - p->osent < SCHED_LOWAT) {
+        rc = outbuf_room(session);
+        if(rc == LIBSSH2_ERROR_EAGAIN)
+            break;
+        else if(rc)
+            return rc;
+
+        rc = sched_send(session, sched_next(session));
+        if(rc)
+            return rc;
+    }
+    return LIBSSH2_ERROR_NONE;
+}
+
+/*
+ * sched_flush() moves the packets waiting in the write queue of the channel
+ * that a message other than a window adjust is for onto the outgoing queue,
+ * ahead of the message.
+ */
+static int
+sched_flush(LIBSSH2_SESSION *session, const unsigned char *data,
+            size_t data_len)
+{
+    LIBSSH2_CHANNEL *channel = NULL;
+    uint32_t id;
+    int priority;
+    int rc;
+
+    if(data_len < 5 || data[0] < SSH_MSG_CHANNEL_DATA ||
+       data[0] > SSH_MSG_CHANNEL_FAILURE)
+        return LIBSSH2_ERROR_NONE;
+
+    id = _libssh2_ntohu32(&data[1]);
+    for(priority = 0; !channel &&
+            priority <= LIBSSH2_CHANNEL_PRIORITY_INTERACTIVE; priority++) {
+        struct channel_ready *entry =
+            _libssh2_list_first(&session->channels_sched[priority]);
+
+        while(entry && entry->channel->remote.id != id)
+            entry = _libssh2_list_next(&entry->node);
+        if(entry)
+            channel = entry->channel;
+    }
+
+    while(channel && channel->write_queued) {
+        /* making room may send some of them already */
+        rc = outbuf_reserve(session);
+        if(rc)
+            return rc;
+        if(!channel->write_queued)
+            break;
+
+        rc = sched_send(session, channel);
+        if(rc)
+            return rc;
+    }
+    return LIBSSH2_ERROR_NONE;
+}
+
+/*
+ * _libssh2_transport_drop_writes
+ *
+ * Throw away what waits in the write queue of a channel that is freed.
+ */
+void _libssh2_transport_drop_writes(LIBSSH2_CHANNEL *channel)
+{
+    LIBSSH2_SESSION *session = channel->session;
+    LIBSSH2_PACKET *packet;
+
+    while((packet = _libssh2_list_first(&channel->write_queue))) {
+        _libssh2_list_remove(&packet->node);
+        session->sched_queued -= packet->data_len;
+        _libssh2_packet_free(session, packet);
+    }
+    channel->write_queued = 0;
+
+    if(channel->sched.listed) {
+        _libssh2_list_remove(&channel->sched.node);
+        channel->sched.listed = 0;
+    }
+}
+
+/*
+ * libssh2_transport_send
+ *
+ * Send a packet, encrypting it and adding a MAC code if necessary
+ * Returns 0 on success, non-zero on failure.
+ *
+ * The packet is encrypted into the outgoing queue, which is sent off with
+ * it unless _libssh2_transport_cork() holds it back.
+ *
+ * The data is provided as _two_ data areas that are combined by this
+ * function.  The 'data' part is sent immediately before 'data2'. 'data2' may
+ * be set to NULL to only use a single part.
+ *
+ * Returns LIBSSH2_ERROR_EAGAIN if it would block or if the whole packet was
+ * not sent yet. If it does so, the caller should call this function again as
+ * soon as it is likely that more data can be sent, and this function MUST
+ * then be called with the same argument set (same data pointer and same
+ * data_len) until ERROR_NONE or failure is returned.
+ *
+ * This function DOES NOT call _libssh2_error() on any errors.
+ */
+int _libssh2_transport_sendv(LIBSSH2_SESSION *session,
+                             const unsigned char *data, size_t data_len,
+                             const LIBSSH2_IOVEC *iov, int iovcnt)
+{
+    struct transportpacket *p = &session->packet;
+    ssize_t ret;
+    int rc;
+    int i;
+
+    /*
+     * If the last read operation was interrupted in the middle of a key
+     * exchange, we must complete that key exchange before continuing to write
+     * further data.
+     *
+     * See the similar block in _libssh2_transport_read for more details.
+     */
+    if(session->state & LIBSSH2_STATE_EXCHANGING_KEYS &&
+        !(session->state & LIBSSH2_STATE_KEX_ACTIVE)) {
+        /* Don't write any new packets if we're still in the middle of a key
+         * exchange. */
+        _libssh2_debug(session, LIBSSH2_TRACE_TRANS, "Redirecting into the"
+                       " key re-exchange from _libssh2_transport_send");
+        rc = _libssh2_kex_exchange(session, 1, &session->startup_key_state);
+        if(rc)
+            return rc;
+    }
+
+    debugdump(session, "libssh2_transport_write plain", data, data_len);
+    for(i = 0; i < iovcnt; i++)
+        debugdump(session, "libssh2_transport_write plain2",
+                  iov[i].iov_base, iov[i].iov_len);
+
+    /* FIRST, check if we have a pending write to complete. send_existing
+       only sanity-check data and data_len and not the iovecs!! */
+    rc = send_existing(session, data, data_len, &ret);
+    if(rc)
+        return rc;
+
+    session->socket_block_directions &= ~LIBSSH2_SESSION_BLOCK_OUTBOUND;
+
+    if(ret)
+        /* set by send_existing if data was sent */
+        return rc;
+
+    if(session->sched_queued) {
+        /* what a channel sends besides data must not pass the data it has
+           waiting in its write queue */
+        rc = sched_flush(session, data, data_len);
+        if(rc)
+            return rc;
+    }
+
+    /* the packet is put together right at the end of the queue */
+    rc = outbuf_reserve(session);
+    if(rc)
+        return rc;
+
+    rc = queue_packet(session, data, data_len, iov, iovcnt);
+    if(rc)
+        return rc;
+    p->oend = p->oqueued;
+
+    if(holding_back(session))
+        /* queued, to be sent along with what follows */
+        return LIBSSH2_ERROR_NONE;
+
+    rc = send_queued(session);
+    if(rc == LIBSSH2_ERROR_EAGAIN) {
+        if(p->osent >= p->oend)
+            /* it went out, channel data queued after it did not */
+            return LIBSSH2_ERROR_NONE;
+
+        /* the whole packet could not be sent, the caller has to come back
+           with it to finish it */
+        p->odata = data;
+        p->olen = data_len;
+    }
+
+    return rc;
+}
+
+int _libssh2_transport_send(LIBSSH2_SESSION *session,
+                            const unsigned char *data, size_t data_len,
+                            const unsigned char *data2, size_t data2_len)
+{
+    LIBSSH2_IOVEC iov;
+
+    iov.iov_base = (void *)data2;
+    iov.iov_len = data2_len;
+    return _libssh2_transport_sendv(session, data, data_len, &iov,
+                                    (data2 && data2_len) ? 1 : 0);
+}
+
+/*
+ * _libssh2_transport_queue
+ *
+ * Put a packet in the outgoing queue, from where it is sent off along with
+ * what follows it. Unlike _libssh2_transport_send() the caller never has to
+ * come back with it: LIBSSH2_ERROR_EAGAIN means it was not queued at all,
+ * because the queue is full or another packet has to be finished first.
+ */
+int _libssh2_transport_queue(LIBSSH2_SESSION *session,
+                             const unsigned char *data, size_t data_len)
+{
+    struct transportpacket *p = &session->packet;
+    int rc;
+
+    if(p->olen)
+        return LIBSSH2_ERROR_EAGAIN;
+
+    rc = _libssh2_transport_send(session, data, data_len, NULL, 0);
+    if(rc == LIBSSH2_ERROR_EAGAIN && p->olen && p->odata == data) {
+        /* queued but not sent, the rest of the queue takes it along */
+        p->odata = NULL;
+        p->olen = 0;
+        rc = LIBSSH2_ERROR_NONE;
+    }
+    return rc;
+}
+
+/*
+ * _libssh2_transport_send_splitv
+ *
+ * Send 'data_len' bytes gathered from the 'iovcnt' iovecs in 'iov' as the
+ * payload of as many packets as it takes to keep each one within 'chunk'
+ * bytes of it. Every packet starts with 'header', which ends with the 32
+ * bit length of the data that follows. It is set for each packet. The data
+ * is copied from the iovecs straight into the packets, or into the write
+ * queue of 'channel' while the outgoing queue is busy, see sched_busy().
+ *
+ * The packets are queued together and sent off in as few sends as
+ * possible. Returns the number of bytes now queued, which may be less than
+ * 'data_len' if the queue could not be sent off to make room, or a negative
+ * error code if none of it was.
+ */
+ssize_t _libssh2_transport_send_splitv(LIBSSH2_SESSION *session,
+                                       LIBSSH2_CHANNEL *channel,
+                                       unsigned char *header,
+                                       size_t header_len,
+                                       const LIBSSH2_IOVEC *iov, int iovcnt,
+                                       size_t data_len, size_t chunk)
+{
+    struct transportpacket *p = &session->packet;
+    int corked = p->ocorked;
+    size_t done = 0;
+    size_t offset = 0; /* into iov[0] */
+    int rc = LIBSSH2_ERROR_NONE;
+
+    assert(header_len >= 4 && chunk > 0);
+
+    p->ocorked = 1;
+
+    while(done < data_len) {
+        /* the pieces of the iovecs that go into this packet */
+        LIBSSH2_IOVEC parts[SPLIT_PARTS];
+        int nparts = 0;
+        size_t len = 0;
+
+        if(channel && channel->write_queued >= SCHED_QUEUE_MAX) {
+            /* its write queue is full, make room by sending */
+            rc = send_queued(session);
+            if(rc && rc != LIBSSH2_ERROR_EAGAIN)
+                break;
+            rc = LIBSSH2_ERROR_EAGAIN;
+            if(channel->write_queued >= SCHED_QUEUE_MAX)
+                break;
+        }
+
+        while(nparts < SPLIT_PARTS && len < chunk &&
+              done + len < data_len && iovcnt > 0) {
+            size_t part = iov->iov_len - offset;
+            if(part > chunk - len)
+                part = chunk - len;
+            if(part > data_len - done - len)
+                part = data_len - done - len;
+
+            if(part) {
+                parts[nparts].iov_base = (char *)iov->iov_base + offset;
+                parts[nparts].iov_len = part;
+                nparts++;
+                len += part;
+                offset += part;
+            }
+            if(offset == iov->iov_len) {
+                iov++;
+                iovcnt--;
+                offset = 0;
+            }
+        }
+        if(!len)
+            break; /* the iovecs hold less than data_len */
+
+        _libssh2_htonu32(&header[header_len - 4], (uint32_t)len);
+        if(channel && sched_busy(session)) {
+            rc = sched_queue(session, channel, header, header_len,
+                             parts, nparts, len);
+            if(rc)
+                break;
+            done += len;
+            continue;
+        }
+
+        rc = _libssh2_transport_sendv(session, header, header_len,
+                                      parts, nparts);
+        if(rc == LIBSSH2_ERROR_EAGAIN && p->olen && p->odata == header) {
+            /* queued but not sent, which a key exchange insists on: it
+               goes out along with the rest of the queue later */
+            p->odata = NULL;
+            p->olen = 0;
+            done += len;
+            break;
         }
-        return LIBSSH2_ERROR_SOCKET_SEND;
+        if(rc)
+            break;
+
+        done += len;
     }
 
-    /* the whole thing got sent away */
-    p->odata = NULL;
-    p->olen = 0;
+    p->ocorked = corked;
+
+    if(!done)
+        return rc;
+
+    if(!holding_back(session)) {
+        /* whatever doesn't go out now is sent before anything is read */
+        rc = send_queued(session);
+        if(rc && rc != LIBSSH2_ERROR_EAGAIN)
+            return rc;
+    }
+
+    return done;
+}
+
+ssize_t _libssh2_transport_send_split(LIBSSH2_SESSION *session,
+                                      unsigned char *header,
+                                      size_t header_len,
+                                      const unsigned char *data,
+                                      size_t data_len, size_t chunk)
+{
+    LIBSSH2_IOVEC iov;
 
-    return LIBSSH2_ERROR_NONE;         /* all is good */
+    iov.iov_base = (void *)data;
+    iov.iov_len = data_len;
+    return _libssh2_transport_send_splitv(session, NULL, header, header_len,
+                                          &iov, 1, data_len, chunk);
 }
@@ -66,6 +66,68 @@ int _libssh2_transport_send(LIBSSH2_SESSION *session,
                             const unsigned char *data, size_t data_len,
                             const unsigned char *data2, size_t data2_len);
 
+/*
+ * _libssh2_transport_queue
+ *
+ * Queue a packet to be sent with the rest of the outgoing queue, without
+ * having to come back with it. Returns LIBSSH2_ERROR_EAGAIN if it could not
+ * be queued now.
+ */
+int _libssh2_transport_queue(LIBSSH2_SESSION *session,
+                             const unsigned char *data, size_t data_len);
+
+/*
+ * _libssh2_transport_sendv
+ *
+ * Like _libssh2_transport_send() but the second part of the payload is
+ * gathered from the 'iovcnt' iovecs in 'iov'.
+ */
+int _libssh2_transport_sendv(LIBSSH2_SESSION *session,
+                             const unsigned char *data, size_t data_len,
+                             const LIBSSH2_IOVEC *iov, int iovcnt);
+
+/*
+ * _libssh2_transport_send_split
+ *
+ * Send 'data' in packets that each start with 'header', which ends with the
+ * 32 bit length of the part of 'data' that follows it, and carry at most
+ * 'chunk' bytes of 'data'. 'header' is modified.
+ *
+ * Returns the number of bytes of 'data' queued for sending, or a negative
+ * error code. Unlike with _libssh2_transport_send(), a caller that gets
+ * LIBSSH2_ERROR_EAGAIN may call again with other data.
+ *
+ * This function DOES NOT call _libssh2_error() on any errors.
+ */
+ssize_t _libssh2_transport_send_split(LIBSSH2_SESSION *session,
+                                      unsigned char *header,
+                                      size_t header_len,
+                                      const unsigned char *data,
+                                      size_t data_len, size_t chunk);
+
+/*
+ * _libssh2_transport_send_splitv
+ *
+ * Like _libssh2_transport_send_split() but the 'data_len' bytes of data are
+ * gathered from the 'iovcnt' iovecs in 'iov'. The packets may wait in the
+ * write queue of 'channel', if it is not NULL, to be sent in the order of
+ * the channel priorities.
+ */
+ssize_t _libssh2_transport_send_splitv(LIBSSH2_SESSION *session,
+                                       LIBSSH2_CHANNEL *channel,
+                                       unsigned char *header,
+                                       size_t header_len,
+                                       const LIBSSH2_IOVEC *iov, int iovcnt,
+                                       size_t data_len, size_t chunk);
+
+/*
+ * _libssh2_transport_drop_writes
+ *
+ * Throw away the packets waiting in the write queue of a channel that is
+ * freed.
+ */
+void _libssh2_transport_drop_writes(LIBSSH2_CHANNEL *channel);
+
 /*
  * _libssh2_transport_read
  *
@@ -83,4 +145,30 @@ int _libssh2_transport_send(LIBSSH2_SESSION *session,
  */
 int _libssh2_transport_read(LIBSSH2_SESSION * session);
 
+/*
+ * _libssh2_transport_cork
+ *
+ * Hold back the packets _libssh2_transport_send() encrypts in the outgoing
+ * queue, so that a burst of them goes out in few sends. It returns success
+ * for a packet as soon as it is queued. Corking does not nest.
+ */
+void _libssh2_transport_cork(LIBSSH2_SESSION *session);
+
+/*
+ * _libssh2_transport_uncork
+ *
+ * Stop holding back outgoing packets and send off the queued ones. Returns
+ * LIBSSH2_ERROR_EAGAIN if not all of them could be sent, they are then sent
+ * by the next _libssh2_transport_read() or _libssh2_transport_send() call.
+ */
+int _libssh2_transport_uncork(LIBSSH2_SESSION *session);
+
+/*
+ * _libssh2_transport_flush
+ *
+ * Send off the queued outgoing packets, unless they are held back. Returns
+ * LIBSSH2_ERROR_EAGAIN if not all of them could be sent.
+ */
+int _libssh2_transport_flush(LIBSSH2_SESSION *session);
+
 #endif /* __LIBSSH2_TRANSPORT_H */
@@ -0,0 +1,488 @@
+/* Copyright (C) 2022 The libssh2 project and its contributors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+
+/*
+ * UMAC following RFC 4418. NH runs all streams of a tag over each 32 byte
+ * block together, which loads every message word once and leaves the
+ * compiler independent multiply-adds to schedule. With SSE2 each stream
+ * takes two 32x32->64 bit multiplies per instruction. The polynomial hash of
+ * the second layer only implements its 64 bit stage, which covers messages
+ * of up to 2 MB; SSH packets are far smaller.
+ */
+
+#include "libssh2_priv.h"
+#include "misc.h"
+#include "umac.h"
+
+#if LIBSSH2_AES
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define UMAC_NH_SSE2
+#endif
+
+#define U8TO32_LE(p)                                                   \
+    ((uint32_t)(p)[0] | ((uint32_t)(p)[1] << 8) |                      \
+     ((uint32_t)(p)[2] << 16) | ((uint32_t)(p)[3] << 24))
+
+/* 2^36 - 5 and 2^64 - 59 */
+#define UMAC_P36 ((((libssh2_uint64_t)1) << 36) - 5)
+#define UMAC_M36 ((((libssh2_uint64_t)1) << 36) - 1)
+#define UMAC_P64 (((libssh2_uint64_t)0) - 59)
+
+/* longest message the 64 bit polynomial hash can take */
+#define UMAC_MAX_MSG_LEN ((size_t)2048 * UMAC_L1_KEY_LEN)
+
+static _libssh2_cipher_type(umac_aes) = _libssh2_cipher_aes128ecb;
+
+/* fill 'out' with 'len' bytes of the key material number 'index' */
+static int
+umac_kdf(_libssh2_cipher_ctx *aes, int index, unsigned char *out,
+         size_t len)
+{
+    unsigned char block[16];
+    unsigned int counter = 1;
+
+    while(len) {
+        size_t n = len < sizeof(block) ? len : sizeof(block);
+
+        memset(block, 0, sizeof(block));
+        block[7] = (unsigned char)index;
+        block[14] = (unsigned char)(counter >> 8);
+        block[15] = (unsigned char)counter;
+        if(_libssh2_cipher_crypt(aes, umac_aes, 1, block, sizeof(block)))
+            return -1;
+
+        memcpy(out, block, n);
+        out += n;
+        len -= n;
+        counter++;
+    }
+    _libssh2_explicit_zero(block, sizeof(block));
+    return 0;
+}
+
+int
+_libssh2_umac_init(_libssh2_umac_ctx *ctx, const unsigned char *key,
+                   size_t taglen)
+{
+    /* big enough for the NH key of UMAC-128, the longest one */
+    unsigned char buf[UMAC_L1_KEY_LEN + 16 * (UMAC_MAX_STREAMS - 1)];
+    unsigned char iv[16];
+    _libssh2_cipher_ctx aes;
+    libssh2_uint64_t poly_mask;
+    size_t nh_key_len;
+    int streams;
+    int rc;
+    int i;
+    int j;
+
+    if(taglen != 8 && taglen != 16)
+        return -1;
+
+    memset(ctx, 0, sizeof(*ctx));
+    streams = (int)(taglen / 4);
+    ctx->streams = streams;
+    nh_key_len = UMAC_L1_KEY_LEN + 16 * (streams - 1);
+
+    /* ECB has no IV, some backends want one anyway */
+    memset(iv, 0, sizeof(iv));
+    memcpy(buf, key, UMAC_KEY_LEN);
+    if(_libssh2_cipher_init(&aes, umac_aes, iv, buf, 1))
+        return -1;
+
+    /* the NH keys of the streams overlap, each starts 16 bytes later */
+    rc = umac_kdf(&aes, 1, buf, nh_key_len);
+    for(i = 0; !rc && i < (int)(nh_key_len / 4); i++)
+        ctx->nh_key[i] = _libssh2_ntohu32(&buf[4 * i]);
+
+    /* 0x01ffffff01ffffff */
+    poly_mask = ((libssh2_uint64_t)0x01ffffff << 32) | 0x01ffffff;
+    if(!rc)
+        rc = umac_kdf(&aes, 2, buf, 24 * streams);
+    for(i = 0; !rc && i < streams; i++) {
+        ctx->poly_key[i] = _libssh2_ntohu64(&buf[24 * i]) & poly_mask;
+        ctx->poly_accum[i] = 1;
+    }
+
+    /* the first half of the inner product keys would only ever multiply
+       the zero upper half of a 64 bit polynomial hash */
+    if(!rc)
+        rc = umac_kdf(&aes, 3, buf, 64 * streams);
+    for(i = 0; !rc && i < streams; i++) {
+        for(j = 0; j < 4; j++)
+            ctx->ip_key[i][j] =
+                _libssh2_ntohu64(&buf[64 * i + 32 + 8 * j]) % UMAC_P36;
+    }
+
+    if(!rc)
+        rc = umac_kdf(&aes, 4, buf, 4 * streams);
+    for(i = 0; !rc && i < streams; i++)
+        ctx->ip_trans[i] = _libssh2_ntohu32(&buf[4 * i]);
+
+    if(!rc)
+        rc = umac_kdf(&aes, 0, buf, UMAC_KEY_LEN);
+    if(!rc)
+        rc = _libssh2_cipher_init(&ctx->pdf, umac_aes, iv, buf, 1);
+
+    _libssh2_cipher_dtor(&aes);
+    _libssh2_explicit_zero(buf, sizeof(buf));
+    if(rc) {
+        _libssh2_explicit_zero(ctx, sizeof(*ctx));
+        return -1;
+    }
+    return 0;
+}
+
+#ifdef UMAC_NH_SSE2
+
+/* h gets the products of words 0 and 4, and 2 and 6, in its two 64 bit
+   lanes, then those of 1 and 5, and 3 and 7 */
+#define NH_STEP(h, k)                                                  \
+    do {                                                               \
+        __m128i a = _mm_add_epi32(lo, _mm_loadu_si128(                 \
+                                      (const __m128i *)(k)));          \
+        __m128i b = _mm_add_epi32(hi, _mm_loadu_si128(                 \
+                                      (const __m128i *)((k) + 4)));    \
+        h = _mm_add_epi64(h, _mm_mul_epu32(a, b));                     \
+        h = _mm_add_epi64(h, _mm_mul_epu32(_mm_srli_epi64(a, 32),      \
+                                           _mm_srli_epi64(b, 32)));    \
+    } while(0)
+
+/* run 'len' bytes, a multiple of 32, through NH for every stream */
+static void
+umac_nh(_libssh2_umac_ctx *ctx, const unsigned char *m, size_t len)
+{
+    const uint32_t *k = &ctx->nh_key[ctx->chunk_len / 4];
+    __m128i h0 = _mm_setzero_si128();
+    __m128i h1 = _mm_setzero_si128();
+    __m128i h2 = _mm_setzero_si128();
+    __m128i h3 = _mm_setzero_si128();
+    libssh2_uint64_t sum[2];
+    int wide = ctx->streams > 2;
+
+    ctx->chunk_len += len;
+
+    /* x86 is little endian, the message words can be loaded as is */
+    for(; len; len -= 32, m += 32, k += 8) {
+        __m128i lo = _mm_loadu_si128((const __m128i *)m);
+        __m128i hi = _mm_loadu_si128((const __m128i *)(m + 16));
+
+        NH_STEP(h0, k);
+        NH_STEP(h1, k + 4);
+        if(wide) {
+            NH_STEP(h2, k + 8);
+            NH_STEP(h3, k + 12);
+        }
+    }
+
+    _mm_storeu_si128((__m128i *)sum, h0);
+    ctx->nh_state[0] += sum[0] + sum[1];
+    _mm_storeu_si128((__m128i *)sum, h1);
+    ctx->nh_state[1] += sum[0] + sum[1];
+    if(wide) {
+        _mm_storeu_si128((__m128i *)sum, h2);
+        ctx->nh_state[2] += sum[0] + sum[1];
+        _mm_storeu_si128((__m128i *)sum, h3);
+        ctx->nh_state[3] += sum[0] + sum[1];
+    }
+}
+
+#else
+
+#define NH_STEP(h, k)                                                  \
+    h += (libssh2_uint64_t)(uint32_t)(m0 + (k)[0]) *                   \
+         (uint32_t)(m4 + (k)[4]);                                      \
+    h += (libssh2_uint64_t)(uint32_t)(m1 + (k)[1]) *                   \
+         (uint32_t)(m5 + (k)[5]);                                      \
+    h += (libssh2_uint64_t)(uint32_t)(m2 + (k)[2]) *                   \
+         (uint32_t)(m6 + (k)[6]);                                      \
+    h += (libssh2_uint64_t)(uint32_t)(m3 + (k)[3]) *                   \
+         (uint32_t)(m7 + (k)[7])
+
+/* run 'len' bytes, a multiple of 32, through NH for every stream */
+static void
+umac_nh(_libssh2_umac_ctx *ctx, const unsigned char *m, size_t len)
+{
+    const uint32_t *k = &ctx->nh_key[ctx->chunk_len / 4];
+    libssh2_uint64_t h0 = ctx->nh_state[0];
+    libssh2_uint64_t h1 = ctx->nh_state[1];
+    libssh2_uint64_t h2 = ctx->nh_state[2];
+    libssh2_uint64_t h3 = ctx->nh_state[3];
+    int wide = ctx->streams > 2;
+
+    ctx->chunk_len += len;
+
+    for(; len; len -= 32, m += 32, k += 8) {
+        uint32_t m0 = U8TO32_LE(m);
+        uint32_t m1 = U8TO32_LE(m + 4);
+        uint32_t m2 = U8TO32_LE(m + 8);
+        uint32_t m3 = U8TO32_LE(m + 12);
+        uint32_t m4 = U8TO32_LE(m + 16);
+        uint32_t m5 = U8TO32_LE(m + 20);
+        uint32_t m6 = U8TO32_LE(m + 24);
+        uint32_t m7 = U8TO32_LE(m + 28);
+
+        NH_STEP(h0, k);
+        NH_STEP(h1, k + 4);
+        if(wide) {
+            NH_STEP(h2, k + 8);
+            NH_STEP(h3, k + 12);
+        }
+    }
+
+    ctx->nh_state[0] = h0;
+    ctx->nh_state[1] = h1;
+    ctx->nh_state[2] = h2;
+    ctx->nh_state[3] = h3;
+}
+
+#endif /* UMAC_NH_SSE2 */
+
+/* cur * key + data modulo 2^64 - 59, the result is not fully reduced */
+static libssh2_uint64_t
+umac_poly64(libssh2_uint64_t cur, libssh2_uint64_t key,
+            libssh2_uint64_t data)
+{
+    uint32_t key_hi = (uint32_t)(key >> 32);
+    uint32_t key_lo = (uint32_t)key;
+    uint32_t cur_hi = (uint32_t)(cur >> 32);
+    uint32_t cur_lo = (uint32_t)cur;
+    libssh2_uint64_t x;
+    libssh2_uint64_t t;
+    libssh2_uint64_t res;
+
+    /* the key halves are below 2^25, so none of this overflows */
+    x = (libssh2_uint64_t)key_hi * cur_lo + (libssh2_uint64_t)cur_hi * key_lo;
+    res = ((libssh2_uint64_t)key_hi * cur_hi + (uint32_t)(x >> 32)) * 59 +
+          (libssh2_uint64_t)key_lo * cur_lo;
+
+    /* a carry out of 64 bits is worth 59 */
+    t = x << 32;
+    res += t;
+    if(res < t)
+        res += 59;
+
+    res += data;
+    if(res < data)
+        res += 59;
+
+    return res;
+}
+
+/* add the NH results of a chunk to the polynomial hashes */
+static void
+umac_poly(_libssh2_umac_ctx *ctx, const libssh2_uint64_t *l1)
+{
+    int i;
+
+    for(i = 0; i < ctx->streams; i++) {
+        libssh2_uint64_t acc = ctx->poly_accum[i];
+        libssh2_uint64_t key = ctx->poly_key[i];
+
+        /* values at or above 2^64 - 2^32 are escaped with a marker */
+        if((uint32_t)(l1[i] >> 32) == 0xffffffff) {
+            acc = umac_poly64(acc, key, UMAC_P64 - 1);
+            acc = umac_poly64(acc, key, l1[i] - 59);
+        }
+        else
+            acc = umac_poly64(acc, key, l1[i]);
+
+        ctx->poly_accum[i] = acc;
+    }
+}
+
+/* finish a full chunk that is followed by more of the message */
+static void
+umac_chunk_done(_libssh2_umac_ctx *ctx)
+{
+    libssh2_uint64_t l1[UMAC_MAX_STREAMS];
+    int i;
+
+    for(i = 0; i < ctx->streams; i++) {
+        l1[i] = ctx->nh_state[i] + (libssh2_uint64_t)UMAC_L1_KEY_LEN * 8;
+        ctx->nh_state[i] = 0;
+    }
+    umac_poly(ctx, l1);
+    ctx->chunk_len = 0;
+}
+
+/* the third layer, inner product with the 16 bit words of 'data' */
+static uint32_t
+umac_ip(const libssh2_uint64_t *key, libssh2_uint64_t data)
+{
+    libssh2_uint64_t t;
+
+    t = key[0] * (uint16_t)(data >> 48) +
+        key[1] * (uint16_t)(data >> 32) +
+        key[2] * (uint16_t)(data >> 16) +
+        key[3] * (uint16_t)data;
+
+    t = (t & UMAC_M36) + 5 * (t >> 36);
+    if(t >= UMAC_P36)
+        t -= UMAC_P36;
+
+    return (uint32_t)t;
+}
+
+void
+_libssh2_umac_update(_libssh2_umac_ctx *ctx, const unsigned char *m,
+                     size_t len)
+{
+    ctx->msg_len += len;
+
+    while(len) {
+        size_t n;
+
+        /* a full chunk is only known not to be the last one now */
+        if(ctx->chunk_len == UMAC_L1_KEY_LEN)
+            umac_chunk_done(ctx);
+
+        if(ctx->buffered || len < 32) {
+            n = sizeof(ctx->buffer) - ctx->buffered;
+            if(n > len)
+                n = len;
+            memcpy(&ctx->buffer[ctx->buffered], m, n);
+            ctx->buffered += n;
+            if(ctx->buffered == sizeof(ctx->buffer)) {
+                umac_nh(ctx, ctx->buffer, sizeof(ctx->buffer));
+                ctx->buffered = 0;
+            }
+        }
+        else {
+            n = UMAC_L1_KEY_LEN - ctx->chunk_len;
+            if(n > (len & ~(size_t)31))
+                n = len & ~(size_t)31;
+            umac_nh(ctx, m, n);
+        }
+
+        m += n;
+        len -= n;
+    }
+}
+
+/* encrypt the nonce, unless the last call already did for this pair */
+static int
+umac_pdf(_libssh2_umac_ctx *ctx, const unsigned char *nonce)
+{
+    unsigned char block[16];
+
+    memcpy(block, nonce, UMAC_NONCE_LEN);
+    memset(&block[UMAC_NONCE_LEN], 0, sizeof(block) - UMAC_NONCE_LEN);
+    if(ctx->streams == 2)
+        block[UMAC_NONCE_LEN - 1] &= 0xfe;
+
+    if(ctx->pdf_valid && !memcmp(block, ctx->pdf_nonce, UMAC_NONCE_LEN))
+        return 0;
+
+    memcpy(ctx->pdf_nonce, block, UMAC_NONCE_LEN);
+    ctx->pdf_valid = 0;
+    if(_libssh2_cipher_crypt(&ctx->pdf, umac_aes, 1, block, sizeof(block)))
+        return -1;
+    memcpy(ctx->pdf_pad, block, sizeof(block));
+    ctx->pdf_valid = 1;
+
+    return 0;
+}
+
+int
+_libssh2_umac_final(_libssh2_umac_ctx *ctx, unsigned char *tag,
+                    const unsigned char *nonce)
+{
+    libssh2_uint64_t l1[UMAC_MAX_STREAMS] = { 0 };
+    libssh2_uint64_t bits = (libssh2_uint64_t)
+        (ctx->chunk_len + ctx->buffered) * 8;
+    const unsigned char *pad;
+    int rc = 0;
+    int i;
+
+    /* the last chunk is zero padded to a whole block, at least one */
+    if(ctx->buffered || !ctx->chunk_len) {
+        memset(&ctx->buffer[ctx->buffered], 0,
+               sizeof(ctx->buffer) - ctx->buffered);
+        umac_nh(ctx, ctx->buffer, sizeof(ctx->buffer));
+    }
+    for(i = 0; i < ctx->streams; i++)
+        l1[i] = ctx->nh_state[i] + bits;
+
+    /* a single chunk skips the polynomial hash */
+    if(ctx->msg_len > UMAC_L1_KEY_LEN) {
+        umac_poly(ctx, l1);
+        for(i = 0; i < ctx->streams; i++) {
+            l1[i] = ctx->poly_accum[i];
+            if(l1[i] >= UMAC_P64)
+                l1[i] -= UMAC_P64;
+        }
+    }
+
+    if(ctx->msg_len > UMAC_MAX_MSG_LEN || umac_pdf(ctx, nonce))
+        rc = -1;
+
+    pad = ctx->pdf_pad;
+    if(ctx->streams == 2)
+        pad += 8 * (nonce[UMAC_NONCE_LEN - 1] & 1);
+
+    for(i = 0; !rc && i < ctx->streams; i++) {
+        uint32_t y = umac_ip(ctx->ip_key[i], l1[i]) ^ ctx->ip_trans[i];
+        tag[4 * i] = (unsigned char)(y >> 24) ^ pad[4 * i];
+        tag[4 * i + 1] = (unsigned char)(y >> 16) ^ pad[4 * i + 1];
+        tag[4 * i + 2] = (unsigned char)(y >> 8) ^ pad[4 * i + 2];
+        tag[4 * i + 3] = (unsigned char)y ^ pad[4 * i + 3];
+    }
+
+    /* ready for the next message */
+    for(i = 0; i < UMAC_MAX_STREAMS; i++) {
+        ctx->nh_state[i] = 0;
+        ctx->poly_accum[i] = 1;
+    }
+    ctx->buffered = 0;
+    ctx->chunk_len = 0;
+    ctx->msg_len = 0;
+
+    return rc;
+}
+
+void
+_libssh2_umac_dtor(_libssh2_umac_ctx *ctx)
+{
+    _libssh2_cipher_dtor(&ctx->pdf);
+    _libssh2_explicit_zero(ctx, sizeof(*ctx));
+}
+
+#endif /* LIBSSH2_AES */
@@ -0,0 +1,93 @@
+#ifndef __LIBSSH2_UMAC_H
+#define __LIBSSH2_UMAC_H
+/* Copyright (C) 2022 The libssh2 project and its contributors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+/*
+ * UMAC (RFC 4418) with 64 or 128 bit tags, as used by the
+ * umac-64@openssh.com and umac-128@openssh.com MACs. The nonce is always
+ * 8 bytes, the packet sequence number.
+ *
+ * The AES operations of the key derivation and of the pad function use the
+ * crypto backend's _libssh2_cipher_aes128ecb, the hash itself is portable.
+ */
+
+#include "libssh2_priv.h"
+
+#if LIBSSH2_AES
+
+#define UMAC_KEY_LEN       16
+#define UMAC_NONCE_LEN     8
+#define UMAC_L1_KEY_LEN    1024     /* bytes of message per NH chunk */
+#define UMAC_MAX_STREAMS   4        /* one per 32 bits of tag */
+
+typedef struct
+{
+    int streams;                    /* 2 for UMAC-64, 4 for UMAC-128 */
+
+    /* the keys, derived once */
+    uint32_t nh_key[UMAC_L1_KEY_LEN / 4 + 4 * (UMAC_MAX_STREAMS - 1)];
+    libssh2_uint64_t poly_key[UMAC_MAX_STREAMS];
+    libssh2_uint64_t ip_key[UMAC_MAX_STREAMS][4];
+    uint32_t ip_trans[UMAC_MAX_STREAMS];
+    _libssh2_cipher_ctx pdf;        /* AES under the pad function key */
+
+    /* the pad of the last nonce, UMAC-64 uses each for two nonces */
+    unsigned char pdf_nonce[UMAC_NONCE_LEN];
+    unsigned char pdf_pad[16];
+    int pdf_valid;
+
+    /* the message hashed so far */
+    libssh2_uint64_t nh_state[UMAC_MAX_STREAMS];
+    libssh2_uint64_t poly_accum[UMAC_MAX_STREAMS];
+    unsigned char buffer[32];       /* a partial NH block */
+    size_t buffered;
+    size_t chunk_len;               /* bytes run through NH in this chunk */
+    size_t msg_len;
+} _libssh2_umac_ctx;
+
+int _libssh2_umac_init(_libssh2_umac_ctx *ctx, const unsigned char *key,
+                       size_t taglen);
+void _libssh2_umac_update(_libssh2_umac_ctx *ctx, const unsigned char *m,
+                          size_t len);
+int _libssh2_umac_final(_libssh2_umac_ctx *ctx, unsigned char *tag,
+                        const unsigned char *nonce);
+void _libssh2_umac_dtor(_libssh2_umac_ctx *ctx);
+
+#endif /* LIBSSH2_AES */
+
+#endif /* __LIBSSH2_UMAC_H */
@@ -2000,6 +2000,34 @@ _libssh2_wincng_cipher_crypt(_libssh2_cipher_ctx *ctx,
     return BCRYPT_SUCCESS(ret) ? 0 : -1;
 }
 
+int
+_libssh2_wincng_cipher_crypt_bulk(_libssh2_cipher_ctx *ctx,
+                                  _libssh2_cipher_type(type),
+                                  int encrypt,
+                                  const unsigned char *src,
+                                  unsigned char *dst,
+                                  size_t len)
+{
+    size_t i;
+
+    if(dst != src)
+        memmove(dst, src, len);
+
+    /* CBC and stream ciphers chain through the context, so the whole span
+       can be handed over at once. Counter mode is done per counter block
+       since the counter lives on our side. */
+    if(!type.ctrMode)
+        return _libssh2_wincng_cipher_crypt(ctx, type, encrypt, dst, len);
+
+    for(i = 0; i < len; i += ctx->dwCtrLength) {
+        if(_libssh2_wincng_cipher_crypt(ctx, type, encrypt, dst + i,
+                                        ctx->dwCtrLength))
+            return -1;
+    }
+
+    return 0;
+}
+
 void
 _libssh2_wincng_cipher_dtor(_libssh2_cipher_ctx *ctx)
 {
@@ -54,6 +54,7 @@
 #define LIBSSH2_HMAC_RIPEMD 0
 #define LIBSSH2_HMAC_SHA256 1
 #define LIBSSH2_HMAC_SHA512 1
+#define LIBSSH2_HMAC_RESET 0
 
 #define LIBSSH2_AES 1
 #define LIBSSH2_AES_CTR 1
@@ -61,6 +62,8 @@
 #define LIBSSH2_RC4 1
 #define LIBSSH2_CAST 0
 #define LIBSSH2_3DES 1
+#define LIBSSH2_CHACHA20 0
+#define LIBSSH2_AES_GCM 0
 
 #define LIBSSH2_RSA 1
 #define LIBSSH2_RSA_SHA2 1
@@ -344,8 +347,10 @@ struct _libssh2_wincng_cipher_type {
 #define _libssh2_cipher_aes256 { &_libssh2_wincng.hAlgAES_CBC, 32, 1, 0 }
 #define _libssh2_cipher_aes192 { &_libssh2_wincng.hAlgAES_CBC, 24, 1, 0 }
 #define _libssh2_cipher_aes128 { &_libssh2_wincng.hAlgAES_CBC, 16, 1, 0 }
+#define _libssh2_cipher_aes128ecb { &_libssh2_wincng.hAlgAES_ECB, 16, 0, 0 }
 #define _libssh2_cipher_arcfour { &_libssh2_wincng.hAlgRC4_NA, 16, 0, 0 }
 #define _libssh2_cipher_3des { &_libssh2_wincng.hAlg3DES_CBC, 24, 1, 0 }
+#define _libssh2_cipher_none { NULL, 0, 0, 0 }
 
 /*
  * Windows CNG backend: Cipher functions
@@ -355,6 +360,8 @@ struct _libssh2_wincng_cipher_type {
   _libssh2_wincng_cipher_init(ctx, type, iv, secret, encrypt)
 #define _libssh2_cipher_crypt(ctx, type, encrypt, block, blocklen) \
   _libssh2_wincng_cipher_crypt(ctx, type, encrypt, block, blocklen)
+#define _libssh2_cipher_crypt_bulk(ctx, type, encrypt, src, dst, len) \
+  _libssh2_wincng_cipher_crypt_bulk(ctx, type, encrypt, src, dst, len)
 #define _libssh2_cipher_dtor(ctx) \
   _libssh2_wincng_cipher_dtor(ctx)
 
@@ -575,6 +582,13 @@ _libssh2_wincng_cipher_crypt(_libssh2_cipher_ctx *ctx,
                              int encrypt,
                              unsigned char *block,
                              size_t blocklen);
+int
+_libssh2_wincng_cipher_crypt_bulk(_libssh2_cipher_ctx *ctx,
+                                  _libssh2_cipher_type(type),
+                                  int encrypt,
+                                  const unsigned char *src,
+                                  unsigned char *dst,
+                                  size_t len);
 void
 _libssh2_wincng_cipher_dtor(_libssh2_cipher_ctx *ctx);
 
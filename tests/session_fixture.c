@@ -100,6 +100,15 @@ void setup_fixture_workdir()
 }
 
 LIBSSH2_SESSION *start_session_fixture()
+{
+    return start_session_fixture_ex(NULL, NULL, NULL);
+}
+
+/* like start_session_fixture() but the session uses the given memory
+   functions */
+LIBSSH2_SESSION *start_session_fixture_ex(LIBSSH2_ALLOC_FUNC((*my_alloc)),
+                                          LIBSSH2_FREE_FUNC((*my_free)),
+                                          LIBSSH2_REALLOC_FUNC((*my_realloc)))
 {
     int rc;
 
@@ -115,7 +124,8 @@ LIBSSH2_SESSION *start_session_fixture()
         return NULL;
     }
 
-    connected_session = libssh2_session_init_ex(NULL, NULL, NULL, NULL);
+    connected_session = libssh2_session_init_ex(my_alloc, my_free,
+                                                my_realloc, NULL);
     libssh2_session_set_blocking(connected_session, 1);
     if(connected_session == NULL) {
         fprintf(stderr, "libssh2_session_init_ex failed\n");
@@ -41,6 +41,9 @@
 #include <libssh2.h>
 
 LIBSSH2_SESSION *start_session_fixture();
+LIBSSH2_SESSION *start_session_fixture_ex(LIBSSH2_ALLOC_FUNC((*my_alloc)),
+                                          LIBSSH2_FREE_FUNC((*my_free)),
+                                          LIBSSH2_REALLOC_FUNC((*my_realloc)));
 void stop_session_fixture();
 void print_last_session_error(const char *function);
 
@@ -0,0 +1,124 @@
+/* Copyright (C) 2022 The libssh2 project and its contributors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+#include "socket_fixture.h"
+
+#ifndef WIN32
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static int fds[2] = { -1, -1 };
+static unsigned char received[8192];
+
+unsigned char *payloads[RECEIVED_MAX];
+size_t payload_lens[RECEIVED_MAX];
+
+LIBSSH2_SESSION *start_socket_fixture(void)
+{
+    LIBSSH2_SESSION *session;
+
+    libssh2_init(0);
+    session = libssh2_session_init();
+    if(!session || socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+        fprintf(stderr, "could not set up session\n");
+        return NULL;
+    }
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+    libssh2_session_set_blocking(session, 0);
+    session->socket_fd = fds[0];
+
+    return session;
+}
+
+void stop_socket_fixture(LIBSSH2_SESSION *session)
+{
+    libssh2_session_free(session);
+    close(fds[0]);
+    close(fds[1]);
+    fds[0] = fds[1] = -1;
+    libssh2_exit();
+}
+
+int socket_fixture_peer(void)
+{
+    return fds[1];
+}
+
+int send_packet(const unsigned char *payload, size_t len)
+{
+    static unsigned char packet[MAX_SSH_PACKET_LEN];
+    size_t padding = 8 - (len + 5) % 8;
+
+    if(padding < 4)
+        padding += 8;
+    if(5 + len + padding > sizeof(packet))
+        return 1;
+
+    _libssh2_htonu32(packet, (uint32_t)(1 + len + padding));
+    packet[4] = (unsigned char)padding;
+    memcpy(packet + 5, payload, len);
+    memset(packet + 5 + len, 0, padding);
+    len += 5 + padding;
+
+    return write(fds[1], packet, len) != (ssize_t)len;
+}
+
+int receive_packets(LIBSSH2_SESSION *session)
+{
+    size_t len = 0;
+    size_t i = 0;
+    ssize_t rc;
+    int count = 0;
+
+    libssh2_transport_write(session, NULL, 0);
+    while((rc = read(fds[1], &received[len], sizeof(received) - len)) > 0)
+        len += rc;
+
+    while(i + 5 <= len && count < RECEIVED_MAX) {
+        size_t packet_len = _libssh2_ntohu32(&received[i]);
+
+        payloads[count] = &received[i + 5];
+        payload_lens[count] = packet_len - 1 - received[i + 4];
+        count++;
+        i += 4 + packet_len;
+    }
+    return count;
+}
+
+#endif /* WIN32 */
@@ -0,0 +1,82 @@
+/* Copyright (C) 2022 The libssh2 project and its contributors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+#ifndef LIBSSH2_TESTS_SOCKET_FIXTURE_H
+#define LIBSSH2_TESTS_SOCKET_FIXTURE_H
+
+/*
+ * For unit tests that play the server's part by hand: a session whose socket
+ * is one end of a non-blocking socket pair, and unencrypted packets written
+ * into and read from the other end.
+ */
+
+#include "libssh2_priv.h"
+
+/* fails the test function it is used in, telling the line and condition */
+#define CHECK(cond) \
+    do { \
+        if(!(cond)) { \
+            fprintf(stderr, "line %d: check failed: %s\n", __LINE__, \
+                    #cond); \
+            return 1; \
+        } \
+    } while(0)
+
+#ifndef WIN32
+
+LIBSSH2_SESSION *start_socket_fixture(void);
+void stop_socket_fixture(LIBSSH2_SESSION *session);
+
+/* the other end of the session's socket */
+int socket_fixture_peer(void);
+
+/* write an unencrypted packet with 'payload' for the session to read,
+   returns non-zero on failure */
+int send_packet(const unsigned char *payload, size_t len);
+
+/* the payloads of the packets receive_packets() has read */
+#define RECEIVED_MAX 64
+extern unsigned char *payloads[RECEIVED_MAX];
+extern size_t payload_lens[RECEIVED_MAX];
+
+/* flush what the session has to send and read it, returns the number of
+   packets */
+int receive_packets(LIBSSH2_SESSION *session);
+
+#endif /* WIN32 */
+
+#endif
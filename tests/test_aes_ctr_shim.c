@@ -0,0 +1,197 @@
+/* Copyright (C) 2022 The libssh2 project and its contributors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+/*
+ * Checks the AES-CTR shim in openssl.c, which encrypts up to AES_CTR_BATCH
+ * counter blocks per EVP call, against OpenSSL's own EVP_aes_*_ctr(). Built
+ * along with openssl.c and LIBSSH2_TEST_AES_CTR_SHIM, since with any recent
+ * OpenSSL the library itself leaves the shim out. The lengths go below, at
+ * and across batch boundaries, the buffers are misaligned, and a stream is
+ * also fed in uneven calls to check that the counter carries over.
+ */
+
+#include <stdlib.h>
+
+#include "libssh2_priv.h"
+
+#if defined(LIBSSH2_OPENSSL) && defined(LIBSSH2_TEST_AES_CTR_SHIM) && \
+    !defined(HAVE_EVP_AES_128_CTR) && LIBSSH2_AES_CTR
+
+#define BLOCK 16
+#define MAX_BLOCKS 1000
+
+struct ctr_cipher {
+    const char *name;
+    int keylen;
+    _libssh2_cipher_type(shim);
+    _libssh2_cipher_type(native);
+};
+
+static const struct ctr_cipher ciphers[] = {
+    { "aes128-ctr", 16, _libssh2_EVP_aes_128_ctr, EVP_aes_128_ctr },
+    { "aes192-ctr", 24, _libssh2_EVP_aes_192_ctr, EVP_aes_192_ctr },
+    { "aes256-ctr", 32, _libssh2_EVP_aes_256_ctr, EVP_aes_256_ctr }
+};
+
+/* number of blocks in each run, around the 32 block batches */
+static const size_t lengths[] = { 1, 2, 31, 32, 33, 64, 95, 97, MAX_BLOCKS };
+
+/* encrypts len bytes of src into dst in one call per entry of chunks, in
+   blocks, or in a single call when chunks is NULL */
+static int ctr_crypt(_libssh2_cipher_type(algo), const unsigned char *src,
+                     unsigned char *dst, size_t len, const size_t *chunks)
+{
+    _libssh2_cipher_ctx h;
+    unsigned char secret[32];
+    unsigned char iv[BLOCK];
+    size_t done = 0;
+    int rc = 0;
+    int i;
+
+    for(i = 0; i < 32; i++)
+        secret[i] = (unsigned char)(i * 3 + 1);
+    /* close to wrapping, so the carry goes through several bytes */
+    for(i = 0; i < BLOCK; i++)
+        iv[i] = (unsigned char)(i < 8 ? i : 0xff);
+    iv[BLOCK - 1] = 0xf0;
+
+    if(_libssh2_cipher_init(&h, algo, iv, secret, 1))
+        return 1;
+
+    while(!rc && done < len) {
+        size_t n = len - done;
+        if(chunks) {
+            n = *chunks++ * BLOCK;
+            if(n > len - done)
+                n = len - done;
+        }
+        rc = _libssh2_cipher_crypt_bulk(&h, algo, 1, src + done, dst + done,
+                                        n);
+        done += n;
+    }
+
+    _libssh2_cipher_dtor(&h);
+    return rc;
+}
+
+static int test_cipher(const struct ctr_cipher *c, const unsigned char *plain)
+{
+    static const size_t chunks[] = { 1, 30, 33, 2, 64, 7, MAX_BLOCKS };
+    unsigned char *expected = malloc(MAX_BLOCKS * BLOCK);
+    unsigned char *buf = malloc(MAX_BLOCKS * BLOCK + 1);
+    unsigned char *out;
+    size_t i;
+    int rc = 1;
+
+    if(!expected || !buf) {
+        fprintf(stderr, "out of memory\n");
+        goto done;
+    }
+    /* the shim has to cope with buffers EVP didn't allocate */
+    out = buf + 1;
+
+    for(i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        size_t len = lengths[i] * BLOCK;
+
+        if(ctr_crypt(c->native, plain + 1, expected, len, NULL) ||
+           ctr_crypt(c->shim, plain + 1, out, len, NULL)) {
+            fprintf(stderr, "%s: encrypting %d blocks failed\n", c->name,
+                    (int)lengths[i]);
+            goto done;
+        }
+        if(memcmp(expected, out, len)) {
+            fprintf(stderr, "%s: %d blocks differ from EVP\n", c->name,
+                    (int)lengths[i]);
+            goto done;
+        }
+    }
+
+    if(ctr_crypt(c->shim, plain + 1, out, MAX_BLOCKS * BLOCK, chunks) ||
+       memcmp(expected, out, MAX_BLOCKS * BLOCK)) {
+        fprintf(stderr, "%s: the counter doesn't carry over calls\n",
+                c->name);
+        goto done;
+    }
+
+    /* and in place, the way the transport layer calls it */
+    memcpy(out, plain + 1, MAX_BLOCKS * BLOCK);
+    if(ctr_crypt(c->shim, out, out, MAX_BLOCKS * BLOCK, NULL) ||
+       memcmp(expected, out, MAX_BLOCKS * BLOCK)) {
+        fprintf(stderr, "%s: in place encryption differs\n", c->name);
+        goto done;
+    }
+
+    rc = 0;
+done:
+    free(expected);
+    free(buf);
+    return rc;
+}
+
+int main(void)
+{
+    unsigned char *plain = malloc(MAX_BLOCKS * BLOCK + 1);
+    size_t i;
+    int rc = 0;
+
+    if(!plain) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    for(i = 0; i < MAX_BLOCKS * BLOCK + 1; i++)
+        plain[i] = (unsigned char)(i * 7 + (i >> 8));
+
+    libssh2_init(0);
+
+    for(i = 0; i < sizeof(ciphers) / sizeof(ciphers[0]); i++)
+        rc |= test_cipher(&ciphers[i], plain);
+
+    libssh2_exit();
+    free(plain);
+
+    return rc;
+}
+
+#else
+
+int main(void)
+{
+    /* the shim is only there for OpenSSL */
+    return 0;
+}
+
+#endif
@@ -0,0 +1,342 @@
+/* Copyright (C) 2022 The libssh2 project and its contributors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+/*
+ * Known answer tests for aes256-gcm@openssh.com: two packets sealed one
+ * after the other, so the second one is under the incremented IV, whose
+ * invocation counter carries over into its next byte. The first packet is
+ * then opened again and must fail authentication once a bit of it, or of its
+ * clear text packet_length field, has been flipped. Last, a session is
+ * handed a packet whose packet_length leaves it short of whole blocks, which
+ * it must refuse.
+ */
+
+#include "libssh2_priv.h"
+#include "transport.h"
+
+#ifndef WIN32
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if LIBSSH2_AES_GCM
+
+#define PACKET_LEN 164           /* packet_length field + 160 bytes */
+#define TAG_LEN 16
+
+/* the packet from make_packet() sealed with key bytes 0..31 and the IV
+   below */
+static const unsigned char sealed[PACKET_LEN + TAG_LEN] = {
+    0x00, 0x00, 0x00, 0xa0, 0x31, 0x3e, 0xb7, 0xb9,
+    0xea, 0xce, 0x18, 0x02, 0xa3, 0x7a, 0x37, 0xf2,
+    0x94, 0x29, 0x1b, 0xe4, 0x55, 0xc7, 0x33, 0xb9,
+    0xa1, 0x91, 0x54, 0x01, 0x7a, 0x7b, 0x48, 0x60,
+    0x3e, 0x46, 0x3d, 0xf7, 0x06, 0x54, 0x2a, 0x33,
+    0x67, 0x8e, 0x8c, 0x1a, 0xc9, 0x34, 0xb6, 0x5c,
+    0xcd, 0xe0, 0x93, 0x46, 0xab, 0xb1, 0x17, 0x37,
+    0x9b, 0x17, 0xe6, 0xe7, 0x82, 0x88, 0x40, 0xa4,
+    0x40, 0x7d, 0x5a, 0x5f, 0xc3, 0x9b, 0x52, 0x88,
+    0xaf, 0xa9, 0x6f, 0x68, 0x3f, 0x5d, 0x3f, 0xb5,
+    0xd6, 0x80, 0x97, 0xec, 0x62, 0x0f, 0xf3, 0x60,
+    0x4e, 0x21, 0x4c, 0xc4, 0x8e, 0x0f, 0x91, 0xb3,
+    0xf4, 0x21, 0xba, 0xcc, 0x93, 0xa1, 0xfc, 0x90,
+    0xdd, 0x12, 0x74, 0x0f, 0x38, 0x43, 0x68, 0x01,
+    0xbf, 0xde, 0x1d, 0x23, 0x82, 0x15, 0x72, 0xb7,
+    0xcb, 0x5d, 0xed, 0x8f, 0xdb, 0x66, 0x49, 0x93,
+    0x14, 0xbc, 0x16, 0x74, 0x74, 0x0c, 0x02, 0x29,
+    0x8a, 0xbc, 0x44, 0x19, 0xce, 0x69, 0x1c, 0xd0,
+    0x30, 0xcb, 0x1d, 0x43, 0xfe, 0x2c, 0x3a, 0x00,
+    0xa1, 0x54, 0xc3, 0x5b, 0xb3, 0xab, 0x91, 0xdd,
+    0xec, 0x4d, 0xb3, 0x1a, 0xb7, 0xe3, 0x74, 0x5f,
+    0xb1, 0x56, 0x79, 0x45, 0x77, 0xd9, 0x09, 0xa4,
+    0xfa, 0x61, 0xaa, 0x7b
+};
+
+/* the tag of the same packet sealed again with the next IV */
+static const unsigned char second_tag[TAG_LEN] = {
+    0x85, 0xc0, 0xda, 0x2c, 0x7a, 0xe6, 0xaf, 0x11,
+    0x86, 0x35, 0x44, 0x68, 0x5e, 0xdf, 0x56, 0x19
+};
+
+static void make_packet(unsigned char *packet)
+{
+    int i;
+
+    for(i = 0; i < PACKET_LEN; i++)
+        packet[i] = (unsigned char)(i * 7 + 3);
+    _libssh2_htonu32(packet, PACKET_LEN - 4);
+    packet[4] = 9;                /* padding_length */
+}
+
+static const LIBSSH2_CRYPT_METHOD *find_method(const char *name)
+{
+    const LIBSSH2_CRYPT_METHOD **methods = libssh2_crypt_methods();
+
+    for(; *methods; methods++) {
+        if(!strcmp((*methods)->name, name))
+            return *methods;
+    }
+    return NULL;
+}
+
+static int init_ctx(LIBSSH2_SESSION *session,
+                    const LIBSSH2_CRYPT_METHOD *method,
+                    int encrypt, void **abstract)
+{
+    unsigned char iv[12];
+    unsigned char secret[32];
+    int free_iv;
+    int free_secret;
+    int i;
+
+    for(i = 0; i < 12; i++)
+        iv[i] = (unsigned char)(0xa0 + i);
+    iv[10] = iv[11] = 0xff;
+    for(i = 0; i < 32; i++)
+        secret[i] = (unsigned char)i;
+
+    return method->init(session, method, iv, &free_iv, secret,
+                        &free_secret, encrypt, abstract);
+}
+
+static int seal_packet(LIBSSH2_SESSION *session,
+                       const LIBSSH2_CRYPT_METHOD *method,
+                       unsigned char *buf, void **ctx)
+{
+    int rc;
+
+    /* in place, the way _libssh2_transport_send() does it */
+    make_packet(buf);
+    rc = method->aead_begin(session, 0, buf, buf, ctx);
+    if(!rc)
+        rc = method->crypt_bulk(session, buf + 4, buf + 4, PACKET_LEN - 4,
+                                ctx);
+    if(!rc)
+        rc = method->aead_end(session, buf + PACKET_LEN, ctx);
+    return rc;
+}
+
+static int open_packet(LIBSSH2_SESSION *session,
+                       const LIBSSH2_CRYPT_METHOD *method,
+                       const unsigned char *in, unsigned char *out)
+{
+    unsigned char tag[TAG_LEN];
+    void *ctx = NULL;
+    size_t i;
+    int rc;
+
+    if(init_ctx(session, method, 0, &ctx))
+        return -1;
+
+    rc = method->aead_begin(session, 0, in, out, &ctx);
+    /* one block at a time, as _libssh2_transport_read() may do */
+    for(i = 4; !rc && i < PACKET_LEN; i += 16)
+        rc = method->crypt_bulk(session, &in[i], &out[i], 16, &ctx);
+    memcpy(tag, &in[PACKET_LEN], sizeof(tag));
+    if(!rc)
+        rc = method->aead_end(session, tag, &ctx);
+
+    method->dtor(session, &ctx);
+    return rc;
+}
+
+static int test_aes_gcm(LIBSSH2_SESSION *session)
+{
+    const LIBSSH2_CRYPT_METHOD *method =
+        find_method("aes256-gcm@openssh.com");
+    unsigned char plain[PACKET_LEN];
+    unsigned char buf[PACKET_LEN + TAG_LEN];
+    void *ctx = NULL;
+    int rc;
+
+    if(!method) {
+        fprintf(stderr, "aes256-gcm@openssh.com: not available\n");
+        return 1;
+    }
+    if(!(method->flags & LIBSSH2_CRYPT_FLAG_INTEGRATED_MAC)) {
+        fprintf(stderr, "aes256-gcm@openssh.com: not an AEAD\n");
+        return 1;
+    }
+
+    if(init_ctx(session, method, 1, &ctx)) {
+        fprintf(stderr, "aes256-gcm@openssh.com: init failed\n");
+        return 1;
+    }
+    rc = seal_packet(session, method, buf, &ctx);
+    if(rc || memcmp(buf, sealed, sizeof(sealed))) {
+        method->dtor(session, &ctx);
+        fprintf(stderr, "aes256-gcm@openssh.com: sealed packet differs\n");
+        return 1;
+    }
+    rc = seal_packet(session, method, buf, &ctx);
+    method->dtor(session, &ctx);
+    if(rc || memcmp(buf + PACKET_LEN, second_tag, TAG_LEN)) {
+        fprintf(stderr, "aes256-gcm@openssh.com: IV not incremented\n");
+        return 1;
+    }
+
+    make_packet(plain);
+    memset(buf, 0, sizeof(buf));
+    if(open_packet(session, method, sealed, buf) ||
+       memcmp(buf, plain, PACKET_LEN)) {
+        fprintf(stderr, "aes256-gcm@openssh.com: open failed\n");
+        return 1;
+    }
+
+    memcpy(buf, sealed, sizeof(sealed));
+    buf[100] ^= 0x10;
+    if(!open_packet(session, method, buf, plain)) {
+        fprintf(stderr, "aes256-gcm@openssh.com: "
+                "tampered packet accepted\n");
+        return 1;
+    }
+
+    memcpy(buf, sealed, sizeof(sealed));
+    buf[3] ^= 0x01;
+    if(!open_packet(session, method, buf, plain)) {
+        fprintf(stderr, "aes256-gcm@openssh.com: "
+                "tampered packet_length accepted\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+#ifndef WIN32
+/* reads a packet sealed with packet_length set to len over a socket pair,
+   the way the session would get it from the server */
+static int read_packet(const LIBSSH2_CRYPT_METHOD *method, uint32_t len)
+{
+    LIBSSH2_SESSION *session;
+    unsigned char buf[PACKET_LEN + TAG_LEN];
+    void *ctx = NULL;
+    int fds[2];
+    int rc;
+
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+        return -1;
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    session = libssh2_session_init();
+    libssh2_session_set_blocking(session, 0);
+    session->socket_fd = fds[0];
+
+    make_packet(buf);
+    _libssh2_htonu32(buf, len);
+    rc = init_ctx(session, method, 1, &ctx);
+    if(!rc)
+        rc = method->aead_begin(session, 0, buf, buf, &ctx);
+    if(!rc)
+        rc = method->crypt_bulk(session, buf + 4, buf + 4, PACKET_LEN - 4,
+                                &ctx);
+    if(!rc)
+        rc = method->aead_end(session, buf + PACKET_LEN, &ctx);
+    if(ctx)
+        method->dtor(session, &ctx);
+
+    if(!rc)
+        rc = init_ctx(session, method, 0, &session->remote.crypt_abstract);
+    if(!rc && write(fds[1], buf, sizeof(buf)) != sizeof(buf))
+        rc = -1;
+    if(!rc) {
+        session->remote.crypt = method;
+        session->remote.mac = method->integrated_mac;
+        session->state |= LIBSSH2_STATE_NEWKEYS;
+        rc = _libssh2_transport_read(session);
+    }
+
+    close(fds[0]);
+    close(fds[1]);
+    libssh2_session_free(session);
+    return rc;
+}
+
+static int test_misaligned(void)
+{
+    const LIBSSH2_CRYPT_METHOD *method =
+        find_method("aes256-gcm@openssh.com");
+    int rc;
+
+    if(!method)
+        return 1;
+
+    rc = read_packet(method, PACKET_LEN - 4);
+    if(rc < 0 && rc != LIBSSH2_ERROR_EAGAIN) {
+        fprintf(stderr, "aes256-gcm@openssh.com: "
+                "packet not read: %d\n", rc);
+        return 1;
+    }
+
+    rc = read_packet(method, PACKET_LEN - 12);
+    if(rc != LIBSSH2_ERROR_DECRYPT) {
+        fprintf(stderr, "aes256-gcm@openssh.com: "
+                "misaligned packet_length gave %d\n", rc);
+        return 1;
+    }
+
+    return 0;
+}
+#endif
+
+int main(void)
+{
+    LIBSSH2_SESSION *session;
+    int rc;
+
+    libssh2_init(0);
+    session = libssh2_session_init();
+
+    rc = test_aes_gcm(session);
+#ifndef WIN32
+    rc |= test_misaligned();
+#endif
+
+    libssh2_session_free(session);
+    libssh2_exit();
+
+    return rc;
+}
+
+#else
+
+int main(void)
+{
+    /* the crypto backend has no AES-GCM */
+    return 0;
+}
+
+#endif /* LIBSSH2_AES_GCM */
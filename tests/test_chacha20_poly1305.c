@@ -0,0 +1,335 @@
+/* Copyright (C) 2022 The libssh2 project and its contributors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+/*
+ * Known answer tests for chacha20-poly1305@openssh.com: the Poly1305 example
+ * from RFC 8439 section 2.5.2, and a packet sealed the way OpenSSH's
+ * PROTOCOL.chacha20poly1305 describes it. The packet is then opened again,
+ * in chunks that don't line up with ChaCha20's 64 byte blocks, and must fail
+ * authentication once a single bit of it has been flipped. Last, a session
+ * is handed a packet whose packet_length leaves it short of whole blocks,
+ * which it must refuse.
+ */
+
+#include "libssh2_priv.h"
+#include "chacha.h"
+#include "transport.h"
+
+#ifndef WIN32
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define SEQNO 7
+#define PACKET_LEN 164           /* packet_length field + 160 bytes */
+
+static const unsigned char poly1305_key[32] = {
+    0x85, 0xd6, 0xbe, 0x78, 0x57, 0x55, 0x6d, 0x33,
+    0x7f, 0x44, 0x52, 0xfe, 0x42, 0xd5, 0x06, 0xa8,
+    0x01, 0x03, 0x80, 0x8a, 0xfb, 0x0d, 0xb2, 0xfd,
+    0x4a, 0xbf, 0xf6, 0xaf, 0x41, 0x49, 0xf5, 0x1b
+};
+
+static const unsigned char poly1305_tag[16] = {
+    0xa8, 0x06, 0x1d, 0xc1, 0x30, 0x51, 0x36, 0xc6,
+    0xc2, 0x2b, 0x8b, 0xaf, 0x0c, 0x01, 0x27, 0xa9
+};
+
+/* the packet from make_packet() sealed with key bytes 0..63 */
+static const unsigned char sealed[PACKET_LEN + POLY1305_TAG_LEN] = {
+    0xa3, 0x9a, 0xfc, 0x0a, 0x21, 0x60, 0x38, 0x77,
+    0x75, 0xc1, 0x63, 0x0e, 0x3b, 0x33, 0xde, 0x9c,
+    0xa4, 0xf5, 0x52, 0xa4, 0xbb, 0x24, 0xad, 0x92,
+    0xd5, 0x51, 0x84, 0x43, 0x87, 0xa4, 0xce, 0x03,
+    0x63, 0xb9, 0xf2, 0xac, 0x5b, 0x51, 0xfc, 0xb1,
+    0x0e, 0x40, 0xdd, 0x89, 0x9b, 0xec, 0x23, 0x62,
+    0x40, 0x68, 0x6a, 0x1f, 0x18, 0xda, 0xed, 0x5b,
+    0x14, 0xb1, 0xd1, 0x53, 0xdd, 0x4a, 0x93, 0x06,
+    0x10, 0x64, 0x86, 0x29, 0xda, 0x24, 0x08, 0xce,
+    0xda, 0x40, 0x5d, 0xf6, 0x33, 0xf6, 0xaa, 0xcf,
+    0x55, 0x7f, 0xbc, 0xb8, 0x27, 0x9b, 0x4e, 0xd8,
+    0x96, 0x47, 0x8d, 0x72, 0x41, 0x1a, 0xa8, 0x67,
+    0xc5, 0x91, 0xc0, 0x8e, 0x1f, 0x53, 0x9d, 0x8c,
+    0x8e, 0xab, 0xcc, 0xc7, 0xbd, 0xa4, 0xa4, 0x17,
+    0xc8, 0x54, 0xd5, 0x9f, 0x4d, 0x7b, 0xfd, 0x81,
+    0x66, 0x5c, 0x0e, 0xb1, 0xe1, 0x06, 0x30, 0x25,
+    0xfb, 0x4e, 0x1a, 0x99, 0x82, 0x9e, 0xdc, 0x75,
+    0x77, 0x63, 0x7b, 0x7d, 0xf3, 0xd5, 0xfd, 0x75,
+    0x05, 0x1e, 0xcd, 0xd5, 0x2f, 0x51, 0xe9, 0x5a,
+    0x59, 0x34, 0x1d, 0x70, 0xc3, 0xfc, 0xef, 0x2a,
+    0x7c, 0x1d, 0xc5, 0xbc, 0xc1, 0xfb, 0x97, 0x41,
+    0x73, 0x4e, 0x80, 0x5f, 0x09, 0xec, 0x48, 0x02,
+    0x0f, 0xe9, 0x22, 0xd9
+};
+
+static void make_packet(unsigned char *packet)
+{
+    int i;
+
+    for(i = 0; i < PACKET_LEN; i++)
+        packet[i] = (unsigned char)(i * 7 + 3);
+    _libssh2_htonu32(packet, PACKET_LEN - 4);
+    packet[4] = 9;                /* padding_length */
+}
+
+static const LIBSSH2_CRYPT_METHOD *find_method(const char *name)
+{
+    const LIBSSH2_CRYPT_METHOD **methods = libssh2_crypt_methods();
+
+    for(; *methods; methods++) {
+        if(!strcmp((*methods)->name, name))
+            return *methods;
+    }
+    return NULL;
+}
+
+static int init_ctx(LIBSSH2_SESSION *session,
+                    const LIBSSH2_CRYPT_METHOD *method,
+                    int encrypt, void **abstract)
+{
+    unsigned char secret[64];
+    int free_iv;
+    int free_secret;
+    int i;
+
+    for(i = 0; i < 64; i++)
+        secret[i] = (unsigned char)i;
+
+    return method->init(session, method, NULL, &free_iv, secret,
+                        &free_secret, encrypt, abstract);
+}
+
+static int test_poly1305(void)
+{
+    static const char msg[] = "Cryptographic Forum Research Group";
+    _libssh2_poly1305_ctx ctx;
+    unsigned char tag[POLY1305_TAG_LEN];
+
+    /* feed it unevenly to cover the partial block handling */
+    _libssh2_poly1305_init(&ctx, poly1305_key);
+    _libssh2_poly1305_update(&ctx, (const unsigned char *)msg, 5);
+    _libssh2_poly1305_update(&ctx, (const unsigned char *)msg + 5, 20);
+    _libssh2_poly1305_update(&ctx, (const unsigned char *)msg + 25,
+                             sizeof(msg) - 1 - 25);
+    _libssh2_poly1305_finish(&ctx, tag);
+
+    if(memcmp(tag, poly1305_tag, sizeof(tag))) {
+        fprintf(stderr, "poly1305: wrong tag\n");
+        return 1;
+    }
+    return 0;
+}
+
+static int open_packet(LIBSSH2_SESSION *session,
+                       const LIBSSH2_CRYPT_METHOD *method,
+                       const unsigned char *in, unsigned char *out)
+{
+    unsigned char tag[POLY1305_TAG_LEN];
+    void *ctx = NULL;
+    size_t i;
+    int rc;
+
+    if(init_ctx(session, method, 0, &ctx))
+        return -1;
+
+    rc = method->aead_begin(session, SEQNO, in, out, &ctx);
+    /* 24 byte steps, so every other chunk straddles a key stream block */
+    for(i = 4; !rc && i < PACKET_LEN; i += 24) {
+        size_t len = PACKET_LEN - i < 24 ? PACKET_LEN - i : 24;
+        rc = method->crypt_bulk(session, &in[i], &out[i], len, &ctx);
+    }
+    memcpy(tag, &in[PACKET_LEN], sizeof(tag));
+    if(!rc)
+        rc = method->aead_end(session, tag, &ctx);
+
+    method->dtor(session, &ctx);
+    return rc;
+}
+
+static int test_chachapoly(LIBSSH2_SESSION *session)
+{
+    const LIBSSH2_CRYPT_METHOD *method =
+        find_method("chacha20-poly1305@openssh.com");
+    unsigned char plain[PACKET_LEN];
+    unsigned char buf[PACKET_LEN + POLY1305_TAG_LEN];
+    void *ctx = NULL;
+    int rc;
+
+    if(!method) {
+        fprintf(stderr, "chacha20-poly1305@openssh.com: not available\n");
+        return 1;
+    }
+    if(!(method->flags & LIBSSH2_CRYPT_FLAG_INTEGRATED_MAC)) {
+        fprintf(stderr, "chacha20-poly1305@openssh.com: not an AEAD\n");
+        return 1;
+    }
+
+    /* seal in place, the way _libssh2_transport_send() does */
+    make_packet(plain);
+    memcpy(buf, plain, PACKET_LEN);
+    if(init_ctx(session, method, 1, &ctx)) {
+        fprintf(stderr, "chacha20-poly1305@openssh.com: init failed\n");
+        return 1;
+    }
+    rc = method->aead_begin(session, SEQNO, buf, buf, &ctx);
+    if(!rc)
+        rc = method->crypt_bulk(session, buf + 4, buf + 4, PACKET_LEN - 4,
+                                &ctx);
+    if(!rc)
+        rc = method->aead_end(session, buf + PACKET_LEN, &ctx);
+    method->dtor(session, &ctx);
+
+    if(rc || memcmp(buf, sealed, sizeof(sealed))) {
+        fprintf(stderr, "chacha20-poly1305@openssh.com: "
+                "sealed packet differs\n");
+        return 1;
+    }
+
+    memset(buf, 0, sizeof(buf));
+    if(open_packet(session, method, sealed, buf) ||
+       memcmp(buf, plain, PACKET_LEN)) {
+        fprintf(stderr, "chacha20-poly1305@openssh.com: open failed\n");
+        return 1;
+    }
+
+    memcpy(buf, sealed, sizeof(sealed));
+    buf[100] ^= 0x10;
+    if(!open_packet(session, method, buf, plain)) {
+        fprintf(stderr, "chacha20-poly1305@openssh.com: "
+                "tampered packet accepted\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+#ifndef WIN32
+/* reads a packet sealed with packet_length set to len over a socket pair,
+   the way the session would get it from the server */
+static int read_packet(const LIBSSH2_CRYPT_METHOD *method, uint32_t len)
+{
+    LIBSSH2_SESSION *session;
+    unsigned char buf[PACKET_LEN + POLY1305_TAG_LEN];
+    void *ctx = NULL;
+    int fds[2];
+    int rc;
+
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+        return -1;
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    session = libssh2_session_init();
+    libssh2_session_set_blocking(session, 0);
+    session->socket_fd = fds[0];
+
+    make_packet(buf);
+    _libssh2_htonu32(buf, len);
+    rc = init_ctx(session, method, 1, &ctx);
+    if(!rc)
+        rc = method->aead_begin(session, SEQNO, buf, buf, &ctx);
+    if(!rc)
+        rc = method->crypt_bulk(session, buf + 4, buf + 4, PACKET_LEN - 4,
+                                &ctx);
+    if(!rc)
+        rc = method->aead_end(session, buf + PACKET_LEN, &ctx);
+    if(ctx)
+        method->dtor(session, &ctx);
+
+    if(!rc)
+        rc = init_ctx(session, method, 0, &session->remote.crypt_abstract);
+    if(!rc && write(fds[1], buf, sizeof(buf)) != sizeof(buf))
+        rc = -1;
+    if(!rc) {
+        session->remote.crypt = method;
+        session->remote.mac = method->integrated_mac;
+        session->remote.seqno = SEQNO;
+        session->state |= LIBSSH2_STATE_NEWKEYS;
+        rc = _libssh2_transport_read(session);
+    }
+
+    close(fds[0]);
+    close(fds[1]);
+    libssh2_session_free(session);
+    return rc;
+}
+
+static int test_misaligned(void)
+{
+    const LIBSSH2_CRYPT_METHOD *method =
+        find_method("chacha20-poly1305@openssh.com");
+    int rc;
+
+    if(!method)
+        return 1;
+
+    rc = read_packet(method, PACKET_LEN - 4);
+    if(rc < 0 && rc != LIBSSH2_ERROR_EAGAIN) {
+        fprintf(stderr, "chacha20-poly1305@openssh.com: "
+                "packet not read: %d\n", rc);
+        return 1;
+    }
+
+    rc = read_packet(method, PACKET_LEN - 5);
+    if(rc != LIBSSH2_ERROR_DECRYPT) {
+        fprintf(stderr, "chacha20-poly1305@openssh.com: "
+                "misaligned packet_length gave %d\n", rc);
+        return 1;
+    }
+
+    return 0;
+}
+#endif
+
+int main(void)
+{
+    LIBSSH2_SESSION *session;
+    int rc;
+
+    libssh2_init(0);
+    session = libssh2_session_init();
+
+    rc = test_poly1305();
+    rc |= test_chachapoly(session);
+#ifndef WIN32
+    rc |= test_misaligned();
+#endif
+
+    libssh2_session_free(session);
+    libssh2_exit();
+
+    return rc;
+}
@@ -0,0 +1,207 @@
+/* Copyright (C) 2022 The libssh2 project and its contributors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+/*
+ * Checks the budgets for buffered channel data: new channels and window
+ * adjusts get no more window than the session's budget leaves or the
+ * channel's allows, and reading off the socket stops once the buffered data
+ * reaches the session's budget, as soon as the channel being read has some.
+ * The packets are written unencrypted into the session's socket.
+ */
+
+#include <stdlib.h>
+
+#include "libssh2_priv.h"
+#include "channel.h"
+#include "socket_fixture.h"
+
+#ifndef WIN32
+
+#define CHANNELS 3
+#define KB 1024
+#define CHUNK (16 * KB)
+
+static LIBSSH2_CHANNEL channels[CHANNELS];
+
+/* write an unencrypted packet with CHUNK bytes of data for a channel */
+static int send_data(LIBSSH2_CHANNEL *channel)
+{
+    static unsigned char payload[9 + CHUNK];
+
+    payload[0] = SSH_MSG_CHANNEL_DATA;
+    _libssh2_htonu32(payload + 1, channel->local.id);
+    _libssh2_htonu32(payload + 5, CHUNK);
+    memset(payload + 9, 'x', CHUNK);
+    return send_packet(payload, sizeof(payload));
+}
+
+/* give a channel a receive window, keeping the session's sum right */
+static void set_window(LIBSSH2_SESSION *session, LIBSSH2_CHANNEL *channel,
+                       uint32_t window)
+{
+    session->channel_windows -= channel->remote.window_size;
+    channel->remote.window_size = window;
+    channel->remote.window_size_initial = window;
+    session->channel_windows += window;
+}
+
+static int test_windows(LIBSSH2_SESSION *session)
+{
+    LIBSSH2_CHANNEL *a = &channels[0];
+    LIBSSH2_CHANNEL *b = &channels[1];
+    char buf[64];
+
+    libssh2_session_set_channel_buffer_max(session, 1024 * KB);
+
+    /* new channels get what is left, and at least a packet */
+    CHECK(_libssh2_channel_window_open(session, 2048 * KB, 32 * KB) ==
+          1024 * KB - session->channel_windows);
+    set_window(session, b, 1000 * KB);
+    CHECK(_libssh2_channel_window_open(session, 2048 * KB, 32 * KB) ==
+          32 * KB);
+    CHECK(_libssh2_channel_window_open(session, 8 * KB, 32 * KB) ==
+          8 * KB);
+
+    /* a window adjust gets no more than the budget leaves */
+    set_window(session, b, 768 * KB);
+    set_window(session, a, 2048 * KB);
+    session->channel_windows -= a->remote.window_size;
+    a->remote.window_size = 0;
+    CHECK(_libssh2_channel_read(a, 0, buf, sizeof(buf)) ==
+          LIBSSH2_ERROR_EAGAIN);
+    CHECK(a->remote.window_size == 256 * KB);
+    CHECK(session->channel_windows == 1024 * KB);
+
+    /* nor more than the channel's own budget */
+    libssh2_session_set_channel_buffer_max(session, 0);
+    libssh2_channel_set_buffer_max(a, 64 * KB);
+    session->channel_windows -= a->remote.window_size;
+    a->remote.window_size = 0;
+    CHECK(_libssh2_channel_read(a, 0, buf, sizeof(buf)) ==
+          LIBSSH2_ERROR_EAGAIN);
+    CHECK(a->remote.window_size == 64 * KB);
+
+    /* without budgets the window is filled up again */
+    libssh2_channel_set_buffer_max(a, 0);
+    session->channel_windows -= a->remote.window_size;
+    a->remote.window_size = 0;
+    CHECK(_libssh2_channel_read(a, 0, buf, sizeof(buf)) ==
+          LIBSSH2_ERROR_EAGAIN);
+    CHECK(a->remote.window_size == 2048 * KB + sizeof(buf));
+
+    return 0;
+}
+
+static int test_reading(LIBSSH2_SESSION *session)
+{
+    LIBSSH2_CHANNEL *a = &channels[0];
+    LIBSSH2_CHANNEL *b = &channels[1];
+    LIBSSH2_CHANNEL *c = &channels[2];
+    static char buf[CHUNK];
+    int i;
+
+    set_window(session, a, 1024 * KB);
+    set_window(session, b, 1024 * KB);
+    set_window(session, c, 1024 * KB);
+    libssh2_session_set_channel_buffer_max(session, CHUNK * 2);
+
+    for(i = 0; i < 3; i++)
+        CHECK(!send_data(b));
+    CHECK(!send_data(a));
+    CHECK(!send_data(c));
+
+    /* reading stops once two chunks are buffered */
+    CHECK(libssh2_transport_read(session, NULL, 0) == 0);
+    CHECK(libssh2_session_get_channel_buffered(session) == CHUNK * 2);
+    CHECK(b->read_avail == CHUNK * 2);
+
+    /* reading a channel with nothing buffered goes on until it has some */
+    CHECK(_libssh2_channel_read(a, 0, buf, sizeof(buf)) == CHUNK);
+    CHECK(b->read_avail == CHUNK * 3);
+    CHECK(!c->read_avail);
+    CHECK(libssh2_session_get_channel_buffered(session) == CHUNK * 3);
+
+    /* and then the rest comes in as the buffered data is read */
+    for(i = 0; i < 3; i++)
+        CHECK(_libssh2_channel_read(b, 0, buf, sizeof(buf)) == CHUNK);
+    CHECK(c->read_avail == CHUNK);
+    CHECK(_libssh2_channel_read(c, 0, buf, sizeof(buf)) == CHUNK);
+    CHECK(!libssh2_session_get_channel_buffered(session));
+
+    return 0;
+}
+
+int main(void)
+{
+    LIBSSH2_SESSION *session;
+    int rc = 0;
+    int i;
+
+    session = start_socket_fixture();
+    if(!session)
+        return 1;
+
+    for(i = 0; i < CHANNELS; i++) {
+        channels[i].session = session;
+        channels[i].remote.packet_size = 32 * KB;
+        if(_libssh2_channel_nextid(session, &channels[i])) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+        _libssh2_list_add(&session->channels, &channels[i].node);
+    }
+
+    rc |= test_windows(session);
+    rc |= test_reading(session);
+
+    /* the channels are not the session's to free */
+    for(i = 0; i < CHANNELS; i++) {
+        _libssh2_channel_queue_clear(&channels[i]);
+        _libssh2_list_remove(&channels[i].node);
+    }
+
+    stop_socket_fixture(session);
+
+    return rc;
+}
+#else
+int main(void)
+{
+    /* no socket pairs to test with */
+    return 0;
+}
+#endif /* WIN32 */
@@ -0,0 +1,259 @@
+/* Copyright (C) 2022 The libssh2 project and its contributors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+/*
+ * Checks that the callbacks set on a channel get its data as it arrives,
+ * that data they leave is queued for reading, that data they take opens
+ * the receive window again, and that they hear of EOF, close and window
+ * adjusts. The packets are written unencrypted into the session's socket.
+ */
+
+#include <stdlib.h>
+
+#include "libssh2_priv.h"
+#include "channel.h"
+#include "socket_fixture.h"
+
+#ifndef WIN32
+
+#define WINDOW (64 * 1024)
+
+static LIBSSH2_CHANNEL channel;
+
+/* what the callbacks have seen */
+static char taken[4096];
+static size_t taken_len;
+static int take;        /* how many bytes the data callback takes */
+static int last_stream;
+static int eofs;
+static int closes;
+static int windows;
+static void *abstract_seen;
+
+static LIBSSH2_CHANNEL_DATA_FUNC(on_data)
+{
+    size_t len = data_len < (size_t)take ? data_len : (size_t)take;
+    (void)session;
+    (void)channel;
+    abstract_seen = *channel_abstract;
+    last_stream = stream_id;
+    memcpy(taken + taken_len, data, len);
+    taken_len += len;
+    return len;
+}
+
+static LIBSSH2_CHANNEL_EVENT_FUNC(on_eof)
+{
+    (void)session;
+    (void)channel;
+    (void)channel_abstract;
+    eofs++;
+}
+
+static LIBSSH2_CHANNEL_EVENT_FUNC(on_close)
+{
+    (void)session;
+    (void)channel;
+    (void)channel_abstract;
+    closes++;
+}
+
+static LIBSSH2_CHANNEL_EVENT_FUNC(on_window)
+{
+    (void)session;
+    (void)channel;
+    (void)channel_abstract;
+    windows++;
+}
+
+static int send_data(uint32_t stream, const char *text, size_t len)
+{
+    static unsigned char payload[1500];
+    size_t head = stream ? 13 : 9;
+
+    payload[0] = stream ? SSH_MSG_CHANNEL_EXTENDED_DATA : SSH_MSG_CHANNEL_DATA;
+    _libssh2_htonu32(payload + 1, channel.local.id);
+    if(stream)
+        _libssh2_htonu32(payload + 5, stream);
+    _libssh2_htonu32(payload + head - 4, (uint32_t)len);
+    memcpy(payload + head, text, len);
+    return send_packet(payload, head + len);
+}
+
+static int send_channel_msg(unsigned char msg, uint32_t arg)
+{
+    unsigned char payload[9];
+
+    payload[0] = msg;
+    _libssh2_htonu32(payload + 1, channel.local.id);
+    _libssh2_htonu32(payload + 5, arg);
+    return send_packet(payload, msg == SSH_MSG_CHANNEL_WINDOW_ADJUST ? 9 : 5);
+}
+
+/* read what the session has sent, returns the window it has given back */
+static uint32_t window_given(LIBSSH2_SESSION *session)
+{
+    uint32_t given = 0;
+    int count = receive_packets(session);
+    int i;
+
+    for(i = 0; i < count; i++) {
+        if(payloads[i][0] == SSH_MSG_CHANNEL_WINDOW_ADJUST)
+            given += _libssh2_ntohu32(payloads[i] + 5);
+    }
+    return given;
+}
+
+static int process(LIBSSH2_SESSION *session)
+{
+    LIBSSH2_CHANNEL *ready[1];
+
+    return libssh2_transport_read(session, ready, 1) < 0;
+}
+
+static int test_data(LIBSSH2_SESSION *session)
+{
+    static char text[1000];
+    char buf[64];
+    int i;
+
+    for(i = 0; i < (int)sizeof(text); i++)
+        text[i] = (char)('a' + i % 26);
+
+    /* all taken: nothing is queued and the window stays open, once there is
+       enough to give back */
+    take = sizeof(text);
+    CHECK(!send_data(0, text, sizeof(text)));
+    CHECK(!process(session));
+    CHECK(taken_len == sizeof(text) && !memcmp(taken, text, sizeof(text)));
+    CHECK(abstract_seen == &channel);
+    CHECK(!libssh2_poll_channel_read(&channel, 1));
+    CHECK(channel.adjust_queue == sizeof(text));
+
+    CHECK(!send_data(SSH_EXTENDED_DATA_STDERR, text, 100));
+    CHECK(!process(session));
+    CHECK(last_stream == SSH_EXTENDED_DATA_STDERR);
+    CHECK(window_given(session) == sizeof(text) + 100);
+    CHECK(channel.remote.window_size == WINDOW);
+    CHECK(!channel.read_avail);
+
+    /* some taken: the rest is read as usual */
+    taken_len = 0;
+    take = 10;
+    CHECK(!send_data(0, text, 30));
+    CHECK(!process(session));
+    CHECK(taken_len == 10 && !memcmp(taken, text, 10));
+    CHECK(channel.read_avail == 20);
+    CHECK(_libssh2_channel_read(&channel, 0, buf, sizeof(buf)) == 20);
+    CHECK(!memcmp(buf, text + 10, 20));
+
+    /* none taken */
+    take = 0;
+    CHECK(!send_data(0, text, 5));
+    CHECK(!process(session));
+    CHECK(_libssh2_channel_read(&channel, 0, buf, sizeof(buf)) == 5);
+
+    return 0;
+}
+
+static int test_events(LIBSSH2_SESSION *session)
+{
+    CHECK(!send_channel_msg(SSH_MSG_CHANNEL_WINDOW_ADJUST, 1000));
+    CHECK(!process(session));
+    CHECK(windows == 1 && !eofs && !closes);
+    CHECK(!send_channel_msg(SSH_MSG_CHANNEL_EOF, 0));
+    CHECK(!process(session));
+    CHECK(eofs == 1);
+    CHECK(!send_channel_msg(SSH_MSG_CHANNEL_CLOSE, 0));
+    CHECK(!process(session));
+    CHECK(closes == 1);
+
+    /* callbacks are replaced, and unset with NULL */
+    CHECK(libssh2_channel_callback_set(&channel,
+                                       LIBSSH2_CHANNEL_CALLBACK_WINDOW,
+                                       NULL) == (void *)on_window);
+    CHECK(!send_channel_msg(SSH_MSG_CHANNEL_WINDOW_ADJUST, 1000));
+    CHECK(!process(session));
+    CHECK(windows == 1);
+    CHECK(!libssh2_channel_callback_set(&channel, 99, NULL));
+
+    return 0;
+}
+
+int main(void)
+{
+    LIBSSH2_SESSION *session;
+    int rc = 0;
+
+    session = start_socket_fixture();
+    if(!session)
+        return 1;
+
+    channel.session = session;
+    channel.remote.window_size = WINDOW;
+    channel.remote.window_size_initial = WINDOW;
+    channel.remote.packet_size = 32768;
+    if(_libssh2_channel_nextid(session, &channel)) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    *libssh2_channel_abstract(&channel) = &channel;
+    libssh2_channel_callback_set(&channel, LIBSSH2_CHANNEL_CALLBACK_DATA,
+                                 (void *)on_data);
+    libssh2_channel_callback_set(&channel, LIBSSH2_CHANNEL_CALLBACK_EOF,
+                                 (void *)on_eof);
+    libssh2_channel_callback_set(&channel, LIBSSH2_CHANNEL_CALLBACK_CLOSE,
+                                 (void *)on_close);
+    libssh2_channel_callback_set(&channel, LIBSSH2_CHANNEL_CALLBACK_WINDOW,
+                                 (void *)on_window);
+
+    rc |= test_data(session);
+    rc |= test_events(session);
+
+    _libssh2_channel_queue_clear(&channel);
+    stop_socket_fixture(session);
+
+    return rc;
+}
+#else
+int main(void)
+{
+    /* no socket pairs to test with */
+    return 0;
+}
+#endif /* WIN32 */
@@ -0,0 +1,140 @@
+/* Copyright (C) 2022 The libssh2 project and its contributors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+/*
+ * Checks that channels are found by their ID through the session's table,
+ * that the IDs of freed channels are given out again only once the peer
+ * has closed them too, and that the table only grows when all IDs are in
+ * use.
+ */
+
+#include <stdlib.h>
+
+#include "libssh2_priv.h"
+#include "channel.h"
+#include "packet.h"
+#include "socket_fixture.h"
+
+#define CHANNELS 1000
+
+static LIBSSH2_CHANNEL channels[CHANNELS];
+
+static int test_locate(LIBSSH2_SESSION *session)
+{
+    unsigned char *buf;
+    int pool_class;
+    uint32_t i;
+
+    for(i = 0; i < CHANNELS; i++) {
+        channels[i].session = session;
+        CHECK(!_libssh2_channel_nextid(session, &channels[i]));
+    }
+    for(i = 0; i < CHANNELS; i++)
+        CHECK(_libssh2_channel_locate(session, channels[i].local.id) ==
+              &channels[i]);
+    CHECK(!_libssh2_channel_locate(session, session->channel_slots_num));
+    CHECK(!_libssh2_channel_locate(session, 0xffffffff));
+
+    /* a window adjust finds its way to the last channel */
+    buf = _libssh2_packet_buf_alloc(session, 9, &pool_class);
+    CHECK(buf);
+    buf[0] = SSH_MSG_CHANNEL_WINDOW_ADJUST;
+    _libssh2_htonu32(buf + 1, channels[CHANNELS - 1].local.id);
+    _libssh2_htonu32(buf + 5, 12345);
+    CHECK(!_libssh2_packet_add(session, buf, 9, LIBSSH2_MAC_CONFIRMED,
+                               pool_class));
+    CHECK(channels[CHANNELS - 1].local.window_size == 12345);
+
+    return 0;
+}
+
+static int test_reuse(LIBSSH2_SESSION *session)
+{
+    LIBSSH2_CHANNEL channel;
+    uint32_t slots = session->channel_slots_num;
+    uint32_t closed_id = channels[0].local.id;
+    uint32_t open_id = channels[1].local.id;
+
+    /* the peer has closed this one, its ID is free at once */
+    channels[0].remote.close = 1;
+    _libssh2_channel_release_id(session, &channels[0]);
+    CHECK(!_libssh2_channel_locate(session, closed_id));
+
+    /* but this one may still get packets */
+    _libssh2_channel_release_id(session, &channels[1]);
+    CHECK(!_libssh2_channel_locate(session, open_id));
+
+    memset(&channel, 0, sizeof(channel));
+    channel.session = session;
+    CHECK(!_libssh2_channel_nextid(session, &channel));
+    CHECK(channel.local.id == closed_id);
+    CHECK(_libssh2_channel_locate(session, closed_id) == &channel);
+    channel.remote.close = 1;
+    _libssh2_channel_release_id(session, &channel);
+
+    /* once its close arrives, that ID is free too */
+    _libssh2_channel_closed_id(session, open_id);
+    CHECK(!_libssh2_channel_nextid(session, &channels[1]));
+    CHECK(channels[1].local.id == open_id);
+    CHECK(!_libssh2_channel_nextid(session, &channels[0]));
+    CHECK(channels[0].local.id == closed_id);
+
+    CHECK(session->channel_slots_num == slots);
+
+    return 0;
+}
+
+int main(void)
+{
+    LIBSSH2_SESSION *session;
+    int rc = 0;
+
+    libssh2_init(0);
+    session = libssh2_session_init();
+    if(!session) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    rc |= test_locate(session);
+    rc |= test_reuse(session);
+
+    libssh2_session_free(session);
+    libssh2_exit();
+
+    return rc;
+}
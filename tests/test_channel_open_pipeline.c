@@ -0,0 +1,258 @@
+/* Copyright (C) 2022 The libssh2 project and its contributors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+/*
+ * Checks that many channel opens and tcpip-forward requests can be in
+ * flight at once: the opens all go out before any reply has come, replies
+ * to opens are matched to their channels by ID in whatever order they
+ * arrive, and replies to global requests are matched by the order of the
+ * requests, including that of a keepalive. The packets are unencrypted.
+ */
+
+#include <stdlib.h>
+
+#include "libssh2_priv.h"
+#include "channel.h"
+#include "socket_fixture.h"
+
+#ifndef WIN32
+
+#define OPENS 8
+
+
+/* the string at the start of 'p' is 'str' */
+static int is_str(const unsigned char *p, const char *str)
+{
+    size_t len = strlen(str);
+
+    return _libssh2_ntohu32(p) == len && !memcmp(p + 4, str, len);
+}
+
+static int send_open_reply(uint32_t id, int confirm, uint32_t arg)
+{
+    unsigned char payload[24];
+
+    if(confirm) {
+        payload[0] = SSH_MSG_CHANNEL_OPEN_CONFIRMATION;
+        _libssh2_htonu32(payload + 1, id);
+        _libssh2_htonu32(payload + 5, arg);    /* sender channel */
+        _libssh2_htonu32(payload + 9, 1000);   /* window */
+        _libssh2_htonu32(payload + 13, 500);   /* packet size */
+        return send_packet(payload, 17);
+    }
+    payload[0] = SSH_MSG_CHANNEL_OPEN_FAILURE;
+    _libssh2_htonu32(payload + 1, id);
+    _libssh2_htonu32(payload + 5, arg);        /* reason */
+    _libssh2_htonu32(payload + 9, 0);          /* description */
+    _libssh2_htonu32(payload + 13, 0);         /* language */
+    return send_packet(payload, 17);
+}
+
+static int send_request_reply(int success, uint32_t port)
+{
+    unsigned char payload[5];
+
+    payload[0] = success ? SSH_MSG_REQUEST_SUCCESS : SSH_MSG_REQUEST_FAILURE;
+    _libssh2_htonu32(payload + 1, port);
+    return send_packet(payload, port ? 5 : 1);
+}
+
+static int test_opens(LIBSSH2_SESSION *session)
+{
+    LIBSSH2_CHANNEL *channels[OPENS];
+    LIBSSH2_CHANNEL *ready[OPENS];
+    uint32_t ids[OPENS];
+    char *msg;
+    int i;
+
+    for(i = 0; i < OPENS; i++) {
+        channels[i] = libssh2_channel_open_session_start(session);
+        CHECK(channels[i]);
+    }
+
+    /* all requests are out before any reply */
+    CHECK(receive_packets(session) == OPENS);
+    for(i = 0; i < OPENS; i++) {
+        CHECK(payloads[i][0] == SSH_MSG_CHANNEL_OPEN);
+        CHECK(is_str(payloads[i] + 1, "session"));
+        ids[i] = _libssh2_ntohu32(payloads[i] + 12);
+        CHECK(ids[i] == channels[i]->local.id);
+    }
+    CHECK(libssh2_channel_open_finish(channels[0]) == LIBSSH2_ERROR_EAGAIN);
+
+    /* replies in reverse order, every other one turned down */
+    for(i = OPENS - 1; i >= 0; i--)
+        CHECK(!send_open_reply(ids[i], !(i % 2),
+                               i % 2 ? SSH_OPEN_CONNECT_FAILED : 100 + i));
+
+    /* all of them can be finished without blocking now */
+    CHECK(libssh2_transport_read(session, ready, OPENS) == OPENS);
+
+    for(i = 0; i < OPENS; i++) {
+        if(i % 2) {
+            CHECK(libssh2_channel_open_finish(channels[i]) ==
+                  LIBSSH2_ERROR_CHANNEL_FAILURE);
+            libssh2_session_last_error(session, &msg, NULL, 0);
+            CHECK(strstr(msg, "connect failed"));
+            /* nothing to close at either end */
+            CHECK(libssh2_channel_free(channels[i]) == 0);
+            continue;
+        }
+        CHECK(libssh2_channel_open_finish(channels[i]) == 0);
+        CHECK(channels[i]->remote.id == (uint32_t)(100 + i));
+        CHECK(channels[i]->local.window_size == 1000);
+        CHECK(channels[i]->local.packet_size == 500);
+    }
+    CHECK(receive_packets(session) == 0);
+
+    for(i = 0; i < OPENS; i += 2) {
+        unsigned char payload[5];
+
+        payload[0] = SSH_MSG_CHANNEL_CLOSE;
+        _libssh2_htonu32(payload + 1, ids[i]);
+        CHECK(!send_packet(payload, 5));
+        CHECK(libssh2_channel_free(channels[i]) == 0);
+    }
+    /* EOF and CLOSE of each */
+    CHECK(receive_packets(session) == OPENS / 2 * 2);
+
+    return 0;
+}
+
+static int test_free_pending(LIBSSH2_SESSION *session)
+{
+    LIBSSH2_CHANNEL *channel;
+    uint32_t id;
+
+    channel = libssh2_channel_direct_tcpip_start(session, "localhost", 80,
+                                                 "127.0.0.1", 22);
+    CHECK(channel);
+    CHECK(receive_packets(session) == 1);
+    CHECK(is_str(payloads[0] + 1, "direct-tcpip"));
+    CHECK(is_str(payloads[0] + 29, "localhost"));
+    id = channel->local.id;
+
+    /* freeing waits for the reply, to know if there is anything to close */
+    CHECK(libssh2_channel_free(channel) == LIBSSH2_ERROR_EAGAIN);
+    CHECK(!send_open_reply(id, 0, SSH_OPEN_ADMINISTRATIVELY_PROHIBITED));
+    CHECK(libssh2_channel_free(channel) == 0);
+    CHECK(receive_packets(session) == 0);
+
+    /* and the ID is free to use again */
+    channel = libssh2_channel_open_session_start(session);
+    CHECK(channel && channel->local.id == id);
+    CHECK(receive_packets(session) == 1);
+    CHECK(!send_open_reply(id, 0, SSH_OPEN_RESOURCE_SHORTAGE));
+    CHECK(libssh2_channel_open_finish(channel) ==
+          LIBSSH2_ERROR_CHANNEL_FAILURE);
+    CHECK(libssh2_channel_free(channel) == 0);
+
+    return 0;
+}
+
+static int test_listen(LIBSSH2_SESSION *session)
+{
+    LIBSSH2_LISTENER *any, *denied, *fixed;
+    int port = 0;
+
+    any = libssh2_channel_forward_listen_start(session, NULL, 0, 16);
+    CHECK(any);
+    libssh2_keepalive_config(session, 1, 60);
+    CHECK(libssh2_keepalive_send(session, NULL) == 0);
+    denied = libssh2_channel_forward_listen_start(session, "::", 2222, 16);
+    fixed = libssh2_channel_forward_listen_start(session, NULL, 3333, 16);
+    CHECK(denied && fixed);
+
+    CHECK(receive_packets(session) == 4);
+    CHECK(is_str(payloads[0] + 1, "tcpip-forward"));
+    CHECK(is_str(payloads[1] + 1, "keepalive@libssh2.org"));
+    CHECK(is_str(payloads[2] + 1, "tcpip-forward"));
+    CHECK(is_str(payloads[2] + 19, "::"));
+    CHECK(is_str(payloads[3] + 1, "tcpip-forward"));
+    CHECK(libssh2_channel_forward_listen_finish(any, &port) ==
+          LIBSSH2_ERROR_EAGAIN);
+
+    /* the keepalive's reply comes in between */
+    CHECK(!send_request_reply(1, 5555));
+    CHECK(!send_request_reply(1, 0));
+    CHECK(!send_request_reply(0, 0));
+    CHECK(!send_request_reply(1, 0));
+
+    CHECK(libssh2_channel_forward_listen_finish(fixed, &port) == 0);
+    CHECK(port == 3333);
+    CHECK(libssh2_channel_forward_listen_finish(denied, &port) ==
+          LIBSSH2_ERROR_REQUEST_DENIED);
+    CHECK(libssh2_channel_forward_listen_finish(any, &port) == 0);
+    CHECK(port == 5555);
+    CHECK(_libssh2_list_first(&session->global_requests) == NULL);
+
+    /* only what got bound is cancelled */
+    CHECK(libssh2_channel_forward_cancel(denied) == 0);
+    CHECK(receive_packets(session) == 0);
+    CHECK(libssh2_channel_forward_cancel(any) == 0);
+    CHECK(libssh2_channel_forward_cancel(fixed) == 0);
+    CHECK(receive_packets(session) == 2);
+    CHECK(is_str(payloads[0] + 1, "cancel-tcpip-forward"));
+    CHECK(_libssh2_ntohu32(payloads[0] + 37) == 5555);
+
+    return 0;
+}
+
+int main(void)
+{
+    LIBSSH2_SESSION *session;
+    int rc = 0;
+
+    session = start_socket_fixture();
+    if(!session)
+        return 1;
+
+    rc |= test_opens(session);
+    rc |= test_free_pending(session);
+    rc |= test_listen(session);
+
+    stop_socket_fixture(session);
+
+    return rc;
+}
+#else
+int main(void)
+{
+    /* no socket pairs to test with */
+    return 0;
+}
+#endif /* WIN32 */
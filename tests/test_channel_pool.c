@@ -0,0 +1,223 @@
+/* Copyright (C) 2022 The libssh2 project and its contributors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+/*
+ * Checks that a channel pool opens its channels ahead of time, hands out an
+ * open channel without a round trip and starts opening another in its
+ * place, keeps its channels off the session's ready lists and gets past
+ * opens the server turns down. The packets are unencrypted.
+ */
+
+#include <stdlib.h>
+
+#include "libssh2_priv.h"
+#include "channel.h"
+#include "socket_fixture.h"
+
+#ifndef WIN32
+
+#define POOL_SIZE 4
+
+
+/* the sender channel of the 'n'th CHANNEL_OPEN received */
+static uint32_t open_id(int n)
+{
+    size_t type_len = _libssh2_ntohu32(payloads[n] + 1);
+
+    return _libssh2_ntohu32(payloads[n] + 5 + type_len);
+}
+
+static int send_open_reply(uint32_t id, int confirm)
+{
+    unsigned char payload[17];
+
+    payload[0] = confirm ? SSH_MSG_CHANNEL_OPEN_CONFIRMATION :
+        SSH_MSG_CHANNEL_OPEN_FAILURE;
+    _libssh2_htonu32(payload + 1, id);
+    if(confirm) {
+        _libssh2_htonu32(payload + 5, 100 + id);  /* sender channel */
+        _libssh2_htonu32(payload + 9, 1000);      /* window */
+        _libssh2_htonu32(payload + 13, 500);      /* packet size */
+    }
+    else {
+        _libssh2_htonu32(payload + 5, SSH_OPEN_RESOURCE_SHORTAGE);
+        _libssh2_htonu32(payload + 9, 0);         /* description */
+        _libssh2_htonu32(payload + 13, 0);        /* language */
+    }
+    return send_packet(payload, 17);
+}
+
+static int send_close(uint32_t id)
+{
+    unsigned char payload[5];
+
+    payload[0] = SSH_MSG_CHANNEL_CLOSE;
+    _libssh2_htonu32(payload + 1, id);
+    return send_packet(payload, 5);
+}
+
+static int test_session_pool(LIBSSH2_SESSION *session)
+{
+    LIBSSH2_CHANNEL_POOL *pool;
+    LIBSSH2_CHANNEL *channel, *second;
+    LIBSSH2_CHANNEL *ready[POOL_SIZE];
+    uint32_t ids[POOL_SIZE];
+    uint32_t id;
+    int i;
+
+    CHECK(!libssh2_channel_pool_init(session, 0));
+    pool = libssh2_channel_pool_init(session, POOL_SIZE);
+    CHECK(pool);
+
+    /* all of them are opened right away */
+    CHECK(receive_packets(session) == POOL_SIZE);
+    for(i = 0; i < POOL_SIZE; i++) {
+        CHECK(payloads[i][0] == SSH_MSG_CHANNEL_OPEN);
+        ids[i] = open_id(i);
+    }
+    CHECK(!libssh2_channel_pool_acquire(pool));
+    CHECK(libssh2_session_last_errno(session) == LIBSSH2_ERROR_EAGAIN);
+
+    for(i = 0; i < POOL_SIZE; i++)
+        CHECK(!send_open_reply(ids[i], 1));
+
+    /* open, but not the app's until taken */
+    CHECK(libssh2_transport_read(session, ready, POOL_SIZE) == 0);
+
+    channel = libssh2_channel_pool_acquire(pool);
+    CHECK(channel);
+    CHECK(channel->remote.id == 100 + channel->local.id);
+    CHECK(channel->local.window_size == 1000);
+
+    /* and one more is opened in its place */
+    CHECK(receive_packets(session) == 1);
+    CHECK(payloads[0][0] == SSH_MSG_CHANNEL_OPEN);
+    id = open_id(0);
+
+    /* a pooled channel the server closed is not handed out */
+    second = libssh2_channel_pool_acquire(pool);
+    CHECK(second && second != channel);
+    CHECK(receive_packets(session) == 1);
+    for(i = 0; i < POOL_SIZE; i++)
+        if(ids[i] != channel->local.id && ids[i] != second->local.id)
+            break;
+    CHECK(!send_close(ids[i]));
+    CHECK(!send_open_reply(id, 0));
+    CHECK(!send_open_reply(open_id(0), 1));
+    for(i = 0; i < 2; i++) {
+        LIBSSH2_CHANNEL *next = libssh2_channel_pool_acquire(pool);
+
+        CHECK(next);
+        CHECK(!next->remote.close);
+        CHECK(libssh2_transport_read(session, ready, POOL_SIZE) == 0);
+        CHECK(!send_close(next->local.id));
+        CHECK(libssh2_channel_free(next) == 0);
+    }
+
+    CHECK(!send_close(channel->local.id));
+    CHECK(libssh2_channel_free(channel) == 0);
+    CHECK(!send_close(second->local.id));
+    CHECK(libssh2_channel_free(second) == 0);
+    receive_packets(session);
+
+    /* what is left is being opened, or turned down */
+    CHECK(libssh2_channel_pool_free(pool) == LIBSSH2_ERROR_EAGAIN);
+    CHECK(receive_packets(session) == 0);
+    for(i = 0; i < POOL_SIZE; i++) {
+        if(pool->channels[i]) {
+            CHECK(pool->channels[i]->open_state == libssh2_NB_state_sent);
+            CHECK(!send_open_reply(pool->channels[i]->local.id, 0));
+        }
+    }
+    CHECK(libssh2_channel_pool_free(pool) == 0);
+    CHECK(receive_packets(session) == 0);
+
+    return 0;
+}
+
+static int test_refused(LIBSSH2_SESSION *session)
+{
+    LIBSSH2_CHANNEL_POOL *pool;
+    char *msg;
+
+    pool = libssh2_channel_pool_direct_tcpip(session, "localhost", 80,
+                                             "127.0.0.1", 22, 1);
+    CHECK(pool);
+    CHECK(receive_packets(session) == 1);
+    CHECK(_libssh2_ntohu32(payloads[0] + 1) == sizeof("direct-tcpip") - 1);
+
+    /* the error of the open is passed on */
+    CHECK(!send_open_reply(open_id(0), 0));
+    CHECK(!libssh2_channel_pool_acquire(pool));
+    CHECK(libssh2_session_last_error(session, &msg, NULL, 0) ==
+          LIBSSH2_ERROR_CHANNEL_FAILURE);
+    CHECK(strstr(msg, "resource shortage"));
+
+    /* and the next call tries again */
+    CHECK(receive_packets(session) == 0);
+    CHECK(!libssh2_channel_pool_acquire(pool));
+    CHECK(libssh2_session_last_errno(session) == LIBSSH2_ERROR_EAGAIN);
+    CHECK(receive_packets(session) == 1);
+    CHECK(!send_open_reply(open_id(0), 0));
+    CHECK(libssh2_channel_pool_free(pool) == 0);
+
+    return 0;
+}
+
+int main(void)
+{
+    LIBSSH2_SESSION *session;
+    int rc = 0;
+
+    session = start_socket_fixture();
+    if(!session)
+        return 1;
+
+    rc |= test_session_pool(session);
+    rc |= test_refused(session);
+
+    stop_socket_fixture(session);
+
+    return rc;
+}
+#else
+int main(void)
+{
+    /* no socket pairs to test with */
+    return 0;
+}
+#endif /* WIN32 */
@@ -0,0 +1,231 @@
+/* Copyright (C) 2022 The libssh2 project and its contributors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+/*
+ * Checks that data written to an interactive channel while a bulk channel
+ * keeps the socket busy goes out ahead of the bulk data waiting to be sent,
+ * and that channels of the same priority share the socket by their weights.
+ */
+
+#include <stdlib.h>
+
+#include "libssh2_priv.h"
+#include "channel.h"
+#include "transport.h"
+#include "socket_fixture.h"
+
+#ifndef WIN32
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define PACKET_SIZE 32768
+#define CHANNELS 3
+
+static char data[SCHED_QUEUE_MAX * 2];
+static unsigned char buf[SCHED_QUEUE_MAX * 16];
+static size_t buf_len;
+
+/* per channel id: the data bytes received and where in the stream of all
+   data bytes its first and last packets were */
+static size_t got[CHANNELS];
+static size_t first[CHANNELS];
+static size_t last[CHANNELS];
+static size_t total;
+
+/* read the unencrypted packets off the socket, sending what the session has
+   queued until nothing is left */
+static int drain(LIBSSH2_SESSION *session, int fd)
+{
+    size_t i = 0;
+    ssize_t rc;
+
+    do {
+        rc = libssh2_transport_write(session, NULL, 0);
+        if(rc < 0 && rc != LIBSSH2_ERROR_EAGAIN)
+            return -1;
+        while((rc = read(fd, &buf[buf_len], sizeof(buf) - buf_len)) > 0)
+            buf_len += rc;
+    } while(session->sched_queued ||
+            session->packet.oqueued > session->packet.osent);
+
+    while(i < buf_len) {
+        size_t packet_len = _libssh2_ntohu32(&buf[i]);
+        unsigned char *payload = &buf[i + 5];
+        uint32_t id = _libssh2_ntohu32(&payload[1]);
+        size_t len = _libssh2_ntohu32(&payload[5]);
+
+        if(payload[0] != SSH_MSG_CHANNEL_DATA || id >= CHANNELS ||
+           9 + len + buf[i + 4] + 1 != packet_len ||
+           memcmp(&payload[9], &data[got[id]], len))
+            return -1;
+        if(!got[id])
+            first[id] = total;
+        last[id] = total;
+        got[id] += len;
+        total += len;
+        i += 4 + packet_len;
+    }
+    buf_len = 0;
+    return 0;
+}
+
+static void reset(void)
+{
+    memset(got, 0, sizeof(got));
+    total = 0;
+}
+
+/* write until the channel takes no more */
+static size_t fill(LIBSSH2_CHANNEL *channel)
+{
+    size_t written = 0;
+    ssize_t rc;
+
+    while((rc = libssh2_channel_write(channel, &data[written],
+                                      sizeof(data) - written)) > 0)
+        written += rc;
+    return written;
+}
+
+static int test_interactive(LIBSSH2_SESSION *session,
+                            LIBSSH2_CHANNEL **channels, int fd)
+{
+    size_t bulk;
+    ssize_t rc;
+
+    CHECK(libssh2_channel_set_priority(channels[0], 3, 1) ==
+          LIBSSH2_ERROR_INVAL);
+    CHECK(libssh2_channel_set_priority(channels[0],
+                                       LIBSSH2_CHANNEL_PRIORITY_BULK, 0) ==
+          LIBSSH2_ERROR_INVAL);
+    CHECK(!libssh2_channel_set_priority(channels[0],
+                                        LIBSSH2_CHANNEL_PRIORITY_BULK, 1));
+    CHECK(!libssh2_channel_set_priority(channels[1],
+                                        LIBSSH2_CHANNEL_PRIORITY_INTERACTIVE,
+                                        1));
+
+    reset();
+    bulk = fill(channels[0]);
+    CHECK(channels[0]->write_queued >= SCHED_QUEUE_MAX);
+
+    /* a keystroke, while the bulk channel has its write queue full */
+    rc = libssh2_channel_write(channels[1], data, 3);
+    CHECK(rc == 3);
+
+    CHECK(!drain(session, fd));
+    CHECK(got[0] == bulk);
+    CHECK(got[1] == 3);
+    /* it went ahead of a full write queue of bulk data */
+    CHECK(first[1] + SCHED_QUEUE_MAX <= bulk);
+    return 0;
+}
+
+static int test_weights(LIBSSH2_SESSION *session,
+                        LIBSSH2_CHANNEL **channels, int fd)
+{
+    size_t light;
+    size_t heavy;
+
+    CHECK(!libssh2_channel_set_priority(channels[0],
+                                        LIBSSH2_CHANNEL_PRIORITY_BULK, 1));
+    CHECK(!libssh2_channel_set_priority(channels[2],
+                                        LIBSSH2_CHANNEL_PRIORITY_BULK, 3));
+
+    reset();
+    light = fill(channels[0]);
+    heavy = fill(channels[2]);
+    CHECK(channels[0]->write_queued >= SCHED_QUEUE_MAX);
+    CHECK(channels[2]->write_queued >= SCHED_QUEUE_MAX);
+
+    CHECK(!drain(session, fd));
+    CHECK(got[0] == light);
+    CHECK(got[2] == heavy);
+    /* the heavier one is done first, although it started later */
+    CHECK(last[2] < last[0]);
+    return 0;
+}
+
+int main(void)
+{
+    LIBSSH2_SESSION *session;
+    LIBSSH2_CHANNEL *channels[CHANNELS];
+    int size = 4096;
+    int rc = 0;
+    size_t i;
+
+    for(i = 0; i < sizeof(data); i++)
+        data[i] = (char)(i * 7 + (i >> 8));
+
+    session = start_socket_fixture();
+    if(!session)
+        return 1;
+    /* small socket buffers, so that the socket is soon busy */
+    setsockopt(session->socket_fd, SOL_SOCKET, SO_SNDBUF, &size,
+               sizeof(size));
+    setsockopt(socket_fixture_peer(), SOL_SOCKET, SO_RCVBUF, &size,
+               sizeof(size));
+
+    for(i = 0; i < CHANNELS; i++) {
+        channels[i] = calloc(1, sizeof(LIBSSH2_CHANNEL));
+        if(!channels[i]) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+        channels[i]->session = session;
+        channels[i]->remote.id = (uint32_t)i;
+        channels[i]->local.packet_size = PACKET_SIZE;
+        channels[i]->local.window_size = 64 * 1024 * 1024;
+    }
+
+    rc |= test_interactive(session, channels, socket_fixture_peer());
+    rc |= test_weights(session, channels, socket_fixture_peer());
+
+    for(i = 0; i < CHANNELS; i++) {
+        _libssh2_transport_drop_writes(channels[i]);
+        free(channels[i]);
+    }
+    stop_socket_fixture(session);
+
+    return rc;
+}
+#else
+int main(void)
+{
+    /* no socket pairs to test with */
+    return 0;
+}
+#endif /* WIN32 */
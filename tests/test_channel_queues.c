@@ -0,0 +1,293 @@
+/* Copyright (C) 2022 The libssh2 project and its contributors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+/*
+ * Checks that received channel data is queued on the channel it is for, one
+ * queue per stream, so that reading, polling and flushing a channel only
+ * look at its own data and report the bytes waiting without walking a list.
+ * Also checks peeking at the queued data in place and consuming it.
+ */
+
+#include <stdlib.h>
+
+#include "libssh2_priv.h"
+#include "channel.h"
+#include "packet.h"
+#include "socket_fixture.h"
+
+#ifndef WIN32
+
+#define CHANNELS 100
+#define ROUNDS 3
+
+static LIBSSH2_CHANNEL channels[CHANNELS];
+
+/* hand the session a CHANNEL_DATA packet, or a CHANNEL_EXTENDED_DATA one
+   when 'stream' isn't 0 */
+static int add_data(LIBSSH2_SESSION *session, LIBSSH2_CHANNEL *channel,
+                    uint32_t stream, const char *text)
+{
+    size_t len = strlen(text);
+    size_t head = stream ? 13 : 9;
+    unsigned char *buf;
+    int pool_class;
+
+    buf = _libssh2_packet_buf_alloc(session, head + len, &pool_class);
+    if(!buf)
+        return 1;
+    buf[0] = stream ? SSH_MSG_CHANNEL_EXTENDED_DATA : SSH_MSG_CHANNEL_DATA;
+    _libssh2_htonu32(buf + 1, channel->local.id);
+    if(stream)
+        _libssh2_htonu32(buf + 5, stream);
+    _libssh2_htonu32(buf + head - 4, (uint32_t)len);
+    memcpy(buf + head, text, len);
+
+    return _libssh2_packet_add(session, buf, head + len,
+                               LIBSSH2_MAC_CONFIRMED, pool_class);
+}
+
+/* read all queued data of a stream as a string */
+static int read_all(LIBSSH2_CHANNEL *channel, int stream, char *buf,
+                    size_t buflen)
+{
+    ssize_t got = _libssh2_channel_read(channel, stream, buf, buflen - 1);
+
+    if(got < 0)
+        return 1;
+    buf[got] = 0;
+    return 0;
+}
+
+static int test_streams(LIBSSH2_SESSION *session)
+{
+    char expect[256];
+    char buf[256];
+    unsigned long avail;
+    int i;
+    int r;
+
+    for(r = 0; r < ROUNDS; r++) {
+        for(i = 0; i < CHANNELS; i++) {
+            char text[32];
+            snprintf(text, sizeof(text), "out%d.%d ", i, r);
+            CHECK(!add_data(session, &channels[i], 0, text));
+            snprintf(text, sizeof(text), "err%d.%d ", i, r);
+            CHECK(!add_data(session, &channels[i], 1, text));
+        }
+    }
+    CHECK(!_libssh2_list_first(&session->packets));
+
+    for(i = 0; i < CHANNELS; i++) {
+        LIBSSH2_CHANNEL *channel = &channels[i];
+
+        libssh2_channel_window_read_ex(channel, &avail, NULL);
+        CHECK(avail == channel->read_avail);
+        CHECK(libssh2_poll_channel_read(channel, 0));
+        CHECK(_libssh2_channel_packet_data_len(channel, 1) ==
+              strlen("err0.0 ") + (i > 9));
+
+        expect[0] = 0;
+        for(r = 0; r < ROUNDS; r++)
+            snprintf(expect + strlen(expect), sizeof(expect) - strlen(expect),
+                     "out%d.%d ", i, r);
+        CHECK(!read_all(channel, 0, buf, sizeof(buf)));
+        CHECK(!strcmp(buf, expect));
+        CHECK(!libssh2_poll_channel_read(channel, 0));
+        CHECK(libssh2_poll_channel_read(channel, 1));
+        CHECK(!libssh2_channel_eof(channel));
+
+        expect[0] = 0;
+        for(r = 0; r < ROUNDS; r++)
+            snprintf(expect + strlen(expect), sizeof(expect) - strlen(expect),
+                     "err%d.%d ", i, r);
+        CHECK(!read_all(channel, 1, buf, sizeof(buf)));
+        CHECK(!strcmp(buf, expect));
+
+        libssh2_channel_window_read_ex(channel, &avail, NULL);
+        CHECK(!avail);
+        CHECK(!channel->read_avail);
+        CHECK(!libssh2_poll_channel_read(channel, 1));
+    }
+
+    return 0;
+}
+
+static int test_merge(LIBSSH2_SESSION *session)
+{
+    LIBSSH2_CHANNEL *channel = &channels[0];
+    char buf[64];
+
+    /* merged extended data reads in the order it arrived */
+    channel->remote.extended_data_ignore_mode =
+        LIBSSH2_CHANNEL_EXTENDED_DATA_MERGE;
+    CHECK(!add_data(session, channel, 1, "a"));
+    CHECK(!add_data(session, channel, 0, "b"));
+    CHECK(!add_data(session, channel, 1, "c"));
+    CHECK(!add_data(session, channel, 0, "d"));
+    CHECK(!read_all(channel, 0, buf, sizeof(buf)));
+    CHECK(!strcmp(buf, "abcd"));
+    channel->remote.extended_data_ignore_mode =
+        LIBSSH2_CHANNEL_EXTENDED_DATA_NORMAL;
+
+    return 0;
+}
+
+static int test_flush(LIBSSH2_SESSION *session)
+{
+    LIBSSH2_CHANNEL *channel = &channels[1];
+    char buf[64];
+
+    CHECK(!add_data(session, channel, 0, "keep"));
+    CHECK(!add_data(session, channel, 1, "toss"));
+    CHECK(!add_data(session, channel, 2, "toss"));
+    channel->remote.eof = 1;
+    CHECK(!libssh2_channel_eof(channel));
+
+    CHECK(_libssh2_channel_flush(channel,
+                                 LIBSSH2_CHANNEL_FLUSH_EXTENDED_DATA) == 8);
+    CHECK(!_libssh2_list_first(&channel->read_queue[1]));
+    CHECK(!read_all(channel, 0, buf, sizeof(buf)));
+    CHECK(!strcmp(buf, "keep"));
+    CHECK(libssh2_channel_eof(channel));
+
+    /* and data for a channel that is gone is dropped */
+    channels[2].remote.close = 1;
+    _libssh2_channel_release_id(session, &channels[2]);
+    CHECK(!add_data(session, &channels[2], 0, "lost"));
+    CHECK(!channels[2].read_queued[0]);
+    CHECK(!_libssh2_list_first(&session->packets));
+
+    return 0;
+}
+
+static int test_peek(LIBSSH2_SESSION *session)
+{
+    LIBSSH2_CHANNEL *channel = &channels[3];
+    static char big[30000];
+    const char *data;
+    size_t len;
+
+    /* the data is pointed to where it was received */
+    CHECK(!add_data(session, channel, 0, "hello"));
+    CHECK(!add_data(session, channel, 1, "oops"));
+    CHECK(!add_data(session, channel, 0, " world"));
+    CHECK(!libssh2_channel_read_peek(channel, 0, &data, &len));
+    CHECK(len == 5 && !memcmp(data, "hello", 5));
+    CHECK(data == (const char *)
+          ((LIBSSH2_PACKET *)_libssh2_list_first(&channel->read_queue[0]))->
+          data + 9);
+
+    /* consumed in parts, and not past what was peeked at */
+    CHECK(!libssh2_channel_read_consume(channel, 0, 2));
+    CHECK(!libssh2_channel_read_peek(channel, 0, &data, &len));
+    CHECK(len == 3 && !memcmp(data, "llo", 3));
+    CHECK(libssh2_channel_read_consume(channel, 0, 4) ==
+          LIBSSH2_ERROR_BAD_USE);
+    CHECK(!libssh2_channel_read_consume(channel, 0, 3));
+    CHECK(!libssh2_channel_read_peek(channel, 0, &data, &len));
+    CHECK(len == 6 && !memcmp(data, " world", 6));
+    CHECK(!libssh2_channel_read_consume(channel, 0, 6));
+
+    CHECK(libssh2_channel_read_peek(channel, 0, &data, &len) ==
+          LIBSSH2_ERROR_EAGAIN);
+    CHECK(!libssh2_channel_read_peek(channel, 1, &data, &len));
+    CHECK(len == 4 && !memcmp(data, "oops", 4));
+    CHECK(!libssh2_channel_read_consume(channel, 1, 4));
+    CHECK(!channel->read_avail);
+
+    /* the window is given back once a quarter of it has been consumed */
+    channel->remote.window_size_initial = 64 * 1024;
+    channel->remote.window_size = 64 * 1024;
+    memset(big, 'x', sizeof(big) - 1);
+    CHECK(!add_data(session, channel, 0, big));
+    CHECK(!libssh2_channel_read_peek(channel, 0, &data, &len));
+    CHECK(len == sizeof(big) - 1);
+    CHECK(channel->remote.window_size == 64 * 1024);
+    CHECK(!libssh2_channel_read_consume(channel, 0, len));
+    CHECK(channel->remote.window_size == 64 * 1024 - len);
+    CHECK(libssh2_channel_read_peek(channel, 0, &data, &len) ==
+          LIBSSH2_ERROR_EAGAIN);
+    CHECK(channel->remote.window_size == 64 * 1024);
+
+    /* at EOF there is nothing to wait for */
+    channel->remote.eof = 1;
+    CHECK(!libssh2_channel_read_peek(channel, 0, &data, &len));
+    CHECK(!len);
+
+    return 0;
+}
+
+int main(void)
+{
+    LIBSSH2_SESSION *session;
+    int rc = 0;
+    int i;
+
+    /* reads find nothing more on the socket, window adjusts go into it */
+    session = start_socket_fixture();
+    if(!session)
+        return 1;
+
+    for(i = 0; i < CHANNELS; i++) {
+        channels[i].session = session;
+        channels[i].remote.window_size = 1024 * 1024;
+        channels[i].remote.packet_size = 32768;
+        if(_libssh2_channel_nextid(session, &channels[i])) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+    }
+
+    rc |= test_streams(session);
+    rc |= test_merge(session);
+    rc |= test_flush(session);
+    rc |= test_peek(session);
+
+    for(i = 0; i < CHANNELS; i++)
+        _libssh2_channel_queue_clear(&channels[i]);
+
+    stop_socket_fixture(session);
+
+    return rc;
+}
+#else
+int main(void)
+{
+    /* no socket pairs to test with */
+    return 0;
+}
+#endif /* WIN32 */
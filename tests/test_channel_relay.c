@@ -0,0 +1,283 @@
+/* Copyright (C) 2022 The libssh2 project and its contributors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+/*
+ * Checks that libssh2_channel_relay_pump() moves data both ways between a
+ * channel and a socket, stops at the remote end's window and at a full
+ * socket, and passes EOF on in both directions. The packets of the remote
+ * end are written unencrypted into the session's socket.
+ */
+
+#include <stdlib.h>
+
+#include "libssh2_priv.h"
+#include "channel.h"
+#include "socket_fixture.h"
+
+#ifndef WIN32
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define WINDOW (256 * 1024)
+#define PACKETS 12
+#define PACKET_DATA 16384
+
+static LIBSSH2_CHANNEL *channel;
+static int local;  /* the other end of the relayed socket */
+
+static unsigned char data[PACKETS * PACKET_DATA];
+static unsigned char buf[PACKETS * PACKET_DATA * 2];
+
+static int send_data(const unsigned char *text, size_t len)
+{
+    static unsigned char payload[PACKET_DATA + 9];
+
+    payload[0] = SSH_MSG_CHANNEL_DATA;
+    _libssh2_htonu32(payload + 1, channel->local.id);
+    _libssh2_htonu32(payload + 5, (uint32_t)len);
+    memcpy(payload + 9, text, len);
+    return send_packet(payload, 9 + len);
+}
+
+static int send_channel_msg(unsigned char msg, uint32_t arg)
+{
+    unsigned char payload[9];
+
+    payload[0] = msg;
+    _libssh2_htonu32(payload + 1, channel->local.id);
+    _libssh2_htonu32(payload + 5, arg);
+    return send_packet(payload, msg == SSH_MSG_CHANNEL_WINDOW_ADJUST ? 9 : 5);
+}
+
+/* read what the session sent the remote end, put the channel data together
+   in 'buf' and count the window adjusts and EOFs. Returns the number of
+   data bytes. */
+static ssize_t collect(int *adjusts, int *eofs)
+{
+    static unsigned char in[sizeof(buf)];
+    size_t len = 0;
+    size_t got = 0;
+    size_t i;
+    ssize_t rc;
+
+    *adjusts = 0;
+    *eofs = 0;
+    while((rc = read(socket_fixture_peer(), &in[len], sizeof(in) - len)) > 0)
+        len += rc;
+
+    for(i = 0; i < len;) {
+        size_t packet_len = _libssh2_ntohu32(&in[i]);
+        unsigned char *payload = &in[i + 5];
+
+        if(_libssh2_ntohu32(&payload[1]) != 7)
+            return -1;
+        if(payload[0] == SSH_MSG_CHANNEL_DATA) {
+            size_t data_len = _libssh2_ntohu32(&payload[5]);
+            memcpy(&buf[got], &payload[9], data_len);
+            got += data_len;
+        }
+        else if(payload[0] == SSH_MSG_CHANNEL_WINDOW_ADJUST)
+            (*adjusts)++;
+        else if(payload[0] == SSH_MSG_CHANNEL_EOF)
+            (*eofs)++;
+        else
+            return -1;
+        i += 4 + packet_len;
+    }
+    return got;
+}
+
+/* read what the relay wrote to the socket into 'buf' */
+static size_t receive(size_t got)
+{
+    ssize_t rc;
+
+    while((rc = read(local, &buf[got], sizeof(buf) - got)) > 0)
+        got += rc;
+    return got;
+}
+
+static int test_to_socket(void)
+{
+    LIBSSH2_WINDOW_STATS stats;
+    size_t got = 0;
+    int adjusts;
+    int eofs;
+    int i;
+
+    CHECK(!send_data((const unsigned char *)"hello", 5));
+    CHECK(libssh2_channel_relay_pump(channel) == LIBSSH2_ERROR_EAGAIN);
+    CHECK(libssh2_channel_relay_directions(channel) ==
+          LIBSSH2_RELAY_WAIT_READ);
+    CHECK(receive(0) == 5);
+    CHECK(!memcmp(buf, "hello", 5));
+
+    /* more than the socket takes, the rest waits in the channel */
+    for(i = 0; i < PACKETS; i++)
+        CHECK(!send_data(&data[i * PACKET_DATA], PACKET_DATA));
+    CHECK(libssh2_channel_relay_pump(channel) == LIBSSH2_ERROR_EAGAIN);
+    CHECK(libssh2_channel_relay_directions(channel) &
+          LIBSSH2_RELAY_WAIT_WRITE);
+    libssh2_channel_window_stats(channel, &stats);
+    CHECK(stats.queued > 0);
+
+    while(got < sizeof(data)) {
+        size_t before = got;
+
+        CHECK(libssh2_channel_relay_pump(channel) == LIBSSH2_ERROR_EAGAIN);
+        got = receive(got);
+        CHECK(got > before);
+    }
+    CHECK(got == sizeof(data));
+    CHECK(!memcmp(buf, data, sizeof(data)));
+    libssh2_channel_window_stats(channel, &stats);
+    CHECK(!stats.queued);
+
+    /* the written data was given back to the window */
+    CHECK(collect(&adjusts, &eofs) == 0);
+    CHECK(adjusts > 0 && !eofs);
+    return 0;
+}
+
+static int test_to_channel(void)
+{
+    int adjusts;
+    int eofs;
+
+    channel->local.window_size = 100;
+    CHECK(write(local, data, 300) == 300);
+
+    /* the window stops it, and the socket is not read meanwhile */
+    CHECK(libssh2_channel_relay_pump(channel) == LIBSSH2_ERROR_EAGAIN);
+    CHECK(!(libssh2_channel_relay_directions(channel) &
+            LIBSSH2_RELAY_WAIT_READ));
+    CHECK(collect(&adjusts, &eofs) == 100);
+    CHECK(!memcmp(buf, data, 100));
+
+    CHECK(!send_channel_msg(SSH_MSG_CHANNEL_WINDOW_ADJUST, 100000));
+    CHECK(libssh2_channel_relay_pump(channel) == LIBSSH2_ERROR_EAGAIN);
+    CHECK(libssh2_channel_relay_directions(channel) ==
+          LIBSSH2_RELAY_WAIT_READ);
+    CHECK(collect(&adjusts, &eofs) == 200);
+    CHECK(!memcmp(buf, data + 100, 200));
+    CHECK(!eofs);
+    return 0;
+}
+
+static int test_eof(void)
+{
+    int adjusts;
+    int eofs;
+
+    CHECK(!send_channel_msg(SSH_MSG_CHANNEL_EOF, 0));
+    CHECK(libssh2_channel_relay_pump(channel) == LIBSSH2_ERROR_EAGAIN);
+    CHECK(read(local, buf, sizeof(buf)) == 0); /* shut down */
+
+    shutdown(local, SHUT_WR);
+    CHECK(libssh2_channel_relay_pump(channel) == 0);
+    CHECK(collect(&adjusts, &eofs) == 0);
+    CHECK(eofs == 1);
+    return 0;
+}
+
+int main(void)
+{
+    LIBSSH2_SESSION *session;
+    int relay[2];
+    int size = 16384;
+    int rc = 0;
+    size_t i;
+
+    for(i = 0; i < sizeof(data); i++)
+        data[i] = (unsigned char)(i * 7 + (i >> 8));
+
+    session = start_socket_fixture();
+    if(!session)
+        return 1;
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, relay)) {
+        fprintf(stderr, "could not set up relayed socket\n");
+        return 1;
+    }
+    /* a small relayed socket, which the data does not fit */
+    setsockopt(relay[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(relay[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    fcntl(relay[0], F_SETFL, fcntl(relay[0], F_GETFL) | O_NONBLOCK);
+    fcntl(relay[1], F_SETFL, fcntl(relay[1], F_GETFL) | O_NONBLOCK);
+    local = relay[1];
+
+    channel = calloc(1, sizeof(*channel));
+    if(!channel || _libssh2_channel_nextid(session, channel)) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    channel->session = session;
+    channel->remote.id = 7;
+    channel->remote.window_size = WINDOW;
+    channel->remote.window_size_initial = WINDOW;
+    channel->remote.packet_size = 32768;
+    channel->local.window_size = 1024 * 1024;
+    channel->local.packet_size = 32768;
+    session->channel_windows = WINDOW;
+    _libssh2_list_add(&session->channels, &channel->node);
+
+    rc |= libssh2_channel_relay_pump(channel) != LIBSSH2_ERROR_BAD_USE;
+    libssh2_channel_relay_fd(channel, relay[0], 0);
+
+    rc |= test_to_socket();
+    rc |= test_to_channel();
+    rc |= test_eof();
+
+    /* the channel is not the session's to free */
+    libssh2_channel_relay_fd(channel, LIBSSH2_INVALID_SOCKET, 0);
+    _libssh2_channel_queue_clear(channel);
+    _libssh2_list_remove(&channel->node);
+    free(channel);
+
+    close(relay[0]);
+    close(relay[1]);
+    stop_socket_fixture(session);
+
+    return rc;
+}
+#else
+int main(void)
+{
+    /* no socket pairs to test with */
+    return 0;
+}
+#endif /* WIN32 */
@@ -0,0 +1,163 @@
+/* Copyright (C) 2022 The libssh2 project and its contributors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+/*
+ * Checks that the data of a number of iovecs written with
+ * libssh2_channel_writev() arrives in order in packets that stay within the
+ * remote end's packet size and window, whichever way the iovecs and the
+ * packets line up.
+ */
+
+#include <stdlib.h>
+
+#include "libssh2_priv.h"
+#include "channel.h"
+#include "socket_fixture.h"
+
+#ifndef WIN32
+#include <unistd.h>
+
+#define IOVECS 40
+#define PACKET_SIZE 100
+
+static char data[IOVECS * (IOVECS + 1) / 2 * 3];
+static char sent[sizeof(data)];
+
+/* read the unencrypted packets off the socket and put their data together
+   in 'sent', returns the number of bytes */
+static ssize_t collect(int fd, int stream_id)
+{
+    static unsigned char buf[sizeof(data) * 2];
+    size_t head = stream_id ? 13 : 9;
+    size_t len = 0;
+    size_t got = 0;
+    size_t i;
+    ssize_t rc;
+
+    while((rc = read(fd, &buf[len], sizeof(buf) - len)) > 0)
+        len += rc;
+
+    for(i = 0; i < len;) {
+        size_t packet_len = _libssh2_ntohu32(&buf[i]);
+        unsigned char *payload = &buf[i + 5];
+        size_t data_len = _libssh2_ntohu32(&payload[head - 4]);
+
+        if(payload[0] != (stream_id ? SSH_MSG_CHANNEL_EXTENDED_DATA :
+                          SSH_MSG_CHANNEL_DATA) ||
+           _libssh2_ntohu32(&payload[1]) != 7 ||
+           (stream_id && _libssh2_ntohu32(&payload[5]) != 1) ||
+           data_len > PACKET_SIZE ||
+           head + data_len + buf[i + 4] + 1 != packet_len)
+            return -1;
+        memcpy(&sent[got], &payload[head], data_len);
+        got += data_len;
+        i += 4 + packet_len;
+    }
+    return got;
+}
+
+static int test_writev(LIBSSH2_CHANNEL *channel, int fd, int stream_id)
+{
+    LIBSSH2_IOVEC iov[IOVECS];
+    size_t total = 0;
+    ssize_t rc;
+    int i;
+
+    /* growing buffers with empty ones in between, crossing the packet
+       boundaries at different places */
+    for(i = 0; i < IOVECS; i++) {
+        iov[i].iov_base = &data[total];
+        iov[i].iov_len = (i % 5 == 4) ? 0 : i * 3;
+        total += iov[i].iov_len;
+    }
+
+    channel->local.window_size = 1024 * 1024;
+    rc = libssh2_channel_writev(channel, stream_id, iov, IOVECS);
+    CHECK(rc == (ssize_t)total);
+    CHECK(channel->local.window_size == 1024 * 1024 - total);
+    CHECK(collect(fd, stream_id) == (ssize_t)total);
+    CHECK(!memcmp(sent, data, total));
+
+    /* a window smaller than the data cuts the write short */
+    channel->local.window_size = 1000;
+    rc = libssh2_channel_writev(channel, stream_id, iov, IOVECS);
+    CHECK(rc == 1000);
+    CHECK(!channel->local.window_size);
+    CHECK(collect(fd, stream_id) == 1000);
+    CHECK(!memcmp(sent, data, 1000));
+
+    return 0;
+}
+
+int main(void)
+{
+    LIBSSH2_SESSION *session;
+    LIBSSH2_CHANNEL *channel;
+    int rc = 0;
+    size_t i;
+
+    for(i = 0; i < sizeof(data); i++)
+        data[i] = (char)(i * 7 + (i >> 8));
+
+    session = start_socket_fixture();
+    if(!session)
+        return 1;
+
+    channel = calloc(1, sizeof(*channel));
+    if(!channel) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    channel->session = session;
+    channel->remote.id = 7;
+    channel->local.packet_size = PACKET_SIZE;
+
+    rc |= test_writev(channel, socket_fixture_peer(), 0);
+    rc |= test_writev(channel, socket_fixture_peer(), 1);
+
+    free(channel);
+    stop_socket_fixture(session);
+
+    return rc;
+}
+#else
+int main(void)
+{
+    /* no socket pairs to test with */
+    return 0;
+}
+#endif /* WIN32 */
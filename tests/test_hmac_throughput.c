@@ -0,0 +1,248 @@
+/* Copyright (C) 2022 The libssh2 project and its contributors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+/*
+ * Runs the HMAC methods over packets from 64 bytes to 32 kB, once through
+ * the MAC method, which keeps its keyed context for the whole session, and
+ * once setting up a new HMAC context for every packet the way the MAC
+ * methods used to. Both must produce the same MAC values. The time per
+ * packet of each way is reported.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "libssh2_priv.h"
+#include "mac.h"
+
+#define MIN_PACKET_SIZE 64
+#define MAX_PACKET_SIZE 32768
+#define BYTES_PER_SIZE (4 * 1024 * 1024)
+
+typedef void (*hmac_setkey_func)(libssh2_hmac_ctx *ctx,
+                                 unsigned char *key, int key_len);
+
+static void setkey_sha1(libssh2_hmac_ctx *ctx, unsigned char *key,
+                        int key_len)
+{
+    libssh2_hmac_ctx_init(*ctx);
+    libssh2_hmac_sha1_init(ctx, key, key_len);
+}
+
+#if LIBSSH2_HMAC_SHA256
+static void setkey_sha256(libssh2_hmac_ctx *ctx, unsigned char *key,
+                          int key_len)
+{
+    libssh2_hmac_ctx_init(*ctx);
+    libssh2_hmac_sha256_init(ctx, key, key_len);
+}
+#endif
+
+#if LIBSSH2_HMAC_SHA512
+static void setkey_sha512(libssh2_hmac_ctx *ctx, unsigned char *key,
+                          int key_len)
+{
+    libssh2_hmac_ctx_init(*ctx);
+    libssh2_hmac_sha512_init(ctx, key, key_len);
+}
+#endif
+
+static const struct {
+    const char *name;
+    hmac_setkey_func setkey;
+} macs[] = {
+    { "hmac-sha1", setkey_sha1 },
+#if LIBSSH2_HMAC_SHA256
+    { "hmac-sha2-256", setkey_sha256 },
+#endif
+#if LIBSSH2_HMAC_SHA512
+    { "hmac-sha2-512", setkey_sha512 },
+#endif
+};
+
+static double seconds(clock_t start)
+{
+    double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+    /* avoid dividing by zero on very coarse clocks */
+    return secs > 0 ? secs : 1e-6;
+}
+
+static const LIBSSH2_MAC_METHOD *find_method(const char *name)
+{
+    const LIBSSH2_MAC_METHOD **methods = _libssh2_mac_methods();
+
+    for(; *methods; methods++) {
+        if(!strcmp((*methods)->name, name))
+            return *methods;
+    }
+    return NULL;
+}
+
+/* the MAC of one packet with an HMAC context set up just for it */
+static void rekeyed_hash(hmac_setkey_func setkey, unsigned char *key,
+                         int key_len, unsigned char *buf, uint32_t seqno,
+                         const unsigned char *packet, uint32_t packet_len)
+{
+    libssh2_hmac_ctx ctx;
+    unsigned char seqno_buf[4];
+
+    _libssh2_htonu32(seqno_buf, seqno);
+
+    setkey(&ctx, key, key_len);
+    libssh2_hmac_update(ctx, seqno_buf, 4);
+    libssh2_hmac_update(ctx, packet, packet_len);
+    libssh2_hmac_final(ctx, buf);
+    libssh2_hmac_cleanup(&ctx);
+}
+
+static int test_mac(LIBSSH2_SESSION *session, const char *name,
+                    hmac_setkey_func setkey, const unsigned char *packet)
+{
+    const LIBSSH2_MAC_METHOD *method = find_method(name);
+    unsigned char expected[SHA512_DIGEST_LENGTH];
+    unsigned char mac[SHA512_DIGEST_LENGTH];
+    unsigned char key[SHA512_DIGEST_LENGTH];
+    unsigned char *method_key;
+    void *abstract = NULL;
+    uint32_t packet_len;
+    uint32_t seqno;
+    int free_key;
+    size_t i;
+    int rc = 1;
+
+    if(!method) {
+        fprintf(stderr, "%s: not supported by this backend, skipped\n",
+                name);
+        return 0;
+    }
+
+    for(i = 0; i < sizeof(key); i++)
+        key[i] = (unsigned char)(0x40 + i);
+
+    /* the method may keep the key buffer, like the one of a key exchange */
+    method_key = LIBSSH2_ALLOC(session, method->key_len);
+    if(!method_key) {
+        fprintf(stderr, "%s: out of memory\n", name);
+        return 1;
+    }
+    memcpy(method_key, key, method->key_len);
+    if(method->init(session, method_key, &free_key, &abstract)) {
+        fprintf(stderr, "%s: MAC init failed\n", name);
+        goto out;
+    }
+    if(free_key) {
+        _libssh2_explicit_zero(method_key, method->key_len);
+        LIBSSH2_FREE(session, method_key);
+    }
+    method_key = NULL;
+
+    for(packet_len = MIN_PACKET_SIZE; packet_len <= MAX_PACKET_SIZE;
+        packet_len *= 2) {
+        uint32_t count = BYTES_PER_SIZE / packet_len;
+        double rekeyed_secs;
+        double method_secs;
+        clock_t start;
+
+        /* a few packets must match before anything is timed */
+        for(seqno = 0; seqno < 4; seqno++) {
+            rekeyed_hash(setkey, key, (int)method->key_len, expected, seqno,
+                         packet, packet_len);
+            if(method->hash(session, mac, seqno, packet, packet_len,
+                            NULL, 0, &abstract) ||
+               memcmp(mac, expected, method->mac_len)) {
+                fprintf(stderr, "%s: wrong MAC for a %u byte packet\n",
+                        name, (unsigned int)packet_len);
+                goto out;
+            }
+        }
+
+        start = clock();
+        for(seqno = 0; seqno < count; seqno++)
+            rekeyed_hash(setkey, key, (int)method->key_len, expected, seqno,
+                         packet, packet_len);
+        rekeyed_secs = seconds(start);
+
+        start = clock();
+        for(seqno = 0; seqno < count; seqno++)
+            method->hash(session, mac, seqno, packet, packet_len,
+                         NULL, 0, &abstract);
+        method_secs = seconds(start);
+
+        fprintf(stderr, "%s: %5u bytes: re-keyed %.2f us, "
+                "kept %.2f us (%.2fx)\n",
+                name, (unsigned int)packet_len,
+                rekeyed_secs * 1e6 / count, method_secs * 1e6 / count,
+                rekeyed_secs / method_secs);
+    }
+    rc = 0;
+
+out:
+    if(method_key)
+        LIBSSH2_FREE(session, method_key);
+    if(abstract)
+        method->dtor(session, &abstract);
+    return rc;
+}
+
+int main(void)
+{
+    LIBSSH2_SESSION *session;
+    unsigned char *packet = malloc(MAX_PACKET_SIZE);
+    size_t i;
+    int rc = 0;
+
+    if(!packet) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    for(i = 0; i < MAX_PACKET_SIZE; i++)
+        packet[i] = (unsigned char)(i * 7 + 3);
+
+    libssh2_init(0);
+    session = libssh2_session_init();
+
+    for(i = 0; i < ARRAY_SIZE(macs); i++)
+        rc |= test_mac(session, macs[i].name, macs[i].setkey, packet);
+
+    libssh2_session_free(session);
+    libssh2_exit();
+
+    free(packet);
+
+    return rc;
+}
@@ -0,0 +1,252 @@
+/* Copyright (C) 2022 The libssh2 project and its contributors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+/*
+ * Measures how much memory sessions hold on to once they have sent and
+ * received a packet and gone idle, with and without
+ * LIBSSH2_FLAG_RELEASE_BUFFERS. Each session talks over a socket pair and
+ * its allocations are counted by size. By default a session must not hold
+ * more than the buffers it embedded when they had fixed sizes.
+ */
+
+#include <stdlib.h>
+
+#include "libssh2_priv.h"
+#include "transport.h"
+
+#ifndef WIN32
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define SESSIONS 100
+
+/* the receive buffer and the outgoing packet buffer sessions embedded */
+#define EMBEDDED_BUFFERS (PACKETBUFSIZE + MAX_SSH_PACKET_LEN)
+
+static size_t allocated; /* bytes in live allocations */
+
+/* each allocation starts with its size, in a header that keeps the
+   alignment malloc() gives */
+union header {
+    size_t size;
+    double align_d;
+    void *align_p;
+};
+
+static LIBSSH2_ALLOC_FUNC(count_alloc)
+{
+    union header *h = malloc(sizeof(*h) + count);
+    (void)abstract;
+    if(!h)
+        return NULL;
+    h->size = count;
+    allocated += count;
+    return h + 1;
+}
+
+static LIBSSH2_REALLOC_FUNC(count_realloc)
+{
+    union header *h = ptr ? (union header *)ptr - 1 : NULL;
+    size_t old = h ? h->size : 0;
+    (void)abstract;
+    h = realloc(h, sizeof(*h) + count);
+    if(!h)
+        return NULL;
+    h->size = count;
+    allocated += count - old;
+    return h + 1;
+}
+
+static LIBSSH2_FREE_FUNC(count_free)
+{
+    (void)abstract;
+    if(ptr) {
+        union header *h = (union header *)ptr - 1;
+        allocated -= h->size;
+        free(h);
+    }
+}
+
+struct peer {
+    LIBSSH2_SESSION *session;
+    int fd;                     /* the other end of the session's socket */
+};
+
+/* an unencrypted SSH_MSG_IGNORE packet with "hi" in it */
+static const unsigned char ignore_packet[] = {
+    0, 0, 0, 12,                /* packet_length */
+    4,                          /* padding_length */
+    SSH_MSG_IGNORE, 0, 0, 0, 2, 'h', 'i',
+    0, 0, 0, 0                  /* padding */
+};
+
+static int open_session(struct peer *peer, int release)
+{
+    int fds[2];
+
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+        return 1;
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+
+    peer->fd = fds[1];
+    peer->session = libssh2_session_init_ex(count_alloc, count_free,
+                                            count_realloc, NULL);
+    if(!peer->session)
+        return 1;
+    libssh2_session_set_blocking(peer->session, 0);
+    libssh2_session_flag(peer->session, LIBSSH2_FLAG_RELEASE_BUFFERS,
+                         release);
+    peer->session->socket_fd = fds[0];
+
+    return 0;
+}
+
+/* send a packet each way, then read until there is nothing left */
+static int exchange(struct peer *peer)
+{
+    static const unsigned char payload[] = { SSH_MSG_IGNORE, 0, 0, 0, 0 };
+    unsigned char drain[256];
+    int rc;
+    int i;
+
+    if(_libssh2_transport_send(peer->session, payload, sizeof(payload),
+                               NULL, 0))
+        return 1;
+    if(read(peer->fd, drain, sizeof(drain)) <= 0)
+        return 1;
+
+    if(write(peer->fd, ignore_packet, sizeof(ignore_packet)) !=
+       sizeof(ignore_packet))
+        return 1;
+    for(i = 0; i < 10; i++) {
+        rc = _libssh2_transport_read(peer->session);
+        if(rc == LIBSSH2_ERROR_EAGAIN)
+            return 0;
+        if(rc < 0)
+            return 1;
+    }
+
+    return 1;
+}
+
+static void close_session(struct peer *peer)
+{
+    close(peer->session->socket_fd);
+    close(peer->fd);
+    libssh2_session_free(peer->session);
+}
+
+/* returns the bytes held per idle session beyond what a new one holds */
+static long idle_cost(int release)
+{
+    static struct peer peers[SESSIONS];
+    size_t before;
+    size_t after;
+    int i;
+
+    for(i = 0; i < SESSIONS; i++) {
+        if(open_session(&peers[i], release)) {
+            fprintf(stderr, "could not set up session %d\n", i);
+            return -1;
+        }
+    }
+    before = allocated;
+
+    for(i = 0; i < SESSIONS; i++) {
+        if(exchange(&peers[i])) {
+            fprintf(stderr, "exchange failed on session %d\n", i);
+            return -1;
+        }
+    }
+    after = allocated;
+
+    for(i = 0; i < SESSIONS; i++)
+        close_session(&peers[i]);
+
+    return (long)(after - before) / SESSIONS;
+}
+
+int main(void)
+{
+    long kept;
+    long released;
+    int rc = 0;
+
+    libssh2_init(0);
+
+    kept = idle_cost(0);
+    released = idle_cost(1);
+    if(kept < 0 || released < 0)
+        rc = 1;
+    else {
+        printf("%d idle sessions hold %ld bytes each for buffers, "
+               "%ld with LIBSSH2_FLAG_RELEASE_BUFFERS\n", SESSIONS,
+               kept, released);
+
+        if(kept < PACKETBUFSIZE) {
+            fprintf(stderr, "sessions don't keep their receive buffers\n");
+            rc = 1;
+        }
+        if(kept > EMBEDDED_BUFFERS) {
+            fprintf(stderr, "sessions keep more than the %d bytes of "
+                    "buffers they embedded\n", EMBEDDED_BUFFERS);
+            rc = 1;
+        }
+        if(released) {
+            fprintf(stderr, "sessions keep %ld bytes after release\n",
+                    released);
+            rc = 1;
+        }
+    }
+
+    libssh2_exit();
+
+    if(allocated) {
+        fprintf(stderr, "%ld bytes left allocated\n", (long)allocated);
+        rc = 1;
+    }
+
+    return rc;
+}
+#else
+int main(void)
+{
+    /* no socket pairs to test with */
+    return 0;
+}
+#endif /* WIN32 */
@@ -0,0 +1,198 @@
+/* Copyright (C) 2022 The libssh2 project and its contributors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+/*
+ * Checks that the packet buffer pool hands out buffers of the right size
+ * class, reuses freed ones, keeps no more than PACKETPOOLMAX bytes of them,
+ * and that a queued packet's data can be handed over and freed with
+ * LIBSSH2_FREE() along with the struct that comes with it. Counts the
+ * session's allocations to check that nothing leaks.
+ */
+
+#include <stdlib.h>
+
+#include "libssh2_priv.h"
+#include "packet.h"
+#include "socket_fixture.h"
+
+static long allocs;   /* number of live allocations */
+
+static LIBSSH2_ALLOC_FUNC(count_alloc)
+{
+    void *ptr = malloc(count);
+    (void)abstract;
+    if(ptr)
+        allocs++;
+    return ptr;
+}
+
+static LIBSSH2_REALLOC_FUNC(count_realloc)
+{
+    void *newptr = realloc(ptr, count);
+    (void)abstract;
+    if(newptr && !ptr)
+        allocs++;
+    return newptr;
+}
+
+static LIBSSH2_FREE_FUNC(count_free)
+{
+    (void)abstract;
+    if(ptr)
+        allocs--;
+    free(ptr);
+}
+
+static int test_reuse(LIBSSH2_SESSION *session)
+{
+    LIBSSH2_POOL_STATS stats;
+    unsigned char *buf;
+    unsigned char *again;
+    int pool_class;
+    int pool_class2;
+
+    buf = _libssh2_packet_buf_alloc(session, 100, &pool_class);
+    CHECK(buf && pool_class == 0);
+    memset(buf, 0xaa, 100);
+    _libssh2_packet_buf_free(session, buf, pool_class);
+
+    libssh2_session_pool_stats(session, &stats);
+    CHECK(stats.misses == 1 && stats.hits == 0 && stats.cached == 1);
+
+    /* any size of the same class gets the same buffer back */
+    again = _libssh2_packet_buf_alloc(session, 500, &pool_class2);
+    CHECK(again == buf && pool_class2 == pool_class);
+
+    libssh2_session_pool_stats(session, &stats);
+    CHECK(stats.misses == 1 && stats.hits == 1 && stats.cached == 0);
+
+    /* but not a larger one */
+    buf = _libssh2_packet_buf_alloc(session, 600, &pool_class2);
+    CHECK(buf && buf != again && pool_class2 > pool_class);
+    _libssh2_packet_buf_free(session, buf, pool_class2);
+    _libssh2_packet_buf_free(session, again, pool_class);
+
+    /* and payloads larger than any packet are not pooled at all */
+    buf = _libssh2_packet_buf_alloc(session, LIBSSH2_PACKET_MAXPAYLOAD + 1,
+                                    &pool_class);
+    CHECK(buf && pool_class == -1);
+    _libssh2_packet_buf_free(session, buf, pool_class);
+
+    libssh2_session_pool_stats(session, &stats);
+    CHECK(stats.cached == 2);
+
+    return 0;
+}
+
+static int test_limit(LIBSSH2_SESSION *session)
+{
+    LIBSSH2_POOL_STATS stats;
+    unsigned char *bufs[32];
+    int classes[32];
+    size_t i;
+
+    for(i = 0; i < 32; i++) {
+        bufs[i] = _libssh2_packet_buf_alloc(session, 32768, &classes[i]);
+        CHECK(bufs[i] && classes[i] >= 0);
+    }
+    for(i = 0; i < 32; i++)
+        _libssh2_packet_buf_free(session, bufs[i], classes[i]);
+
+    libssh2_session_pool_stats(session, &stats);
+    /* full, up to less than the room for another one */
+    CHECK(stats.cached_bytes <= stats.cached_max);
+    CHECK(stats.cached_max - stats.cached_bytes < 2 * 32768);
+
+    return 0;
+}
+
+static int test_handover(LIBSSH2_SESSION *session)
+{
+    unsigned char *buf;
+    unsigned char *data;
+    size_t data_len;
+    long before;
+    int pool_class;
+
+    /* a packet nobody deals with as it arrives is queued */
+    buf = _libssh2_packet_buf_alloc(session, 5, &pool_class);
+    CHECK(buf && pool_class >= 0);
+    before = allocs;
+    buf[0] = SSH_MSG_CHANNEL_SUCCESS;
+    _libssh2_htonu32(buf + 1, 42);
+    CHECK(_libssh2_packet_add(session, buf, 5, LIBSSH2_MAC_CONFIRMED,
+                              pool_class) == 0);
+
+    CHECK(!_libssh2_packet_ask(session, SSH_MSG_CHANNEL_SUCCESS,
+                               &data, &data_len, 0, NULL, 0));
+    CHECK(data == buf && data_len == 5 && _libssh2_ntohu32(data + 1) == 42);
+
+    /* the packet's struct went along with the data, freeing it frees all */
+    LIBSSH2_FREE(session, data);
+    CHECK(allocs == before - 1);
+
+    return 0;
+}
+
+int main(void)
+{
+    LIBSSH2_SESSION *session;
+    int rc = 0;
+
+    libssh2_init(0);
+    session = libssh2_session_init_ex(count_alloc, count_free, count_realloc,
+                                      NULL);
+    if(!session) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    rc |= test_reuse(session);
+    rc |= test_limit(session);
+    rc |= test_handover(session);
+
+    libssh2_session_free(session);
+    libssh2_exit();
+
+    if(allocs) {
+        fprintf(stderr, "%ld allocations left after libssh2_session_free\n",
+                allocs);
+        rc = 1;
+    }
+
+    return rc;
+}
@@ -0,0 +1,196 @@
+/* Copyright (C) 2022 The libssh2 project and its contributors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+/*
+ * Checks that libssh2_transport_read() and libssh2_transport_write() return
+ * just the channels that data, EOF or window has arrived for, out of many
+ * open ones. The packets are written unencrypted into the session's socket.
+ */
+
+#include <stdlib.h>
+
+#include "libssh2_priv.h"
+#include "channel.h"
+#include "socket_fixture.h"
+
+#ifndef WIN32
+
+#define CHANNELS 1000
+
+static LIBSSH2_CHANNEL channels[CHANNELS];
+
+static int send_data(int channel, const char *text)
+{
+    unsigned char payload[32];
+    size_t len = strlen(text);
+
+    payload[0] = SSH_MSG_CHANNEL_DATA;
+    _libssh2_htonu32(payload + 1, channels[channel].local.id);
+    _libssh2_htonu32(payload + 5, (uint32_t)len);
+    memcpy(payload + 9, text, len);
+    return send_packet(payload, 9 + len);
+}
+
+static int send_channel_msg(int channel, unsigned char msg, uint32_t arg)
+{
+    unsigned char payload[9];
+
+    payload[0] = msg;
+    _libssh2_htonu32(payload + 1, channels[channel].local.id);
+    _libssh2_htonu32(payload + 5, arg);
+    return send_packet(payload, msg == SSH_MSG_CHANNEL_WINDOW_ADJUST ? 9 : 5);
+}
+
+/* tell if 'channel' is among the 'found' ones in 'ready' */
+static int has(LIBSSH2_CHANNEL **ready, int found, int channel)
+{
+    int i;
+
+    for(i = 0; i < found; i++)
+        if(ready[i] == &channels[channel])
+            return 1;
+    return 0;
+}
+
+static int test_readable(LIBSSH2_SESSION *session)
+{
+    LIBSSH2_CHANNEL *ready[8];
+    char buf[32];
+    int found;
+
+    CHECK(libssh2_transport_read(session, ready, 8) == 0);
+
+    CHECK(!send_data(10, "ten"));
+    CHECK(!send_data(500, "five hundred"));
+    CHECK(!send_data(999, "last"));
+    CHECK(!send_channel_msg(7, SSH_MSG_CHANNEL_EOF, 0));
+
+    found = libssh2_transport_read(session, ready, 8);
+    CHECK(found == 4);
+    CHECK(has(ready, found, 10) && has(ready, found, 500) &&
+          has(ready, found, 999) && has(ready, found, 7));
+
+    /* they stay readable until read */
+    CHECK(libssh2_transport_read(session, ready, 8) == 4);
+    CHECK(_libssh2_channel_read(&channels[500], 0, buf, sizeof(buf)) == 12);
+    found = libssh2_transport_read(session, ready, 8);
+    CHECK(found == 3);
+    CHECK(!has(ready, found, 500));
+
+    /* with room for one, each call returns another */
+    CHECK(_libssh2_channel_read(&channels[999], 0, buf, sizeof(buf)) == 4);
+    channels[7].remote.eof = 0;
+    CHECK(!send_data(20, "twenty"));
+    CHECK(libssh2_transport_read(session, ready, 8) == 2);
+    CHECK(libssh2_transport_read(session, ready, 1) == 1);
+    CHECK(ready[0] == &channels[10]);
+    CHECK(libssh2_transport_read(session, ready, 1) == 1);
+    CHECK(ready[0] == &channels[20]);
+    CHECK(libssh2_transport_read(session, ready, 1) == 1);
+    CHECK(ready[0] == &channels[10]);
+
+    CHECK(_libssh2_channel_read(&channels[10], 0, buf, sizeof(buf)) == 3);
+    CHECK(_libssh2_channel_read(&channels[20], 0, buf, sizeof(buf)) == 6);
+    CHECK(libssh2_transport_read(session, ready, 8) == 0);
+
+    return 0;
+}
+
+static int test_writable(LIBSSH2_SESSION *session)
+{
+    LIBSSH2_CHANNEL *ready[8];
+    int found;
+
+    CHECK(libssh2_transport_write(session, ready, 8) == 0);
+
+    CHECK(!send_channel_msg(3, SSH_MSG_CHANNEL_WINDOW_ADJUST, 1000));
+    CHECK(!send_channel_msg(600, SSH_MSG_CHANNEL_WINDOW_ADJUST, 1000));
+    CHECK(libssh2_transport_read(session, ready, 8) == 0);
+
+    found = libssh2_transport_write(session, ready, 8);
+    CHECK(found == 2);
+    CHECK(has(ready, found, 3) && has(ready, found, 600));
+
+    /* a channel that has sent EOF or used up its window is not */
+    channels[3].local.eof = 1;
+    channels[600].local.window_size = 0;
+    CHECK(libssh2_transport_write(session, ready, 8) == 0);
+
+    return 0;
+}
+
+int main(void)
+{
+    LIBSSH2_SESSION *session;
+    int rc = 0;
+    int i;
+
+    session = start_socket_fixture();
+    if(!session)
+        return 1;
+
+    for(i = 0; i < CHANNELS; i++) {
+        channels[i].session = session;
+        channels[i].remote.window_size = 1024 * 1024;
+        channels[i].remote.packet_size = 32768;
+        if(_libssh2_channel_nextid(session, &channels[i])) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+        _libssh2_list_add(&session->channels, &channels[i].node);
+    }
+
+    rc |= test_readable(session);
+    rc |= test_writable(session);
+
+    /* the channels are not the session's to free */
+    for(i = 0; i < CHANNELS; i++) {
+        _libssh2_channel_queue_clear(&channels[i]);
+        _libssh2_list_remove(&channels[i].node);
+    }
+
+    stop_socket_fixture(session);
+
+    return rc;
+}
+#else
+int main(void)
+{
+    /* no socket pairs to test with */
+    return 0;
+}
+#endif /* WIN32 */
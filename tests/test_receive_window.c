@@ -0,0 +1,184 @@
+/* Copyright (C) 2022 The libssh2 project and its contributors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+/*
+ * Checks the automatic receive window mode: a window that the application
+ * keeps up with grows to twice the data read per round trip, one it doesn't
+ * fill shrinks slowly, both stay within the session's bounds, and round
+ * trip samples are smoothed into the session's estimate.
+ */
+
+#include <stdlib.h>
+
+#include "libssh2_priv.h"
+#include "channel.h"
+#include "socket_fixture.h"
+
+#ifndef WIN32
+
+#define RTT 10000 /* microseconds */
+#define MB (1024 * 1024)
+
+/* pretend 'consumed' more bytes were read over the last two round trips,
+   then read to let the window be tuned */
+static uint32_t tune(LIBSSH2_CHANNEL *channel, libssh2_uint64_t consumed)
+{
+    char buf[16];
+
+    channel->window_mark_time = _libssh2_usecs() - 2 * RTT;
+    channel->window_mark_consumed = channel->window_consumed;
+    channel->window_consumed += consumed;
+    libssh2_channel_read(channel, buf, sizeof(buf));
+    return channel->remote.window_size_initial;
+}
+
+static int test_tune(LIBSSH2_SESSION *session, LIBSSH2_CHANNEL *channel)
+{
+    LIBSSH2_WINDOW_STATS stats;
+    uint32_t window;
+
+    CHECK(libssh2_session_set_window_mode(session, LIBSSH2_WINDOW_AUTO,
+                                          256 * 1024, 8 * MB) == 0);
+    session->window_rtt = RTT;
+
+    /* the first read only starts the measurement */
+    channel->remote.window_size_initial = MB;
+    channel->remote.window_size = MB;
+    channel->window_mark_time = 0;
+    libssh2_channel_read(channel, (char *)&window, sizeof(window));
+    CHECK(channel->window_mark_time);
+    CHECK(channel->remote.window_size_initial == MB);
+
+    /* a whole window read per round trip doubles it */
+    window = tune(channel, 2 * MB);
+    CHECK(window > MB * 3 / 2 && window <= 2 * MB);
+
+    /* up to the upper bound */
+    window = tune(channel, 16 * MB);
+    CHECK(window == 8 * MB);
+
+    /* nothing read shrinks it by an eighth at a time */
+    window = tune(channel, 0);
+    CHECK(window == 7 * MB);
+    while(window > 256 * 1024) {
+        uint32_t smaller = tune(channel, 0);
+        CHECK(smaller < window);
+        window = smaller;
+    }
+    /* down to the lower bound */
+    CHECK(window == 256 * 1024);
+
+    libssh2_channel_window_stats(channel, &stats);
+    CHECK(stats.window == 256 * 1024);
+    CHECK(stats.queued == 0);
+    CHECK(stats.consumed == channel->window_consumed);
+    CHECK(stats.rtt == RTT);
+
+    /* in the fixed mode reading leaves the window alone */
+    CHECK(libssh2_session_set_window_mode(session, LIBSSH2_WINDOW_FIXED,
+                                          0, 0) == 0);
+    window = tune(channel, 16 * MB);
+    CHECK(window == 256 * 1024);
+
+    CHECK(libssh2_session_set_window_mode(session, LIBSSH2_WINDOW_AUTO,
+                                          2 * MB, MB) ==
+          LIBSSH2_ERROR_INVAL);
+    CHECK(libssh2_session_set_window_mode(session, 7, 0, 0) ==
+          LIBSSH2_ERROR_INVAL);
+    return 0;
+}
+
+static int test_rtt(LIBSSH2_SESSION *session, LIBSSH2_CHANNEL *channel)
+{
+    session->window_rtt = 0;
+
+    /* the first sample is taken as it is */
+    channel->window_probe = _libssh2_usecs() - RTT;
+    _libssh2_channel_rtt_sample(channel);
+    CHECK(!channel->window_probe);
+    CHECK(session->window_rtt >= RTT && session->window_rtt < RTT * 2);
+
+    /* later ones move the estimate an eighth of the way */
+    session->window_rtt = RTT;
+    channel->window_probe = _libssh2_usecs() - RTT / 2;
+    _libssh2_channel_rtt_sample(channel);
+    CHECK(session->window_rtt < RTT && session->window_rtt > RTT * 7 / 8);
+
+    /* and a much longer one counts as twice the estimate */
+    session->window_rtt = RTT;
+    channel->window_probe = _libssh2_usecs() - RTT * 100;
+    _libssh2_channel_rtt_sample(channel);
+    CHECK(session->window_rtt == RTT * 9 / 8);
+
+    return 0;
+}
+
+int main(void)
+{
+    LIBSSH2_SESSION *session;
+    LIBSSH2_CHANNEL *channel;
+    int rc = 0;
+
+    /* reads find nothing on the socket, window adjusts go into it */
+    session = start_socket_fixture();
+    if(!session)
+        return 1;
+
+    channel = calloc(1, sizeof(*channel));
+    if(!channel) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    channel->session = session;
+    _libssh2_list_init(&channel->read_queue[0]);
+    _libssh2_list_init(&channel->read_queue[1]);
+
+    rc |= test_tune(session, channel);
+    rc |= test_rtt(session, channel);
+
+    free(channel);
+    stop_socket_fixture(session);
+
+    return rc;
+}
+#else
+int main(void)
+{
+    /* no socket pairs to test with */
+    return 0;
+}
+#endif /* WIN32 */
@@ -0,0 +1,229 @@
+#include "session_fixture.h"
+
+#include <libssh2.h>
+#include <libssh2_sftp.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Checks that once a transfer is under way, moving more data over a
+ * channel or an SFTP file handle doesn't allocate any memory. The session
+ * counts every allocation through its memory functions. The first
+ * megabyte of each transfer warms up the buffers, the allocations made
+ * while moving the following ones must be none.
+ */
+
+/* configured in Dockerfile */
+static const char *USERNAME = "libssh2";
+static const char *PASSWORD = "my test password";
+static const char *FILENAME = "sandbox/steady_state_allocations";
+
+#define BLOCK (32 * 1024)
+#define WARMUP (1024 * 1024)
+#define MEASURED (4 * 1024 * 1024)
+
+static long allocations; /* calls to allocate or grow memory */
+
+static LIBSSH2_ALLOC_FUNC(count_alloc)
+{
+    (void)abstract;
+    allocations++;
+    return malloc(count);
+}
+
+static LIBSSH2_REALLOC_FUNC(count_realloc)
+{
+    (void)abstract;
+    allocations++;
+    return realloc(ptr, count);
+}
+
+static LIBSSH2_FREE_FUNC(count_free)
+{
+    (void)abstract;
+    free(ptr);
+}
+
+static char block[BLOCK];
+
+/* echo blocks through 'cat' on the server */
+static int echo_blocks(LIBSSH2_CHANNEL *channel, size_t total)
+{
+    static char echoed[BLOCK];
+    size_t done;
+
+    for(done = 0; done < total; done += BLOCK) {
+        size_t got = 0;
+        ssize_t rc = libssh2_channel_write(channel, block, BLOCK);
+        if(rc != BLOCK) {
+            print_last_session_error("libssh2_channel_write");
+            return 1;
+        }
+        while(got < BLOCK) {
+            rc = libssh2_channel_read(channel, &echoed[got], BLOCK - got);
+            if(rc <= 0) {
+                print_last_session_error("libssh2_channel_read");
+                return 1;
+            }
+            got += rc;
+        }
+        if(memcmp(block, echoed, BLOCK)) {
+            fprintf(stderr, "data echoed back differs\n");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int test_channel(LIBSSH2_SESSION *session)
+{
+    LIBSSH2_CHANNEL *channel;
+    long before;
+    long made;
+
+    channel = libssh2_channel_open_session(session);
+    if(!channel) {
+        print_last_session_error("libssh2_channel_open_session");
+        return 1;
+    }
+    if(libssh2_channel_exec(channel, "cat")) {
+        print_last_session_error("libssh2_channel_exec");
+        return 1;
+    }
+
+    if(echo_blocks(channel, WARMUP))
+        return 1;
+    before = allocations;
+    if(echo_blocks(channel, MEASURED))
+        return 1;
+    made = allocations - before;
+
+    libssh2_channel_send_eof(channel);
+    libssh2_channel_free(channel);
+
+    if(made) {
+        fprintf(stderr, "%ld allocations echoing %d MB over a channel\n",
+                made, MEASURED / (1024 * 1024));
+        return 1;
+    }
+    return 0;
+}
+
+static int write_blocks(LIBSSH2_SFTP_HANDLE *handle, size_t total)
+{
+    size_t done;
+
+    for(done = 0; done < total; done += BLOCK) {
+        size_t sent = 0;
+        while(sent < BLOCK) {
+            ssize_t rc = libssh2_sftp_write(handle, &block[sent],
+                                            BLOCK - sent);
+            if(rc <= 0) {
+                fprintf(stderr, "libssh2_sftp_write returned %d\n",
+                        (int)rc);
+                return 1;
+            }
+            sent += rc;
+        }
+    }
+    return 0;
+}
+
+static int read_blocks(LIBSSH2_SFTP_HANDLE *handle, size_t total)
+{
+    static char buffer[BLOCK];
+    size_t done;
+
+    for(done = 0; done < total; done += BLOCK) {
+        size_t got = 0;
+        while(got < BLOCK) {
+            ssize_t rc = libssh2_sftp_read(handle, &buffer[got],
+                                           BLOCK - got);
+            if(rc <= 0) {
+                fprintf(stderr, "libssh2_sftp_read returned %d\n", (int)rc);
+                return 1;
+            }
+            got += rc;
+        }
+        if(memcmp(block, buffer, BLOCK)) {
+            fprintf(stderr, "data read back differs\n");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int test_sftp(LIBSSH2_SESSION *session)
+{
+    LIBSSH2_SFTP *sftp;
+    LIBSSH2_SFTP_HANDLE *handle;
+    long before;
+    long written;
+    long read;
+
+    sftp = libssh2_sftp_init(session);
+    if(!sftp) {
+        print_last_session_error("libssh2_sftp_init");
+        return 1;
+    }
+
+    handle = libssh2_sftp_open(sftp, FILENAME, LIBSSH2_FXF_WRITE |
+                               LIBSSH2_FXF_CREAT | LIBSSH2_FXF_TRUNC, 0600);
+    if(!handle) {
+        print_last_session_error("libssh2_sftp_open");
+        return 1;
+    }
+    if(write_blocks(handle, WARMUP))
+        return 1;
+    before = allocations;
+    if(write_blocks(handle, MEASURED))
+        return 1;
+    written = allocations - before;
+    libssh2_sftp_close(handle);
+
+    handle = libssh2_sftp_open(sftp, FILENAME, LIBSSH2_FXF_READ, 0);
+    if(!handle) {
+        print_last_session_error("libssh2_sftp_open");
+        return 1;
+    }
+    if(read_blocks(handle, WARMUP))
+        return 1;
+    before = allocations;
+    if(read_blocks(handle, MEASURED))
+        return 1;
+    read = allocations - before;
+    libssh2_sftp_close(handle);
+
+    libssh2_sftp_unlink(sftp, FILENAME);
+    libssh2_sftp_shutdown(sftp);
+
+    if(written || read) {
+        fprintf(stderr, "%ld allocations writing and %ld reading %d MB "
+                "over SFTP\n", written, read, MEASURED / (1024 * 1024));
+        return 1;
+    }
+    return 0;
+}
+
+int main()
+{
+    LIBSSH2_SESSION *session;
+    int exit_code = 1;
+    size_t i;
+
+    for(i = 0; i < BLOCK; i++)
+        block[i] = (char)(i * 7 + (i >> 8));
+
+    session = start_session_fixture_ex(count_alloc, count_free,
+                                       count_realloc);
+    if(session) {
+        if(libssh2_userauth_password(session, USERNAME, PASSWORD))
+            print_last_session_error("libssh2_userauth_password");
+        else
+            exit_code = test_channel(session) | test_sftp(session);
+    }
+    stop_session_fixture();
+    return exit_code;
+}
@@ -0,0 +1,297 @@
+/* Copyright (C) 2022 The libssh2 project and its contributors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+/*
+ * Checks UMAC-64 and UMAC-128 against known tags for the key and nonce of
+ * the RFC 4418 test vectors, fed whole and in odd sized pieces, and checks
+ * that UMAC-64 takes the right half of a cached pad. Then reports the
+ * throughput of the umac MAC methods and of hmac-sha2-256 for packets from
+ * 64 bytes to 32 kB.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "libssh2_priv.h"
+#include "mac.h"
+#include "umac.h"
+
+#if LIBSSH2_AES
+
+#define MIN_PACKET_SIZE 64
+#define MAX_PACKET_SIZE 32768
+#define BYTES_PER_SIZE (4 * 1024 * 1024)
+
+static const unsigned char key[UMAC_KEY_LEN + 1] = "abcdefghijklmnop";
+static const unsigned char nonce[UMAC_NONCE_LEN + 1] = "bcdefghi";
+
+static const struct {
+    const char *pattern;
+    size_t repeat;
+    const char *tag64;
+    const char *tag128;
+} vectors[] = {
+    { "", 0, "6e155fad26900be1", "32fedb100c79ad58f07ff7643cc60465" },
+    { "a", 3, "44b5cb542f220104", "185e4fe905cba7bd85e4c2dc3d117d8d" },
+    { "a", 1024, "26bf2f5d60118bd9", "7a54abe04af82d60fb298c3cbd195bcb" },
+    { "a", 32768, "27f8ef643b0d118d", "7b136bd911e4b734286ef2be501f2c3c" },
+    { "abc", 1, "d4d7b9f6bd4fbfcf", "883c3d4b97a61976ffcf232308cba5a5" },
+    { "abc", 500, "d4cf26ddefd5c01a", "8824a260c53c66a36c9260a62cb83aa1" }
+};
+
+static const char *benchmarks[] = {
+    "umac-64@openssh.com",
+    "umac-128@openssh.com",
+    "hmac-sha2-256"
+};
+
+static double seconds(clock_t start)
+{
+    double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+    /* avoid dividing by zero on very coarse clocks */
+    return secs > 0 ? secs : 1e-6;
+}
+
+static void to_hex(const unsigned char *buf, size_t len, char *hex)
+{
+    size_t i;
+
+    for(i = 0; i < len; i++)
+        snprintf(&hex[2 * i], 3, "%02x", buf[i]);
+}
+
+/* the tag of 'msg', fed in pieces of 'step' bytes or whole when 0 */
+static int umac_tag(size_t taglen, const unsigned char *msg, size_t len,
+                    size_t step, const unsigned char *n, char *hex)
+{
+    _libssh2_umac_ctx ctx;
+    unsigned char tag[16];
+    int rc;
+
+    if(_libssh2_umac_init(&ctx, key, taglen))
+        return -1;
+
+    if(!step)
+        step = len;
+    while(len) {
+        size_t piece = len < step ? len : step;
+        _libssh2_umac_update(&ctx, msg, piece);
+        msg += piece;
+        len -= piece;
+    }
+    rc = _libssh2_umac_final(&ctx, tag, n);
+    _libssh2_umac_dtor(&ctx);
+
+    to_hex(tag, taglen, hex);
+    return rc;
+}
+
+static int test_vectors(unsigned char *msg)
+{
+    static const size_t steps[] = { 0, 1, 7, 32, 33, 1000, 1024 };
+    char hex[33];
+    size_t i;
+    size_t j;
+    int rc = 0;
+
+    for(i = 0; i < ARRAY_SIZE(vectors); i++) {
+        size_t plen = strlen(vectors[i].pattern);
+        size_t len = plen * vectors[i].repeat;
+
+        for(j = 0; j < vectors[i].repeat; j++)
+            memcpy(&msg[j * plen], vectors[i].pattern, plen);
+
+        for(j = 0; j < ARRAY_SIZE(steps); j++) {
+            if(umac_tag(8, msg, len, steps[j], nonce, hex) ||
+               strcmp(hex, vectors[i].tag64)) {
+                fprintf(stderr, "UMAC-64 of '%s' x %u in %u byte pieces: "
+                        "%s\n", vectors[i].pattern,
+                        (unsigned int)vectors[i].repeat,
+                        (unsigned int)steps[j], hex);
+                rc = 1;
+            }
+            if(umac_tag(16, msg, len, steps[j], nonce, hex) ||
+               strcmp(hex, vectors[i].tag128)) {
+                fprintf(stderr, "UMAC-128 of '%s' x %u in %u byte pieces: "
+                        "%s\n", vectors[i].pattern,
+                        (unsigned int)vectors[i].repeat,
+                        (unsigned int)steps[j], hex);
+                rc = 1;
+            }
+        }
+    }
+    return rc;
+}
+
+/* consecutive nonces share a pad with UMAC-64, each takes its own half */
+static int test_pad_cache(const unsigned char *msg)
+{
+    static const unsigned char last[] = { 0x10, 0x11, 0x10, 0x12, 0x11 };
+    unsigned char n[UMAC_NONCE_LEN];
+    unsigned char tag[8];
+    char expected[17];
+    char hex[17];
+    _libssh2_umac_ctx ctx;
+    size_t i;
+    int rc = 0;
+
+    if(_libssh2_umac_init(&ctx, key, 8))
+        return 1;
+
+    memset(n, 0, sizeof(n));
+    for(i = 0; i < sizeof(last); i++) {
+        n[UMAC_NONCE_LEN - 1] = last[i];
+        _libssh2_umac_update(&ctx, msg, 100);
+        if(_libssh2_umac_final(&ctx, tag, n) ||
+           umac_tag(8, msg, 100, 0, n, expected)) {
+            rc = 1;
+            break;
+        }
+        to_hex(tag, sizeof(tag), hex);
+        if(strcmp(hex, expected)) {
+            fprintf(stderr, "UMAC-64 with nonce ...%02x: %s, expected %s\n",
+                    last[i], hex, expected);
+            rc = 1;
+        }
+    }
+    _libssh2_umac_dtor(&ctx);
+    return rc;
+}
+
+static const LIBSSH2_MAC_METHOD *find_method(const char *name)
+{
+    const LIBSSH2_MAC_METHOD **methods = _libssh2_mac_methods();
+
+    for(; *methods; methods++) {
+        if(!strcmp((*methods)->name, name))
+            return *methods;
+    }
+    return NULL;
+}
+
+static int benchmark(LIBSSH2_SESSION *session, const char *name,
+                     const unsigned char *packet)
+{
+    const LIBSSH2_MAC_METHOD *method = find_method(name);
+    unsigned char mac[SHA512_DIGEST_LENGTH];
+    unsigned char *method_key;
+    void *abstract = NULL;
+    uint32_t packet_len;
+    int free_key;
+
+    if(!method) {
+        fprintf(stderr, "%s: not supported by this backend, skipped\n",
+                name);
+        return 0;
+    }
+
+    method_key = LIBSSH2_ALLOC(session, method->key_len);
+    if(!method_key) {
+        fprintf(stderr, "%s: out of memory\n", name);
+        return 1;
+    }
+    memset(method_key, 0x5a, method->key_len);
+    if(method->init(session, method_key, &free_key, &abstract)) {
+        fprintf(stderr, "%s: MAC init failed\n", name);
+        LIBSSH2_FREE(session, method_key);
+        return 1;
+    }
+    if(free_key) {
+        _libssh2_explicit_zero(method_key, method->key_len);
+        LIBSSH2_FREE(session, method_key);
+    }
+
+    for(packet_len = MIN_PACKET_SIZE; packet_len <= MAX_PACKET_SIZE;
+        packet_len *= 2) {
+        uint32_t count = BYTES_PER_SIZE / packet_len;
+        clock_t start = clock();
+        uint32_t seqno;
+
+        for(seqno = 0; seqno < count; seqno++)
+            method->hash(session, mac, seqno, packet, packet_len,
+                         NULL, 0, &abstract);
+
+        fprintf(stderr, "%s: %5u bytes: %.1f MB/s\n", name,
+                (unsigned int)packet_len,
+                (double)count * packet_len / seconds(start) / 1e6);
+    }
+
+    method->dtor(session, &abstract);
+    return 0;
+}
+
+int main(void)
+{
+    LIBSSH2_SESSION *session;
+    unsigned char *msg = malloc(MAX_PACKET_SIZE);
+    size_t i;
+    int rc = 0;
+
+    if(!msg) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    libssh2_init(0);
+    session = libssh2_session_init();
+
+    rc |= test_vectors(msg);
+    rc |= test_pad_cache(msg);
+
+    for(i = 0; i < MAX_PACKET_SIZE; i++)
+        msg[i] = (unsigned char)(i * 7 + 3);
+
+    for(i = 0; !rc && i < ARRAY_SIZE(benchmarks); i++)
+        rc |= benchmark(session, benchmarks[i], msg);
+
+    libssh2_session_free(session);
+    libssh2_exit();
+
+    free(msg);
+
+    return rc;
+}
+
+#else
+
+int main(void)
+{
+    /* the crypto backend has no AES */
+    return 0;
+}
+
+#endif /* LIBSSH2_AES */